@@ -21,15 +21,17 @@
  * See MatFile.h for help and changelog.
  */
 
+#include <zlib.h>
+
 #include "MatFile.h"
 
-void MatFile::open(std::string &filename) {
-	this->open(filename.c_str());
+void MatFile::open(std::string &filename, bool direct, uint64_t size) {
+	this->open(filename.c_str(), direct, size);
 }
 
-void MatFile::open(const char* filename) {
+void MatFile::open(const char* filename, bool direct, uint64_t size) {
 
-	file.open(filename, std::ios_base::out | std::ios_base::binary);
+	file.open(filename, direct, size);
 
 	if(file.is_open()) {
 		char buffer[128];
@@ -236,10 +238,7 @@ int MatCellArray::write(MatFile &file) {
 		int32_t stop_pos = file.get_pos();
 		head[1] = stop_pos - start_pos;
 
-		file.set_pos(start_pos - 4);
-		file.write((char *)(head+1), 4);
-
-		file.set_pos(stop_pos);
+		file.patch(start_pos - 4, (char *)(head+1), 4);
 
 		return 0;
 
@@ -477,10 +476,7 @@ int MatStruct::write(MatFile &file) {
 		int32_t stop_pos = file.get_pos();
 		buffer[1] = stop_pos - start_pos;
 
-		file.set_pos(start_pos - 4);
-		file.write((char *)(buffer+1), 4);
-
-		file.set_pos(stop_pos);
+		file.patch(start_pos - 4, (char *)(buffer+1), 4);
 
 		return 0;
 
@@ -652,3 +648,296 @@ size_t MatObj::get_bytes(uint8_t* buffer, size_t nb) {
 
 	return max_write;
 }
+
+/* Matrix header used by MatStream (no data attached) */
+class MatStreamHeader : public MatMatrix {
+public:
+	MatStreamHeader(const char *name, uint8_t class_id, uint32_t nrows, uint32_t ncols) {
+		set_name(name);
+		set_class(class_id);
+		rows = nrows;
+		cols = ncols;
+	}
+};
+
+MatStream::MatStream(uint32_t chunk) : ptr(0), obj(0), objoff(0), chunk_begin(0), chunk_len(0), zlevel(0), zcomp(NULL) {
+	/* The staging buffer must hold a whole number of elements of any type */
+	chunk_size = (chunk < 8) ? 8 : chunk - chunk % 8;
+	this->chunk = new uint8_t[chunk_size];
+
+	/* Format the timestamp */
+	time_t current_time = time(NULL);
+	char *date_str = ctime(&current_time);
+
+	/* Fill header */
+	memset(mbuffer, 0x20, 128);
+	memcpy(mbuffer, MAT_HEADER, strlen(MAT_HEADER));
+	memcpy(mbuffer+strlen(MAT_HEADER), date_str, strlen(date_str));
+	*(uint8_t*)(mbuffer+124) = MAT_VERSION_1B;
+	*(uint8_t*)(mbuffer+125) = MAT_VERSION_2B;
+	*(uint16_t*)(mbuffer+126) = MAT_ENDIAN;
+}
+
+MatStream::~MatStream() {
+	for(size_t i = 0; i < objs.size(); i++)
+		delete[] objs[i].header;
+	delete[] chunk;
+}
+
+int MatStream::add_obj(const char *name, uint8_t class_id, uint32_t type, uint32_t elsize, uint32_t rows, uint32_t cols, MatSource *src) {
+	Obj o;
+
+	/* The size must fit in the 32 bit tags of the v5 format */
+	uint64_t datasize = (uint64_t)rows * cols * elsize;
+	if(datasize > 0xFFFFFF00ULL) {
+#ifdef _SYS_SYSLOG_H
+		syslog(LOG_DAEMON|LOG_ERR, "Runtime error! MatStream::add_obj matrix '%s' is too big for a v5 MAT file.", name);
+#else
+		std::cerr << "Runtime error! MatStream::add_obj matrix '" << name << "' is too big for a v5 MAT file." << std::endl;
+#endif
+		return -1;
+	}
+
+	/* Base header */
+	MatStreamHeader mh(name, class_id, rows, cols);
+	uint8_t *base_header;
+	uint32_t base_size;
+	mh.make_baseheader(base_header, base_size);
+
+	o.datasize = datasize;
+	o.elsize = elsize;
+	o.padding = (o.datasize % 8 != 0) ? 8 - o.datasize % 8 : 0;
+	o.src = src;
+
+	/* miMATRIX tag, base header and data tag */
+	o.headsize = base_size + 4*sizeof(uint32_t);
+	o.header = new uint8_t[o.headsize];
+	*((uint32_t*)o.header) = miMATRIX;
+	*((uint32_t*)(o.header+4)) = base_size + 8 + o.datasize + o.padding;
+	memcpy((void*)(o.header+8), (void*)base_header, base_size);
+	delete base_header;
+	*((uint32_t*)(o.header+8+base_size)) = type;
+	*((uint32_t*)(o.header+8+base_size+4)) = o.datasize;
+
+	objs.push_back(o);
+	return 0;
+}
+
+size_t MatStream::total_size()const {
+	size_t sz = 128;
+	for(size_t i = 0; i < objs.size(); i++)
+		sz += objs[i].headsize + objs[i].datasize + objs[i].padding;
+	return sz;
+}
+
+void MatStream::reset() {
+	ptr = 0;
+	obj = 0;
+	objoff = 0;
+	chunk_begin = 0;
+	chunk_len = 0;
+}
+
+/* Load in the staging buffer the data of the current object starting from 'offset' */
+void MatStream::stage(uint32_t offset) {
+	Obj &o = objs[obj];
+	uint32_t count = chunk_size / o.elsize;
+	uint32_t first = offset / o.elsize;
+	if(count > o.datasize / o.elsize - first)
+		count = o.datasize / o.elsize - first;
+	o.src->fill(chunk, first, count);
+	chunk_begin = first * o.elsize;
+	chunk_len = count * o.elsize;
+}
+
+size_t MatStream::get_bytes(uint8_t* buffer, size_t nb) {
+	size_t done = 0;
+
+	while(done < nb) {
+		const uint8_t *start = NULL;
+		size_t max_write = 0;
+
+		if(ptr < 128) {
+			// File header
+			start = (uint8_t*)mbuffer+ptr;
+			max_write = 128-ptr;
+
+		} else if(obj < objs.size()) {
+			Obj &o = objs[obj];
+
+			if(objoff < o.headsize) {
+				// Matrix header
+				start = o.header+objoff;
+				max_write = o.headsize-objoff;
+
+			} else if(objoff < o.headsize + o.datasize) {
+				// Data, through the staging buffer
+				uint32_t offset = objoff - o.headsize;
+				if(offset < chunk_begin || offset >= chunk_begin + chunk_len)
+					stage(offset);
+				start = chunk + (offset - chunk_begin);
+				max_write = chunk_begin + chunk_len - offset;
+
+			} else if(objoff < o.headsize + o.datasize + o.padding) {
+				// Padding
+				max_write = o.headsize + o.datasize + o.padding - objoff;
+
+			} else {
+				// Next object
+				obj++;
+				objoff = 0;
+				chunk_begin = 0;
+				chunk_len = 0;
+				continue;
+			}
+
+		} else {
+			// End of stream
+			break;
+		}
+
+		if(max_write > nb - done)
+			max_write = nb - done;
+
+		if(start != NULL)
+			memcpy((void*)(buffer+done), (void*)start, max_write);
+		else
+			memset((void*)(buffer+done), 0x00, max_write);
+
+		if(ptr >= 128)
+			objoff += max_write;
+		ptr += max_write;
+		done += max_write;
+	}
+
+	return done;
+}
+
+int MatStream::write(MatFile &file) {
+	if(!file.IsOpen())
+		return -1;
+
+	if(zlevel > 0)
+		return write_compressed(file);
+
+	/* The file header has already been written by MatFile::open() */
+	reset();
+	ptr = 128;
+
+	uint8_t *buffer = new uint8_t[chunk_size];
+	size_t nb;
+	while((nb = get_bytes(buffer, chunk_size)) > 0) {
+		file.write((char *)buffer, nb);
+		if(!file.good())
+			break;
+	}
+	delete[] buffer;
+
+	return (file.good()) ? 0 : -1;
+}
+
+int MatBlock::run() {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+
+	/* Raw deflate: the zlib header and trailer are written by MatStream */
+	if(deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+
+	/* A sync flush adds at most a few bytes to the bound */
+	out.resize(deflateBound(&zs, in_len) + 16);
+	zs.next_in = (Bytef*)in;
+	zs.avail_in = in_len;
+	zs.next_out = &(out[0]);
+	zs.avail_out = out.size();
+
+	int ret = ::deflate(&zs, (last) ? Z_FINISH : Z_SYNC_FLUSH);
+	bool ok = (zs.avail_in == 0) && (((last) ? Z_STREAM_END : Z_OK) == ret);
+	out.resize(out.size() - zs.avail_out);
+	deflateEnd(&zs);
+
+	adler = adler32(adler32(0L, Z_NULL, 0), in, in_len);
+	return (ok) ? 0 : -1;
+}
+
+int MatCompressor::compress(MatBlock *blocks, size_t n) {
+	int retval = 0;
+	for(size_t i = 0; i < n; i++)
+		if(blocks[i].run())
+			retval = -1;
+	return retval;
+}
+
+int MatStream::write_compressed(MatFile &file) {
+	MatCompressor local;
+	MatCompressor *comp = (zcomp) ? zcomp : &local;
+	size_t nblocks = (comp->workers() > 0) ? comp->workers() : 1;
+
+	uint8_t *buffer = new uint8_t[nblocks * MAT_DEFLATE_BLOCK];
+	std::vector<MatBlock> blocks(nblocks);
+	int retval = 0;
+
+	/* zlib header for the compression level */
+	uint8_t zhead[2];
+	zhead[0] = 0x78;
+	zhead[1] = ((zlevel < 2) ? 0 : (zlevel < 6) ? 1 : (zlevel == 6) ? 2 : 3) << 6;
+	zhead[1] += 31 - ((zhead[0] << 8) | zhead[1]) % 31;
+
+	reset();
+	ptr = 128;
+
+	for(size_t o = 0; o < objs.size() && retval == 0; o++) {
+		uint64_t left = objs[o].headsize + objs[o].datasize + objs[o].padding;
+
+		/* Element tag, the size is patched at the end */
+		int64_t tag_pos = file.get_pos();
+		uint32_t tag[2] = { miCOMPRESSED, 0 };
+		file.write((char *)tag, 8);
+		file.write((char *)zhead, 2);
+
+		uint32_t csize = 2;
+		uLong adler = adler32(0L, Z_NULL, 0);
+
+		while(left > 0) {
+			/* Fill a batch of blocks */
+			size_t n = 0;
+			while(n < nblocks && left > 0) {
+				uint32_t len = (left < MAT_DEFLATE_BLOCK) ? left : MAT_DEFLATE_BLOCK;
+				get_bytes(buffer + n * MAT_DEFLATE_BLOCK, len);
+				left -= len;
+				blocks[n].in = buffer + n * MAT_DEFLATE_BLOCK;
+				blocks[n].in_len = len;
+				blocks[n].last = (left == 0);
+				blocks[n].level = zlevel;
+				n++;
+			}
+
+			if(comp->compress(&(blocks[0]), n)) {
+				retval = -1;
+				break;
+			}
+
+			/* Write in order */
+			for(size_t i = 0; i < n; i++) {
+				if(blocks[i].out.size() > 0)
+					file.write((char *)&(blocks[i].out[0]), blocks[i].out.size());
+				csize += blocks[i].out.size();
+				adler = adler32_combine(adler, blocks[i].adler, blocks[i].in_len);
+			}
+		}
+
+		/* zlib trailer (Adler-32, big endian) */
+		uint8_t trailer[4] = { (uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler };
+		file.write((char *)trailer, 4);
+		csize += 4;
+
+		/* Patch the element size */
+		file.patch(tag_pos + 4, (char *)&csize, 4);
+
+		if(!file.good())
+			retval = -1;
+	}
+
+	delete[] buffer;
+	return retval;
+}
@@ -24,6 +24,10 @@
  *
  *  Changelog:
  *  1.0 - Release (Aug-2011) Michele Devetta
+ *  1.1 - Added MatStream to write matrices streamed from a MatSource
+ *        MatVector with geometric capacity growth and bulk setters
+ *        Optional miCOMPRESSED output of MatStream (zlib)
+ *        Output through FileWriter (asynchronous, optionally direct I/O)
  */
 
 #ifndef __MatFile_h__
@@ -32,12 +36,11 @@
 #include <string.h>
 #include <time.h>
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <string>
 #include <typeinfo>
 #include <stdint.h>
-#include <std_fileno.h>
+#include "atmd_filewriter.h"
 
 /* Mat header */
 #define MAT_HEADER "MATLAB 5.0 MAT-file, Platform: PCWIN, Created on: "
@@ -57,6 +60,7 @@
 #define miINT64  12 /* 64 bit signed */
 #define miUINT64 13 /* 64 bit signed */
 #define miMATRIX 14 /* Matlab matrix */
+#define miCOMPRESSED 15 /* Compressed element (zlib) */
 
 /* Array classes */
 #define mxCELL_CLASS    1 /* Cell array */
@@ -73,6 +77,12 @@
 #define mxINT32_CLASS  12 /* 32-bit, signed integer */
 #define mxUINT32_CLASS 13 /* 32-bit unsigned, integer */
 
+/* Size of the staging buffer of MatStream (must be a multiple of 8) */
+#define MAT_STREAM_CHUNK 65536
+
+/* Size of the blocks compressed independently by MatStream */
+#define MAT_DEFLATE_BLOCK 262144
+
 
 /*
  * CLASS: MatFile - This class is used to write objects to a .mat file (Matlab v6 format)
@@ -82,27 +92,30 @@ public:
 	MatFile() {};
 	MatFile(const char * filename) { open(filename); }
 	MatFile(std::string &filename) { open(filename); }
-	~MatFile() { if(file.is_open()) file.close(); }
+	~MatFile() { close(); }
 
-	void open(std::string &filename);
-	void open(const char * filename);
+	/* With direct set the page cache is bypassed; size is the expected file size, reserved up front */
+	void open(std::string &filename, bool direct = false, uint64_t size = 0);
+	void open(const char * filename, bool direct = false, uint64_t size = 0);
 	bool IsOpen() { return file.is_open(); }
-	void close() { if(file.is_open()) file.close(); }
+	int close() { return (file.is_open()) ? file.close() : 0; }
 	int write(char * buffer, uint32_t size) {
 		if(file.is_open()) {
-			file.write(buffer, size);
-			return 0;
+			return file.write(buffer, size);
 		} else {
 			return -1;
 		}
 	}
-	int32_t get_pos() { return file.tellg(); }
-	void set_pos(int32_t pos) { file.seekg(pos, std::ios::beg); }
+	/* Overwrite bytes already written (e.g. element sizes) */
+	int patch(int64_t pos, char * buffer, uint32_t size) { return file.patch(pos, buffer, size); }
+	bool good() { return file.good(); }
+	int flush() { return (file.is_open()) ? file.sync() : -1; }
+	int64_t get_pos() { return file.pos(); }
 
-	int fd()const { return fileno(file); };
+	int fd()const { return file.fd(); };
 
 private:
-	std::fstream file;
+	FileWriter file;
 };
 
 
@@ -149,21 +162,26 @@ protected:
  */
 template <class T> class MatVector : public MatMatrix {
 public:
-	MatVector(): data(NULL) { class_name = std::string(typeid(T).name()); }
-	MatVector(const char * name, uint8_t class_id): data(NULL) {
+	MatVector(): data(NULL), stride(0), cap_cols(0) { class_name = std::string(typeid(T).name()); }
+	MatVector(const char * name, uint8_t class_id): data(NULL), stride(0), cap_cols(0) {
 		set_name(name);
 		set_class(class_id);
 		class_name = std::string(typeid(T).name());
 	}
 	MatVector(MatVector &mv) {}
-	~MatVector() { if(data) delete(data); }
+	~MatVector() { if(data) delete[] data; }
 
 	void resize(uint32_t nrows, uint32_t ncols);
-	void clear() { if(data) delete(data); data = NULL; rows = 0; cols = 0; }
-	void zero() { if(data) for(uint32_t i = 0; i < rows*cols; i++) data[i] = 0.0; }
+	void reserve(uint32_t nrows, uint32_t ncols);
+	void clear() { if(data) delete[] data; data = NULL; rows = 0; cols = 0; stride = 0; cap_cols = 0; }
+	void zero() { if(data) memset((char *)data, 0x00, (size_t)stride * cap_cols * sizeof(T)); }
 
 	T &operator()(uint32_t i, uint32_t j);
 
+	/* Bulk setters */
+	void assign_column(uint32_t j, const T *src, uint32_t n);
+	void append(const T *src, uint32_t n);
+
 	int write(MatFile &file);
 
 	size_t datasize() { return (cols * rows * sizeof(T)); };
@@ -172,7 +190,12 @@ protected:
 	int _priv_write(uint8_t *&header, uint32_t &headsize, uint32_t &padding);
 
 private:
-	T *data; // Pointer to the data array
+	void relayout(uint32_t nstride, uint32_t ncap);
+	void compact();
+
+	T *data;           // Pointer to the data array
+	uint32_t stride;   // Allocated rows (distance between columns in data)
+	uint32_t cap_cols; // Allocated columns
 
 friend class MatObj;
 };
@@ -182,50 +205,86 @@ friend class MatObj;
  * CLASS: MatVector<T> - Members definition
  */
 template <class T> T &MatVector<T>::operator()(uint32_t i, uint32_t j) {
-	if(i < rows && j < cols) {
-		return data[i+rows*j];
-
-	} else {
+	if(i >= rows || j >= cols)
 		resize((i+1 > rows) ? i+1 : rows, (j+1 > cols) ? j+1 : cols);
-		return data[i+rows*j];
-	}
+	return data[i+stride*j];
 }
 
-template <class T> void MatVector<T>::resize(uint32_t nrows, uint32_t ncols) {
+/* Move the data to a new array of nstride x ncap elements (columns are copied whole) */
+template <class T> void MatVector<T>::relayout(uint32_t nstride, uint32_t ncap) {
+	T *new_data = new T[(size_t)nstride*ncap];
+	memset((char *)new_data, 0x00, (size_t)nstride * ncap * sizeof(T));
+
 	if(data) {
-		if(nrows < rows)
-			nrows = rows;
-		if(ncols < cols)
-			nrows = cols;
-		if(nrows > rows || ncols > cols) {
-			/* Allocate new data array */
-			T *new_data = new T[nrows*ncols];
-			memset((char *)new_data, 0x00, nrows * ncols * sizeof(T));
-
-			/* Copy data to new array */
-			for(uint32_t i = 0; i < cols; i++)
-				for(uint32_t j = 0; j < rows; j++)
-					new_data[nrows*i+j] = data[rows*i+j];
-
-			/* Free old array */
-			if(data)
-				delete data;
-
-			/* Update structure */
-			data = new_data;
-			rows = nrows;
-			cols = ncols;
+		if(nstride == stride) {
+			memcpy((char *)new_data, (char *)data, (size_t)stride * cols * sizeof(T));
+		} else {
+			for(uint32_t j = 0; j < cols; j++)
+				memcpy((char *)(new_data+(size_t)nstride*j), (char *)(data+(size_t)stride*j), rows * sizeof(T));
 		}
-	} else {
-		data = new T[nrows*ncols];
-		memset((char *)data, 0x00, nrows * ncols * sizeof(T));
-		rows = nrows;
-		cols = ncols;
+		delete[] data;
+	}
+
+	data = new_data;
+	stride = nstride;
+	cap_cols = ncap;
+}
+
+/* Pack the columns one after the other, as required by the file format */
+template <class T> void MatVector<T>::compact() {
+	if(data && rows > 0 && stride != rows) {
+		for(uint32_t j = 1; j < cols; j++)
+			memmove((char *)(data+(size_t)rows*j), (char *)(data+(size_t)stride*j), rows * sizeof(T));
+		memset((char *)(data+(size_t)rows*cols), 0x00, ((size_t)stride * cap_cols - (size_t)rows * cols) * sizeof(T));
+		cap_cols = ((size_t)stride * cap_cols) / rows;
+		stride = rows;
+	}
+}
+
+template <class T> void MatVector<T>::reserve(uint32_t nrows, uint32_t ncols) {
+	if(nrows > stride || ncols > cap_cols)
+		relayout((nrows > stride) ? nrows : stride, (ncols > cap_cols) ? ncols : cap_cols);
+}
+
+template <class T> void MatVector<T>::resize(uint32_t nrows, uint32_t ncols) {
+	if(nrows < rows)
+		nrows = rows;
+	if(ncols < cols)
+		ncols = cols;
+
+	/* Capacity grows geometrically, so incremental growth is amortized linear */
+	if(nrows > stride || ncols > cap_cols) {
+		uint32_t nstride = stride, ncap = cap_cols;
+		if(nrows > stride)
+			nstride = (nrows > 2*stride) ? nrows : 2*stride;
+		if(ncols > cap_cols)
+			ncap = (ncols > 2*cap_cols) ? ncols : 2*cap_cols;
+		relayout(nstride, ncap);
 	}
+
+	rows = nrows;
+	cols = ncols;
+}
+
+/* Copy n elements to column j (rows are added if needed) */
+template <class T> void MatVector<T>::assign_column(uint32_t j, const T *src, uint32_t n) {
+	resize(n, j+1);
+	memcpy((char *)(data+(size_t)stride*j), (char *)src, n * sizeof(T));
+}
+
+/* Append n rows. Source is n x cols in column-major order (a vector of n elements for single column) */
+template <class T> void MatVector<T>::append(const T *src, uint32_t n) {
+	uint32_t first = rows;
+	resize(rows+n, (cols > 0) ? cols : 1);
+	for(uint32_t j = 0; j < cols; j++)
+		memcpy((char *)(data+(size_t)stride*j+first), (char *)(src+(size_t)n*j), n * sizeof(T));
 }
 
 template <class T> int MatVector<T>::_priv_write(uint8_t *&header, uint32_t &headsize, uint32_t &padding) {
 
+	// Data must be contiguous to be written
+	compact();
+
 	// First we check that the data type is known
 	uint32_t type = 0;
 	if(typeid(T) == typeid(double))
@@ -288,7 +347,6 @@ template <class T> int MatVector<T>::write(MatFile &file) {
 		// Write to file
 		file.write((char *)header, headsize);
 		delete header;
-
 		file.write((char *)data, datasize());
 
 		/* Last we write the padding */
@@ -412,4 +470,135 @@ private:
 	char mbuffer[128];
 };
 
+
+/*
+ * CLASS: MatSource - Producer of the elements of a matrix written by MatStream
+ */
+class MatSource {
+public:
+	virtual ~MatSource() {}
+
+	/* Fill buffer with 'count' elements starting from element 'first' (column-major order) */
+	virtual void fill(uint8_t *buffer, uint32_t first, uint32_t count) = 0;
+};
+
+
+/*
+ * STRUCT: MatBlock - A block of a miCOMPRESSED element. Blocks are compressed
+ * independently as raw deflate data ending on a byte boundary, so that their
+ * outputs can be concatenated in a single zlib stream.
+ */
+struct MatBlock {
+	MatBlock() : in(NULL), in_len(0), last(false), level(0), adler(0) {}
+
+	const uint8_t *in;        // Input data
+	uint32_t in_len;          // Input length
+	bool last;                // Last block of the element
+	int level;                // Compression level
+	std::vector<uint8_t> out; // Compressed data
+	uint32_t adler;           // Adler-32 of the input
+
+	int run();
+};
+
+
+/*
+ * CLASS: MatCompressor - Compresses a batch of blocks. This implementation runs
+ * in the calling thread, derived classes can spread the blocks over workers.
+ */
+class MatCompressor {
+public:
+	virtual ~MatCompressor() {}
+
+	/* Number of blocks worth giving to compress() at once */
+	virtual size_t workers()const { return 1; }
+
+	/* Compress n blocks (return 0 on success, -1 if any block failed) */
+	virtual int compress(MatBlock *blocks, size_t n);
+};
+
+
+/*
+ * CLASS: MatStream - MAT file produced on demand from a list of MatSource.
+ * The headers are computed up front from the matrix sizes, while the data is
+ * pulled from the sources through a fixed size buffer, so memory usage does not
+ * depend on the size of the matrices. The sources must outlive the stream.
+ */
+class MatStream {
+public:
+	MatStream(uint32_t chunk = MAT_STREAM_CHUNK);
+	~MatStream();
+
+	template <class T> int add_obj(const char *name, uint8_t class_id, uint32_t rows, uint32_t cols, MatSource *src);
+
+	size_t get_bytes(uint8_t *buffer, size_t nb);
+	size_t total_size()const;
+	void reset();
+
+	/* Write matrices as miCOMPRESSED elements (level 0 disables). Compressed
+	 * sizes are known only after writing, so get_bytes() and total_size() always
+	 * give the uncompressed stream, while write() patches the element sizes. */
+	void set_compression(int level, MatCompressor *comp = NULL) { zlevel = level; zcomp = comp; }
+	int compression()const { return zlevel; }
+
+	int write(MatFile &file);
+
+private:
+	MatStream(const MatStream&);
+	int write_compressed(MatFile &file);
+	int add_obj(const char *name, uint8_t class_id, uint32_t type, uint32_t elsize, uint32_t rows, uint32_t cols, MatSource *src);
+	void stage(uint32_t offset);
+
+	struct Obj {
+		uint8_t *header;
+		uint32_t headsize;
+		uint32_t datasize;
+		uint32_t padding;
+		uint32_t elsize;
+		MatSource *src;
+	};
+
+	std::vector<Obj> objs;
+	size_t ptr;           // Position in the whole stream
+	size_t obj;           // Current object
+	size_t objoff;        // Position inside the current object
+	uint8_t *chunk;       // Staging buffer
+	uint32_t chunk_size;
+	uint32_t chunk_begin; // Data offset of the staged bytes
+	uint32_t chunk_len;   // Number of staged bytes
+	int zlevel;           // Compression level
+	MatCompressor *zcomp; // Compressor (NULL to compress in the calling thread)
+	char mbuffer[128];
+};
+
+
+/*
+ * CLASS: MatStream - Members definition
+ */
+template <class T> int MatStream::add_obj(const char *name, uint8_t class_id, uint32_t rows, uint32_t cols, MatSource *src) {
+	uint32_t type = 0;
+	if(typeid(T) == typeid(double))
+		type = miDOUBLE;
+	else if(typeid(T) == typeid(float))
+		type = miSINGLE;
+	else if(typeid(T) == typeid(uint32_t))
+		type = miUINT32;
+	else if(typeid(T) == typeid(int32_t))
+		type = miINT32;
+	else if(typeid(T) == typeid(uint16_t))
+		type = miUINT16;
+	else if(typeid(T) == typeid(int16_t))
+		type = miINT16;
+	else if(typeid(T) == typeid(uint8_t))
+		type = miUINT8;
+	else if(typeid(T) == typeid(int8_t))
+		type = miINT8;
+	else
+		std::cerr << "Runtime error! MatStream::add_obj requested an unexpected type (" << typeid(T).name() << ")." << std::endl;
+	if(type == 0)
+		return -1;
+
+	return add_obj(name, class_id, type, sizeof(T), rows, cols, src);
+}
+
 #endif
@@ -0,0 +1,118 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Start assembler
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Global debug flag
+#ifdef DEBUG
+extern bool enable_debug;
+#endif
+
+#include <rtdk.h>
+
+#include "atmd_assembler.h"
+
+
+/* @fn StartAssembler::setup(size_t agents)
+ * Set the number of agents. Partial starts are discarded.
+ *
+ * @param agents The number of agents.
+ */
+void StartAssembler::setup(size_t agents) {
+  clear();
+  _start.assign(agents, NULL);
+  _start_id.assign(agents, 0);
+  _done.assign(agents, false);
+}
+
+
+/* @fn StartAssembler::add_packet(size_t agent_id, const DataMsg& packet, double tbin)
+ * Add the events of a decoded packet to the current start of its agent.
+ *
+ * @param agent_id The agent that sent the packet.
+ * @param packet The packet.
+ * @param tbin The bin width of the start.
+ * @return Return 1 when the start is complete, 0 otherwise and -1 if the packet was discarded.
+ */
+int StartAssembler::add_packet(size_t agent_id, const DataMsg& packet, double tbin) {
+  if(agent_id >= _start.size())
+    return -1;
+
+  // If current start is NULL, create one
+  if(_start[agent_id] == NULL) {
+    if(packet.type() == ATMD_DT_FIRST || packet.type() == ATMD_DT_ONLY) {
+      _start[agent_id] = new StartData;
+      _start[agent_id]->add_time(packet.window_start(), packet.window_time());
+      _start[agent_id]->set_tbin(tbin);
+      _start_id[agent_id] = packet.id();
+
+    } else if(packet.type() == ATMD_DT_TERM) {
+      return 0;
+
+    } else {
+      // Error! We missed the first packet or something very bad happened
+      rt_syslog(ATMD_ERR, "StartAssembler [add_packet]: missed the first packet of a data sequence. Discarding current start.");
+      return -1;
+    }
+
+  } else {
+    // Start id should not change until all the packets are received.
+    // The order of packets from a single agent is guaranteed, but it is not between different agents.
+    // We need to handle out of sequence packets (maybe we can implement a FIFO of out of sequence packets that will be processed after the current start is over)
+    if(_start_id[agent_id] != packet.id()) {
+      rt_syslog(ATMD_ERR, "StartAssembler [add_packet]: packet out of sequence! PANIC!");
+      rt_syslog(ATMD_INFO, "StartAssembler [add_packet]: agent %lu sent a packet with start ID (%d) while we are still receiving start (%d).", (unsigned long)agent_id, packet.id(), _start_id[agent_id]);
+      // TODO: handle out of sequence packets
+      return -1;
+    }
+  }
+
+  // Extract events from packet
+  for(size_t i = 0; i < packet.numev(); i++) {
+    int8_t ch;
+    int32_t stop;
+    uint32_t retrig;
+    packet.getevent(i, ch, stop, retrig);
+    _start[agent_id]->add_event(retrig, stop, (ch > 0) ? ch + 8*agent_id : ch - 8*agent_id);
+  }
+
+  // If the packet was the last of its series set the done flag for this agent
+  if(packet.type() == ATMD_DT_LAST || packet.type() == ATMD_DT_ONLY)
+    _done[agent_id] = true;
+
+  // Check if all the agent are done
+  for(size_t i = 0; i < _done.size(); i++)
+    if(!_done[i])
+      return 0;
+  return 1;
+}
+
+
+/* @fn StartAssembler::clear()
+ * Delete the current start of all the agents, so that the next packets begin
+ * a new start.
+ */
+void StartAssembler::clear() {
+  for(size_t i = 0; i < _start.size(); i++) {
+    delete _start[i];
+    _start[i] = NULL;
+  }
+  for(size_t i = 0; i < _done.size(); i++)
+    _done[i] = false;
+}
@@ -0,0 +1,66 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Start assembler header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_ASSEMBLER_H
+#define ATMD_ASSEMBLER_H
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+
+// Local
+#include "common.h"
+#include "atmd_netagent.h"
+#include "atmd_measure.h"
+
+
+/* @class StartAssembler
+ * Assembles the data packets of the agents into starts. Each agent sends the
+ * events of a start in a sequence of packets (ATMD_DT_FIRST, ATMD_DT_DATA...,
+ * ATMD_DT_LAST or a single ATMD_DT_ONLY); the start is complete when the last
+ * packet of every agent has been received. Channels of agent i are shifted by
+ * 8*i. Used by the data task and by the replay tool.
+ */
+class StartAssembler {
+public:
+  StartAssembler() {};
+  ~StartAssembler() { clear(); };
+
+  // Set the number of agents (discards partial starts)
+  void setup(size_t agents);
+
+  // Add a packet. Return 1 when the start is complete, 0 otherwise and -1 if the packet was discarded.
+  int add_packet(size_t agent_id, const DataMsg& packet, double tbin);
+
+  // The complete start (one StartData for each agent)
+  std::vector<StartData*>& start() { return _start; };
+
+  // Delete the current start of all the agents (after a complete start has been used)
+  void clear();
+
+private:
+  std::vector<StartData*> _start;     // Current start of each agent
+  std::vector<uint32_t> _start_id;    // Current start ID of each agent
+  std::vector<bool> _done;            // Last packet of the start received
+};
+
+#endif
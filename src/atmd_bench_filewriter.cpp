@@ -0,0 +1,217 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - File output bandwidth benchmark
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Write the same amount of data in fixed size blocks through std::ofstream
+ * (the output path of the saves before FileWriter) and through FileWriter,
+ * buffered and with direct I/O, with and without reserving the file size up
+ * front, and print the sustained bandwidth of each. Every file is flushed to
+ * disk before the clock is stopped, so the page cache does not hide the cost
+ * of the writes.
+ */
+
+// Debug flag
+#ifdef DEBUG
+bool enable_debug = false;
+#endif
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Xenomai
+#include <rtdk.h>
+#include <native/task.h>
+
+// Local
+#include "common.h"
+#include "atmd_filewriter.h"
+
+
+/* @fn static void usage()
+ * Print command line help.
+ */
+static void usage() {
+  printf("atmd_bench_filewriter [-s size] [-b block] [-r repeat] [directory]\n");
+  printf(" -s size: MB written to each file (default 1024).\n");
+  printf(" -b block: size in kB of each write (default 64).\n");
+  printf(" -r repeat: number of runs of each backend, the best one is printed (default 1).\n");
+  printf(" directory: where the files are created (default the current directory).\n");
+}
+
+
+/* @fn static double elapsed(const struct timeval& begin)
+ * Seconds elapsed since 'begin'.
+ */
+static double elapsed(const struct timeval& begin) {
+  struct timeval end;
+  gettimeofday(&end, NULL);
+  return (double)(end.tv_sec - begin.tv_sec) + (double)(end.tv_usec - begin.tv_usec) / 1e6;
+}
+
+
+/* @fn static int flush(const std::string& filename)
+ * Flush a closed file to disk.
+ *
+ * @return Return 0 on success, -1 on error.
+ */
+static int flush(const std::string& filename) {
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if(fd < 0)
+    return -1;
+  int retval = fdatasync(fd);
+  ::close(fd);
+  return retval;
+}
+
+
+/* @fn static int write_fstream(const std::string& filename, const std::vector<char>& block, size_t blocks)
+ * Write the file through std::ofstream.
+ *
+ * @return Return 0 on success, -1 on error.
+ */
+static int write_fstream(const std::string& filename, const std::vector<char>& block, size_t blocks) {
+  std::ofstream out(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  for(size_t i = 0; i < blocks && out.good(); i++)
+    out.write(&(block[0]), block.size());
+  bool good = out.good();
+  out.close();
+  return (good) ? 0 : -1;
+}
+
+
+/* @fn static int write_filewriter(const std::string& filename, const std::vector<char>& block, size_t blocks, bool direct, bool reserve)
+ * Write the file through FileWriter.
+ *
+ * @return Return 0 on success, -1 on error.
+ */
+static int write_filewriter(const std::string& filename, const std::vector<char>& block, size_t blocks, bool direct, bool reserve) {
+  FileWriter out;
+  if(out.open(filename, direct, (reserve) ? (uint64_t)block.size() * blocks : 0))
+    return -1;
+  int retval = 0;
+  for(size_t i = 0; i < blocks && retval == 0; i++)
+    retval = out.write(&(block[0]), block.size());
+  if(out.close())
+    retval = -1;
+  return retval;
+}
+
+
+/* @fn int main(int argc, char * const argv[])
+ * Main entry point
+ */
+int main(int argc, char * const argv[])
+{
+  size_t size = 1024;
+  size_t block_size = 64;
+  uint32_t repeat = 1;
+
+  int c;
+  while( (c = getopt(argc, argv, "s:b:r:")) != -1 ) {
+    switch(c) {
+      case 's':
+        size = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'b':
+        block_size = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'r':
+        repeat = strtoul(optarg, NULL, 10);
+        break;
+
+      default:
+        usage();
+        return -1;
+    }
+  }
+  if(optind < argc - 1 || size == 0 || block_size == 0 || repeat == 0) {
+    usage();
+    return -1;
+  }
+  std::string filename = std::string((optind < argc) ? argv[optind] : ".") + "/atmd_bench_filewriter.tmp";
+
+  // Lock memory and shadow to Xenomai domain
+  mlockall(MCL_CURRENT|MCL_FUTURE);
+  RT_TASK main_task;
+  int retval = rt_task_shadow(&main_task, "atmd_bench_fw", 0, T_FPU);
+  if(retval) {
+    fprintf(stderr, "Failed to shadow main task (Code: %d).\n", retval);
+    return -1;
+  }
+  rt_print_auto_init(1);
+
+  // Data block (not compressible, not zero)
+  std::vector<char> block(block_size * 1024);
+  srand(1);
+  for(size_t i = 0; i < block.size(); i++)
+    block[i] = (char)rand();
+  size_t blocks = (size * 1024 * 1024) / block.size();
+  double mbytes = (double)blocks * block.size() / (1024.0 * 1024.0);
+
+  const char* names[] = { "std::ofstream", "FileWriter", "FileWriter reserved", "FileWriter direct", "FileWriter direct reserved" };
+  const size_t backends = sizeof(names) / sizeof(names[0]);
+
+  printf("Writing %.0f MB in blocks of %lu kB to \"%s\" (best of %u runs):\n", mbytes, (unsigned long)block_size, filename.c_str(), repeat);
+  retval = 0;
+  for(size_t b = 0; b < backends; b++) {
+    double best = 0.0;
+    int ret = 0;
+
+    for(uint32_t r = 0; r < repeat && ret == 0; r++) {
+      unlink(filename.c_str());
+      struct timeval begin;
+      gettimeofday(&begin, NULL);
+
+      if(b == 0)
+        ret = write_fstream(filename, block, blocks);
+      else
+        ret = write_filewriter(filename, block, blocks, (b >= 3), (b == 2 || b == 4));
+      if(ret == 0)
+        ret = flush(filename);
+
+      double t = elapsed(begin);
+      if(r == 0 || t < best)
+        best = t;
+    }
+    unlink(filename.c_str());
+
+    if(ret) {
+      printf(" %-28s failed (Error: %s)\n", names[b], strerror(errno));
+      retval = -1;
+    } else {
+      printf(" %-28s %10.3f s %10.1f MB/s\n", names[b], best, mbytes / best);
+    }
+  }
+
+  return retval;
+}
@@ -0,0 +1,188 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - MatVector growth benchmark
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Build the same rows x 3 MatVector<double> in several ways and print the
+ * time taken by each: element by element through operator() (the way the
+ * exports filled the matrices), with the size set up front, and with the bulk
+ * setters append() and assign_column(). The content of every matrix is checked
+ * against the first one.
+ */
+
+// Debug flag
+#ifdef DEBUG
+bool enable_debug = false;
+#endif
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <vector>
+
+// Local
+#include "MatFile.h"
+
+
+// Columns of the benchmark matrices
+#define BENCH_COLS   3
+
+// Rows appended at once by the append() variant
+#define BENCH_BLOCK  4096
+
+
+/* @fn static void usage()
+ * Print command line help.
+ */
+static void usage() {
+  printf("atmd_bench_matvector [-n rows] [-r repeat]\n");
+  printf(" -n rows: number of rows of the matrices (default 1000000).\n");
+  printf(" -r repeat: number of runs of each variant, the best one is printed (default 3).\n");
+}
+
+
+/* @fn static double elapsed(const struct timeval& begin)
+ * Seconds elapsed since 'begin'.
+ */
+static double elapsed(const struct timeval& begin) {
+  struct timeval end;
+  gettimeofday(&end, NULL);
+  return (double)(end.tv_sec - begin.tv_sec) + (double)(end.tv_usec - begin.tv_usec) / 1e6;
+}
+
+
+/* @fn static double value(uint32_t i, uint32_t j)
+ * Element (i,j) of the benchmark matrices.
+ */
+static double value(uint32_t i, uint32_t j) {
+  return (double)i * 10.0 + (double)j;
+}
+
+
+/* @fn static bool check(MatVector<double>& mv, uint32_t rows)
+ * Check the content of a benchmark matrix.
+ */
+static bool check(MatVector<double>& mv, uint32_t rows) {
+  for(uint32_t j = 0; j < BENCH_COLS; j++)
+    for(uint32_t i = 0; i < rows; i++)
+      if(mv(i, j) != value(i, j))
+        return false;
+  return true;
+}
+
+
+/* @fn int main(int argc, char * const argv[])
+ * Main entry point
+ */
+int main(int argc, char * const argv[])
+{
+  uint32_t rows = 1000000;
+  uint32_t repeat = 3;
+
+  int c;
+  while( (c = getopt(argc, argv, "n:r:")) != -1 ) {
+    switch(c) {
+      case 'n':
+        rows = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'r':
+        repeat = strtoul(optarg, NULL, 10);
+        break;
+
+      default:
+        usage();
+        return -1;
+    }
+  }
+  if(optind != argc || rows == 0 || repeat == 0) {
+    usage();
+    return -1;
+  }
+
+  // Source columns of the bulk setters
+  std::vector<double> src((size_t)rows * BENCH_COLS);
+  for(uint32_t j = 0; j < BENCH_COLS; j++)
+    for(uint32_t i = 0; i < rows; i++)
+      src[(size_t)rows*j + i] = value(i, j);
+  std::vector<double> block((size_t)BENCH_BLOCK * BENCH_COLS);
+
+  const char* names[] = { "operator() growing", "operator() after resize", "append() blocks", "assign_column()" };
+  const size_t variants = sizeof(names) / sizeof(names[0]);
+
+  printf("Building %u x %d MatVector<double> (best of %u runs):\n", rows, BENCH_COLS, repeat);
+  int retval = 0;
+  for(size_t v = 0; v < variants; v++) {
+    double best = 0.0;
+    bool good = true;
+
+    for(uint32_t r = 0; r < repeat; r++) {
+      MatVector<double> mv("data", mxDOUBLE_CLASS);
+      struct timeval begin;
+      gettimeofday(&begin, NULL);
+
+      switch(v) {
+        case 0:
+          for(uint32_t i = 0; i < rows; i++)
+            for(uint32_t j = 0; j < BENCH_COLS; j++)
+              mv(i, j) = value(i, j);
+          break;
+
+        case 1:
+          mv.resize(rows, BENCH_COLS);
+          for(uint32_t i = 0; i < rows; i++)
+            for(uint32_t j = 0; j < BENCH_COLS; j++)
+              mv(i, j) = value(i, j);
+          break;
+
+        case 2:
+          mv.resize(0, BENCH_COLS);
+          for(uint32_t i = 0; i < rows; i += BENCH_BLOCK) {
+            uint32_t n = (rows - i < BENCH_BLOCK) ? rows - i : BENCH_BLOCK;
+            for(uint32_t j = 0; j < BENCH_COLS; j++)
+              memcpy(&(block[(size_t)n*j]), &(src[(size_t)rows*j + i]), n * sizeof(double));
+            mv.append(&(block[0]), n);
+          }
+          break;
+
+        case 3:
+          mv.reserve(rows, BENCH_COLS);
+          for(uint32_t j = 0; j < BENCH_COLS; j++)
+            mv.assign_column(j, &(src[(size_t)rows*j]), rows);
+          break;
+      }
+
+      double t = elapsed(begin);
+      if(r == 0 || t < best)
+        best = t;
+      if(r == 0)
+        good = check(mv, rows);
+    }
+
+    printf(" %-24s %10.3f ms %8.2f ns/element%s\n", names[v], best * 1e3, best * 1e9 / ((double)rows * BENCH_COLS), (good) ? "" : "  CONTENT MISMATCH");
+    if(!good)
+      retval = -1;
+  }
+
+  return retval;
+}
@@ -0,0 +1,158 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Stop time conversion benchmark
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Convert the same random events to stop times in ps through the per event
+ * accessors (StartData::get_stoptime() and Measure::get_stoptime()) and
+ * through the batch kernel stops2ps() (Measure::get_stoptimes()), and print
+ * the time per event of each path together with the largest difference from
+ * the per event result.
+ */
+
+// Debug flag
+#ifdef DEBUG
+bool enable_debug = false;
+#endif
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <vector>
+
+// Local
+#include "common.h"
+#include "atmd_measure.h"
+
+
+// Time bin of the benchmark events in ps
+#define BENCH_TBIN  82.3045
+
+
+/* @fn static void usage()
+ * Print command line help.
+ */
+static void usage() {
+  printf("atmd_bench_stops2ps [-n events] [-r repeat]\n");
+  printf(" -n events: number of events (default 10000000).\n");
+  printf(" -r repeat: number of runs of each path, the best one is printed (default 3).\n");
+}
+
+
+/* @fn static double elapsed(const struct timeval& begin)
+ * Seconds elapsed since 'begin'.
+ */
+static double elapsed(const struct timeval& begin) {
+  struct timeval end;
+  gettimeofday(&end, NULL);
+  return (double)(end.tv_sec - begin.tv_sec) + (double)(end.tv_usec - begin.tv_usec) / 1e6;
+}
+
+
+/* @fn int main(int argc, char * const argv[])
+ * Main entry point
+ */
+int main(int argc, char * const argv[])
+{
+  uint32_t events = 10000000;
+  uint32_t repeat = 3;
+
+  int c;
+  while( (c = getopt(argc, argv, "n:r:")) != -1 ) {
+    switch(c) {
+      case 'n':
+        events = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'r':
+        repeat = strtoul(optarg, NULL, 10);
+        break;
+
+      default:
+        usage();
+        return -1;
+    }
+  }
+  if(optind != argc || events == 0 || repeat == 0) {
+    usage();
+    return -1;
+  }
+
+  // Random events in a single start (the measure has no channels, so they are kept in order)
+  StartData start;
+  start.set_tbin(BENCH_TBIN);
+  srand(1);
+  for(uint32_t i = 0; i < events; i++)
+    start.add_event(rand() % 16, rand() % (1 << 20), 1 + rand() % 8);
+
+  Measure meas;
+  if(meas.add_start(start)) {
+    fprintf(stderr, "Failed to build the measure.\n");
+    return -1;
+  }
+
+  std::vector<double> ref(events), out(events);
+  const char* names[] = { "StartData::get_stoptime()", "Measure::get_stoptime()", "Measure::get_stoptimes()" };
+  const size_t paths = sizeof(names) / sizeof(names[0]);
+
+  printf("Converting %u events (best of %u runs):\n", events, repeat);
+  for(size_t p = 0; p < paths; p++) {
+    double* dst = (p == 0) ? &(ref[0]) : &(out[0]);
+    double best = 0.0;
+
+    for(uint32_t r = 0; r < repeat; r++) {
+      struct timeval begin;
+      gettimeofday(&begin, NULL);
+
+      switch(p) {
+        case 0:
+          for(uint32_t i = 0; i < events; i++)
+            start.get_stoptime(i, dst[i]);
+          break;
+
+        case 1:
+          for(uint32_t i = 0; i < events; i++)
+            dst[i] = meas.get_stoptime(i);
+          break;
+
+        case 2:
+          meas.get_stoptimes(0, events, dst);
+          break;
+      }
+
+      double t = elapsed(begin);
+      if(r == 0 || t < best)
+        best = t;
+    }
+
+    // Largest difference from the per event conversion (one rounding with FMA)
+    double diff = 0.0;
+    for(uint32_t i = 0; p > 0 && i < events; i++)
+      if(fabs(dst[i] - ref[i]) > diff)
+        diff = fabs(dst[i] - ref[i]);
+
+    printf(" %-26s %10.3f ms %7.3f ns/event %8.1f Mevents/s  max diff %g ps\n", names[p], best * 1e3, best * 1e9 / events, events / best / 1e6, diff);
+  }
+
+  return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Binary measure file format and reader
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "atmd_binfile.h"
+
+
+/* @fn atmd_bin_layout(AtmdBinHeader& head)
+ * Compute the column offsets and sizes, and the file size, from the type and
+ * the counts of the header. Columns follow the header in order, each aligned
+ * to 8 bytes.
+ *
+ * @param head The header to complete.
+ */
+void atmd_bin_layout(AtmdBinHeader& head) {
+  head.size[ATMD_BIN_MEAS_BEGIN] = head.times * sizeof(uint64_t);
+  head.size[ATMD_BIN_MEAS_TIME] = head.times * sizeof(uint64_t);
+  head.size[ATMD_BIN_START_INDEX] = (head.starts + 1) * sizeof(uint64_t);
+  head.size[ATMD_BIN_START_ID] = head.starts * sizeof(uint32_t);
+  head.size[ATMD_BIN_TIME_INDEX] = (head.starts + 1) * sizeof(uint64_t);
+  head.size[ATMD_BIN_WIN_BEGIN] = head.windows * sizeof(uint64_t);
+  head.size[ATMD_BIN_WIN_TIME] = head.windows * sizeof(uint64_t);
+  head.size[ATMD_BIN_CHANNEL] = head.events * sizeof(int8_t);
+  if(head.type == ATMD_BIN_PS) {
+    head.size[ATMD_BIN_STOPTIME] = head.events * sizeof(double);
+    head.size[ATMD_BIN_RETRIG] = 0;
+  } else {
+    head.size[ATMD_BIN_STOPTIME] = head.events * sizeof(int32_t);
+    head.size[ATMD_BIN_RETRIG] = head.events * sizeof(uint32_t);
+  }
+
+  uint64_t off = ATMD_BIN_HEADSIZE;
+  for(size_t c = 0; c < ATMD_BIN_COLUMNS; c++) {
+    head.offset[c] = off;
+    off += (head.size[c] + 7) & ~((uint64_t)7);
+  }
+  head.file_size = off;
+}
+
+
+/* @fn BinFile::open(const char* path)
+ * Map a binary measure file. Only the header is read and validated.
+ *
+ * @param path The file path.
+ * @return Return 0 on success, -1 on error (see error()).
+ */
+int BinFile::open(const char* path) {
+  close();
+
+  int fd = ::open(path, O_RDONLY);
+  if(fd == -1) {
+    _error = std::string("cannot open file: ") + strerror(errno);
+    return -1;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) || (size_t)st.st_size < ATMD_BIN_HEADSIZE) {
+    _error = "file too short";
+    ::close(fd);
+    return -1;
+  }
+
+  void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(addr == MAP_FAILED) {
+    _error = std::string("cannot map file: ") + strerror(errno);
+    return -1;
+  }
+
+  // Check the header against the layout it implies
+  const AtmdBinHeader* head = (const AtmdBinHeader*)addr;
+  AtmdBinHeader check;
+  memcpy(&check, head, sizeof(check));
+
+  if(memcmp(head->magic, ATMD_BIN_MAGIC, sizeof(head->magic))) {
+    _error = "not an ATMD binary file";
+  } else if(head->endian != ATMD_BIN_ENDIAN) {
+    _error = "file has a different byte order";
+  } else if(head->version != ATMD_BIN_VERSION) {
+    _error = "unsupported file version";
+  } else if(head->type != ATMD_BIN_PS && head->type != ATMD_BIN_RAW) {
+    _error = "unknown file type";
+  } else {
+    atmd_bin_layout(check);
+    if(memcmp(check.offset, head->offset, sizeof(check.offset)) || memcmp(check.size, head->size, sizeof(check.size)) || check.file_size != head->file_size)
+      _error = "corrupted header";
+    else if(head->file_size > (uint64_t)st.st_size)
+      _error = "truncated file";
+    else
+      _error = "";
+  }
+
+  if(_error != "") {
+    munmap(addr, st.st_size);
+    return -1;
+  }
+
+  _addr = addr;
+  _len = st.st_size;
+  _head = head;
+  return 0;
+}
+
+
+/* @fn BinFile::close()
+ * Release the mapping.
+ */
+void BinFile::close() {
+  if(_addr)
+    munmap(_addr, _len);
+  _addr = NULL;
+  _len = 0;
+  _head = NULL;
+}
@@ -0,0 +1,175 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Binary measure file format and reader header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Binary measure file (ATMD_FORMAT_BINPS and ATMD_FORMAT_BINRAW)
+ *
+ * The file is a fixed 256 byte header followed by a set of columns. Every
+ * column starts at an offset aligned to 8 bytes, recorded in the header with
+ * its size in bytes. All values are little-endian, so on the server platform
+ * the columns can be used in place from a read-only mapping of the file.
+ *
+ * Columns:
+ *  MEAS_BEGIN    uint64 x times        Begin of each measure window (ns from epoch)
+ *  MEAS_TIME     uint64 x times        Duration of each measure window (ns)
+ *  START_INDEX   uint64 x (starts+1)   Index of the first event of each start
+ *  START_ID      uint32 x starts       Start IDs (0 when not available)
+ *  TIME_INDEX    uint64 x (starts+1)   Index of the first window timing of each start
+ *  WIN_BEGIN     uint64 x windows      Begin of each start window (ns)
+ *  WIN_TIME      uint64 x windows      Effective duration of each start window (ns)
+ *  CHANNEL       int8   x events       Channel of each event
+ *  STOPTIME      double x events       BINPS: stop time in ps
+ *                int32  x events       BINRAW: stop time in units of tbin
+ *  RETRIG        uint32 x events       BINRAW only: retrigger counter (stop time in ps
+ *                                      is stoptime * tbin + retrig * retrig_period)
+ *
+ * This file has no dependency on the rest of the server, so that it can be
+ * used by external tools together with atmd_binfile.cpp (libatmdbin).
+ */
+
+#ifndef ATMD_BINFILE_H
+#define ATMD_BINFILE_H
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+
+
+// File identification
+#define ATMD_BIN_MAGIC        "ATMDBIN"   // 8 bytes including the terminator
+#define ATMD_BIN_VERSION      1
+#define ATMD_BIN_ENDIAN       0x01020304
+#define ATMD_BIN_HEADSIZE     256
+
+// File types (same values as ATMD_FORMAT_BINPS and ATMD_FORMAT_BINRAW)
+#define ATMD_BIN_PS           4
+#define ATMD_BIN_RAW          5
+
+// Columns
+#define ATMD_BIN_MEAS_BEGIN   0
+#define ATMD_BIN_MEAS_TIME    1
+#define ATMD_BIN_START_INDEX  2
+#define ATMD_BIN_START_ID     3
+#define ATMD_BIN_TIME_INDEX   4
+#define ATMD_BIN_WIN_BEGIN    5
+#define ATMD_BIN_WIN_TIME     6
+#define ATMD_BIN_CHANNEL      7
+#define ATMD_BIN_STOPTIME     8
+#define ATMD_BIN_RETRIG       9
+#define ATMD_BIN_COLUMNS      10
+
+
+/* @struct AtmdBinHeader
+ * Header of a binary measure file (ATMD_BIN_HEADSIZE bytes).
+ */
+struct AtmdBinHeader {
+  char magic[8];                          // ATMD_BIN_MAGIC
+  uint32_t endian;                        // ATMD_BIN_ENDIAN as written by the server
+  uint32_t version;                       // ATMD_BIN_VERSION
+  uint32_t type;                          // ATMD_BIN_PS or ATMD_BIN_RAW
+  uint32_t agents;                        // Number of agents
+  uint32_t nch;                           // Number of channels
+  uint32_t reserved0;
+  double tbin;                            // Time bin in ps
+  double retrig_period;                   // Retrigger period in ps
+  uint64_t times;                         // Number of measure windows
+  uint64_t starts;                        // Number of starts
+  uint64_t windows;                       // Number of start window timings
+  uint64_t events;                        // Number of events
+  uint64_t offset[ATMD_BIN_COLUMNS];      // Column offsets from the beginning of the file
+  uint64_t size[ATMD_BIN_COLUMNS];        // Column sizes in bytes
+  uint64_t file_size;                     // Total file size
+  uint64_t reserved1;
+};
+
+// Compile time check of the header size
+typedef char atmd_bin_header_size_check[(sizeof(AtmdBinHeader) == ATMD_BIN_HEADSIZE) ? 1 : -1];
+
+
+/* @fn atmd_bin_layout(AtmdBinHeader& head)
+ * Compute offsets, sizes and file size from type and counts.
+ */
+void atmd_bin_layout(AtmdBinHeader& head);
+
+
+/* @class BinFile
+ * Reader of binary measure files. The file is mapped read-only and the columns
+ * are accessed in place: opening checks the header only, whatever the size.
+ */
+class BinFile {
+public:
+  BinFile() : _addr(NULL), _len(0), _head(NULL) {};
+  ~BinFile() { close(); };
+
+  // Open and map a file (return 0 on success, -1 on error)
+  int open(const char* path);
+  void close();
+  bool is_open()const { return (_head != NULL); };
+
+  // Error description of the last failed open
+  const std::string& error()const { return _error; };
+
+  // Header
+  const AtmdBinHeader& header()const { return *_head; };
+  uint32_t type()const { return _head->type; };
+  double tbin()const { return _head->tbin; };
+  uint64_t times()const { return _head->times; };
+  uint64_t starts()const { return _head->starts; };
+  uint64_t events()const { return _head->events; };
+
+  // Measure windows
+  uint64_t measure_begin(uint64_t i)const { return col<uint64_t>(ATMD_BIN_MEAS_BEGIN)[i]; };
+  uint64_t measure_time(uint64_t i)const { return col<uint64_t>(ATMD_BIN_MEAS_TIME)[i]; };
+
+  // Starts
+  uint64_t first_stop(uint64_t start)const { return col<uint64_t>(ATMD_BIN_START_INDEX)[start]; };
+  uint64_t count_stops(uint64_t start)const { return first_stop(start+1) - first_stop(start); };
+  uint32_t start_id(uint64_t start)const { return col<uint32_t>(ATMD_BIN_START_ID)[start]; };
+  uint64_t start_times(uint64_t start)const { return col<uint64_t>(ATMD_BIN_TIME_INDEX)[start+1] - col<uint64_t>(ATMD_BIN_TIME_INDEX)[start]; };
+  uint64_t window_begin(uint64_t start, uint64_t i)const { return col<uint64_t>(ATMD_BIN_WIN_BEGIN)[col<uint64_t>(ATMD_BIN_TIME_INDEX)[start]+i]; };
+  uint64_t window_time(uint64_t start, uint64_t i)const { return col<uint64_t>(ATMD_BIN_WIN_TIME)[col<uint64_t>(ATMD_BIN_TIME_INDEX)[start]+i]; };
+
+  // Event columns
+  const int8_t* channels()const { return col<int8_t>(ATMD_BIN_CHANNEL); };
+  const double* stoptimes_ps()const { return (_head->type == ATMD_BIN_PS) ? col<double>(ATMD_BIN_STOPTIME) : NULL; };
+  const int32_t* raw_stoptimes()const { return (_head->type == ATMD_BIN_RAW) ? col<int32_t>(ATMD_BIN_STOPTIME) : NULL; };
+  const uint32_t* retrigs()const { return (_head->type == ATMD_BIN_RAW) ? col<uint32_t>(ATMD_BIN_RETRIG) : NULL; };
+
+  // Stop time in ps of an event (any type)
+  double stoptime(uint64_t ev)const {
+    if(_head->type == ATMD_BIN_PS)
+      return col<double>(ATMD_BIN_STOPTIME)[ev];
+    return (double)(col<int32_t>(ATMD_BIN_STOPTIME)[ev]) * _head->tbin + (double)(col<uint32_t>(ATMD_BIN_RETRIG)[ev]) * _head->retrig_period;
+  };
+
+private:
+  BinFile(const BinFile&);
+  BinFile& operator=(const BinFile&);
+
+  template <typename T> const T* col(size_t c)const { return (const T*)((const char*)_addr + _head->offset[c]); };
+
+  void* _addr;
+  size_t _len;
+  const AtmdBinHeader* _head;
+  std::string _error;
+};
+
+#endif
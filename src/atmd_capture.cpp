@@ -0,0 +1,333 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Data packet capture
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Global debug flag
+#ifdef DEBUG
+extern bool enable_debug;
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <rtdk.h>
+
+#include "atmd_capture.h"
+
+
+/* @fn write_all(int fd, const void* ptr, size_t len)
+ * Write a whole buffer, retrying on short writes.
+ *
+ * @return Return 0 on success, -1 on error.
+ */
+static int write_all(int fd, const void* ptr, size_t len) {
+  const char* p = (const char*)ptr;
+  while(len > 0) {
+    ssize_t n = ::write(fd, p, len);
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+/* @fn PacketRecorder::start(const std::string& filename, size_t agents)
+ * Create the capture file, write its header and start the writer task.
+ *
+ * @param filename The capture file.
+ * @param agents The number of agents.
+ * @return Return 0 on success, -1 on error.
+ */
+int PacketRecorder::start(const std::string& filename, size_t agents) {
+  if(_running)
+    return -1;
+
+  _fd = ::open(filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if(_fd < 0) {
+    rt_syslog(ATMD_ERR, "PacketRecorder [start]: error creating capture file \"%s\" (Error: %s).", filename.c_str(), strerror(errno));
+    return -1;
+  }
+
+  CaptureHeader head;
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, ATMD_CAPTURE_MAGIC, sizeof(head.magic));
+  head.endian = ATMD_CAPTURE_ENDIAN;
+  head.version = ATMD_CAPTURE_VERSION;
+  head.agents = agents;
+  if(write_all(_fd, &head, sizeof(head))) {
+    rt_syslog(ATMD_ERR, "PacketRecorder [start]: error writing capture file \"%s\" (Error: %s).", filename.c_str(), strerror(errno));
+    ::close(_fd);
+    _fd = -1;
+    return -1;
+  }
+
+  // The ring is touched now, so that the RT task never faults on it
+  _ring = new char[ATMD_CAPTURE_RING];
+  memset(_ring, 0, ATMD_CAPTURE_RING);
+  _head = 0;
+  _tail = 0;
+  _tbin = 0.0;
+  _packets = 0;
+  _bytes = 0;
+  _dropped = 0;
+  _stop = false;
+
+  int retval = rt_task_spawn(&_task, ATMD_NRT_CAPTURE_TASK, 0, 0, T_FPU|T_JOINABLE, PacketRecorder::writer_task, (void*)this);
+  if(retval) {
+    rt_syslog(ATMD_ERR, "PacketRecorder [start]: rt_task_spawn() failed to start the writer task (Code: %d).", retval);
+    delete[] _ring;
+    _ring = NULL;
+    ::close(_fd);
+    _fd = -1;
+    return -1;
+  }
+
+  __sync_synchronize();
+  _running = true;
+  return 0;
+}
+
+
+/* @fn PacketRecorder::stop()
+ * Stop the writer task, after it has written out the whole ring, and close the
+ * capture file. The producer must not record any more packets.
+ *
+ * @return Return 0 on success, -1 on error.
+ */
+int PacketRecorder::stop() {
+  if(!_running)
+    return 0;
+  _running = false;
+
+  int retval = 0;
+  _stop = true;
+  if(rt_task_join(&_task)) {
+    rt_syslog(ATMD_ERR, "PacketRecorder [stop]: failed to join the writer task.");
+    retval = -1;
+  }
+
+  if(::close(_fd)) {
+    rt_syslog(ATMD_ERR, "PacketRecorder [stop]: error closing capture file (Error: %s).", strerror(errno));
+    retval = -1;
+  }
+  _fd = -1;
+
+  if(_dropped > 0)
+    rt_syslog(ATMD_WARN, "PacketRecorder [stop]: %llu packets were not recorded because the capture ring was full.", (unsigned long long)_dropped);
+
+  delete[] _ring;
+  _ring = NULL;
+  return retval;
+}
+
+
+/* @fn PacketRecorder::put(size_t pos, const void* ptr, size_t len)
+ * Copy to the ring, wrapping around its end.
+ *
+ * @param pos Position in bytes ever written.
+ * @param ptr The data.
+ * @param len The size of the data.
+ */
+void PacketRecorder::put(size_t pos, const void* ptr, size_t len) {
+  size_t off = pos & (ATMD_CAPTURE_RING - 1);
+  size_t n = (len < ATMD_CAPTURE_RING - off) ? len : ATMD_CAPTURE_RING - off;
+  memcpy(_ring + off, ptr, n);
+  if(n < len)
+    memcpy(_ring, (const char*)ptr + n, len - n);
+}
+
+
+/* @fn PacketRecorder::record(uint64_t time, size_t agent, double tbin, const char* buffer, size_t size)
+ * Append a packet to the ring. A bin width record is added before it when the
+ * bin width has changed. The packet is dropped if the ring has no room for it.
+ *
+ * @param time The receive time in ns.
+ * @param agent The agent ID.
+ * @param tbin The current bin width in ps.
+ * @param buffer The raw packet.
+ * @param size The size of the packet.
+ * @return Return 0 on success, -1 if the packet was dropped.
+ */
+int PacketRecorder::record(uint64_t time, size_t agent, double tbin, const char* buffer, size_t size) {
+  CaptureRecord rec;
+  bool new_tbin = (tbin != _tbin);
+  size_t need = sizeof(rec) + size;
+  if(new_tbin)
+    need += sizeof(rec) + sizeof(double);
+
+  size_t head = _head;
+  size_t tail = _tail;
+  // The consumer must be done with the free space before we overwrite it
+  __sync_synchronize();
+  if(ATMD_CAPTURE_RING - (head - tail) < need) {
+    _dropped++;
+    return -1;
+  }
+
+  if(new_tbin) {
+    rec.time = time;
+    rec.agent = ATMD_CAPTURE_TBIN;
+    rec.size = sizeof(double);
+    put(head, &rec, sizeof(rec));
+    put(head + sizeof(rec), &tbin, sizeof(double));
+    head += sizeof(rec) + sizeof(double);
+    _tbin = tbin;
+  }
+
+  rec.time = time;
+  rec.agent = agent;
+  rec.size = size;
+  put(head, &rec, sizeof(rec));
+  put(head + sizeof(rec), buffer, size);
+  head += sizeof(rec) + size;
+
+  // Publish the record after its content
+  __sync_synchronize();
+  _head = head;
+  _packets++;
+  _bytes += size;
+  return 0;
+}
+
+
+/* @fn PacketRecorder::flush()
+ * Write out all the records published by the producer.
+ *
+ * @return Return 0 on success, -1 on error.
+ */
+int PacketRecorder::flush() {
+  size_t head = _head;
+  // Read the records only after their publication
+  __sync_synchronize();
+  size_t tail = _tail;
+
+  while(tail != head) {
+    size_t off = tail & (ATMD_CAPTURE_RING - 1);
+    size_t len = (head - tail < ATMD_CAPTURE_RING - off) ? head - tail : ATMD_CAPTURE_RING - off;
+    if(write_all(_fd, _ring + off, len))
+      return -1;
+    tail += len;
+
+    // Give the space back to the producer
+    __sync_synchronize();
+    _tail = tail;
+  }
+  return 0;
+}
+
+
+/* @fn static void PacketRecorder::writer_task(void *arg)
+ * Periodically write out the ring to the capture file. On a write error the
+ * task terminates: the ring fills up and the following packets are counted as
+ * dropped.
+ *
+ * @param arg Cookie for the task (pointer to the recorder).
+ */
+void PacketRecorder::writer_task(void *arg) {
+
+  // Init rt_printf and rt_syslog
+  rt_print_auto_init(1);
+
+  // Cast back 'this' pointer
+  PacketRecorder *pthis = (PacketRecorder*)arg;
+
+  // Prevent this task to send SIGDEBUG when switching to secondary mode
+  rt_task_set_mode(T_WARNSW, 0, NULL);
+
+  while(true) {
+    bool stop = pthis->_stop;
+    if(pthis->flush()) {
+      rt_syslog(ATMD_ERR, "PacketRecorder [writer_task]: error writing capture file (Error: %s). Recording stopped.", strerror(errno));
+      break;
+    }
+    if(stop)
+      break;
+    rt_task_sleep(ATMD_CAPTURE_PERIOD);
+  }
+}
+
+
+/* @fn CaptureReader::open(const std::string& filename)
+ * Open a capture file and check its header.
+ *
+ * @param filename The capture file.
+ * @return Return 0 on success, -1 on error.
+ */
+int CaptureReader::open(const std::string& filename) {
+  close();
+
+  _file = fopen(filename.c_str(), "rb");
+  if(!_file)
+    return -1;
+
+  CaptureHeader head;
+  if(fread(&head, sizeof(head), 1, _file) != 1 ||
+     memcmp(head.magic, ATMD_CAPTURE_MAGIC, sizeof(head.magic)) != 0 ||
+     head.endian != ATMD_CAPTURE_ENDIAN ||
+     head.version != ATMD_CAPTURE_VERSION ||
+     head.agents == 0) {
+    close();
+    errno = EINVAL;
+    return -1;
+  }
+
+  _agents = head.agents;
+  return 0;
+}
+
+
+/* @fn CaptureReader::close()
+ * Close the capture file.
+ */
+void CaptureReader::close() {
+  if(_file)
+    fclose(_file);
+  _file = NULL;
+  _agents = 0;
+}
+
+
+/* @fn CaptureReader::next(CaptureRecord& rec, char* buffer, size_t maxsize)
+ * Read the next record.
+ *
+ * @param rec The record header.
+ * @param buffer Buffer for the record content.
+ * @param maxsize Size of the buffer.
+ * @return Return 1 on success, 0 at the end of the file and -1 on error (also on a truncated record).
+ */
+int CaptureReader::next(CaptureRecord& rec, char* buffer, size_t maxsize) {
+  if(!_file)
+    return -1;
+
+  size_t n = fread(&rec, 1, sizeof(rec), _file);
+  if(n == 0 && feof(_file))
+    return 0;
+  if(n != sizeof(rec) || rec.size > maxsize)
+    return -1;
+  if(rec.size > 0 && fread(buffer, rec.size, 1, _file) != 1)
+    return -1;
+  return 1;
+}
@@ -0,0 +1,158 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Data packet capture header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Capture file
+ *
+ * A 16 byte header followed by one record for every data packet received from
+ * the agents, in the order the master received them. Each record is a 16 byte
+ * header followed by the raw packet bytes (size bytes, at most ATMD_PACKET_SIZE).
+ * Values are in the byte order of the server, recorded in the header.
+ *
+ * A record with agent ATMD_CAPTURE_TBIN carries the bin width (double, in ps)
+ * of the packets that follow it. It is written before the first packet and
+ * every time the bin width changes.
+ */
+
+#ifndef ATMD_CAPTURE_H
+#define ATMD_CAPTURE_H
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+// Xenomai
+#include <native/task.h>
+
+// Local
+#include "common.h"
+
+
+// File identification
+#define ATMD_CAPTURE_MAGIC    "ATMDCAP"   // 8 bytes including the terminator
+#define ATMD_CAPTURE_VERSION  1
+#define ATMD_CAPTURE_ENDIAN   0x01020304
+
+// Agent of the records carrying the bin width
+#define ATMD_CAPTURE_TBIN     0xFFFFFFFF
+
+
+/* @struct CaptureHeader
+ * Header of a capture file.
+ */
+struct CaptureHeader {
+  char magic[8];      // ATMD_CAPTURE_MAGIC
+  uint32_t endian;    // ATMD_CAPTURE_ENDIAN as written by the server
+  uint16_t version;   // ATMD_CAPTURE_VERSION
+  uint16_t agents;    // Number of agents
+};
+
+
+/* @struct CaptureRecord
+ * Header of a record.
+ */
+struct CaptureRecord {
+  uint64_t time;      // Receive time (ns, Xenomai clock)
+  uint32_t agent;     // Agent ID (or ATMD_CAPTURE_TBIN)
+  uint32_t size;      // Bytes following the record header
+};
+
+
+/* @class PacketRecorder
+ * Recorder of the data packets. The RT data task copies each packet into a
+ * lock-free single producer, single consumer byte ring; a low priority task
+ * drains the ring to the capture file. The RT task never blocks and never
+ * enters a system call: when the ring is full the packet is dropped and
+ * counted.
+ */
+class PacketRecorder {
+public:
+  PacketRecorder() : _fd(-1), _ring(NULL), _head(0), _tail(0), _tbin(0.0), _packets(0), _bytes(0), _dropped(0), _stop(false), _running(false) {};
+  ~PacketRecorder() { stop(); };
+
+  // Create the capture file and start the writer task
+  int start(const std::string& filename, size_t agents);
+
+  // Write out the ring, stop the writer task and close the file
+  int stop();
+
+  // Tell if packets are being recorded
+  bool enabled()const { return _running; };
+
+  // Record a packet (producer, called by the RT data task)
+  int record(uint64_t time, size_t agent, double tbin, const char* buffer, size_t size);
+
+  // Counters
+  uint64_t packets()const { return _packets; };
+  uint64_t bytes()const { return _bytes; };
+  uint64_t dropped()const { return _dropped; };
+
+private:
+  // Writer task (consumer)
+  static void writer_task(void *arg);
+
+  // Copy to the ring starting at the given position
+  void put(size_t pos, const void* ptr, size_t len);
+
+  // Write out the content of the ring (consumer)
+  int flush();
+
+  int _fd;                            // Capture file
+  char* _ring;                        // Ring buffer (ATMD_CAPTURE_RING bytes)
+  volatile size_t _head;              // Bytes ever written to the ring (producer)
+  volatile size_t _tail;              // Bytes ever written to the file (consumer)
+  double _tbin;                       // Last bin width recorded (producer)
+
+  volatile uint64_t _packets;         // Packets recorded
+  volatile uint64_t _bytes;           // Bytes recorded
+  volatile uint64_t _dropped;         // Packets dropped because the ring was full
+
+  volatile bool _stop;                // Stop request for the writer task
+  bool _running;
+  RT_TASK _task;
+};
+
+
+/* @class CaptureReader
+ * Sequential reader of a capture file.
+ */
+class CaptureReader {
+public:
+  CaptureReader() : _file(NULL), _agents(0) {};
+  ~CaptureReader() { close(); };
+
+  // Open a file and check its header
+  int open(const std::string& filename);
+  void close();
+
+  // Number of agents
+  size_t agents()const { return _agents; };
+
+  // Read the next record. Return 1 on success, 0 at the end of the file and -1 on error.
+  int next(CaptureRecord& rec, char* buffer, size_t maxsize);
+
+private:
+  FILE* _file;
+  size_t _agents;
+};
+
+#endif
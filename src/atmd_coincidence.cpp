@@ -0,0 +1,202 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Coincidence detection class
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Global debug flag
+#ifdef DEBUG
+extern bool enable_debug;
+#endif
+
+#include <pcrecpp.h>
+
+#include "atmd_coincidence.h"
+#include "atmd_measure.h"
+
+
+/* @fn Coincidence::setup(uint32_t tol, uint32_t width, const std::vector< std::vector<uint8_t> >& groups)
+ * Configure the coincidence groups and reset all the counters.
+ *
+ * @param tol The tolerance in ticks.
+ * @param width The bin width of the dt histograms in ticks.
+ * @param groups The channel groups (each with at least two channels).
+ */
+void Coincidence::setup(uint32_t tol, uint32_t width, const std::vector< std::vector<uint8_t> >& groups) {
+  _tol = tol;
+  _width = (width > 0) ? width : 1;
+  _nbins = (2 * (uint64_t)_tol) / _width + 1;
+  _groups = groups;
+  _ticks.resize(ATMD_COINC_MAXCH);
+  clear();
+}
+
+
+/* @fn Coincidence::clear()
+ * Reset all the counters.
+ */
+void Coincidence::clear() {
+  _starts = 0;
+  _counts.assign(_groups.size(), 0);
+  _hist.assign(_groups.size() * _nbins, 0);
+}
+
+
+/* @fn Coincidence::add_start(const Measure& meas, size_t start)
+ * Look for coincidences in one start. The stops of each channel are taken
+ * already sorted from the time index of the measure, so each group is
+ * evaluated with a single merge pass: for every stop of the first channel
+ * the window [t - tol, t + tol] only moves forward on the other channels.
+ *
+ * @param meas The measure.
+ * @param start The start number.
+ */
+void Coincidence::add_start(const Measure& meas, size_t start) {
+  if(!enabled() || meas.nch() == 0)
+    return;
+
+  size_t base = meas.first_stop(start);
+  _starts++;
+
+  for(size_t g = 0; g < _groups.size(); g++) {
+    const std::vector<uint8_t>& grp = _groups[g];
+
+    // Collect sorted ticks of the channels of the group
+    bool empty = false;
+    for(size_t k = 0; k < grp.size(); k++) {
+      _ticks[k].clear();
+      if(grp[k] > meas.nch()) {
+        empty = true;
+        continue;
+      }
+      uint32_t n = 0;
+      const uint32_t* index = meas.channel_index(start, grp[k], n);
+      for(uint32_t i = 0; i < n; i++)
+        _ticks[k].push_back(meas.get_tick(base + index[i]));
+      if(n == 0)
+        empty = true;
+    }
+    if(empty)
+      continue;
+
+    const std::vector<int64_t>& ta = _ticks[0];
+
+    if(grp.size() == 2) {
+      // Pair: count every couple within tolerance
+      const std::vector<int64_t>& tb = _ticks[1];
+      size_t lo = 0;
+      for(size_t i = 0; i < ta.size(); i++) {
+        while(lo < tb.size() && tb[lo] < ta[i] - (int64_t)_tol)
+          lo++;
+        for(size_t j = lo; j < tb.size() && tb[j] <= ta[i] + (int64_t)_tol; j++) {
+          _counts[g]++;
+          fill(g, tb[j] - ta[i]);
+        }
+      }
+
+    } else {
+      // Tuple: count stops on the first channel matched on every other channel
+      std::vector<size_t> lo(grp.size(), 0);
+      for(size_t i = 0; i < ta.size(); i++) {
+        bool match = true;
+        int64_t dt = 0;
+        for(size_t k = 1; k < grp.size(); k++) {
+          const std::vector<int64_t>& tk = _ticks[k];
+          while(lo[k] < tk.size() && tk[lo[k]] < ta[i] - (int64_t)_tol)
+            lo[k]++;
+          if(lo[k] >= tk.size() || tk[lo[k]] > ta[i] + (int64_t)_tol) {
+            match = false;
+            break;
+          }
+          if(k == 1) {
+            // Nearest stop on the second channel
+            dt = tk[lo[k]] - ta[i];
+            for(size_t j = lo[k]+1; j < tk.size() && tk[j] <= ta[i] + (int64_t)_tol; j++)
+              if(llabs(tk[j] - ta[i]) < llabs(dt))
+                dt = tk[j] - ta[i];
+          }
+        }
+        if(match) {
+          _counts[g]++;
+          fill(g, dt);
+        }
+      }
+    }
+  }
+}
+
+
+/* @fn Coincidence::parse_groups(const std::string& txt, size_t maxch, std::vector< std::vector<uint8_t> >& groups)
+ * Parse a list of channel groups. Groups are separated by ';' and channels
+ * inside a group by ','.
+ *
+ * @param txt The string to parse.
+ * @param maxch The highest valid channel number.
+ * @param groups Output vector of groups.
+ * @return Return 0 on success, -1 on error.
+ */
+int Coincidence::parse_groups(const std::string& txt, size_t maxch, std::vector< std::vector<uint8_t> >& groups) {
+  groups.clear();
+
+  pcrecpp::StringPiece input(txt);
+  pcrecpp::RE group_re("([0-9,]+);?");
+  std::string grp_txt;
+
+  while(group_re.Consume(&input, &grp_txt)) {
+    std::vector<uint8_t> grp;
+    pcrecpp::StringPiece grp_input(grp_txt);
+    pcrecpp::RE ch_re("(\\d+),?");
+    uint32_t ch;
+
+    while(ch_re.Consume(&grp_input, &ch)) {
+      if(ch < 1 || ch > maxch)
+        return -1;
+      grp.push_back(ch);
+    }
+
+    if(grp.size() < 2 || grp.size() > ATMD_COINC_MAXCH)
+      return -1;
+    groups.push_back(grp);
+  }
+
+  if(input.size() != 0 || groups.size() == 0 || groups.size() > ATMD_COINC_MAXGROUPS)
+    return -1;
+
+  return 0;
+}
+
+
+/* @fn Coincidence::format_groups(const std::vector< std::vector<uint8_t> >& groups)
+ * Format a list of channel groups in the same syntax accepted by parse_groups().
+ *
+ * @param groups The groups.
+ * @return The formatted string.
+ */
+std::string Coincidence::format_groups(const std::vector< std::vector<uint8_t> >& groups) {
+  std::stringstream txt(std::stringstream::out);
+  for(size_t g = 0; g < groups.size(); g++) {
+    if(g > 0)
+      txt << ";";
+    for(size_t k = 0; k < groups[g].size(); k++) {
+      if(k > 0)
+        txt << ",";
+      txt << (uint32_t)groups[g][k];
+    }
+  }
+  return txt.str();
+}
@@ -0,0 +1,99 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Coincidence detection header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_COINCIDENCE_H
+#define ATMD_COINCIDENCE_H
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <sstream>
+
+// Local
+#include "common.h"
+
+// Declare class Measure
+class Measure;
+
+
+/* @class Coincidence
+ * Coincidence counters for a set of channel groups. All times are in units of
+ * Tbin (TDC ticks).
+ * For a pair (A,B) every couple of stops of the same start with |tB - tA| not
+ * greater than the tolerance is counted, and tB - tA is histogrammed.
+ * For a tuple (A,B,C,...) every stop on A that has at least one stop on each
+ * of the other channels within the tolerance is counted, and the distance to
+ * the nearest stop on B is histogrammed.
+ */
+class Coincidence {
+public:
+  Coincidence() : _tol(0), _width(1), _nbins(0), _starts(0) {};
+  ~Coincidence() {};
+
+  // Configure and clear
+  void setup(uint32_t tol, uint32_t width, const std::vector< std::vector<uint8_t> >& groups);
+
+  // Reset all counters
+  void clear();
+
+  // Tell if there is something to compute
+  bool enabled()const { return (_groups.size() > 0); };
+
+  // Add a start of a measure
+  void add_start(const Measure& meas, size_t start);
+
+  // Configuration
+  uint32_t tolerance()const { return _tol; };
+  uint32_t width()const { return _width; };
+  uint32_t nbins()const { return _nbins; };
+  size_t groups()const { return _groups.size(); };
+  const std::vector<uint8_t>& group(size_t i)const { return _groups[i]; };
+
+  // Results
+  uint64_t starts()const { return _starts; };
+  uint64_t count(size_t i)const { return _counts[i]; };
+  const uint32_t* hist(size_t i)const { return (_nbins) ? &(_hist[i * _nbins]) : NULL; };
+
+  // Parse and format a group list like "1,2;3,4,5"
+  static int parse_groups(const std::string& txt, size_t maxch, std::vector< std::vector<uint8_t> >& groups);
+  static std::string format_groups(const std::vector< std::vector<uint8_t> >& groups);
+
+private:
+  // Add one bin to the dt histogram of a group
+  void fill(size_t g, int64_t dt) {
+    _hist[g * _nbins + (uint64_t)(dt + _tol) / _width]++;
+  };
+
+  uint32_t _tol;                                  // Tolerance
+  uint32_t _width;                                // dt bin width
+  uint32_t _nbins;                                // Number of dt bins (covering -tol to +tol)
+  uint64_t _starts;                               // Number of starts processed
+  std::vector< std::vector<uint8_t> > _groups;    // Channel groups
+  std::vector<uint64_t> _counts;                  // Coincidence counts of each group
+  std::vector<uint32_t> _hist;                    // dt histograms of each group
+
+  // Scratch buffers with the sorted ticks of each channel of a group
+  std::vector< std::vector<int64_t> > _ticks;
+};
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Column storage header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_COLUMN_H
+#define ATMD_COLUMN_H
+
+// Global
+#include <stddef.h>
+#include <vector>
+
+
+/* @class Column
+ * A column of plain values. The data either live in an owned std::vector or,
+ * once the column has been spilled, in an external read-only memory region
+ * (usually a memory-mapped file) that is owned by someone else.
+ * A mapped column cannot be modified any more.
+ */
+template <typename T> class Column {
+public:
+  Column() : _ptr(NULL), _sz(0), _mapped(false) {};
+  ~Column() {};
+
+  // Copy (the copy of a mapped column refers to the same memory region)
+  Column(const Column& obj) : _vec(obj._vec), _ptr(obj._ptr), _sz(obj._sz), _mapped(obj._mapped) { if(!_mapped) _sync(); };
+  Column& operator=(const Column& obj) {
+    if(this != &obj) {
+      _vec = obj._vec;
+      _ptr = obj._ptr;
+      _sz = obj._sz;
+      _mapped = obj._mapped;
+      if(!_mapped)
+        _sync();
+    }
+    return *this;
+  };
+
+  // push_back method: add one element at the end of the column
+  void push_back(const T& value) { _vec.push_back(value); _sync(); };
+
+  // append method: add a range of elements at the end of the column
+  template <typename It> void append(It first, It last) { _vec.insert(_vec.end(), first, last); _sync(); };
+
+  // reserve method: preallocate storage
+  void reserve(size_t sz) { _vec.reserve(sz); _sync(); };
+
+  // clear method: delete all elements (and detach from an external region)
+  void clear() { _vec.clear(); _mapped = false; _sync(); };
+
+  // size() method: return the number of elements in the column
+  size_t size()const { return _sz; };
+
+  // [] operator: select an element given its index (no bound checking)
+  const T& operator[](size_t i)const { return _ptr[i]; };
+
+  // Pointer to the first element (NULL if the column is empty)
+  const T* data()const { return (_sz) ? _ptr : NULL; };
+
+  // Bytes of memory held by the column (zero if the column is mapped)
+  size_t bytes()const { return (_mapped) ? 0 : _vec.capacity() * sizeof(T); };
+
+  // Bytes of payload
+  size_t payload()const { return _sz * sizeof(T); };
+
+  // Detach from the vector and point to an external region holding 'sz' elements
+  void map(const T* ptr, size_t sz) {
+    std::vector<T>().swap(_vec);
+    _ptr = ptr;
+    _sz = sz;
+    _mapped = true;
+  };
+  bool mapped()const { return _mapped; };
+
+private:
+  // Update the data pointer after the vector has changed
+  void _sync() {
+    _ptr = (_vec.size()) ? &(_vec[0]) : NULL;
+    _sz = _vec.size();
+  };
+
+  std::vector<T> _vec;
+  const T* _ptr;
+  size_t _sz;
+  bool _mapped;
+};
+
+#endif
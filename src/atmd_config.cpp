@@ -139,6 +139,106 @@ int AtmdConfig::read(const std::string& filename) {
         }
         continue;
       }
+
+      // Memory budget for stored measures (in MB)
+      unsigned int mb = 0;
+      conf_re = "^memlimit (\\d+)";
+      if(conf_re.PartialMatch(line, &mb)) {
+#ifdef DEBUG
+        if(enable_debug)
+          syslog(ATMD_DEBUG, "Config [read]: configured memory limit as %u MB.", mb);
+#endif
+        _memlimit = (size_t)mb * 1024 * 1024;
+        continue;
+      }
+
+      // Spool directory
+      conf_re = "^spooldir (\\/[a-zA-Z0-9\\.\\_\\-\\/]+)";
+      if(conf_re.PartialMatch(line, &txt)) {
+#ifdef DEBUG
+        if(enable_debug)
+          syslog(ATMD_DEBUG, "Config [read]: configured spool directory as '%s'.", txt.c_str());
+#endif
+        _spooldir = txt;
+        continue;
+      }
+
+      // Autosave chunks in flight
+      unsigned int sq = 0;
+      conf_re = "^savequeue (\\d+)";
+      if(conf_re.PartialMatch(line, &sq)) {
+#ifdef DEBUG
+        if(enable_debug)
+          syslog(ATMD_DEBUG, "Config [read]: configured autosave queue length as %u.", sq);
+#endif
+        if(sq > 0)
+          _savequeue = sq;
+        else
+          syslog(ATMD_WARN, "Config [read]: ignoring invalid autosave queue length.");
+        continue;
+      }
+
+      // MAT compression level
+      unsigned int level = 0;
+      conf_re = "^matcompress (\\d+)";
+      if(conf_re.PartialMatch(line, &level)) {
+#ifdef DEBUG
+        if(enable_debug)
+          syslog(ATMD_DEBUG, "Config [read]: configured MAT compression level as %u.", level);
+#endif
+        if(level <= 9)
+          _matcompress = level;
+        else
+          syslog(ATMD_WARN, "Config [read]: ignoring invalid MAT compression level.");
+        continue;
+      }
+
+      // Direct I/O
+      unsigned int dio = 0;
+      conf_re = "^directio (\\d+)";
+      if(conf_re.PartialMatch(line, &dio)) {
+#ifdef DEBUG
+        if(enable_debug)
+          syslog(ATMD_DEBUG, "Config [read]: direct I/O %s.", (dio) ? "enabled" : "disabled");
+#endif
+        _directio = (dio != 0);
+        continue;
+      }
+
+      // Export workers ("zworkers" is the name used before text exports shared the pool)
+      unsigned int ew = 0;
+      conf_re = "^(?:exportworkers|zworkers) (\\d+)";
+      if(conf_re.PartialMatch(line, &ew)) {
+#ifdef DEBUG
+        if(enable_debug)
+          syslog(ATMD_DEBUG, "Config [read]: configured %u export workers.", ew);
+#endif
+        _exportworkers = ew;
+        continue;
+      }
+
+      // Batch save workers
+      unsigned int sw = 0;
+      conf_re = "^saveworkers (\\d+)";
+      if(conf_re.PartialMatch(line, &sw)) {
+#ifdef DEBUG
+        if(enable_debug)
+          syslog(ATMD_DEBUG, "Config [read]: configured %u save workers.", sw);
+#endif
+        _saveworkers = sw;
+        continue;
+      }
+
+      // Packet capture file
+      conf_re = "^capture (\\/[a-zA-Z0-9\\.\\_\\-\\/]+)";
+      if(conf_re.PartialMatch(line, &txt)) {
+#ifdef DEBUG
+        if(enable_debug)
+          syslog(ATMD_DEBUG, "Config [read]: configured packet capture file as '%s'.", txt.c_str());
+#endif
+        _capture = txt;
+        continue;
+      }
 #endif
 
       // Number of RTSKBS
@@ -51,6 +51,13 @@ public:
 #ifdef ATMD_SERVER
     _uid = 0;
     _gid = 0;
+    _memlimit = 0;
+    _spooldir = ATMD_SPOOL_DIR;
+    _savequeue = ATMD_DEF_SAVEQUEUE;
+    _matcompress = ATMD_DEF_MATCOMPRESS;
+    _directio = false;
+    _exportworkers = ATMD_DEF_EXPORT_WORKERS;
+    _saveworkers = ATMD_DEF_SAVE_WORKERS;
 #endif
     memset(_rtif, 0, IFNAMSIZ);
     memset(_tdma_dev, 0, IFNAMSIZ);
@@ -74,6 +81,30 @@ public:
   // GID to save files
   gid_t gid()const { return _gid; }
   void gid(gid_t num) { _gid = num; }
+
+  // Memory budget for stored measures in bytes (zero means unlimited)
+  size_t memlimit()const { return _memlimit; };
+
+  // Spool directory for measures spilled to disk
+  const std::string& spooldir()const { return _spooldir; };
+
+  // Number of autosave chunks in flight to the writer task
+  size_t savequeue()const { return _savequeue; };
+
+  // zlib level of MAT files (zero writes uncompressed files)
+  int matcompress()const { return _matcompress; };
+
+  // Write saved files with direct I/O (bypassing the page cache)
+  bool directio()const { return _directio; };
+
+  // Number of worker tasks helping saves
+  size_t exportworkers()const { return _exportworkers; };
+
+  // Number of worker tasks saving measures in parallel
+  size_t saveworkers()const { return _saveworkers; };
+
+  // File recording all the data packets (empty to disable)
+  const std::string& capture()const { return _capture; };
 #endif
   
   // Return a pointer to RTSKBS
@@ -109,6 +140,28 @@ private:
 
   // GID
   gid_t _gid;
+
+  // Memory budget
+  size_t _memlimit;
+
+  // Spool directory
+  std::string _spooldir;
+
+  // Autosave queue length
+  size_t _savequeue;
+
+  // MAT compression
+  int _matcompress;
+
+  // Direct I/O
+  bool _directio;
+
+  // Save workers
+  size_t _exportworkers;
+  size_t _saveworkers;
+
+  // Packet capture file
+  std::string _capture;
 #endif
   
   // RTSKBS
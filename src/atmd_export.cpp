@@ -0,0 +1,522 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Measure export classes
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Global debug flag
+#ifdef DEBUG
+extern bool enable_debug;
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <rtdk.h>
+
+#include "atmd_export.h"
+
+
+/* @fn TimesSource::fill(uint8_t *buffer, uint32_t first, uint32_t count)
+ * Fill the buffer with a range of elements (column-major order).
+ *
+ * @param buffer The output buffer.
+ * @param first The first element.
+ * @param count The number of elements.
+ */
+void TimesSource::fill(uint8_t *buffer, uint32_t first, uint32_t count) {
+  uint32_t* out = (uint32_t*)buffer;
+  size_t rows = _meas.times();
+
+  for(uint32_t i = 0; i < count; i++) {
+    size_t row = (first + i) % rows;
+    uint64_t val = (_begin) ? _meas.get_begin(row) : _meas.get_time(row);
+    if((first + i) / rows == 0)
+      out[i] = val / 1000000000;
+    else
+      out[i] = (val % 1000000000) / 1000;
+  }
+}
+
+
+/* @fn StatTimesSource::fill(uint8_t *buffer, uint32_t first, uint32_t count)
+ * Fill the buffer with a range of elements (column-major order). Windows
+ * beyond the number of agents are dropped, missing ones are zero.
+ *
+ * @param buffer The output buffer.
+ * @param first The first element.
+ * @param count The number of elements.
+ */
+void StatTimesSource::fill(uint8_t *buffer, uint32_t first, uint32_t count) {
+  uint32_t* out = (uint32_t*)buffer;
+  size_t rows = _meas.count_starts();
+
+  for(uint32_t i = 0; i < count; i++) {
+    size_t row = (first + i) % rows;
+    size_t col = (first + i) / rows;
+    size_t agent = col / 2;
+
+    if(agent < _meas.start_times(row) && agent < _agents)
+      out[i] = (uint32_t)( ((col % 2) ? _meas.get_window_time(row, agent) : _meas.get_window_begin(row, agent)) / 1000 );
+    else
+      out[i] = 0;
+  }
+}
+
+
+/* @fn MeasureMat::MeasureMat(const Measure& meas, uint32_t format, size_t agents)
+ * Build the MAT layout of a measure. Sizes are known up front from the
+ * measure, so all the headers are computed here.
+ *
+ * @param meas The measure.
+ * @param format The file format (one of the MATPS formats).
+ * @param agents The number of agents.
+ */
+MeasureMat::MeasureMat(const Measure& meas, uint32_t format, size_t agents)
+  : _begin(meas, true), _time(meas, false), _data(meas), _start(meas), _channel(meas), _stoptime(meas), _stat_times(meas, agents), _valid(true) {
+
+  int retval = 0;
+  uint32_t num_events = meas.count_stops();
+
+  // Measure times
+  retval |= _stream.add_obj<uint32_t>("measure_begin", mxUINT32_CLASS, meas.times(), 2, &_begin);
+  retval |= _stream.add_obj<uint32_t>("measure_time", mxUINT32_CLASS, meas.times(), 2, &_time);
+
+  if(format == ATMD_FORMAT_MATPS1) {
+    // All data in a single matrix
+    _data.add_field(ATMD_FIELD_START);
+    _data.add_field(ATMD_FIELD_CHANNEL);
+    _data.add_field(ATMD_FIELD_STOPTIME);
+    retval |= _stream.add_obj<double>("data", mxDOUBLE_CLASS, num_events, 3, &_data);
+
+  } else {
+    // Separate variables for start, channel and stoptime
+    _start.add_field(ATMD_FIELD_START);
+    _channel.add_field(ATMD_FIELD_CHANNEL);
+    _stoptime.add_field(ATMD_FIELD_STOPTIME);
+    retval |= _stream.add_obj<uint32_t>("start", mxUINT32_CLASS, num_events, 1, &_start);
+    retval |= _stream.add_obj<int8_t>("channel", mxINT8_CLASS, num_events, 1, &_channel);
+    retval |= _stream.add_obj<double>("stoptime", mxDOUBLE_CLASS, num_events, 1, &_stoptime);
+  }
+
+  if(format == ATMD_FORMAT_MATPS3 || format == ATMD_FORMAT_MATPS3_FTP || format == ATMD_FORMAT_MATPS3_ALL) {
+    for(size_t i = 0; i < meas.count_starts(); i++) {
+      if(meas.start_times(i) > agents) {
+        rt_syslog(ATMD_WARN, "MeasureMat [MeasureMat]: found a start that had more timings than the number of agents.");
+        break;
+      }
+    }
+    retval |= _stream.add_obj<uint32_t>("stat_times", mxUINT32_CLASS, meas.count_starts(), 2 * agents, &_stat_times);
+  }
+
+  if(retval) {
+    rt_syslog(ATMD_ERR, "MeasureMat [MeasureMat]: measure is too big for a MAT file.");
+    _valid = false;
+  }
+}
+
+
+/* @class BinConvJob
+ * Converts a slice of the stop times of a measure to ps (BINPS files).
+ */
+class BinConvJob : public PoolJob {
+public:
+  BinConvJob() : meas(NULL), first(0), count(0) {};
+
+  int run() {
+    if(buffer.size() < count)
+      buffer.resize(count);
+    meas->get_stoptimes(first, count, &(buffer[0]));
+    return 0;
+  };
+
+  const Measure* meas;
+  size_t first;                 // First event
+  size_t count;                 // Number of events
+  std::vector<double> buffer;   // Stop times in ps (reused across slices)
+};
+
+
+/* @fn measure2bin(const Measure& meas, uint32_t format, size_t agents, FileWriter& out, WorkerPool* pool)
+ * Write a measure as a binary file. The columns are appended in order, padded
+ * to their offsets: plain columns straight from the measure, the BINPS stop
+ * times converted in slices of ATMD_BIN_SLICE bytes, in parallel on the worker
+ * pool when one is given, while the writer has the previous slices in flight.
+ *
+ * @param meas The measure.
+ * @param format ATMD_FORMAT_BINPS or ATMD_FORMAT_BINRAW.
+ * @param agents The number of agents.
+ * @param out The output file.
+ * @param pool The worker pool (can be NULL).
+ * @return Return 0 on success, -1 on error.
+ */
+int measure2bin(const Measure& meas, uint32_t format, size_t agents, FileWriter& out, WorkerPool* pool) {
+  AtmdBinHeader head;
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, ATMD_BIN_MAGIC, sizeof(head.magic));
+  head.endian = ATMD_BIN_ENDIAN;
+  head.version = ATMD_BIN_VERSION;
+  head.type = (format == ATMD_FORMAT_BINRAW) ? ATMD_BIN_RAW : ATMD_BIN_PS;
+  head.agents = agents;
+  head.nch = meas.nch();
+  head.tbin = meas.get_tbin();
+  head.retrig_period = ATMD_RETRIG_PS;
+  head.times = meas.times();
+  head.starts = meas.count_starts();
+  head.windows = meas.windows();
+  head.events = meas.count_stops();
+  atmd_bin_layout(head);
+
+  const void* cols[ATMD_BIN_COLUMNS] = { meas.begins(), meas.durations(),
+                                         meas.start_indexes(), meas.start_ids(),
+                                         meas.time_indexes(), meas.window_begins(), meas.window_times(),
+                                         meas.channels(), meas.stoptimes(), meas.retrigs() };
+  static const char zeros[8] = { 0 };
+
+  size_t njobs = (pool) ? pool->workers() : 1;
+  std::vector<BinConvJob> jobs;
+  std::vector<PoolJob*> ptrs;
+
+  out.write(&head, sizeof(head));
+  for(size_t c = 0; c < ATMD_BIN_COLUMNS && out.good(); c++) {
+    if(out.pos() < head.offset[c])
+      out.write(zeros, head.offset[c] - out.pos());
+
+    if(c != ATMD_BIN_STOPTIME || head.type != ATMD_BIN_PS) {
+      if(head.size[c] > 0)
+        out.write(cols[c], head.size[c]);
+      continue;
+    }
+
+    // Stop times in ps: convert a batch of slices, then append them in order
+    if(jobs.size() == 0) {
+      jobs.resize(njobs);
+      ptrs.resize(njobs);
+      for(size_t i = 0; i < njobs; i++) {
+        jobs[i].meas = &meas;
+        ptrs[i] = &(jobs[i]);
+      }
+    }
+    size_t slice = ATMD_BIN_SLICE / sizeof(double);
+    for(size_t ev = 0; ev < head.events && out.good(); ) {
+      size_t n = 0;
+      while(n < njobs && ev < head.events) {
+        jobs[n].first = ev;
+        jobs[n].count = (head.events - ev < slice) ? head.events - ev : slice;
+        ev += jobs[n].count;
+        n++;
+      }
+      if(pool)
+        pool->run(&(ptrs[0]), n);
+      else
+        jobs[0].run();
+      for(size_t i = 0; i < n; i++)
+        out.write(&(jobs[i].buffer[0]), jobs[i].count * sizeof(double));
+    }
+  }
+  if(out.good() && out.pos() < head.file_size)
+    out.write(zeros, head.file_size - out.pos());
+
+  if(!out.good()) {
+    rt_syslog(ATMD_ERR, "measure2bin: error writing binary file (Error: %s).", strerror(out.error()));
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* @fn export_size(const Measure& meas, uint32_t format, size_t agents)
+ * Size of the file written for a measure, before compression. It is exact for
+ * the binary formats, neglects tags and padding for the MAT formats and uses a
+ * typical line length for the text formats. Only counters are used, so it is
+ * cheap enough to be checked after every start.
+ *
+ * @param meas The measure.
+ * @param format The file format.
+ * @param agents The number of agents.
+ * @return The size in bytes.
+ */
+uint64_t export_size(const Measure& meas, uint32_t format, size_t agents) {
+  uint64_t events = meas.count_stops();
+  uint64_t starts = meas.count_starts();
+
+  switch(format) {
+    case ATMD_FORMAT_BINPS:
+    case ATMD_FORMAT_BINRAW: {
+      AtmdBinHeader head;
+      memset(&head, 0, sizeof(head));
+      head.type = (format == ATMD_FORMAT_BINRAW) ? ATMD_BIN_RAW : ATMD_BIN_PS;
+      head.times = meas.times();
+      head.starts = starts;
+      head.windows = meas.windows();
+      head.events = events;
+      atmd_bin_layout(head);
+      return head.file_size;
+    }
+
+    case ATMD_FORMAT_MATPS1:
+      return 128 + events * 3 * sizeof(double);
+
+    case ATMD_FORMAT_MATPS2:
+    case ATMD_FORMAT_MATPS2_FTP:
+    case ATMD_FORMAT_MATPS2_ALL:
+      return 128 + events * (sizeof(uint32_t) + sizeof(int8_t) + sizeof(double));
+
+    case ATMD_FORMAT_MATPS3:
+    case ATMD_FORMAT_MATPS3_FTP:
+    case ATMD_FORMAT_MATPS3_ALL:
+      return 128 + events * (sizeof(uint32_t) + sizeof(int8_t) + sizeof(double)) + starts * 2 * agents * sizeof(uint32_t);
+
+    default:
+      return events * ATMD_TEXT_AVGLINE;
+  }
+}
+
+
+/* @fn format_uint(char* p, uint64_t v)
+ * Format an unsigned integer.
+ *
+ * @return Return the pointer past the last character.
+ */
+static inline char* format_uint(char* p, uint64_t v) {
+  char tmp[20];
+  size_t n = 0;
+  do {
+    tmp[n++] = '0' + (v % 10);
+    v /= 10;
+  } while(v);
+  while(n)
+    *(p++) = tmp[--n];
+  return p;
+}
+
+
+/* @fn format_int(char* p, int64_t v)
+ * Format a signed integer.
+ *
+ * @return Return the pointer past the last character.
+ */
+static inline char* format_int(char* p, int64_t v) {
+  if(v < 0) {
+    *(p++) = '-';
+    return format_uint(p, -(uint64_t)v);
+  }
+  return format_uint(p, v);
+}
+
+
+/* @fn format_double(char* p, double v)
+ * Format a double with the shortest representation that reads back to the
+ * same value (at most 17 significant digits, "%g" style). Values in the
+ * usual range of stop times are formatted by hand: for growing d, v * 10^d is
+ * rounded to an integer N and the first N that gives back v when divided by
+ * 10^d is printed with d decimals. With N < 2^53 both N and 10^d are exact, so
+ * the division is correctly rounded exactly like strtod(). Other values fall
+ * back to snprintf().
+ *
+ * @param p The output buffer (at least 32 characters).
+ * @param v The value.
+ * @return Return the pointer past the last character.
+ */
+char* format_double(char* p, double v) {
+  static const double p10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+
+  if(v == 0.0) {
+    *(p++) = '0';
+    return p;
+  }
+
+  double a = fabs(v);
+  if(a >= 1e-4 && a < 1e15) {
+    for(size_t d = 0; d < sizeof(p10) / sizeof(double); d++) {
+      double s = floor(a * p10[d] + 0.5);
+      if(s >= 9007199254740992.0)
+        break;
+      if(s / p10[d] != a)
+        continue;
+      uint64_t n = (uint64_t)s;
+
+      // Print n with d decimals
+      if(v < 0)
+        *(p++) = '-';
+      char tmp[20];
+      size_t len = 0;
+      do {
+        tmp[len++] = '0' + (n % 10);
+        n /= 10;
+      } while(n);
+      if(len <= d) {
+        *(p++) = '0';
+        *(p++) = '.';
+        for(size_t i = len; i < d; i++)
+          *(p++) = '0';
+      }
+      while(len) {
+        *(p++) = tmp[--len];
+        if(len == d && d > 0)
+          *(p++) = '.';
+      }
+      return p;
+    }
+  }
+
+  // Generic case
+  int n = snprintf(p, 32, "%.15g", v);
+  if(strtod(p, NULL) != v)
+    n = snprintf(p, 32, "%.16g", v);
+  if(strtod(p, NULL) != v)
+    n = snprintf(p, 32, "%.17g", v);
+  return p + n;
+}
+
+
+/* @fn TextJob::setup(const Measure* meas, uint32_t format, size_t first, size_t last)
+ * Set the range of starts to format.
+ *
+ * @param meas The measure.
+ * @param format The text format.
+ * @param first The first start.
+ * @param last One past the last start.
+ */
+void TextJob::setup(const Measure* meas, uint32_t format, size_t first, size_t last) {
+  _meas = meas;
+  _format = format;
+  _first = first;
+  _last = last;
+  _len = 0;
+}
+
+
+/* @fn TextJob::run()
+ * Format the range. The buffer is sized once for the longest possible lines,
+ * so there are no checks in the loop.
+ *
+ * @return Return 0.
+ */
+int TextJob::run() {
+  const Measure& meas = *_meas;
+  size_t events = meas.first_stop(_last) - meas.first_stop(_first);
+  if(_buffer.size() < events * ATMD_TEXT_MAXLINE)
+    _buffer.resize(events * ATMD_TEXT_MAXLINE);
+  _len = 0;
+  if(events == 0)
+    return 0;
+
+  // Stop times in ps of the whole range
+  size_t base = meas.first_stop(_first);
+  if(_format != ATMD_FORMAT_RAW) {
+    if(_ps.size() < events)
+      _ps.resize(events);
+    meas.get_stoptimes(base, events, &(_ps[0]));
+  }
+
+  char* p = &(_buffer[0]);
+  for(size_t i = _first; i < _last; i++) {
+    size_t last = meas.first_stop(i) + meas.count_stops(i);
+    for(size_t j = meas.first_stop(i); j < last; j++) {
+      p = format_uint(p, i+1);
+      *(p++) = '\t';
+      p = format_int(p, meas.get_channel(j));
+      *(p++) = '\t';
+
+      if(_format == ATMD_FORMAT_RAW) {
+        p = format_uint(p, meas.get_retrig(j));
+        *(p++) = '\t';
+        p = format_double(p, (double)meas.get_rawstop(j) * meas.get_tbin());
+
+      } else if(_format == ATMD_FORMAT_US) {
+        p = format_double(p, _ps[j - base] / 1e6);
+
+      } else {
+        p = format_double(p, _ps[j - base]);
+      }
+      *(p++) = '\n';
+    }
+  }
+
+  _len = p - &(_buffer[0]);
+  return 0;
+}
+
+
+/* @fn measure2text(const Measure& meas, uint32_t format, FileWriter& out, WorkerPool* pool)
+ * Write a measure as a text file. The starts are cut in ranges of about
+ * ATMD_TEXT_BLOCK events, formatted in batches by the worker pool (or by the
+ * caller when pool is NULL) and written in order, so memory is bounded by one
+ * batch whatever the size of the measure.
+ *
+ * @param meas The measure.
+ * @param format ATMD_FORMAT_RAW, ATMD_FORMAT_PS or ATMD_FORMAT_US.
+ * @param out The output file.
+ * @param pool The worker pool (can be NULL).
+ * @return Return 0 on success, -1 on error.
+ */
+int measure2text(const Measure& meas, uint32_t format, FileWriter& out, WorkerPool* pool) {
+  // Header
+  const char* header = (format == ATMD_FORMAT_RAW) ? "start\tchannel\tslope\trefcount\tstoptime\n" : "start\tchannel\tslope\tstoptime\n";
+  if(out.write(header, strlen(header))) {
+    rt_syslog(ATMD_ERR, "measure2text: error writing text file (Error: %s).", strerror(out.error()));
+    return -1;
+  }
+
+  size_t njobs = (pool) ? pool->workers() : 1;
+  std::vector<TextJob> jobs(njobs);
+  std::vector<PoolJob*> ptrs(njobs);
+  for(size_t i = 0; i < njobs; i++)
+    ptrs[i] = &(jobs[i]);
+
+  size_t start = 0;
+  size_t starts = meas.count_starts();
+  while(start < starts) {
+    // Assign consecutive ranges of starts to the jobs
+    size_t n = 0;
+    while(n < njobs && start < starts) {
+      size_t last = start + 1;
+      while(last < starts && meas.first_stop(last) - meas.first_stop(start) < ATMD_TEXT_BLOCK)
+        last++;
+      jobs[n++].setup(&meas, format, start, last);
+      start = last;
+    }
+
+    // Format
+    int retval = 0;
+    if(pool)
+      retval = pool->run(&(ptrs[0]), n);
+    else
+      retval = jobs[0].run();
+    if(retval) {
+      rt_syslog(ATMD_ERR, "measure2text: error formatting text.");
+      return -1;
+    }
+
+    // Write in order
+    for(size_t i = 0; i < n; i++) {
+      if(out.write(jobs[i].text(), jobs[i].length())) {
+        rt_syslog(ATMD_ERR, "measure2text: error writing text file (Error: %s).", strerror(out.error()));
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Measure export header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_EXPORT_H
+#define ATMD_EXPORT_H
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+
+// Local
+#include "common.h"
+#include "atmd_measure.h"
+#include "atmd_binfile.h"
+#include "atmd_workerpool.h"
+#include "atmd_filewriter.h"
+#include "MatFile.h"
+
+
+// Event fields that can be exported
+#define ATMD_FIELD_START      0   // Start ID
+#define ATMD_FIELD_CHANNEL    1   // Channel
+#define ATMD_FIELD_STOPTIME   2   // Stop time in ps
+
+// Number of events converted at a time when exporting
+#define ATMD_EXPORT_CHUNK     8192
+
+// Number of events formatted by a text job, and maximum length of a text line
+#define ATMD_TEXT_BLOCK       65536
+#define ATMD_TEXT_MAXLINE     96
+
+// Typical length of a text line (used to estimate the size of text files)
+#define ATMD_TEXT_AVGLINE     28
+
+// Size of the slices of BINPS stop times converted in parallel (a multiple of 8)
+#define ATMD_BIN_SLICE        (16*1024*1024)
+
+
+/* @fn export_start_id(const Measure& meas, size_t start)
+ * Start ID written in exported files (1-based start number, or the TANGO
+ * start ID when available).
+ */
+inline uint32_t export_start_id(const Measure& meas, size_t start) {
+#ifdef EN_TANGO
+  uint32_t startid = meas.start_id(start);
+  if(startid != 0)
+    return startid;
+#endif
+  return start + 1;
+}
+
+
+/* @fn export_stoptimes(const Measure& meas, size_t first, size_t count, T* out)
+ * Stop times in ps of a range of events. Double buffers are filled directly by
+ * the batch conversion, other types go through a small scratch buffer.
+ */
+inline void export_stoptimes(const Measure& meas, size_t first, size_t count, double* out) {
+  meas.get_stoptimes(first, count, out);
+}
+
+template <class T> void export_stoptimes(const Measure& meas, size_t first, size_t count, T* out) {
+  double buffer[512];
+  while(count > 0) {
+    size_t n = (count < 512) ? count : 512;
+    meas.get_stoptimes(first, n, buffer);
+    for(size_t i = 0; i < n; i++)
+      out[i] = (T)buffer[i];
+    out += n;
+    first += n;
+    count -= n;
+  }
+}
+
+
+/* @class EventCursor
+ * Tracks the start an event belongs to. Sequential lookups are resolved by
+ * walking forward, random ones with a binary search over the start index.
+ */
+class EventCursor {
+public:
+  EventCursor(const Measure& meas) : _meas(meas), _start(0) {};
+
+  size_t start_of(size_t ev) {
+    size_t starts = _meas.count_starts();
+    if(_start < starts && _meas.first_stop(_start) <= ev) {
+      while(_start + 1 < starts && _meas.first_stop(_start + 1) <= ev)
+        _start++;
+      return _start;
+    }
+    size_t lo = 0, hi = starts;
+    while(hi - lo > 1) {
+      size_t mid = (lo + hi) / 2;
+      if(_meas.first_stop(mid) <= ev)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    _start = lo;
+    return _start;
+  };
+
+private:
+  const Measure& _meas;
+  size_t _start;
+};
+
+
+/* @class EventSource
+ * MAT source reading fields of all the events straight from the measure
+ * columns. Each field is one column of a (events x fields) matrix of type T.
+ */
+template <class T> class EventSource : public MatSource {
+public:
+  EventSource(const Measure& meas) : _meas(meas), _cursor(meas) {};
+  ~EventSource() {};
+
+  void add_field(int field) { _fields.push_back(field); };
+  size_t fields()const { return _fields.size(); };
+
+  void fill(uint8_t *buffer, uint32_t first, uint32_t count);
+
+private:
+  const Measure& _meas;
+  EventCursor _cursor;
+  std::vector<int> _fields;
+};
+
+
+/* @fn EventSource<T>::fill(uint8_t *buffer, uint32_t first, uint32_t count)
+ * Fill the buffer with a range of elements (column-major order).
+ *
+ * @param buffer The output buffer.
+ * @param first The first element.
+ * @param count The number of elements.
+ */
+template <class T> void EventSource<T>::fill(uint8_t *buffer, uint32_t first, uint32_t count) {
+  T* out = (T*)buffer;
+  size_t nev = _meas.count_stops();
+  if(nev == 0)
+    return;
+
+  while(count > 0) {
+    size_t col = first / nev;
+    size_t row = first % nev;
+    uint32_t n = (count < nev - row) ? count : nev - row;
+
+    switch(_fields[col]) {
+      case ATMD_FIELD_START: {
+        size_t s = _cursor.start_of(row);
+        size_t next = _meas.first_stop(s) + _meas.count_stops(s);
+        T id = (T)export_start_id(_meas, s);
+        for(uint32_t i = 0; i < n; i++) {
+          if(row + i >= next) {
+            s = _cursor.start_of(row + i);
+            next = _meas.first_stop(s) + _meas.count_stops(s);
+            id = (T)export_start_id(_meas, s);
+          }
+          out[i] = id;
+        }
+        break;
+      }
+
+      case ATMD_FIELD_CHANNEL:
+        for(uint32_t i = 0; i < n; i++)
+          out[i] = (T)_meas.get_channel(row + i);
+        break;
+
+      case ATMD_FIELD_STOPTIME:
+        export_stoptimes(_meas, row, n, out);
+        break;
+    }
+
+    out += n;
+    first += n;
+    count -= n;
+  }
+}
+
+
+/* @class TimesSource
+ * MAT source of the begin or duration of the measure time windows, as a
+ * (times x 2) matrix of seconds and microseconds.
+ */
+class TimesSource : public MatSource {
+public:
+  TimesSource(const Measure& meas, bool begin) : _meas(meas), _begin(begin) {};
+  ~TimesSource() {};
+
+  void fill(uint8_t *buffer, uint32_t first, uint32_t count);
+
+private:
+  const Measure& _meas;
+  bool _begin;
+};
+
+
+/* @class StatTimesSource
+ * MAT source of the start windows, as a (starts x 2*agents) matrix with the
+ * begin and duration in us of the window of each agent.
+ */
+class StatTimesSource : public MatSource {
+public:
+  StatTimesSource(const Measure& meas, size_t agents) : _meas(meas), _agents(agents) {};
+  ~StatTimesSource() {};
+
+  void fill(uint8_t *buffer, uint32_t first, uint32_t count);
+
+private:
+  const Measure& _meas;
+  size_t _agents;
+};
+
+
+/* @class MeasureMat
+ * MAT file layout of a measure (MATPS formats). Nothing is copied from the
+ * measure: the stream pulls the data from the measure columns while it is
+ * written, so the measure must stay alive until the stream is used.
+ */
+class MeasureMat {
+public:
+  MeasureMat(const Measure& meas, uint32_t format, size_t agents);
+  ~MeasureMat() {};
+
+  // Tell if the layout was built successfully
+  bool valid()const { return _valid; };
+
+  // The MAT stream
+  MatStream& stream() { return _stream; };
+
+private:
+  MeasureMat(const MeasureMat&);
+  MeasureMat& operator=(const MeasureMat&);
+
+  TimesSource _begin;
+  TimesSource _time;
+  EventSource<double> _data;
+  EventSource<uint32_t> _start;
+  EventSource<int8_t> _channel;
+  EventSource<double> _stoptime;
+  StatTimesSource _stat_times;
+  MatStream _stream;
+  bool _valid;
+};
+
+
+
+// Write a measure as a binary file (ATMD_FORMAT_BINPS or ATMD_FORMAT_BINRAW)
+int measure2bin(const Measure& meas, uint32_t format, size_t agents, FileWriter& out, WorkerPool* pool);
+
+// Size in bytes of the file written for a measure (before compression)
+uint64_t export_size(const Measure& meas, uint32_t format, size_t agents);
+
+
+/* @class TextJob
+ * Formats the events of a range of starts as text lines (ATMD_FORMAT_RAW,
+ * ATMD_FORMAT_PS or ATMD_FORMAT_US) into its own buffer.
+ */
+class TextJob : public PoolJob {
+public:
+  TextJob() : _meas(NULL), _format(0), _first(0), _last(0), _len(0) {};
+  ~TextJob() {};
+
+  // Set the range of starts [first, last)
+  void setup(const Measure* meas, uint32_t format, size_t first, size_t last);
+
+  // Format the range
+  int run();
+
+  // Formatted text
+  const char* text()const { return (_len) ? &(_buffer[0]) : NULL; };
+  size_t length()const { return _len; };
+
+private:
+  const Measure* _meas;
+  uint32_t _format;
+  size_t _first;
+  size_t _last;
+  std::vector<char> _buffer;    // Reused across ranges
+  std::vector<double> _ps;      // Stop times in ps of the range
+  size_t _len;
+};
+
+
+// Format a double with the shortest representation that reads back to the same value
+char* format_double(char* p, double v);
+
+// Write a measure as a text file (ATMD_FORMAT_RAW, ATMD_FORMAT_PS or ATMD_FORMAT_US)
+int measure2text(const Measure& meas, uint32_t format, FileWriter& out, WorkerPool* pool);
+
+#endif
@@ -0,0 +1,524 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Asynchronous file writer
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Global debug flag
+#ifdef DEBUG
+extern bool enable_debug;
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <rtdk.h>
+
+#include "atmd_filewriter.h"
+
+
+/* @fn pwrite_all(int fd, const void* ptr, size_t len, uint64_t off)
+ * Write a buffer at a given offset, retrying on short writes.
+ *
+ * @return Return 0 on success, errno on error.
+ */
+static int pwrite_all(int fd, const void* ptr, size_t len, uint64_t off) {
+  const char* p = (const char*)ptr;
+  while(len > 0) {
+    ssize_t ret = pwrite(fd, p, len, off);
+    if(ret == -1) {
+      if(errno == EINTR)
+        continue;
+      return errno;
+    }
+    p += ret;
+    off += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+
+/* @fn FileWriter::FileWriter()
+ * Constructor.
+ */
+FileWriter::FileWriter() : _fd(-1), _direct(false), _pos(0), _error(0), _dirty(false), _cur(0), _fill(0), _terminate(false), _objects(false) {
+#ifdef HAVE_LIBURING
+  _uring = false;
+#endif
+  for(size_t i = 0; i < ATMD_AIO_BUFFERS; i++) {
+    _slots[i].buf = NULL;
+    _slots[i].len = 0;
+    _slots[i].off = 0;
+    _slots[i].state = SLOT_FREE;
+  }
+}
+
+
+/* @fn FileWriter::open(const std::string& filename, bool direct, uint64_t size)
+ * Create a file and start the write backend.
+ *
+ * @param filename The file to create (truncated if it exists, an empty file
+ *                 keeps the space reserved by preallocate()).
+ * @param direct Bypass the page cache, if the file system allows it.
+ * @param size The expected file size, reserved up front (0 to skip).
+ * @return Return 0 on success, -1 on error (errno is set).
+ */
+int FileWriter::open(const std::string& filename, bool direct, uint64_t size) {
+  if(_fd >= 0)
+    return -1;
+
+  _filename = filename;
+  _pos = 0;
+  _error = 0;
+  _dirty = false;
+  _cur = 0;
+  _fill = 0;
+  _patches.clear();
+
+  // Not O_TRUNC, that would release the space of a preallocated file
+  int flags = O_WRONLY | O_CREAT;
+  mode_t mode = S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH;
+  _direct = false;
+  if(direct) {
+    _fd = ::open(filename.c_str(), flags | O_DIRECT, mode);
+    _direct = (_fd >= 0);
+  }
+  if(_fd < 0)
+    _fd = ::open(filename.c_str(), flags, mode);
+  if(_fd < 0)
+    return -1;
+
+  // Drop the old content of an existing file
+  struct stat st;
+  if(fstat(_fd, &st) || (st.st_size > 0 && ftruncate(_fd, 0))) {
+    int err = errno;
+    ::close(_fd);
+    _fd = -1;
+    errno = err;
+    return -1;
+  }
+
+  // Contiguous extents for the whole file (not supported everywhere, so failures are ignored)
+  if(size > 0)
+    fallocate(_fd, FALLOC_FL_KEEP_SIZE, 0, size);
+
+  for(size_t i = 0; i < ATMD_AIO_BUFFERS; i++) {
+    void* ptr = NULL;
+    if(posix_memalign(&ptr, ATMD_AIO_ALIGN, ATMD_AIO_BUFSIZE)) {
+      close();
+      errno = ENOMEM;
+      return -1;
+    }
+    _slots[i].buf = (char*)ptr;
+    _slots[i].state = SLOT_FREE;
+  }
+
+#ifdef HAVE_LIBURING
+  // io_uring when the kernel supports it
+  _uring = (io_uring_queue_init(ATMD_AIO_BUFFERS, &_ring, 0) == 0);
+  if(_uring)
+    return 0;
+#endif
+
+  // Otherwise worker tasks (anonymous, as many files can be written at the same time)
+  if(rt_mutex_create(&_mutex, NULL) == 0) {
+    if(rt_cond_create(&_work, NULL) == 0) {
+      if(rt_cond_create(&_done, NULL) == 0) {
+        _objects = true;
+      } else {
+        rt_cond_delete(&_work);
+        rt_mutex_delete(&_mutex);
+      }
+    } else {
+      rt_mutex_delete(&_mutex);
+    }
+  }
+  if(!_objects) {
+    rt_syslog(ATMD_WARN, "FileWriter [open]: failed to create synchronization objects. Writing synchronously.");
+    return 0;
+  }
+
+  _terminate = false;
+  _queue.clear();
+  _tasks.resize(ATMD_AIO_THREADS);
+  for(size_t i = 0; i < _tasks.size(); i++) {
+    int retval = rt_task_spawn(&(_tasks[i]), NULL, 0, 0, T_FPU|T_JOINABLE, FileWriter::worker_task, (void*)this);
+    if(retval) {
+      rt_syslog(ATMD_WARN, "FileWriter [open]: rt_task_spawn() failed to start a worker task (Code: %d).", retval);
+      _tasks.resize(i);
+      break;
+    }
+  }
+  return 0;
+}
+
+
+/* @fn static FileWriter::preallocate(const std::string& filename, uint64_t size)
+ * Create (or truncate) a file and reserve disk space for it without changing
+ * its size, so that a later open() finds its extents already allocated.
+ *
+ * @param filename The file.
+ * @param size The space to reserve.
+ * @return Return 0 on success, -1 on error (errno is set).
+ */
+int FileWriter::preallocate(const std::string& filename, uint64_t size) {
+  int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH);
+  if(fd < 0)
+    return -1;
+
+  int retval = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size);
+  int err = errno;
+  ::close(fd);
+  errno = err;
+  return (retval) ? -1 : 0;
+}
+
+
+/* @fn FileWriter::write(const void* ptr, size_t len)
+ * Append data. Full buffers are queued and the oldest buffer is waited for
+ * only when all of them are in flight.
+ *
+ * @param ptr The data.
+ * @param len The size of the data.
+ * @return Return 0 on success, -1 on error.
+ */
+int FileWriter::write(const void* ptr, size_t len) {
+  if(_fd < 0)
+    return -1;
+
+  const char* p = (const char*)ptr;
+  if(len > 0)
+    _dirty = true;
+
+  while(len > 0) {
+    size_t n = (len < ATMD_AIO_BUFSIZE - _fill) ? len : ATMD_AIO_BUFSIZE - _fill;
+    memcpy(_slots[_cur].buf + _fill, p, n);
+    _fill += n;
+    _pos += n;
+    p += n;
+    len -= n;
+
+    if(_fill == ATMD_AIO_BUFSIZE) {
+      _slots[_cur].len = ATMD_AIO_BUFSIZE;
+      _slots[_cur].off = _pos - ATMD_AIO_BUFSIZE;
+      submit(_cur);
+      _cur = (_cur + 1) % ATMD_AIO_BUFFERS;
+      _fill = 0;
+      if(wait_slot(_cur))
+        return -1;
+    }
+  }
+
+  return (_error) ? -1 : 0;
+}
+
+
+/* @fn FileWriter::patch(uint64_t off, const void* ptr, size_t len)
+ * Overwrite bytes already appended. Bytes still in the buffer being filled are
+ * changed in place, the others are written on sync.
+ *
+ * @param off The file offset.
+ * @param ptr The data.
+ * @param len The size of the data.
+ * @return Return 0 on success, -1 on error.
+ */
+int FileWriter::patch(uint64_t off, const void* ptr, size_t len) {
+  if(_fd < 0 || off + len > _pos)
+    return -1;
+
+  const char* p = (const char*)ptr;
+  uint64_t base = _pos - _fill;
+  if(off + len > base) {
+    size_t skip = (off < base) ? base - off : 0;
+    memcpy(_slots[_cur].buf + (off + skip - base), p + skip, len - skip);
+    len = skip;
+  }
+  if(len > 0)
+    _patches.push_back(std::make_pair(off, std::string(p, len)));
+
+  _dirty = true;
+  return 0;
+}
+
+
+/* @fn FileWriter::sync()
+ * Wait for the buffers in flight, write the buffer being filled (padded to the
+ * alignment with direct I/O; it stays in place and is written again when
+ * full), apply the patches and set the file size.
+ *
+ * @return Return 0 on success, -1 on error (errno is set to the first error).
+ */
+int FileWriter::sync() {
+  if(_fd < 0)
+    return -1;
+  if(!_dirty) {
+    errno = _error;
+    return (_error) ? -1 : 0;
+  }
+
+  for(size_t i = 0; i < ATMD_AIO_BUFFERS; i++)
+    wait_slot(i);
+
+  if(_fill > 0) {
+    size_t len = _fill;
+    if(_direct) {
+      size_t aligned = (len + ATMD_AIO_ALIGN - 1) & ~((size_t)ATMD_AIO_ALIGN - 1);
+      memset(_slots[_cur].buf + len, 0, aligned - len);
+      len = aligned;
+    }
+    int err = write_range(_slots[_cur].buf, len, _pos - _fill);
+    if(err)
+      set_error(err);
+  }
+
+  if(_patches.size() > 0) {
+    // Small unaligned writes go through the page cache
+    int pfd = (_direct) ? ::open(_filename.c_str(), O_WRONLY) : _fd;
+    if(pfd < 0) {
+      set_error(errno);
+    } else {
+      for(size_t i = 0; i < _patches.size(); i++) {
+        int err = pwrite_all(pfd, _patches[i].second.data(), _patches[i].second.size(), _patches[i].first);
+        if(err)
+          set_error(err);
+      }
+      if(pfd != _fd)
+        ::close(pfd);
+    }
+    _patches.clear();
+  }
+
+  // Drop the alignment padding and the space reserved beyond the end
+  if(ftruncate(_fd, _pos))
+    set_error(errno);
+
+  _dirty = false;
+  errno = _error;
+  return (_error) ? -1 : 0;
+}
+
+
+/* @fn FileWriter::close()
+ * Write out everything, stop the backend and close the file.
+ *
+ * @return Return 0 on success, -1 if any write failed (errno is set to the first error).
+ */
+int FileWriter::close() {
+  int retval = 0;
+
+  if(_fd >= 0 && sync())
+    retval = -1;
+
+#ifdef HAVE_LIBURING
+  if(_uring) {
+    io_uring_queue_exit(&_ring);
+    _uring = false;
+  }
+#endif
+
+  if(_objects) {
+    if(rt_mutex_acquire(&_mutex, TM_INFINITE) == 0) {
+      _terminate = true;
+      rt_cond_broadcast(&_work);
+      rt_mutex_release(&_mutex);
+    }
+    for(size_t i = 0; i < _tasks.size(); i++)
+      rt_task_join(&(_tasks[i]));
+    _tasks.clear();
+    rt_cond_delete(&_done);
+    rt_cond_delete(&_work);
+    rt_mutex_delete(&_mutex);
+    _objects = false;
+  }
+
+  for(size_t i = 0; i < ATMD_AIO_BUFFERS; i++) {
+    free(_slots[i].buf);
+    _slots[i].buf = NULL;
+    _slots[i].state = SLOT_FREE;
+  }
+
+  if(_fd >= 0 && ::close(_fd)) {
+    set_error(errno);
+    retval = -1;
+  }
+  _fd = -1;
+
+  if(retval)
+    errno = _error;
+  return retval;
+}
+
+
+/* @fn FileWriter::submit(size_t slot)
+ * Queue a full buffer to the backend (or write it now if there is none).
+ *
+ * @param slot The buffer.
+ * @return Return 0 on success, -1 on error.
+ */
+int FileWriter::submit(size_t slot) {
+  Slot& s = _slots[slot];
+  s.state = SLOT_QUEUED;
+
+#ifdef HAVE_LIBURING
+  if(_uring) {
+    // At most ATMD_AIO_BUFFERS requests are in flight, so a SQE is always available
+    struct io_uring_sqe* sqe = io_uring_get_sqe(&_ring);
+    io_uring_prep_write(sqe, _fd, s.buf, s.len, s.off);
+    io_uring_sqe_set_data(sqe, &s);
+    if(io_uring_submit(&_ring) >= 0)
+      return 0;
+    // Not queued: no completion will come
+    s.state = SLOT_FREE;
+    int err = write_range(s.buf, s.len, s.off);
+    if(err)
+      set_error(err);
+    return (err) ? -1 : 0;
+  }
+#endif
+
+  if(_tasks.size() > 0) {
+    if(rt_mutex_acquire(&_mutex, TM_INFINITE) == 0) {
+      _queue.push_back(slot);
+      rt_cond_signal(&_work);
+      rt_mutex_release(&_mutex);
+      return 0;
+    }
+  }
+
+  s.state = SLOT_FREE;
+  int err = write_range(s.buf, s.len, s.off);
+  if(err)
+    set_error(err);
+  return (err) ? -1 : 0;
+}
+
+
+/* @fn FileWriter::wait_slot(size_t slot)
+ * Wait until a buffer has been written. A request failed by io_uring (e.g. an
+ * operation not supported by the kernel) or written only in part is completed
+ * synchronously.
+ *
+ * @param slot The buffer.
+ * @return Return 0 on success, -1 on error.
+ */
+int FileWriter::wait_slot(size_t slot) {
+#ifdef HAVE_LIBURING
+  if(_uring) {
+    while(_slots[slot].state != SLOT_FREE) {
+      struct io_uring_cqe* cqe = NULL;
+      int ret = io_uring_wait_cqe(&_ring, &cqe);
+      if(ret == -EINTR)
+        continue;
+      if(ret < 0) {
+        set_error(-ret);
+        for(size_t i = 0; i < ATMD_AIO_BUFFERS; i++)
+          _slots[i].state = SLOT_FREE;
+        break;
+      }
+
+      Slot* s = (Slot*)io_uring_cqe_get_data(cqe);
+      int res = cqe->res;
+      io_uring_cqe_seen(&_ring, cqe);
+
+      int err = 0;
+      if(res < 0)
+        err = write_range(s->buf, s->len, s->off);
+      else if((size_t)res < s->len)
+        err = write_range(s->buf + res, s->len - res, s->off + res);
+      if(err)
+        set_error(err);
+      s->state = SLOT_FREE;
+    }
+    return (_error) ? -1 : 0;
+  }
+#endif
+
+  if(_tasks.size() > 0) {
+    if(rt_mutex_acquire(&_mutex, TM_INFINITE) == 0) {
+      while(_slots[slot].state != SLOT_FREE)
+        rt_cond_wait(&_done, &_mutex, TM_INFINITE);
+      rt_mutex_release(&_mutex);
+    }
+  }
+
+  return (_error) ? -1 : 0;
+}
+
+
+/* @fn FileWriter::write_range(const char* ptr, size_t len, uint64_t off)
+ * Write a range synchronously. If the file system refuses direct I/O the file
+ * goes back to buffered I/O and the write is retried.
+ *
+ * @return Return 0 on success, errno on error.
+ */
+int FileWriter::write_range(const char* ptr, size_t len, uint64_t off) {
+  int err = pwrite_all(_fd, ptr, len, off);
+  if(err == EINVAL && _direct) {
+    int flags = fcntl(_fd, F_GETFL);
+    if(flags != -1 && fcntl(_fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+      _direct = false;
+      err = pwrite_all(_fd, ptr, len, off);
+    }
+  }
+  return err;
+}
+
+
+/* @fn static void FileWriter::worker_task(void *arg)
+ * Write the queued buffers (fallback backend).
+ *
+ * @param arg Cookie for the task (pointer to the writer).
+ */
+void FileWriter::worker_task(void *arg) {
+
+  // Init rt_printf and rt_syslog
+  rt_print_auto_init(1);
+
+  // Cast back 'this' pointer
+  FileWriter *pthis = (FileWriter*)arg;
+
+  // Prevent this task to send SIGDEBUG when switching to secondary mode
+  rt_task_set_mode(T_WARNSW, 0, NULL);
+
+  while(true) {
+    if(rt_mutex_acquire(&(pthis->_mutex), TM_INFINITE))
+      break;
+    while(pthis->_queue.empty() && !pthis->_terminate)
+      rt_cond_wait(&(pthis->_work), &(pthis->_mutex), TM_INFINITE);
+    if(pthis->_queue.empty()) {
+      rt_mutex_release(&(pthis->_mutex));
+      break;
+    }
+    Slot& s = pthis->_slots[pthis->_queue.front()];
+    pthis->_queue.pop_front();
+    rt_mutex_release(&(pthis->_mutex));
+
+    int err = pthis->write_range(s.buf, s.len, s.off);
+
+    if(rt_mutex_acquire(&(pthis->_mutex), TM_INFINITE))
+      break;
+    if(err)
+      pthis->set_error(err);
+    s.state = SLOT_FREE;
+    rt_cond_broadcast(&(pthis->_done));
+    rt_mutex_release(&(pthis->_mutex));
+  }
+}
@@ -0,0 +1,145 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Asynchronous file writer header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_FILEWRITER_H
+#define ATMD_FILEWRITER_H
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+// Xenomai
+#include <native/task.h>
+#include <native/mutex.h>
+#include <native/cond.h>
+
+// Local
+#include "common.h"
+
+
+/* @class FileWriter
+ * Sequential file output with several writes in flight. Data is copied into
+ * ATMD_AIO_BUFFERS aligned buffers of ATMD_AIO_BUFSIZE bytes; each full buffer
+ * is written at its offset while the next ones are filled. Writes are queued
+ * to io_uring when available, otherwise to ATMD_AIO_THREADS worker tasks
+ * calling pwrite().
+ * With direct I/O (O_DIRECT) the page cache is bypassed: the last buffer is
+ * padded to the alignment and the file truncated to its size on close. If the
+ * file system refuses direct I/O the writer silently goes back to buffered I/O.
+ * Bytes already written can be overwritten with patch() (e.g. sizes known only
+ * at the end of a MAT element).
+ */
+class FileWriter {
+public:
+  FileWriter();
+  ~FileWriter() { close(); };
+
+  // Create a file. With size > 0 the disk space is reserved up front.
+  int open(const std::string& filename, bool direct = false, uint64_t size = 0);
+
+  // Create an empty file with 'size' bytes of disk space reserved, for a later open()
+  static int preallocate(const std::string& filename, uint64_t size);
+
+  // Append data
+  int write(const void* ptr, size_t len);
+
+  // Overwrite bytes already written
+  int patch(uint64_t off, const void* ptr, size_t len);
+
+  // Wait for all the data written so far to be in the file
+  int sync();
+
+  // Sync and close the file (releases the space reserved beyond its end)
+  int close();
+
+  bool is_open()const { return (_fd >= 0); };
+  bool good()const { return (_error == 0); };
+  int error()const { return _error; };
+  int fd()const { return _fd; };
+  uint64_t pos()const { return _pos; };
+
+private:
+  // Buffers cannot be copied
+  FileWriter(const FileWriter&);
+  FileWriter& operator=(const FileWriter&);
+
+  // Buffer state
+  enum { SLOT_FREE, SLOT_QUEUED };
+
+  struct Slot {
+    char* buf;        // Aligned buffer
+    size_t len;       // Bytes to write
+    uint64_t off;     // File offset
+    int state;
+  };
+
+  // Queue a full buffer
+  int submit(size_t slot);
+
+  // Wait for a buffer to be written
+  int wait_slot(size_t slot);
+
+  // Write a range synchronously, going back to buffered I/O if direct I/O is refused (return 0 or errno)
+  int write_range(const char* ptr, size_t len, uint64_t off);
+
+  // Record the first error
+  void set_error(int err) { if(_error == 0) _error = err; };
+
+  // Worker task (fallback backend)
+  static void worker_task(void *arg);
+
+  std::string _filename;
+  int _fd;
+  bool _direct;
+  uint64_t _pos;                      // Bytes appended
+  int _error;                         // First errno (0 if none)
+  bool _dirty;                        // Data written after the last sync
+
+  Slot _slots[ATMD_AIO_BUFFERS];
+  size_t _cur;                        // Buffer being filled
+  size_t _fill;                       // Bytes in the buffer being filled
+
+  // Patches of bytes already submitted, applied on sync
+  std::vector< std::pair<uint64_t, std::string> > _patches;
+
+#ifdef HAVE_LIBURING
+  struct io_uring _ring;
+  bool _uring;
+#endif
+
+  // Fallback backend
+  RT_MUTEX _mutex;
+  RT_COND _work;
+  RT_COND _done;
+  std::deque<size_t> _queue;          // Buffers waiting for a worker
+  std::vector<RT_TASK> _tasks;
+  bool _terminate;
+  bool _objects;                      // Mutex and condition variables created
+};
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Time-of-flight histogram class
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Global debug flag
+#ifdef DEBUG
+extern bool enable_debug;
+#endif
+
+#include "atmd_histogram.h"
+#include "atmd_measure.h"
+
+
+/* @fn Histogram::setup(size_t nch, uint32_t nbins, uint32_t width, uint32_t offset)
+ * Configure the histogram and reset all the bins.
+ *
+ * @param nch The number of channels.
+ * @param nbins The number of bins of each channel (zero disables the histogram).
+ * @param width The bin width in ticks.
+ * @param offset The tick of the lower edge of the first bin.
+ */
+void Histogram::setup(size_t nch, uint32_t nbins, uint32_t width, uint32_t offset) {
+  _nch = nch;
+  _nbins = nbins;
+  _width = (width > 0) ? width : 1;
+  _offset = offset;
+  _counts.assign(_nch * _nbins, 0);
+}
+
+
+/* @fn Histogram::clear()
+ * Reset all the bins to zero.
+ */
+void Histogram::clear() {
+  _counts.assign(_counts.size(), 0);
+}
+
+
+/* @fn Histogram::add_start(const Measure& meas, size_t start)
+ * Add the stops of one start to the histogram. Stops on channels out of range
+ * or outside the histogram range are ignored.
+ *
+ * @param meas The measure.
+ * @param start The start number.
+ */
+void Histogram::add_start(const Measure& meas, size_t start) {
+  if(!enabled())
+    return;
+
+  const int8_t* ch = meas.channels();
+  uint32_t* counts = &(_counts[0]);
+  size_t last = meas.first_stop(start) + meas.count_stops(start);
+
+  for(size_t i = meas.first_stop(start); i < last; i++) {
+    size_t c = (ch[i] > 0) ? ch[i] : -ch[i];
+    if(c < 1 || c > _nch)
+      continue;
+
+    int64_t tick = meas.get_tick(i) - (int64_t)_offset;
+    if(tick < 0)
+      continue;
+
+    uint64_t bin = (uint64_t)tick / _width;
+    if(bin >= _nbins)
+      continue;
+
+    counts[(c-1) * _nbins + bin]++;
+  }
+}
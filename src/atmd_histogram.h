@@ -0,0 +1,77 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Time-of-flight histogram header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_HISTOGRAM_H
+#define ATMD_HISTOGRAM_H
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+
+// Local
+#include "common.h"
+
+// Declare class Measure
+class Measure;
+
+
+/* @class Histogram
+ * Per channel time-of-flight histograms with fixed bins. Bins and offset are
+ * in units of Tbin (TDC ticks), so filling requires only integer arithmetic.
+ * Counts are stored channel by channel (channel 1 first).
+ */
+class Histogram {
+public:
+  Histogram() : _nch(0), _nbins(0), _width(1), _offset(0) {};
+  ~Histogram() {};
+
+  // Configure the histogram and clear it
+  void setup(size_t nch, uint32_t nbins, uint32_t width, uint32_t offset);
+
+  // Reset all bins to zero
+  void clear();
+
+  // Tell if the histogram has bins
+  bool enabled()const { return (_nch > 0 && _nbins > 0); };
+
+  // Add the stops of a start of a measure
+  void add_start(const Measure& meas, size_t start);
+
+  // Configuration
+  size_t nch()const { return _nch; };
+  uint32_t nbins()const { return _nbins; };
+  uint32_t width()const { return _width; };
+  uint32_t offset()const { return _offset; };
+
+  // Bin counts
+  const uint32_t* data()const { return (_counts.size()) ? &(_counts[0]) : NULL; };
+  size_t bytes()const { return _counts.size() * sizeof(uint32_t); };
+
+private:
+  size_t _nch;                      // Number of channels
+  uint32_t _nbins;                  // Number of bins per channel
+  uint32_t _width;                  // Bin width in ticks
+  uint32_t _offset;                 // Tick of the lower edge of the first bin
+  std::vector<uint32_t> _counts;    // Bin counts
+};
+
+#endif
@@ -0,0 +1,372 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - MAT file tool
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Summarise a MAT measure file saved by the server, or re-export a range of
+ * its starts as text or as a smaller MAT file. The file is read through
+ * MatReader, so the columns are scanned straight from the file mapping.
+ */
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+
+// Local
+#include "atmd_matreader.h"
+
+
+// Output buffer of the exports
+#define MATREAD_OUTBUF  (4*1024*1024)
+
+
+/* @fn static void usage()
+ * Print command line help.
+ */
+static void usage() {
+  printf("atmd_matread [-s first[:last]] [-f format] [-o output] <mat_file>\n");
+  printf(" -s first[:last]: only the starts with IDs in [first, last].\n");
+  printf(" -f format: export format: ps (text, stop times in ps), us (text, stop times in us), mat (default ps).\n");
+  printf(" -o output: export the selected starts to this file (default: print a summary).\n");
+}
+
+
+/* @fn static const char* class_name(uint8_t mxclass)
+ * Name of a MAT array class.
+ */
+static const char* class_name(uint8_t mxclass) {
+  static const char* names[] = { "unknown", "cell", "struct", "object", "char", "sparse", "double", "single",
+                                 "int8", "uint8", "int16", "uint16", "int32", "uint32", "int64", "uint64" };
+  return (mxclass < sizeof(names)/sizeof(names[0])) ? names[mxclass] : names[0];
+}
+
+
+/* @class EventView
+ * Event columns of a MAT file, from the separate variables (MATPS2/3) or from
+ * the 'data' matrix (MATPS1).
+ */
+class EventView {
+public:
+  EventView(const MatReader& mat) : _start(mat.data<uint32_t>("start")), _channel(mat.data<int8_t>("channel")),
+                                    _stoptime(mat.data<double>("stoptime")), _data(mat.data<double>("data")), _events(mat.events()) {};
+
+  bool valid()const { return (_start && _channel && _stoptime) || _data; };
+  uint64_t events()const { return _events; };
+
+  double start(uint64_t i)const { return (_data) ? _data[i] : _start[i]; };
+  int channel(uint64_t i)const { return (_data) ? (int)_data[_events + i] : _channel[i]; };
+  double stoptime(uint64_t i)const { return (_data) ? _data[2*_events + i] : _stoptime[i]; };
+
+private:
+  const uint32_t* _start;
+  const int8_t* _channel;
+  const double* _stoptime;
+  const double* _data;
+  uint64_t _events;
+};
+
+
+/* @fn static void summary(const MatReader& mat, const EventView& ev, uint64_t begin, uint64_t end)
+ * Print the variables of the file and the statistics of a range of events.
+ */
+static void summary(const MatReader& mat, const EventView& ev, uint64_t begin, uint64_t end) {
+  printf("Variables:\n");
+  for(size_t i = 0; i < mat.variables(); i++) {
+    const MatVariable& v = mat.variable(i);
+    printf("  %-16s %-8s %10llu x %-6llu %14llu bytes%s\n", v.name.c_str(), class_name(v.mxclass),
+           (unsigned long long)v.rows, (unsigned long long)v.cols, (unsigned long long)v.bytes, (v.compressed) ? " (compressed)" : "");
+  }
+
+  // Measure windows
+  const MatVariable* mt = mat.find("measure_time");
+  const uint32_t* times = mat.data<uint32_t>("measure_time");
+  if(mt && times && mt->cols == 2) {
+    double total = 0.0;
+    for(uint64_t i = 0; i < mt->rows; i++)
+      total += times[i] + times[mt->rows + i] / 1e6;
+    printf("Measure windows: %llu (%.6f s)\n", (unsigned long long)mt->rows, total);
+  }
+  const MatVariable* st = mat.find("stat_times");
+  if(st)
+    printf("Start windows: %llu starts, %llu agents\n", (unsigned long long)st->rows, (unsigned long long)st->cols / 2);
+
+  if(!ev.valid())
+    return;
+
+  printf("Events: %llu", (unsigned long long)(end - begin));
+  if(end - begin < ev.events())
+    printf(" of %llu", (unsigned long long)ev.events());
+  printf("\n");
+  if(begin == end)
+    return;
+
+  // Statistics in one pass over the columns
+  uint64_t counts[256];
+  double tmin[256], tmax[256];
+  memset(counts, 0, sizeof(counts));
+  uint64_t starts = 0;
+  double last_start = -1.0;
+  for(uint64_t i = begin; i < end; i++) {
+    double s = ev.start(i);
+    if(s != last_start) {
+      starts++;
+      last_start = s;
+    }
+    int ch = ev.channel(i) & 0xFF;
+    double t = ev.stoptime(i);
+    if(counts[ch] == 0 || t < tmin[ch])
+      tmin[ch] = t;
+    if(counts[ch] == 0 || t > tmax[ch])
+      tmax[ch] = t;
+    counts[ch]++;
+  }
+
+  printf("Starts with events: %llu (IDs %.0f to %.0f)\n", (unsigned long long)starts, ev.start(begin), ev.start(end - 1));
+  printf("Channel         Events     Min stop (ps)     Max stop (ps)\n");
+  for(int c = -128; c < 128; c++) {
+    int ch = c & 0xFF;
+    if(counts[ch] > 0)
+      printf("%7d %14llu %17.1f %17.1f\n", c, (unsigned long long)counts[ch], tmin[ch], tmax[ch]);
+  }
+}
+
+
+/* @fn static void print_double(FILE* out, double v)
+ * Print a double with the shortest representation that reads back the same.
+ */
+static void print_double(FILE* out, double v) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.15g", v);
+  if(strtod(buf, NULL) != v)
+    snprintf(buf, sizeof(buf), "%.17g", v);
+  fputs(buf, out);
+}
+
+
+/* @fn static int export_text(const EventView& ev, uint64_t begin, uint64_t end, bool us, FILE* out)
+ * Export a range of events as text, one line per event.
+ *
+ * @return Return 0 on success, -1 on error.
+ */
+static int export_text(const EventView& ev, uint64_t begin, uint64_t end, bool us, FILE* out) {
+  fprintf(out, "start\tchannel\tstoptime\n");
+  for(uint64_t i = begin; i < end; i++) {
+    fprintf(out, "%.0f\t%d\t", ev.start(i), ev.channel(i));
+    print_double(out, (us) ? ev.stoptime(i) / 1e6 : ev.stoptime(i));
+    fputc('\n', out);
+  }
+  return ferror(out) ? -1 : 0;
+}
+
+
+/* @fn static void write_matrix(FILE* out, const MatVariable& v, uint64_t row, uint64_t rows)
+ * Write a range of rows of a numeric variable as an uncompressed miMATRIX
+ * element. Each column is copied straight from the source.
+ */
+static void write_matrix(FILE* out, const MatVariable& v, uint64_t row, uint64_t rows) {
+  static const char zeros[8] = { 0 };
+  size_t elsize = v.bytes / (v.rows * v.cols);
+  uint64_t datasize = rows * v.cols * elsize;
+  uint32_t datapad = (8 - datasize % 8) % 8;
+  uint32_t namelen = v.name.size();
+  uint32_t namepad = (8 - namelen % 8) % 8;
+  bool smallname = (namelen <= 4);
+
+  uint32_t head[12];
+  size_t headlen = 0;
+  uint32_t matsize = 16 + 16 + ((smallname) ? 8 : 8 + namelen + namepad) + 8 + datasize + datapad;
+  head[headlen++] = ATMD_MI_MATRIX;
+  head[headlen++] = matsize;
+  // Array flags
+  head[headlen++] = ATMD_MI_UINT32;
+  head[headlen++] = 8;
+  head[headlen++] = v.mxclass;
+  head[headlen++] = 0;
+  // Dimensions
+  head[headlen++] = ATMD_MI_INT32;
+  head[headlen++] = 8;
+  head[headlen++] = rows;
+  head[headlen++] = v.cols;
+  fwrite(head, sizeof(uint32_t), headlen, out);
+
+  // Name
+  if(smallname) {
+    uint32_t tag = (namelen << 16) | ATMD_MI_INT8;
+    char name[4] = { 0, 0, 0, 0 };
+    memcpy(name, v.name.data(), namelen);
+    fwrite(&tag, sizeof(tag), 1, out);
+    fwrite(name, 1, 4, out);
+  } else {
+    uint32_t tag[2] = { ATMD_MI_INT8, namelen };
+    fwrite(tag, sizeof(uint32_t), 2, out);
+    fwrite(v.name.data(), 1, namelen, out);
+    fwrite(zeros, 1, namepad, out);
+  }
+
+  // Data
+  uint32_t tag[2] = { v.type, (uint32_t)datasize };
+  fwrite(tag, sizeof(uint32_t), 2, out);
+  for(uint64_t c = 0; c < v.cols && rows > 0; c++)
+    fwrite((const char*)v.data + (c * v.rows + row) * elsize, elsize, rows, out);
+  fwrite(zeros, 1, datapad, out);
+}
+
+
+/* @fn static int export_mat(const MatReader& mat, double first, double last, uint64_t begin, uint64_t end, FILE* out)
+ * Export a range of starts as an uncompressed MAT file with the same
+ * variables: event columns are cut to the range, 'stat_times' to the rows of
+ * the starts (start IDs are start numbers in files saved without TANGO) and
+ * any other variable is copied whole.
+ *
+ * @return Return 0 on success, -1 on error.
+ */
+static int export_mat(const MatReader& mat, double first, double last, uint64_t begin, uint64_t end, FILE* out) {
+  char head[ATMD_MAT_HEADSIZE];
+  memset(head, ' ', 116);
+  int n = snprintf(head, 116, "MATLAB 5.0 MAT-file, Platform: GNU/Linux, Created by: atmd_matread");
+  head[n] = ' ';
+  memset(head + 116, 0, 8);
+  uint16_t version = 0x0100;
+  memcpy(head + 124, &version, 2);
+  head[126] = 'I';
+  head[127] = 'M';
+  fwrite(head, 1, sizeof(head), out);
+
+  uint64_t events = mat.events();
+  for(size_t i = 0; i < mat.variables(); i++) {
+    const MatVariable& v = mat.variable(i);
+    if(v.data == NULL || v.rows * v.cols == 0) {
+      fprintf(stderr, "Skipping variable \"%s\" (no numeric data).\n", v.name.c_str());
+      continue;
+    }
+
+    if(v.rows == events && (v.name == "start" || v.name == "channel" || v.name == "stoptime" || v.name == "data")) {
+      write_matrix(out, v, begin, end - begin);
+
+    } else if(v.name == "stat_times") {
+      uint64_t r0 = (first > 1) ? (uint64_t)first - 1 : 0;
+      uint64_t r1 = (last < (double)v.rows) ? (uint64_t)last : v.rows;
+      write_matrix(out, v, (r0 < r1) ? r0 : 0, (r0 < r1) ? r1 - r0 : 0);
+
+    } else {
+      write_matrix(out, v, 0, v.rows);
+    }
+  }
+  return ferror(out) ? -1 : 0;
+}
+
+
+/* @fn int main(int argc, char * const argv[])
+ * Main entry point
+ */
+int main(int argc, char * const argv[])
+{
+  double first = 0.0, last = 4294967295.0;
+  std::string format = "ps";
+  std::string output;
+
+  int c;
+  while( (c = getopt(argc, argv, "s:f:o:")) != -1 ) {
+    switch(c) {
+      case 's': {
+        char* p = NULL;
+        first = strtod(optarg, &p);
+        last = (*p == ':') ? strtod(p + 1, NULL) : first;
+        break;
+      }
+
+      case 'f':
+        format = optarg;
+        if(format != "ps" && format != "us" && format != "mat") {
+          fprintf(stderr, "Unsupported export format \"%s\".\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'o':
+        output = optarg;
+        break;
+
+      default:
+        usage();
+        return -1;
+    }
+  }
+  if(optind != argc - 1) {
+    usage();
+    return -1;
+  }
+
+  MatReader mat;
+  if(mat.open(argv[optind])) {
+    fprintf(stderr, "Cannot read \"%s\": %s.\n", argv[optind], mat.error().c_str());
+    return -1;
+  }
+
+  EventView ev(mat);
+  uint64_t begin = 0, end = ev.events();
+  if(ev.valid())
+    mat.start_range(first, last, begin, end);
+
+  if(output.size() == 0) {
+    summary(mat, ev, begin, end);
+    return 0;
+  }
+
+  if(!ev.valid()) {
+    fprintf(stderr, "\"%s\" has no event columns to export.\n", argv[optind]);
+    return -1;
+  }
+
+  FILE* out = fopen(output.c_str(), "wb");
+  if(out == NULL) {
+    fprintf(stderr, "Cannot create \"%s\" (Error: %s).\n", output.c_str(), strerror(errno));
+    return -1;
+  }
+  std::vector<char> buffer(MATREAD_OUTBUF);
+  setvbuf(out, &(buffer[0]), _IOFBF, buffer.size());
+
+  struct timeval t_begin, t_end;
+  gettimeofday(&t_begin, NULL);
+
+  int retval;
+  if(format == "mat")
+    retval = export_mat(mat, first, last, begin, end, out);
+  else
+    retval = export_text(ev, begin, end, (format == "us"), out);
+
+  if(fclose(out))
+    retval = -1;
+  if(retval) {
+    fprintf(stderr, "Error writing \"%s\".\n", output.c_str());
+    return -1;
+  }
+
+  gettimeofday(&t_end, NULL);
+  double secs = (double)(t_end.tv_sec - t_begin.tv_sec) + (double)(t_end.tv_usec - t_begin.tv_usec) / 1e6;
+  printf("Exported %llu events to \"%s\" in %.3f s.\n", (unsigned long long)(end - begin), output.c_str(), secs);
+  return 0;
+}
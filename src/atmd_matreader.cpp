@@ -0,0 +1,407 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - MAT file reader
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#include "atmd_matreader.h"
+
+
+/* @fn mat_tag(const char* ptr, const char* end, uint32_t& type, uint32_t& size, const char*& data)
+ * Read the tag of a data element, in the normal or in the small (4 byte data)
+ * form.
+ *
+ * @param ptr The tag.
+ * @param end End of the enclosing element.
+ * @param type The data type.
+ * @param size The size of the data.
+ * @param data The data.
+ * @return Return the next element (8 byte aligned), or NULL if the element does not fit.
+ */
+static const char* mat_tag(const char* ptr, const char* end, uint32_t& type, uint32_t& size, const char*& data) {
+  if(end - ptr < 8)
+    return NULL;
+
+  uint32_t tag[2];
+  memcpy(tag, ptr, sizeof(tag));
+  if(tag[0] >> 16) {
+    // Small data element
+    type = tag[0] & 0xFFFF;
+    size = tag[0] >> 16;
+    if(size > 4)
+      return NULL;
+    data = ptr + 4;
+    return ptr + 8;
+  }
+
+  type = tag[0];
+  size = tag[1];
+  if((uint64_t)(end - ptr - 8) < size)
+    return NULL;
+  data = ptr + 8;
+  uint64_t padded = ((uint64_t)size + 7) & ~((uint64_t)7);
+  return ((uint64_t)(end - ptr - 8) < padded) ? end : ptr + 8 + padded;
+}
+
+
+/* @fn mat_type_size(uint32_t type)
+ * Size of the elements of a MAT data type (0 for non numeric types).
+ */
+static size_t mat_type_size(uint32_t type) {
+  switch(type) {
+    case ATMD_MI_INT8:
+    case ATMD_MI_UINT8:
+      return 1;
+    case ATMD_MI_INT16:
+    case ATMD_MI_UINT16:
+      return 2;
+    case ATMD_MI_INT32:
+    case ATMD_MI_UINT32:
+    case ATMD_MI_SINGLE:
+      return 4;
+    case ATMD_MI_DOUBLE:
+    case ATMD_MI_INT64:
+    case ATMD_MI_UINT64:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+
+/* @fn MatReader::open(const char* path)
+ * Map a MAT file and index its variables. Uncompressed variables are not
+ * touched; compressed ones are inflated here.
+ *
+ * @param path The file path.
+ * @return Return 0 on success, -1 on error (see error()).
+ */
+int MatReader::open(const char* path) {
+  close();
+
+  int fd = ::open(path, O_RDONLY);
+  if(fd == -1) {
+    _error = std::string("cannot open file: ") + strerror(errno);
+    return -1;
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) || (size_t)st.st_size < ATMD_MAT_HEADSIZE) {
+    _error = "file too short";
+    ::close(fd);
+    return -1;
+  }
+
+  void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(addr == MAP_FAILED) {
+    _error = std::string("cannot map file: ") + strerror(errno);
+    return -1;
+  }
+
+  // Columns are mostly scanned from begin to end
+  madvise(addr, st.st_size, MADV_SEQUENTIAL);
+  _addr = addr;
+  _len = st.st_size;
+
+  // Header: version 0x0100 and endian indicator "IM" as written on little-endian
+  const char* base = (const char*)addr;
+  uint16_t version;
+  memcpy(&version, base + 124, sizeof(version));
+  if(base[126] == 'M' && base[127] == 'I') {
+    _error = "file has a different byte order";
+  } else if(base[126] != 'I' || base[127] != 'M' || version != 0x0100) {
+    _error = "not a level 5 MAT file";
+  } else {
+    _error = "";
+  }
+
+  // Top level elements
+  const char* ptr = base + ATMD_MAT_HEADSIZE;
+  const char* end = base + _len;
+  while(_error == "" && ptr < end) {
+    uint32_t type, size;
+    const char* data;
+    const char* next = mat_tag(ptr, end, type, size, data);
+    if(next == NULL) {
+      _error = "truncated file";
+      break;
+    }
+
+    if(type == ATMD_MI_MATRIX) {
+      parse_matrix(data, size, false);
+
+    } else if(type == ATMD_MI_COMPRESSED) {
+      // Compressed elements are not padded
+      next = data + size;
+      std::vector<char>* buffer = new std::vector<char>();
+      _inflated.push_back(buffer);
+      if(inflate_element(data, size, *buffer) == 0) {
+        uint32_t itype, isize;
+        const char* idata;
+        const char* ibegin = &((*buffer)[0]);
+        if(buffer->size() > 0 && mat_tag(ibegin, ibegin + buffer->size(), itype, isize, idata) && itype == ATMD_MI_MATRIX)
+          parse_matrix(idata, isize, true);
+        else
+          _error = "corrupted compressed element";
+      }
+    }
+    ptr = next;
+  }
+
+  if(_error != "") {
+    close();
+    return -1;
+  }
+  return 0;
+}
+
+
+/* @fn MatReader::close()
+ * Release the mapping and the inflated variables.
+ */
+void MatReader::close() {
+  if(_addr)
+    munmap(_addr, _len);
+  _addr = NULL;
+  _len = 0;
+  _vars.clear();
+  for(size_t i = 0; i < _inflated.size(); i++)
+    delete _inflated[i];
+  _inflated.clear();
+}
+
+
+/* @fn MatReader::parse_matrix(const char* ptr, uint64_t len, bool compressed)
+ * Index a miMATRIX element: array flags, dimensions, name and real part.
+ * Non numeric arrays (cells, structures, ...) are listed without data; the
+ * imaginary part of complex arrays is ignored.
+ *
+ * @param ptr The element data.
+ * @param len The element size.
+ * @param compressed Tell if the element was compressed.
+ * @return Return 0 on success, -1 on error (see error()).
+ */
+int MatReader::parse_matrix(const char* ptr, uint64_t len, bool compressed) {
+  const char* end = ptr + len;
+  uint32_t type, size;
+  const char* data;
+
+  MatVariable var;
+  var.mxclass = 0;
+  var.type = 0;
+  var.rows = 0;
+  var.cols = 0;
+  var.data = NULL;
+  var.bytes = 0;
+  var.compressed = compressed;
+
+  // Array flags
+  ptr = mat_tag(ptr, end, type, size, data);
+  if(ptr == NULL || type != ATMD_MI_UINT32 || size < 4) {
+    _error = "corrupted array flags";
+    return -1;
+  }
+  var.mxclass = (uint8_t)data[0];
+
+  // Dimensions
+  ptr = mat_tag(ptr, end, type, size, data);
+  if(ptr == NULL || type != ATMD_MI_INT32 || size < 8) {
+    _error = "corrupted array dimensions";
+    return -1;
+  }
+  int32_t dims[2];
+  memcpy(dims, data, sizeof(dims));
+  var.rows = dims[0];
+  var.cols = dims[1];
+  for(uint32_t i = 2; i < size / 4; i++) {
+    int32_t d;
+    memcpy(&d, data + 4*i, sizeof(d));
+    var.cols *= d;
+  }
+
+  // Name
+  ptr = mat_tag(ptr, end, type, size, data);
+  if(ptr == NULL || type != ATMD_MI_INT8) {
+    _error = "corrupted array name";
+    return -1;
+  }
+  var.name.assign(data, size);
+
+  // Real part of numeric arrays
+  if(ptr < end) {
+    const char* next = mat_tag(ptr, end, type, size, data);
+    size_t elsize = mat_type_size(type);
+    if(next && elsize > 0 && (uint64_t)size == var.rows * var.cols * elsize) {
+      var.type = type;
+      var.data = data;
+      var.bytes = size;
+    }
+  }
+
+  _vars.push_back(var);
+  return 0;
+}
+
+
+/* @fn MatReader::inflate_element(const char* ptr, uint64_t len, std::vector<char>& out)
+ * Inflate the zlib stream of a miCOMPRESSED element.
+ *
+ * @param ptr The compressed data.
+ * @param len The size of the compressed data.
+ * @param out The inflated element.
+ * @return Return 0 on success, -1 on error (see error()).
+ */
+int MatReader::inflate_element(const char* ptr, uint64_t len, std::vector<char>& out) {
+#ifdef HAVE_ZLIB_H
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if(inflateInit(&zs) != Z_OK) {
+    _error = "cannot initialize zlib";
+    return -1;
+  }
+
+  // The inflated element is at least as big as the compressed one
+  out.resize((len < 4096) ? 4096 : 2 * len);
+  zs.next_in = (Bytef*)ptr;
+  uint64_t in_left = len;
+  uint64_t done = 0;
+
+  int ret = Z_OK;
+  while(ret == Z_OK) {
+    if(zs.avail_in == 0) {
+      zs.avail_in = (in_left > 0x40000000) ? 0x40000000 : in_left;
+      in_left -= zs.avail_in;
+    }
+    if(done == out.size())
+      out.resize(2 * out.size());
+    uint64_t room = out.size() - done;
+    zs.next_out = (Bytef*)&(out[done]);
+    zs.avail_out = (room > 0x40000000) ? 0x40000000 : room;
+    uInt before = zs.avail_out;
+
+    ret = inflate(&zs, Z_NO_FLUSH);
+    done += before - zs.avail_out;
+    if(ret == Z_BUF_ERROR && zs.avail_in == 0 && in_left == 0)
+      break;
+    if(ret == Z_BUF_ERROR)
+      ret = Z_OK;
+  }
+  inflateEnd(&zs);
+
+  if(ret != Z_STREAM_END) {
+    _error = "corrupted compressed element";
+    return -1;
+  }
+  out.resize(done);
+  return 0;
+#else
+  (void)ptr;
+  (void)len;
+  (void)out;
+  _error = "compressed variables are not supported (built without zlib)";
+  return -1;
+#endif
+}
+
+
+/* @fn MatReader::find(const std::string& name)
+ * Look for a variable.
+ *
+ * @param name The variable name.
+ * @return Return the variable, or NULL if there is no such variable.
+ */
+const MatVariable* MatReader::find(const std::string& name)const {
+  for(size_t i = 0; i < _vars.size(); i++)
+    if(_vars[i].name == name)
+      return &(_vars[i]);
+  return NULL;
+}
+
+
+/* @fn MatReader::events()
+ * Number of events: rows of 'start' (MATPS2 and MATPS3) or of 'data' (MATPS1).
+ */
+uint64_t MatReader::events()const {
+  const MatVariable* v = find("start");
+  if(v == NULL)
+    v = find("data");
+  return (v) ? v->rows : 0;
+}
+
+
+/* @fn MatReader::start_of(uint64_t ev)
+ * Start ID of an event, from 'start' or from the first column of 'data'.
+ *
+ * @param ev The event index (less than events()).
+ * @return The start ID.
+ */
+double MatReader::start_of(uint64_t ev)const {
+  const uint32_t* start = data<uint32_t>("start");
+  if(start)
+    return start[ev];
+  const double* mdata = data<double>("data");
+  return (mdata) ? mdata[ev] : 0.0;
+}
+
+
+/* @fn MatReader::start_range(double first, double last, uint64_t& begin, uint64_t& end)
+ * Find the events of a range of starts, with a binary search on the sorted
+ * start column.
+ *
+ * @param first The first start ID.
+ * @param last The last start ID (included).
+ * @param begin The first event of the range.
+ * @param end One past the last event of the range.
+ */
+void MatReader::start_range(double first, double last, uint64_t& begin, uint64_t& end)const {
+  uint64_t n = events();
+
+  // First event with start >= first
+  uint64_t lo = 0, hi = n;
+  while(lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if(start_of(mid) < first)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  begin = lo;
+
+  // First event with start > last
+  hi = n;
+  while(lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if(start_of(mid) <= last)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  end = lo;
+}
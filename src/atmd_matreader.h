@@ -0,0 +1,159 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - MAT file reader header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* MAT measure file (ATMD_FORMAT_MATPS1, MATPS2 and MATPS3)
+ *
+ * Level 5 MAT files as written by measure2file: a 128 byte header followed by
+ * one top level element per variable, either a miMATRIX or a miCOMPRESSED
+ * element wrapping a miMATRIX. Variables written by the server:
+ *  measure_begin   uint32 x (times x 2)        Begin of each measure window (s, us)
+ *  measure_time    uint32 x (times x 2)        Duration of each measure window (s, us)
+ *  start           uint32 x events             MATPS2/3: start ID of each event
+ *  channel         int8   x events             MATPS2/3: channel of each event
+ *  stoptime        double x events             MATPS2/3: stop time in ps
+ *  data            double x (events x 3)       MATPS1: start ID, channel, stop time
+ *  stat_times      uint32 x (starts x 2*agents) MATPS3: begin and duration (us)
+ *                                              of the window of each agent
+ *
+ * Events are stored in start order, so the start column is sorted.
+ *
+ * Like atmd_binfile.h, this file has no dependency on the rest of the server
+ * and can be used by external tools together with atmd_matreader.cpp
+ * (libatmdmat). When zlib is found at configure time the library reads
+ * compressed variables and programs using it must be linked with -lz.
+ */
+
+#ifndef ATMD_MATREADER_H
+#define ATMD_MATREADER_H
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+// MAT data types
+#define ATMD_MI_INT8          1
+#define ATMD_MI_UINT8         2
+#define ATMD_MI_INT16         3
+#define ATMD_MI_UINT16        4
+#define ATMD_MI_INT32         5
+#define ATMD_MI_UINT32        6
+#define ATMD_MI_SINGLE        7
+#define ATMD_MI_DOUBLE        9
+#define ATMD_MI_INT64         12
+#define ATMD_MI_UINT64        13
+#define ATMD_MI_MATRIX        14
+#define ATMD_MI_COMPRESSED    15
+
+// Size of the MAT file header
+#define ATMD_MAT_HEADSIZE     128
+
+
+/* @struct MatVariable
+ * A variable of a MAT file. The data of uncompressed variables points into
+ * the file mapping, compressed ones are inflated once when the file is opened.
+ */
+struct MatVariable {
+  std::string name;
+  uint8_t mxclass;          // MAT array class
+  uint32_t type;            // Data type (ATMD_MI_*, 0 for non numeric arrays)
+  uint64_t rows;
+  uint64_t cols;            // Product of all the dimensions after the first
+  const void* data;         // Column-major data (NULL for non numeric arrays)
+  uint64_t bytes;           // Size of the data
+  bool compressed;          // Stored in a miCOMPRESSED element
+};
+
+
+/* @fn atmd_mi_type<T>()
+ * MAT data type of a C type.
+ */
+template <typename T> inline uint32_t atmd_mi_type() { return 0; }
+template <> inline uint32_t atmd_mi_type<int8_t>() { return ATMD_MI_INT8; }
+template <> inline uint32_t atmd_mi_type<uint8_t>() { return ATMD_MI_UINT8; }
+template <> inline uint32_t atmd_mi_type<int16_t>() { return ATMD_MI_INT16; }
+template <> inline uint32_t atmd_mi_type<uint16_t>() { return ATMD_MI_UINT16; }
+template <> inline uint32_t atmd_mi_type<int32_t>() { return ATMD_MI_INT32; }
+template <> inline uint32_t atmd_mi_type<uint32_t>() { return ATMD_MI_UINT32; }
+template <> inline uint32_t atmd_mi_type<float>() { return ATMD_MI_SINGLE; }
+template <> inline uint32_t atmd_mi_type<double>() { return ATMD_MI_DOUBLE; }
+template <> inline uint32_t atmd_mi_type<int64_t>() { return ATMD_MI_INT64; }
+template <> inline uint32_t atmd_mi_type<uint64_t>() { return ATMD_MI_UINT64; }
+
+
+/* @class MatReader
+ * Reader of MAT measure files. The file is mapped read-only and the variables
+ * are indexed on open; the columns of uncompressed variables are then accessed
+ * in place, so opening costs the same whatever the size of the file.
+ */
+class MatReader {
+public:
+  MatReader() : _addr(NULL), _len(0) {};
+  ~MatReader() { close(); };
+
+  // Open and map a file (return 0 on success, -1 on error)
+  int open(const char* path);
+  void close();
+  bool is_open()const { return (_addr != NULL); };
+
+  // Error description of the last failed open
+  const std::string& error()const { return _error; };
+
+  // Variables
+  size_t variables()const { return _vars.size(); };
+  const MatVariable& variable(size_t i)const { return _vars[i]; };
+  const MatVariable* find(const std::string& name)const;
+
+  // Typed view of a variable (NULL if missing or of a different type)
+  template <typename T> const T* data(const std::string& name)const {
+    const MatVariable* v = find(name);
+    return (v && v->type == atmd_mi_type<T>()) ? (const T*)v->data : NULL;
+  };
+
+  // Number of events (MATPS1, MATPS2 and MATPS3 files)
+  uint64_t events()const;
+
+  // Start ID of an event (any format)
+  double start_of(uint64_t ev)const;
+
+  // Range [begin, end) of the events of the starts with IDs in [first, last]
+  void start_range(double first, double last, uint64_t& begin, uint64_t& end)const;
+
+private:
+  MatReader(const MatReader&);
+  MatReader& operator=(const MatReader&);
+
+  // Index a miMATRIX element
+  int parse_matrix(const char* ptr, uint64_t len, bool compressed);
+
+  // Inflate a miCOMPRESSED element
+  int inflate_element(const char* ptr, uint64_t len, std::vector<char>& out);
+
+  void* _addr;
+  size_t _len;
+  std::vector<MatVariable> _vars;
+  std::vector< std::vector<char>* > _inflated;  // Buffers of compressed variables
+  std::string _error;
+};
+
+#endif
@@ -24,9 +24,76 @@
 extern bool enable_debug;
 #endif
 
+// Global
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <algorithm>
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "atmd_measure.h"
 
 
+/* @fn stops2ps(const int32_t* stop, const uint32_t* retrig, size_t count, double tbin, double* out)
+ * Convert a block of stop times to ps: stop * tbin + retrig * ATMD_RETRIG_PS.
+ * The kernel is selected at compile time: AVX2 with FMA converts four events
+ * per iteration, SSE2 two, and a scalar loop handles the tail (or everything
+ * when no vector extension is enabled). The arrays need not be aligned, so
+ * out can point directly into an export buffer.
+ * Unsigned retrig counts are converted by flipping the sign bit, converting as
+ * signed and adding back 2^31, which is exact.
+ * With FMA the sum is rounded once, so the result can differ by one rounding
+ * from Measure::get_stoptime().
+ *
+ * @param stop The stop times in units of tbin.
+ * @param retrig The retrig counts.
+ * @param count The number of events.
+ * @param tbin The time bin in ps.
+ * @param out The output array of stop times in ps.
+ */
+void stops2ps(const int32_t* stop, const uint32_t* retrig, size_t count, double tbin, double* out) {
+  size_t i = 0;
+
+#if defined(__AVX2__) && defined(__FMA__)
+  const __m256d vtbin = _mm256_set1_pd(tbin);
+  const __m256d vperiod = _mm256_set1_pd(ATMD_RETRIG_PS);
+  const __m256d voffset = _mm256_set1_pd(2147483648.0);
+  const __m128i vsign = _mm_set1_epi32((int)0x80000000);
+  for(; i + 4 <= count; i += 4) {
+    __m256d s = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(stop + i)));
+    __m128i r32 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(retrig + i)), vsign);
+    __m256d r = _mm256_add_pd(_mm256_cvtepi32_pd(r32), voffset);
+    _mm256_storeu_pd(out + i, _mm256_fmadd_pd(s, vtbin, _mm256_mul_pd(r, vperiod)));
+  }
+
+#elif defined(__SSE2__)
+  const __m128d vtbin = _mm_set1_pd(tbin);
+  const __m128d vperiod = _mm_set1_pd(ATMD_RETRIG_PS);
+  const __m128d voffset = _mm_set1_pd(2147483648.0);
+  const __m128i vsign = _mm_set1_epi32((int)0x80000000);
+  for(; i + 4 <= count; i += 4) {
+    __m128i s32 = _mm_loadu_si128((const __m128i*)(stop + i));
+    __m128i r32 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(retrig + i)), vsign);
+    __m128d s_lo = _mm_cvtepi32_pd(s32);
+    __m128d s_hi = _mm_cvtepi32_pd(_mm_srli_si128(s32, 8));
+    __m128d r_lo = _mm_add_pd(_mm_cvtepi32_pd(r32), voffset);
+    __m128d r_hi = _mm_add_pd(_mm_cvtepi32_pd(_mm_srli_si128(r32, 8)), voffset);
+    _mm_storeu_pd(out + i, _mm_add_pd(_mm_mul_pd(s_lo, vtbin), _mm_mul_pd(r_lo, vperiod)));
+    _mm_storeu_pd(out + i + 2, _mm_add_pd(_mm_mul_pd(s_hi, vtbin), _mm_mul_pd(r_hi, vperiod)));
+  }
+#endif
+
+  for(; i < count; i++)
+    out[i] = (double)stop[i] * tbin + (double)retrig[i] * ATMD_RETRIG_PS;
+}
+
+
 /* @fn StartData::add_event(uint32_t retrig, uint32_t stop, int8_t ch)
  * Add a stop to a StartData object.
  *
@@ -105,7 +172,7 @@ int StartData::get_channel(uint32_t num, int8_t& ch)const {
  */
 int StartData::get_stoptime(uint32_t num, double& stop)const {
   if(num < this->retrig_count.size()) {
-    stop = (double)(this->stoptime[num]) * this->time_bin + (double)(this->retrig_count[num]) * (ATMD_AUTORETRIG + 1) * ATMD_TREF * 1e12;
+    stop = (double)(this->stoptime[num]) * this->time_bin + (double)(this->retrig_count[num]) * ATMD_RETRIG_PS;
 
   } else {
     // Non-existent stop, so we return -1
@@ -138,61 +205,165 @@ int StartData::get_rawstoptime(uint32_t num, uint32_t& retrig, double& stop)cons
 }
 
 
-/* @fn StartData::merge(const std::vector<StartData*>& st)
+/* @fn StartData::assign(const std::vector<StartData*>& svec)
+ * Replace the content of this start with the merge of the starts of all the
+ * agents. The vectors are cleared but keep their capacity, so a reused object
+ * stops allocating once it has seen the largest start.
  *
+ * @param svec The starts of each agent.
  */
-StartData* StartData::merge(const std::vector<StartData*>& svec) {
-  StartData * merged = new StartData;
-
-  if(!merged)
-    return NULL;
-
-  // Sum up all events
-  size_t numev = 0;
-  for(size_t i = 0; i < svec.size(); i++)
-    numev += svec[i]->count_stops();
-
-  // Allocate memory
-  merged->reserve(numev);
+void StartData::assign(const std::vector<StartData*>& svec) {
+  this->clear();
+  if(svec.size() == 0)
+    return;
 
   // Merge events
   for(size_t i = 0; i < svec.size(); i++) {
-    for(size_t j = 0; j < svec[i]->count_stops(); j++) {
-      int8_t ch = 0;
-      int32_t stop = 0;
-      uint32_t retrig = 0;
-      svec[i]->get_event(j, retrig, stop, ch);
-      merged->add_event(retrig, stop, ch);
-    }
+    const StartData* st = svec[i];
+    this->retrig_count.insert(this->retrig_count.end(), st->retrig_count.begin(), st->retrig_count.end());
+    this->stoptime.insert(this->stoptime.end(), st->stoptime.begin(), st->stoptime.end());
+    this->channel.insert(this->channel.end(), st->channel.begin(), st->channel.end());
 
     // Window times
-    if(svec[i]->times())
-      merged->add_time(svec[i]->get_window_begin(0), svec[i]->get_window_time(0));
+    if(st->times())
+      this->add_time(st->get_window_begin(0), st->get_window_time(0));
     else
-      syslog(ATMD_ERR, "Measure [add_start]: StartData was missing the window start and duration.");
+      syslog(ATMD_ERR, "StartData [assign]: StartData was missing the window start and duration.");
   }
 
   // Add tbin
-  merged->set_tbin(svec[0]->get_tbin());
+  this->set_tbin(svec[0]->get_tbin());
 
   // Add ID
-  merged->id(svec[0]->id());
+  this->id(svec[0]->id());
+}
+
 
-  return merged;
+/* @fn Measure::reserve(size_t starts, size_t stops)
+ * Preallocate the arenas for 'starts' starts and 'stops' events.
+ *
+ * @param starts The number of starts to preallocate
+ * @param stops The number of events to preallocate
+ */
+void Measure::reserve(size_t starts, size_t stops) {
+  try {
+    this->_channel.reserve(stops);
+    this->_stoptime.reserve(stops);
+    this->_retrig.reserve(stops);
+    this->_start_index.reserve(starts+1);
+    this->_start_id.reserve(starts);
+    this->_time_index.reserve(starts+1);
+    if(this->_nch) {
+      this->_counts.reserve(starts * (this->_nch+1));
+      this->_index.reserve(stops);
+    }
+  } catch(std::exception& e) {
+    syslog(ATMD_ERR, "Measure [reserve]: memory allocation failed with error %s", e.what());
+  }
+}
+
+
+/* @fn Measure::add_chunk_times(size_t agents)
+ * A chunk saved while the measure is running gets no termination packet, so
+ * the measure time of each agent is taken from the begin of the window of the
+ * first start to the end of the window of the last one.
+ *
+ * @param agents The number of agents.
+ */
+void Measure::add_chunk_times(size_t agents) {
+  if(count_starts() == 0)
+    return;
+
+  size_t last = count_starts()-1;
+  for(size_t i = 0; i < agents; i++) {
+    uint64_t begin = 0;
+    uint64_t duration = 0;
+    if(start_times(0) > i)
+      begin = get_window_begin(0, i);
+    if(start_times(last) > i)
+      duration = get_window_begin(last, i) + get_window_time(last, i) - begin;
+    add_time(begin, duration);
+  }
+}
+
+
+/* @fn Measure::add_start(const std::vector<StartData*>& svec)
+ * Get a vector of starts from the agents and appends their events and timings
+ * to the arenas of the Measure object as a single start.
+ *
+ * @param svec A vector of pointers to the StartData objects of each agent.
+ * @return Return 0 on success, -1 on error.
+ */
+int Measure::add_start(const std::vector<StartData*>& svec) {
+  if(svec.size() == 0)
+    return -1;
+
+  if(this->spilled()) {
+    syslog(ATMD_ERR, "Measure [add_start]: trying to add a start to a spilled measure.");
+    return -1;
+  }
+
+  try {
+    // Append events
+    for(size_t i = 0; i < svec.size(); i++) {
+      const StartData* st = svec[i];
+      this->_channel.append(st->channel.begin(), st->channel.end());
+      this->_stoptime.append(st->stoptime.begin(), st->stoptime.end());
+      this->_retrig.append(st->retrig_count.begin(), st->retrig_count.end());
+
+      // Window times
+      if(st->times()) {
+        this->_window_begin.push_back(st->get_window_begin(0));
+        this->_window_time.push_back(st->get_window_time(0));
+      } else {
+        syslog(ATMD_ERR, "Measure [add_start]: StartData was missing the window start and duration.");
+      }
+    }
+
+    // Update start columns
+    this->_start_index.push_back(this->_channel.size());
+    this->_time_index.push_back(this->_window_begin.size());
+    this->_start_id.push_back(svec[0]->id());
+
+    // Time bin
+    this->set_tbin(svec[0]->get_tbin());
+
+    // Statistics
+    this->count_last_start();
+
+    return 0;
+
+  } catch (std::exception& e) {
+    syslog(ATMD_ERR, "Measure [add_start]: memory allocation failed with error %s", e.what());
+    return -1;
+  }
 }
 
 
 /* @fn Measure::add_start(const StartData& start)
- * Get a vector of starts from the agents, merges them into a single start object
- * and adds it to the Measure object.
+ * Append a single (already merged) start to the Measure object.
  *
  * @param start A constant reference to a StartData object.
  * @return Return 0 on success, -1 on error.
  */
-int Measure::add_start(std::vector<StartData*>& svec) {
-  // Add start to measure
+int Measure::add_start(const StartData& start) {
+  if(this->spilled()) {
+    syslog(ATMD_ERR, "Measure [add_start]: trying to add a start to a spilled measure.");
+    return -1;
+  }
+
   try {
-    this->starts.push_back(StartData::merge(svec));
+    this->_channel.append(start.channel.begin(), start.channel.end());
+    this->_stoptime.append(start.stoptime.begin(), start.stoptime.end());
+    this->_retrig.append(start.retrig_count.begin(), start.retrig_count.end());
+    this->_window_begin.append(start.window_begin.begin(), start.window_begin.end());
+    this->_window_time.append(start.window_time.begin(), start.window_time.end());
+
+    this->_start_index.push_back(this->_channel.size());
+    this->_time_index.push_back(this->_window_begin.size());
+    this->_start_id.push_back(start.id());
+    this->set_tbin(start.get_tbin());
+    this->count_last_start();
     return 0;
 
   } catch (std::exception& e) {
@@ -200,3 +371,314 @@ int Measure::add_start(std::vector<StartData*>& svec) {
     return -1;
   }
 }
+
+
+/* @fn Measure::count_last_start()
+ * Append the statistics row of the last start added, update the totals and
+ * append the time index of the start: its local event indexes sorted by
+ * channel, then by tick. The events of the start are still hot in cache, so
+ * this is the cheapest moment to do it. The tick of each event is computed
+ * once into reusable sort keys. The events themselves stay in acquisition
+ * order. Does nothing if the measure has no channels.
+ */
+void Measure::count_last_start() {
+  if(this->_nch == 0)
+    return;
+
+  size_t start = this->count_starts() - 1;
+  size_t base = this->first_stop(start);
+  size_t n = this->count_stops(start);
+  this->_row.assign(this->_nch+1, 0);
+
+  // Window time in us
+  if(this->start_times(start))
+    this->_row[0] = (uint32_t)(this->get_window_time(start, 0) / 1000);
+
+  // Stops per channel (both slopes are counted on the same channel) and sort keys
+  const int8_t* ch = this->_channel.data();
+  bool sorted = true;
+  this->_keys.resize(n);
+  for(size_t i = 0; i < n; i++) {
+    size_t c = (ch[base+i] > 0) ? ch[base+i] : -ch[base+i];
+    if(c >= 1 && c <= this->_nch)
+      this->_row[c]++;
+    else
+      c = this->_nch+1;
+
+    EventKey& key = this->_keys[i];
+    key.bucket = c;
+    key.tick = this->get_tick(base+i);
+    key.index = i;
+    if(i > 0 && key < this->_keys[i-1])
+      sorted = false;
+  }
+
+  this->_counts.append(this->_row.begin(), this->_row.end());
+  for(size_t i = 0; i <= this->_nch; i++)
+    this->_totals[i] += this->_row[i];
+
+  // Time index
+  if(!sorted)
+    std::sort(this->_keys.begin(), this->_keys.end());
+  this->_index_row.resize(n);
+  for(size_t i = 0; i < n; i++)
+    this->_index_row[i] = this->_keys[i].index;
+  this->_index.append(this->_index_row.begin(), this->_index_row.end());
+}
+
+
+/* @fn Measure::channel_index(size_t start, size_t ch, uint32_t& n)
+ * Return the slice of the time index of a start that belongs to channel 'ch'.
+ *
+ * @param start The start number.
+ * @param ch The channel (1 to nch()).
+ * @param n Output of the number of stops of the channel.
+ * @return Pointer to the local event indexes (relative to first_stop(start)) sorted by tick.
+ */
+const uint32_t* Measure::channel_index(size_t start, size_t ch, uint32_t& n)const {
+  const uint32_t* counts = this->stat_row(start);
+  size_t offset = 0;
+  for(size_t c = 1; c < ch; c++)
+    offset += counts[c];
+  n = counts[ch];
+  return this->_index.data() + this->first_stop(start) + offset;
+}
+
+
+/* @fn Measure::tick_bound(size_t base, const uint32_t* first, const uint32_t* last, int64_t tick)
+ * Binary search on a slice of the time index.
+ *
+ * @param base The first event of the start.
+ * @param first The first element of the slice.
+ * @param last One past the last element of the slice.
+ * @param tick The tick to search.
+ * @return The first element of the slice with a tick not less than 'tick' ('last' if none).
+ */
+const uint32_t* Measure::tick_bound(size_t base, const uint32_t* first, const uint32_t* last, int64_t tick)const {
+  while(first < last) {
+    const uint32_t* mid = first + (last - first) / 2;
+    if(this->get_tick(base + *mid) < tick)
+      first = mid + 1;
+    else
+      last = mid;
+  }
+  return first;
+}
+
+
+/* @fn Measure::count_window(size_t start, double begin, double end, uint32_t* row)
+ * Count the stops of a start on each channel with a stop time strictly between
+ * 'begin' and 'end'. Each channel takes two binary searches on the time index;
+ * only the stops whose tick falls on the bins of the window edges, where the
+ * rounding of the retrig term matters, are tested with the exact stop time
+ * from get_stoptime(). Without a time bin every stop is tested exactly.
+ *
+ * @param start The start number.
+ * @param begin The begin of the window in ps.
+ * @param end The end of the window in ps.
+ * @param row Output row (element i is the count of channel i, element zero is not modified).
+ */
+void Measure::count_window(size_t start, double begin, double end, uint32_t* row)const {
+  const uint32_t* counts = this->stat_row(start);
+  size_t base = this->first_stop(start);
+  const uint32_t* index = this->_index.data() + base;
+
+  if(this->_tbin <= 0.0) {
+    for(size_t c = 1; c <= this->_nch; c++) {
+      row[c] = 0;
+      for(uint32_t i = 0; i < counts[c]; i++) {
+        double t = this->get_stoptime(base + index[i]);
+        if(t > begin && t < end)
+          row[c]++;
+      }
+      index += counts[c];
+    }
+    return;
+  }
+
+  // First and last whole bins inside the window
+  int64_t first = (int64_t)floor(begin / this->_tbin) + 1;
+  int64_t last = (int64_t)ceil(end / this->_tbin) - 1;
+
+  for(size_t c = 1; c <= this->_nch; c++) {
+    const uint32_t* lo = this->tick_bound(base, index, index + counts[c], first - 1);
+    const uint32_t* hi = this->tick_bound(base, lo, index + counts[c], last + 2);
+    index += counts[c];
+
+    // Edge bins: exact test
+    uint32_t n = 0;
+    for(; lo < hi && this->get_tick(base + *lo) <= first; lo++) {
+      double t = this->get_stoptime(base + *lo);
+      if(t > begin && t < end)
+        n++;
+    }
+    for(; hi > lo && this->get_tick(base + *(hi-1)) >= last; hi--) {
+      double t = this->get_stoptime(base + *(hi-1));
+      if(t > begin && t < end)
+        n++;
+    }
+    row[c] = n + (hi - lo);
+  }
+}
+
+
+/* @fn Measure::resident_bytes()
+ * Return the amount of memory held in RAM by the columns of the measure.
+ *
+ * @return The number of bytes.
+ */
+size_t Measure::resident_bytes()const {
+  return this->_channel.bytes() + this->_stoptime.bytes() + this->_retrig.bytes() +
+         this->_start_index.bytes() + this->_start_id.bytes() +
+         this->_window_begin.bytes() + this->_window_time.bytes() + this->_time_index.bytes() +
+         this->_counts.bytes() + this->_index.bytes();
+}
+
+
+/* @fn Measure::spill(const std::string& dir)
+ * Write all the columns of the measure to a temporary file in 'dir' and
+ * return a new measure whose columns map it read-only. The original measure is
+ * left untouched, so readers holding it are not disturbed; the caller replaces
+ * it and drops its reference. The file is unlinked immediately, so it
+ * disappears as soon as the mapping is released.
+ * The mapped pages are unlocked and dropped, so they are paged back from disk
+ * only when the measure is read (MSR SAVE, MSR STAT, ...).
+ *
+ * @param dir The spool directory.
+ * @return Return the spilled copy, NULL on error.
+ */
+Measure* Measure::spill(const std::string& dir)const {
+  if(this->spilled())
+    return NULL;
+
+  // Column layout (each column aligned to 8 bytes)
+  const size_t ncols = 10;
+  const void* col_ptr[ncols] = { this->_channel.data(), this->_stoptime.data(), this->_retrig.data(),
+                                 this->_start_index.data(), this->_start_id.data(),
+                                 this->_window_begin.data(), this->_window_time.data(), this->_time_index.data(),
+                                 this->_counts.data(), this->_index.data() };
+  size_t col_len[ncols] = { this->_channel.payload(), this->_stoptime.payload(), this->_retrig.payload(),
+                            this->_start_index.payload(), this->_start_id.payload(),
+                            this->_window_begin.payload(), this->_window_time.payload(), this->_time_index.payload(),
+                            this->_counts.payload(), this->_index.payload() };
+  size_t col_off[ncols];
+
+  size_t len = 0;
+  for(size_t i = 0; i < ncols; i++) {
+    col_off[i] = len;
+    len += (col_len[i] + 7) & ~((size_t)7);
+  }
+
+  // Create the spill file
+  std::string path = dir + "/atmd_spill_XXXXXX";
+  std::vector<char> tmpl(path.begin(), path.end());
+  tmpl.push_back('\0');
+  int fd = mkstemp(&(tmpl[0]));
+  if(fd == -1) {
+    syslog(ATMD_ERR, "Measure [spill]: cannot create spill file \"%s\" (Error: %s).", path.c_str(), strerror(errno));
+    return NULL;
+  }
+  unlink(&(tmpl[0]));
+
+  // Write columns
+  static const char pad[8] = { 0 };
+  for(size_t i = 0; i < ncols; i++) {
+    const char* ptr = (const char*)col_ptr[i];
+    size_t left = col_len[i];
+    size_t padding = ((col_len[i] + 7) & ~((size_t)7)) - col_len[i];
+    while(left > 0 || padding > 0) {
+      ssize_t ret;
+      if(left > 0)
+        ret = write(fd, ptr, left);
+      else
+        ret = write(fd, pad, padding);
+      if(ret == -1) {
+        if(errno == EINTR)
+          continue;
+        syslog(ATMD_ERR, "Measure [spill]: error writing spill file (Error: %s).", strerror(errno));
+        close(fd);
+        return NULL;
+      }
+      if(left > 0) {
+        ptr += ret;
+        left -= ret;
+      } else {
+        padding -= ret;
+      }
+    }
+  }
+
+  // Flush to disk so that the mapped pages are clean and can be dropped
+  if(fdatasync(fd))
+    syslog(ATMD_WARN, "Measure [spill]: fdatasync on spill file failed (Error: %s).", strerror(errno));
+
+  void* addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+  if(addr == MAP_FAILED) {
+    syslog(ATMD_ERR, "Measure [spill]: cannot map spill file (Error: %s).", strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+
+  // The server runs with mlockall(MCL_FUTURE), so the new mapping is locked: unlock it and drop the pages
+  munlock(addr, len);
+  madvise(addr, len, MADV_DONTNEED);
+
+  // Build the copy on the mapping
+  Measure* copy = NULL;
+  try {
+    copy = new Measure(this->_nch);
+    copy->measure_begin = this->measure_begin;
+    copy->measure_time = this->measure_time;
+    copy->_tbin = this->_tbin;
+    copy->_retrig_ticks = this->_retrig_ticks;
+    copy->_totals = this->_totals;
+    copy->_hist = this->_hist;
+
+  } catch(std::exception& e) {
+    syslog(ATMD_ERR, "Measure [spill]: memory allocation failed with error %s", e.what());
+    if(copy)
+      copy->unref();
+    munmap(addr, len);
+    return NULL;
+  }
+
+  const char* base = (const char*)addr;
+  copy->_channel.map((const int8_t*)(base + col_off[0]), this->_channel.size());
+  copy->_stoptime.map((const int32_t*)(base + col_off[1]), this->_stoptime.size());
+  copy->_retrig.map((const uint32_t*)(base + col_off[2]), this->_retrig.size());
+  copy->_start_index.map((const uint64_t*)(base + col_off[3]), this->_start_index.size());
+  copy->_start_id.map((const uint32_t*)(base + col_off[4]), this->_start_id.size());
+  copy->_window_begin.map((const uint64_t*)(base + col_off[5]), this->_window_begin.size());
+  copy->_window_time.map((const uint64_t*)(base + col_off[6]), this->_window_time.size());
+  copy->_time_index.map((const uint64_t*)(base + col_off[7]), this->_time_index.size());
+  copy->_counts.map((const uint32_t*)(base + col_off[8]), this->_counts.size());
+  copy->_index.map((const uint32_t*)(base + col_off[9]), this->_index.size());
+
+  copy->_map_addr = addr;
+  copy->_map_len = len;
+  return copy;
+}
+
+
+/* @fn Measure::unmap()
+ * Release the spill mapping. The columns are cleared if they were mapped.
+ */
+void Measure::unmap() {
+  if(this->_map_addr) {
+    this->_channel.clear();
+    this->_stoptime.clear();
+    this->_retrig.clear();
+    this->_start_index.clear();
+    this->_start_id.clear();
+    this->_window_begin.clear();
+    this->_window_time.clear();
+    this->_time_index.clear();
+    this->_counts.clear();
+    this->_index.clear();
+    munmap(this->_map_addr, this->_map_len);
+    this->_map_addr = NULL;
+    this->_map_len = 0;
+  }
+}
@@ -25,14 +25,22 @@
 // Global
 #include <stdlib.h>
 #include <stdint.h>
+#include <math.h>
 #include <vector>
+#include <string>
 #include <exception>
 
 // Local
 #include "common.h"
+#include "atmd_column.h"
+#include "atmd_histogram.h"
 
-// Declare class VirtualBoard for friendship
+// Declare classes VirtualBoard and Measure for friendship
 class VirtualBoard;
+class Measure;
+
+// Convert stop times from Tbin units and retrig counts to ps
+void stops2ps(const int32_t* stop, const uint32_t* retrig, size_t count, double tbin, double* out);
 
 
 /* @class StartData
@@ -43,6 +51,9 @@ public:
   StartData(): time_bin(0.0), _id(0) {};
   ~StartData() {};
 
+  // Make class Measure a friend
+  friend class Measure;
+
   int add_event(uint32_t retrig, int32_t stop, int8_t ch);
   int get_event(uint32_t num, uint32_t& retrig, int32_t& stop, int8_t& ch)const;
   int get_channel(uint32_t num, int8_t& ch)const;
@@ -72,8 +83,8 @@ public:
   // Preallocate
   void reserve(size_t sz);
 
-  // Merge multiple StartData struct into one
-  static StartData* merge(const std::vector<StartData*>& svec);
+  // Replace the content with the merge of multiple StartData (storage is reused)
+  void assign(const std::vector<StartData*>& svec);
 
   // ID
   uint32_t id()const { return _id; };
@@ -94,53 +105,208 @@ private:
 
 
 /* @class Measure
- * This class manages the starts of one measure
+ * This class stores the starts of one measure in columnar form. The events of
+ * all the starts are packed in a few contiguous arenas (channel, stoptime and
+ * retrig) and each start is described by an offset into them, its ID and its
+ * window timings.
+ * Per start and per measure channel counters are updated while starts are
+ * added, so that statistics never need to scan the event arenas. For the same
+ * reason each start keeps an index of its events sorted by channel and time.
+ * A completed measure can be spilled to a memory-mapped file to release memory.
+ * Completed measures are shared with readers by reference counting: once a
+ * measure is stored it is never modified, and it is deleted when the last
+ * reference is dropped.
  */
 class Measure {
 public:
-  Measure() {};
-  ~Measure() {
-    for(uint32_t i = 0; i < this->starts.size(); i++)
-      delete starts[i];
-    this->starts.clear();
-  }; // The destructor should cycle over starts vector to free all the start objects
+  Measure(size_t nch = 0) : _tbin(0.0), _retrig_ticks(0.0), _nch(nch), _totals(nch+1, 0), _map_addr(NULL), _map_len(0), _refs(1) { _start_index.push_back(0); _time_index.push_back(0); };
+  ~Measure() { unmap(); };
 
   // Make class VirtualBoard a friend
   friend class VirtualBoard;
 
-  // Interface to add a start object
-  int add_start(std::vector<StartData*>& starts);
+  // Interface to add a start object (merges the starts of all the agents)
+  int add_start(const std::vector<StartData*>& svec);
+  int add_start(const StartData& start);
 
   // Interface to clear all stored start objects
   void clear() {
-    for(uint32_t i = 0; i < this->starts.size(); i++)
-      delete starts[i];
-    this->starts.clear();
+    this->unmap();
+    this->_channel.clear();
+    this->_stoptime.clear();
+    this->_retrig.clear();
+    this->_start_index.clear();
+    this->_start_index.push_back(0);
+    this->_start_id.clear();
+    this->_window_begin.clear();
+    this->_window_time.clear();
+    this->_time_index.clear();
+    this->_time_index.push_back(0);
     this->measure_begin.clear();
     this->measure_time.clear();
+    this->_counts.clear();
+    this->_index.clear();
+    this->_totals.assign(this->_nch+1, 0);
+    this->_tbin = 0.0;
+    this->_retrig_ticks = 0.0;
+    this->_hist = Histogram();
   };
 
+  // Preallocate storage for 'starts' starts and 'stops' events
+  void reserve(size_t starts, size_t stops);
+
+  // Reference counting (a new measure holds one reference, owned by its creator)
+  void ref()const { __sync_add_and_fetch(&this->_refs, 1); };
+  void unref()const { if(__sync_sub_and_fetch(&this->_refs, 1) == 0) delete this; };
+
+  // Copy of the measure with all columns spilled to an (unlinked) memory-mapped file in directory 'dir'
+  Measure* spill(const std::string& dir)const;
+  bool spilled()const { return (this->_map_addr != NULL); };
+
+  // Memory held by the measure in RAM and in the spill file (in bytes)
+  size_t resident_bytes()const;
+  size_t spilled_bytes()const { return this->_map_len; };
+
   // Interface to count start events
-  uint32_t count_starts() { return this->starts.size(); };
-
-  // Interface to retrieve a start object
-  StartData* get_start(uint32_t num_start) {
-    if(num_start < this->starts.size())
-      return this->starts[num_start];
-    else
-      return NULL;
-  };
+  uint32_t count_starts()const { return this->_start_index.size() - 1; };
+
+  // Interface to count stops (of the whole measure or of a single start)
+  size_t count_stops()const { return this->_channel.size(); };
+  uint32_t count_stops(size_t start)const { return this->_start_index[start+1] - this->_start_index[start]; };
+
+  // Index of the first event of a start in the event arenas
+  size_t first_stop(size_t start)const { return this->_start_index[start]; };
+
+  // Event accessors (the event number is the index in the arenas)
+  int8_t get_channel(size_t ev)const { return this->_channel[ev]; };
+  int32_t get_rawstop(size_t ev)const { return this->_stoptime[ev]; };
+  uint32_t get_retrig(size_t ev)const { return this->_retrig[ev]; };
+  int64_t get_tick(size_t ev)const { return (int64_t)(this->_stoptime[ev]) + llround((double)(this->_retrig[ev]) * this->_retrig_ticks); };
+  double get_stoptime(size_t ev)const { return (double)(this->_stoptime[ev]) * this->_tbin + (double)(this->_retrig[ev]) * ATMD_RETRIG_PS; };
+
+  // Stop times in ps of a range of events (batch version of get_stoptime())
+  void get_stoptimes(size_t first, size_t count, double* out)const { stops2ps(this->_stoptime.data() + first, this->_retrig.data() + first, count, this->_tbin, out); };
+
+  // Direct access to the event arenas
+  const int8_t* channels()const { return this->_channel.data(); };
+  const int32_t* stoptimes()const { return this->_stoptime.data(); };
+  const uint32_t* retrigs()const { return this->_retrig.data(); };
+
+  // Direct access to the start columns
+  const uint64_t* start_indexes()const { return this->_start_index.data(); };
+  const uint32_t* start_ids()const { return this->_start_id.data(); };
+  const uint64_t* time_indexes()const { return this->_time_index.data(); };
+  const uint64_t* window_begins()const { return this->_window_begin.data(); };
+  const uint64_t* window_times()const { return this->_window_time.data(); };
+  size_t windows()const { return this->_window_begin.size(); };
+
+  // Per start window timings and ID
+  size_t start_times(size_t start)const { return this->_time_index[start+1] - this->_time_index[start]; };
+  uint64_t get_window_begin(size_t start, size_t i)const { return this->_window_begin[this->_time_index[start]+i]; };
+  uint64_t get_window_time(size_t start, size_t i)const { return this->_window_time[this->_time_index[start]+i]; };
+  uint32_t start_id(size_t start)const { return this->_start_id[start]; };
+
+  // Time bin in ps
+  double get_tbin()const { return this->_tbin; };
+
+  // Channel statistics. Each start has a row of stat_width() counters: the
+  // first is the window time in us, then the number of stops on each channel.
+  // The totals have the same layout, summed over all starts.
+  size_t nch()const { return this->_nch; };
+  size_t stat_width()const { return this->_nch + 1; };
+  const uint32_t* stat_rows()const { return this->_counts.data(); };
+  const uint32_t* stat_row(size_t start)const { return this->_counts.data() + start * (this->_nch + 1); };
+  const std::vector<uint64_t>& stat_totals()const { return this->_totals; };
+
+  // Time-of-flight histogram accumulated while the measure was acquired
+  const Histogram& histogram()const { return this->_hist; };
+  void set_histogram(const Histogram& hist) { this->_hist = hist; };
+
+  // Local indexes (relative to first_stop(start)) of the stops of a channel sorted by tick
+  const uint32_t* channel_index(size_t start, size_t ch, uint32_t& n)const;
+
+  // Count the stops of a start with stop time in (begin, end) ps on each channel (row has stat_width() elements, first untouched)
+  void count_window(size_t start, double begin, double end, uint32_t* row)const;
 
   // Interface for managing effective measure time
   void add_time(uint64_t begin, uint64_t duration) { measure_begin.push_back(begin); measure_time.push_back(duration); };
+  void clear_times() { measure_begin.clear(); measure_time.clear(); };
   size_t times()const { return measure_begin.size(); };
-  uint64_t get_time(size_t i) { return measure_time[i]; };
-  uint64_t get_begin(size_t i) { return measure_begin[i]; };
+  uint64_t get_time(size_t i)const { return measure_time[i]; };
+  uint64_t get_begin(size_t i)const { return measure_begin[i]; };
+  const uint64_t* begins()const { return (measure_begin.size()) ? &(measure_begin[0]) : NULL; };
+  const uint64_t* durations()const { return (measure_time.size()) ? &(measure_time[0]) : NULL; };
+
+  // Set the measure time of each agent from the windows of the first and last start (autosave chunks)
+  void add_chunk_times(size_t agents);
 
 private:
+  // Measures own their spill mapping, so they cannot be copied
+  Measure(const Measure&);
+  Measure& operator=(const Measure&);
+
+  // Release the spill mapping
+  void unmap();
+
+  // Update channel statistics and time index with the last start added
+  void count_last_start();
+
+  // First element of a slice of the time index with tick not less than 'tick'
+  const uint32_t* tick_bound(size_t base, const uint32_t* first, const uint32_t* last, int64_t tick)const;
+
+  // Update the time bin
+  void set_tbin(double tbin) { this->_tbin = tbin; this->_retrig_ticks = (tbin > 0.0) ? ATMD_RETRIG_PS / tbin : 0.0; };
+
   std::vector<uint64_t> measure_begin;  // Timestamp of measure start
   std::vector<uint64_t> measure_time;   // Duration of measure
-  std::vector<StartData*> starts;       // Vector of pointers to start objects relative to this measure
+
+  // Event arenas
+  Column<int8_t> _channel;              // Channel numbers of all the events
+  Column<int32_t> _stoptime;            // Stoptimes in unit of Tbin of all the events
+  Column<uint32_t> _retrig;             // Retrig counters of all the events
+
+  // Start columns
+  Column<uint64_t> _start_index;        // Offset of the first event of each start (one more element than starts)
+  Column<uint32_t> _start_id;           // Start IDs
+  Column<uint64_t> _window_begin;       // Window begin in nanoseconds for each start and agent
+  Column<uint64_t> _window_time;        // Effective window time in nanoseconds for each start and agent
+  Column<uint64_t> _time_index;         // Offset of the first window timing of each start
+
+  double _tbin;                         // Time bin in ps
+  double _retrig_ticks;                 // Retrig period in units of Tbin
+
+  // Channel statistics
+  size_t _nch;                          // Number of channels
+  Column<uint32_t> _counts;             // Per start window time and channel counters
+  std::vector<uint64_t> _totals;        // Per measure sum of the per start counters
+  Column<uint32_t> _index;              // Per start event indexes sorted by channel and tick
+
+  // Scratch buffers of count_last_start()
+  struct EventKey {
+    size_t bucket;                      // Channel (nch+1 for channels out of range)
+    int64_t tick;
+    uint32_t index;                     // Index in the start
+    bool operator<(const EventKey& b)const {
+      if(bucket != b.bucket)
+        return bucket < b.bucket;
+      if(tick != b.tick)
+        return tick < b.tick;
+      return index < b.index;
+    };
+  };
+  std::vector<EventKey> _keys;
+  std::vector<uint32_t> _row;
+  std::vector<uint32_t> _index_row;
+
+  // Histogram
+  Histogram _hist;
+
+  // Spill file mapping
+  void* _map_addr;
+  size_t _map_len;
+
+  // References
+  mutable volatile int _refs;
 };
 
 #endif
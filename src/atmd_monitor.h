@@ -35,59 +35,130 @@ class VirtualBoard;
 
 
 /* @class Monitor
- *
+ * Keeps the last _m starts of the running measure in a ring of preallocated
+ * slots, so that adding a start only copies its events into storage that is
+ * reused. Every _n starts the ring is due to be written to the monitor file.
+ * For the write the ring is frozen: the monitor task reads the slots in place,
+ * and a frozen slot that the data task has to overwrite is first swapped with
+ * a spare one, so no start is copied or allocated on the data task.
  */
 class Monitor {
 public:
-  Monitor() : _n(0), _m(0), _count(0) {};
-  ~Monitor() { clear(); };
+  Monitor() : _n(0), _m(0), _head(0), _size(0), _count(0) {};
+  ~Monitor() { release(); free(); };
 
   // Make class VirtualBoard a friend
   friend class VirtualBoard;
 
-  // Setup
-  void setup(uint32_t n, uint32_t m) { _n = n; _m = m; };
+  // Setup (refresh every n starts, keep the last m starts). Nothing may be frozen.
+  void setup(uint32_t n, uint32_t m) {
+    release();
+    if(m != _m) {
+      free();
+      _ring.resize(m);
+      _spare.resize(m);
+      for(size_t i = 0; i < m; i++) {
+        _ring[i] = new StartData;
+        _spare[i] = new StartData;
+      }
+      _retired.reserve(m);
+      _frozen.reserve(m);
+    }
+    _n = n;
+    _m = m;
+    _pinned.assign(_m, false);
+    clear();
+  };
 
   // Enabled?
   bool enabled()const { return (_m && _n); };
 
   // Add start
   void add_start(const std::vector<StartData*>& svec) {
-    // Add new start object
-    _data.push_back(StartData::merge(svec));
-
-    // Check if circular buffer is full
-    if(_data.size() > _m) {
-      // Remove first element of vector
-      delete _data.front();
-      _data.erase(_data.begin());
+    if(_pinned[_head]) {
+      // The slot is read by the monitor task: replace it with a spare one
+      _retired.push_back(_ring[_head]);
+      _ring[_head] = _spare.back();
+      _spare.pop_back();
+      _pinned[_head] = false;
     }
+    _ring[_head]->assign(svec);
+    _head = (_head + 1) % _m;
+    if(_size < _m)
+      _size++;
+    _count++;
   };
 
-  // Clear
+  // Tell if the monitor file should be refreshed
+  bool due()const { return (_count >= _n); };
+
+  // Clear (slots keep their storage)
   void clear() {
-    for(size_t i = 0; i < _data.size(); i++)
-      delete _data[i];
-    _data.clear();
+    _head = 0;
+    _size = 0;
     _count = 0;
   };
 
   // Start count
-  size_t start_count()const { return _data.size(); };
+  size_t start_count()const { return _size; };
+
+  // Get starts (0 is the oldest)
+  const StartData* get_start(size_t i)const { return _ring[slot(i)]; };
+
+  // Freeze the current starts for the monitor task (they are kept until release())
+  void freeze() {
+    _frozen.resize(_size);
+    for(size_t i = 0; i < _size; i++) {
+      _frozen[i] = _ring[slot(i)];
+      _pinned[slot(i)] = true;
+    }
+  };
+
+  // The monitor task is done with the frozen starts
+  void release() {
+    _spare.insert(_spare.end(), _retired.begin(), _retired.end());
+    _retired.clear();
+    _pinned.assign(_m, false);
+    _frozen.clear();
+  };
 
-  // Get starts
-  const StartData* get_start(size_t i)const { return _data[i]; };
+  // Frozen starts (0 is the oldest)
+  const std::vector<const StartData*>& frozen()const { return _frozen; };
 
 private:
+  // Ring index of start i (0 is the oldest)
+  size_t slot(size_t i)const { return (_head + _m - _size + i) % _m; };
+
+  // Free all the slots
+  void free() {
+    for(size_t i = 0; i < _ring.size(); i++)
+      delete _ring[i];
+    for(size_t i = 0; i < _spare.size(); i++)
+      delete _spare[i];
+    _ring.clear();
+    _spare.clear();
+  };
 
-  // Vector of start objects
-  std::vector<StartData*> _data;
+  // Ring of start slots
+  std::vector<StartData*> _ring;
+  std::vector<bool> _pinned;            // Slots frozen for the monitor task
+
+  // Slots to replace frozen ones, and frozen slots replaced (spare again on release)
+  std::vector<StartData*> _spare;
+  std::vector<StartData*> _retired;
+
+  // Starts frozen for the monitor task
+  std::vector<const StartData*> _frozen;
 
   // Monitor parameters
-  uint32_t _n; // Save _n starts
-  uint32_t _m; // Save every _m starts
+  uint32_t _n; // Refresh every _n starts
+  uint32_t _m; // Keep the last _m starts
+
+  // Ring position and fill
+  size_t _head;
+  size_t _size;
 
-  // Counter
+  // Starts since last refresh
   size_t _count;
 };
 
@@ -41,6 +41,10 @@ extern bool enable_debug;
 #define ATMD_NETERR_STOP           10
 #define ATMD_NETERR_BOOT           11
 #define ATMD_NETERR_BAD_STATUS     12
+#define ATMD_NETERR_HIST           13
+#define ATMD_NETERR_COINC          14
+#define ATMD_NETERR_FETCH          15
+#define ATMD_NETERR_SUBSCRIBE      16
 
 static const char *network_strerror[] = {
   "NONE",
@@ -55,12 +59,55 @@ static const char *network_strerror[] = {
   "START",
   "STOP",
   "BOOT",
-  "BAD_STATUS"
+  "BAD_STATUS",
+  "HISTOGRAM",
+  "COINCIDENCE",
+  "FETCH",
+  "SUBSCRIBE"
 };
 
 #include "atmd_network.h"
 
 
+/* @class SaveAllProgress
+ * Streams the progress of MSR SAVEALL to the client: one line with the number
+ * of measures, then one line per measure as soon as it is saved. saved() runs
+ * on the save workers, so send errors are not thrown: the first one is kept,
+ * nothing more is sent, and the caller of save_all() rethrows it.
+ */
+class SaveAllProgress : public SaveProgress {
+public:
+  SaveAllProgress(NetClient* net) : _net(net), _error(0) {};
+
+  void begin(size_t count) {
+    send(_net->format_command("MSR SAVEALL NUM %lu", (unsigned long)count));
+  };
+
+  void saved(size_t measure, const std::string& filename, bool success) {
+    send(_net->format_command("MSR SAVEALL %lu %s %s", (unsigned long)measure, (success) ? "OK" : "ERR", filename.c_str()));
+  };
+
+  // First send error (0 if none)
+  int error()const { return _error; };
+
+private:
+  void send(const std::string& command) {
+    if(_error)
+      return;
+    try {
+      _net->send_command(command);
+    } catch(int e) {
+      _error = e;
+    } catch(...) {
+      _error = ATMD_ERR_SEND;
+    }
+  };
+
+  NetClient* _net;
+  int _error;
+};
+
+
 /* @fn Network::Network()
  * Network object constructor
  */
@@ -68,7 +115,31 @@ Network::Network() {
   address = ATMD_DEF_LISTEN;
   port = ATMD_DEF_PORT;
   listen_socket = -1;
-  client_socket = -1;
+  epoll_fd = -1;
+  wake_fd = -1;
+  _board = NULL;
+  _readers = 0;
+  _writer = false;
+  _writers_waiting = 0;
+  _terminate = false;
+  _init = false;
+}
+
+
+/* @fn NetClient::NetClient(Network* net, int socket, const std::string& peer)
+ * Client connection constructor
+ *
+ * @param net The server owning the connection.
+ * @param socket The connected socket.
+ * @param peer The client address (for the logs).
+ */
+NetClient::NetClient(Network* net, int socket, const std::string& peer) {
+  _net = net;
+  client_socket = socket;
+  _peer = peer;
+  _busy = false;
+  _waiting_writer = false;
+  _closed = false;
   valid_commands.clear();
 
   // Valid commands - ATMD protocol version 2.0
@@ -76,12 +147,38 @@ Network::Network() {
   valid_commands.push_back("GET");
   valid_commands.push_back("MSR");
   valid_commands.push_back("EXT");
+
+  // Send mutex
+  _sub = NULL;
+  _stream = NULL;
+  _stream_stop = false;
+  int retval = rt_mutex_create(&_send_mutex, NULL);
+  if(retval)
+    rt_syslog(ATMD_ERR, "NetClient [NetClient]: failed to create send mutex (Code: %d).", retval);
+  _send_init = (retval == 0);
+}
+
+
+/* @fn NetClient::~NetClient()
+ * Client connection destructor: stop the subscription and close the socket.
+ */
+NetClient::~NetClient() {
+  if(_sub) {
+    // Unblock a stream task waiting on a dead connection
+    shutdown(client_socket, SHUT_RDWR);
+    unsubscribe();
+  }
+  if(_send_init)
+    rt_mutex_delete(&_send_mutex);
+  if(client_socket >= 0)
+    close(client_socket);
 }
 
 
 /* @fn Network::init()
  * This function initializes the server network interface. It creates the listening
- * socket, binds to it and begins to listen.
+ * socket, binds to it and begins to listen. Then it creates the epoll set and
+ * starts the command workers.
  *
  * @return Returns 0 on success, throws an exception on error.
  */
@@ -125,7 +222,7 @@ int Network::init() {
   }
 
   // Start to listen
-  if(listen(this->listen_socket, 1) == -1) {
+  if(listen(this->listen_socket, ATMD_NET_BACKLOG) == -1) {
     // Listen failed
     rt_syslog(ATMD_ERR, "Network [init]: failed listening on address %s (Error: %s).", this->address.c_str(), strerror(errno));
     close(this->listen_socket);
@@ -133,126 +230,548 @@ int Network::init() {
     throw(ATMD_ERR_LISTEN);
   }
 
+  // Event set with the listening socket and the wake up of the workers
+  this->epoll_fd = epoll_create(ATMD_NET_MAXEVENTS);
+  this->wake_fd = eventfd(0, EFD_NONBLOCK);
+  if(this->epoll_fd == -1 || this->wake_fd == -1) {
+    rt_syslog(ATMD_ERR, "Network [init]: failed to create the event set (Error: %s).", strerror(errno));
+    throw(ATMD_ERR_SOCK);
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = this->listen_socket;
+  int retval = epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->listen_socket, &ev);
+  ev.data.fd = this->wake_fd;
+  if(retval == 0)
+    retval = epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->wake_fd, &ev);
+  if(retval) {
+    rt_syslog(ATMD_ERR, "Network [init]: failed to add sockets to the event set (Error: %s).", strerror(errno));
+    throw(ATMD_ERR_SOCK);
+  }
+
+  // Command workers
+  std::string name = ATMD_NRT_NET_POOL;
+  retval = rt_mutex_create(&_mutex, (name + "_mutex").c_str());
+  if(retval == 0)
+    retval = rt_cond_create(&_work, (name + "_work").c_str());
+  if(retval) {
+    rt_syslog(ATMD_ERR, "Network [init]: failed to create the synchronization objects of the workers (Code: %d).", retval);
+    throw(ATMD_ERR_SOCK);
+  }
+  _init = true;
+
+  // The vector must not be resized once the tasks are running
+  _tasks.resize(ATMD_NET_WORKERS);
+  for(size_t i = 0; i < _tasks.size(); i++) {
+    char task_name[64];
+    snprintf(task_name, sizeof(task_name), "%s_%lu", name.c_str(), (unsigned long)i);
+    retval = rt_task_spawn(&(_tasks[i]), task_name, 0, 0, T_FPU|T_JOINABLE, Network::worker_task, (void*)this);
+    if(retval) {
+      rt_syslog(ATMD_ERR, "Network [init]: failed to spawn command worker %lu (Code: %d).", (unsigned long)i, retval);
+      _tasks.resize(i);
+      throw(ATMD_ERR_SOCK);
+    }
+  }
+
   rt_syslog(ATMD_INFO, "Network [init]: begin listening on address %s:%d.", this->address.c_str(), this->port);
   return 0;
 }
 
 
-/* @fn Network::accept_client()
- * This function loops waiting for a connection. In the meantime checks for the
- * terminate interrupt.
+/* @fn Network::run(VirtualBoard& board)
+ * Event loop: accept connections, read the commands of the clients and hand
+ * them to the workers, until the terminate interrupt is set.
  *
- * @return Return 0 on success, -1 on error (or terminate interrupt).
+ * @param board The board the commands act on.
+ * @return Return 0 on terminate interrupt, -1 on error.
  */
-int Network::accept_client() {
-  bool connection_ok = false;
-  struct sockaddr_in client_addr;
-  socklen_t client_addr_length = sizeof(client_addr);
-
-  // We set 25ms sleep between accept tries
-  struct timespec sleeptime;
-  sleeptime.tv_sec = 0;
-  sleeptime.tv_nsec = 25000000;
-
-  // We cycle until a valid connection is recieved or the terminate_interrupt is set.
-  while(!connection_ok && !terminate_interrupt) {
-    // We accept a connection
-    this->client_socket = accept(this->listen_socket, (struct sockaddr *)&client_addr, &client_addr_length);
-
-    if(this->client_socket == -1) {
-      // If errno is EAGAIN, ECONNABORTED or EINTR we try again after 25ms
-      if(errno == EAGAIN || errno == ECONNABORTED || errno == EINTR) {
-        nanosleep(&sleeptime, NULL);
+int Network::run(VirtualBoard& board) {
+  _board = &board;
+  struct epoll_event events[ATMD_NET_MAXEVENTS];
+
+  while(!terminate_interrupt) {
+    int n = epoll_wait(this->epoll_fd, events, ATMD_NET_MAXEVENTS, ATMD_NET_TIMEOUT);
+    if(n == -1) {
+      if(errno == EINTR)
         continue;
+      rt_syslog(ATMD_ERR, "Network [run]: epoll_wait failed (Error: %s).", strerror(errno));
+      return -1;
+    }
+
+    for(int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+
+      if(fd == this->listen_socket) {
+        accept_clients();
+
+      } else if(fd == this->wake_fd) {
+        uint64_t count;
+        if(read(this->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+          rt_syslog(ATMD_WARN, "Network [run]: failed to read wake up counter (Error: %s).", strerror(errno));
 
-      // An error occurred
       } else {
-        rt_syslog(ATMD_ERR, "Network [accept]: accept failed (Error: %s).", strerror(errno));
-        this->client_socket = -1;
-        return -1;
+        std::map<int, NetClient*>::iterator it = this->clients.find(fd);
+        if(it != this->clients.end())
+          client_event(it->second);
       }
+    }
+
+    reap_clients();
+  }
+
+  return 0;
+}
+
+
+/* @fn Network::accept_clients()
+ * Accept all the pending connections and add them to the event set.
+ */
+void Network::accept_clients() {
+  while(true) {
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_length = sizeof(client_addr);
+    int sock = accept(this->listen_socket, (struct sockaddr *)&client_addr, &client_addr_length);
+
+    if(sock == -1) {
+      if(errno != EAGAIN && errno != ECONNABORTED && errno != EINTR)
+        rt_syslog(ATMD_ERR, "Network [accept]: accept failed (Error: %s).", strerror(errno));
+      return;
+    }
+
+    // Accepted sockets do not inherit O_NONBLOCK: sends block, receives use MSG_DONTWAIT
+    char peer[64];
+    snprintf(peer, sizeof(peer), "%s:%d", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+
+    // Sends time out, so a client that stops reading cannot hold a worker
+    struct timeval sndtimeo;
+    sndtimeo.tv_sec = ATMD_NET_SNDTIMEO;
+    sndtimeo.tv_usec = 0;
+    if(setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &sndtimeo, sizeof(sndtimeo)))
+      rt_syslog(ATMD_WARN, "Network [accept]: failed to set the send timeout of connection from %s (Error: %s).", peer, strerror(errno));
+    NetClient* client = new NetClient(this, sock, peer);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = sock;
+    if(epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, sock, &ev)) {
+      rt_syslog(ATMD_ERR, "Network [accept]: failed to add connection from %s to the event set (Error: %s).", peer, strerror(errno));
+      delete client;
+      continue;
+    }
+    // The workers count the connected clients on EXT
+    rt_mutex_acquire(&_mutex, TM_INFINITE);
+    this->clients[sock] = client;
+    size_t connected = this->clients.size();
+    rt_mutex_release(&_mutex);
+
+    rt_syslog(ATMD_INFO, "Network [accept]: successfully accepted a connection from %s (%lu clients connected).", peer, (unsigned long)connected);
+  }
+}
+
+
+/* @fn Network::client_event(NetClient* client)
+ * Read the commands of a client and queue the client for a worker if it is
+ * not already being served.
+ *
+ * @param client The client.
+ */
+void Network::client_event(NetClient* client) {
+  std::vector<std::string> commands;
+  int retval = client->receive(commands);
+
+  rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(client->_closed) {
+    rt_mutex_release(&_mutex);
+    return;
+  }
+
+  for(size_t i = 0; i < commands.size(); i++)
+    client->_pending.push_back(commands[i]);
+
+  if(client->_pending.size() > ATMD_NET_MAXPENDING) {
+    rt_syslog(ATMD_ERR, "Network [client_event]: client %s has too many commands pending. Closing connection.", client->peer().c_str());
+    retval = -1;
+  }
+
+  if(retval) {
+    // Stop polling the socket, the client is released when no worker uses it
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, client->socket(), NULL);
+    client->_closed = true;
+    client->_pending.clear();
+  } else if(!client->_busy && client->_pending.size() > 0) {
+    client->_busy = true;
+    _queue.push_back(client);
+    rt_cond_signal(&_work);
+  }
+  rt_mutex_release(&_mutex);
+}
+
+
+/* @fn Network::reap_clients()
+ * Release the closed clients that no worker is using.
+ */
+void Network::reap_clients() {
+  rt_mutex_acquire(&_mutex, TM_INFINITE);
+  std::map<int, NetClient*>::iterator it = this->clients.begin();
+  while(it != this->clients.end()) {
+    NetClient* client = it->second;
+    if(client->_closed && !client->_busy) {
+      epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, client->socket(), NULL);
+      rt_syslog(ATMD_INFO, "Network [reap_clients]: closed connection from %s.", client->peer().c_str());
+      delete client;
+      this->clients.erase(it++);
     } else {
-      // We have a connection!
-      connection_ok = true;
+      ++it;
     }
   }
+  rt_mutex_release(&_mutex);
+}
+
 
-  // If we exited the cycle for a terminate_interrupt we should close the client_socket and return -1;
-  if(terminate_interrupt) {
-    if(this->client_socket > 0) {
-      close(client_socket);
-      this->client_socket = -1;
+/* @fn Network::close_clients()
+ * Stop the workers (after the commands they are running) and close all the
+ * client connections.
+ */
+void Network::close_clients() {
+  if(_init) {
+    if(rt_mutex_acquire(&_mutex, TM_INFINITE) == 0) {
+      _terminate = true;
+      rt_cond_broadcast(&_work);
+      rt_mutex_release(&_mutex);
     }
-    return -1;
+    for(size_t i = 0; i < _tasks.size(); i++)
+      rt_task_join(&(_tasks[i]));
+    _tasks.clear();
+    rt_cond_delete(&_work);
+    rt_mutex_delete(&_mutex);
+    _init = false;
   }
 
-  rt_syslog(ATMD_INFO, "Network [accept]: successfully accepted a connection from %s:%d.", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-  return 0;
+  std::map<int, NetClient*>::iterator it;
+  for(it = this->clients.begin(); it != this->clients.end(); ++it)
+    delete it->second;
+  this->clients.clear();
+  _queue.clear();
+  _parked.clear();
+
+  if(this->wake_fd >= 0)
+    close(this->wake_fd);
+  if(this->epoll_fd >= 0)
+    close(this->epoll_fd);
+  this->wake_fd = -1;
+  this->epoll_fd = -1;
 }
 
 
-/* @fn Network::get_command(std::string& command)
- * This function search for a valid command.
+/* @fn static void Network::worker_task(void *arg)
+ * Command worker: take a client from the queue and execute its next command.
+ * The client is queued again if it has more commands, so a client is served
+ * by one worker at a time. If the command lock is not available the client is
+ * parked until the lock is released, so waiting never occupies a worker.
  *
- * @param command A reference to a string variable for returning the recieved command.
- * @return Return 0 on success, -1 on empty recv buffer, throw an exception on error or on terminate interrupt.
+ * @param arg Cookie for the task (pointer to the network object).
  */
-int Network::get_command(std::string& command) {
+void Network::worker_task(void *arg) {
+
+  // Init rt_printf and rt_syslog
+  rt_print_auto_init(1);
+
+  // Cast back 'this' pointer
+  Network *pthis = (Network*)arg;
+
+  // Prevent this task to send SIGDEBUG when switching to secondary mode
+  rt_task_set_mode(T_WARNSW, 0, NULL);
+
+  rt_mutex_acquire(&(pthis->_mutex), TM_INFINITE);
+  while(true) {
+    while(!pthis->_terminate && pthis->_queue.empty())
+      rt_cond_wait(&(pthis->_work), &(pthis->_mutex), TM_INFINITE);
+    if(pthis->_terminate)
+      break;
+
+    NetClient* client = pthis->_queue.front();
+    pthis->_queue.pop_front();
+
+    if(client->_closed && client->_waiting_writer) {
+      // Closed while parked with an exclusive command: the shared commands
+      // parked behind it may run now
+      client->_waiting_writer = false;
+      pthis->_writers_waiting--;
+      pthis->unlock_command(ATMD_CMD_FREE);
+    }
+
+    if(!client->_closed) {
+      // The command stays pending while the client is parked
+      int cls = command_class(client->_pending.front());
+      if(!pthis->try_lock_command(client, cls)) {
+        pthis->_parked.push_back(client);
+        continue;
+      }
+
+      std::string command = client->_pending.front();
+      client->_pending.pop_front();
+      rt_mutex_release(&(pthis->_mutex));
+
+      pthis->execute(client, command);
+
+      rt_mutex_acquire(&(pthis->_mutex), TM_INFINITE);
+      pthis->unlock_command(cls);
+    }
+
+    if(client->_closed) {
+      // Let the event loop release the client
+      client->_busy = false;
+      pthis->wake_loop();
+    } else if(client->_pending.size() > 0) {
+      pthis->_queue.push_back(client);
+    } else {
+      client->_busy = false;
+    }
+  }
+  rt_mutex_release(&(pthis->_mutex));
+}
+
+
+/* @fn Network::drop_client(NetClient* client)
+ * Mark a client as closed from outside the command execution (e.g. when its
+ * stream fails). The event loop releases it once no worker uses it.
+ *
+ * @param client The client.
+ */
+void Network::drop_client(NetClient* client) {
+  rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(!client->_closed) {
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, client->socket(), NULL);
+    client->_closed = true;
+    client->_pending.clear();
+  }
+  rt_mutex_release(&_mutex);
+  wake_loop();
+}
+
+
+/* @fn Network::wake_loop()
+ * Wake up the event loop to release closed clients.
+ */
+void Network::wake_loop() {
+  uint64_t one = 1;
+  if(write(this->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    rt_syslog(ATMD_WARN, "Network [wake_loop]: failed to wake up the event loop (Error: %s).", strerror(errno));
+}
+
+
+/* @fn Network::execute(NetClient* client, const std::string& command)
+ * Execute a command of a client (the command lock is held by the caller). On
+ * errors of the connection (or on EXT) the client is marked as closed.
+ *
+ * @param client The client.
+ * @param command The command.
+ */
+void Network::execute(NetClient* client, const std::string& command) {
+#ifdef DEBUG
+  if(enable_debug)
+    // If debug is eanbled, we log all commands received
+    rt_syslog(ATMD_DEBUG, "Received command \"%s\" from %s", command.c_str(), client->peer().c_str());
+#endif
+
+  bool closed = false;
+
+  client->lock_send();
   try {
+    client->exec_command(command, *_board);
 
-    int retval;
-    do {
-      // First of all we check if there is something on the network
-      retval = this->fill_buffer();
+  } catch(int e) {
+    // Exception indicating an error on client connection (or EXT) so we close it
+    switch(e) {
+      case ATMD_ERR_CLOSED:
+      case ATMD_ERR_SEND:
+      case ATMD_ERR_TERM:
+        break;
+      default:
+        rt_syslog(ATMD_CRIT, "Network [execute]: unexpected exception %d.", e);
+    }
+    closed = true;
 
-      // If the buffer is not empty try to find a command
-      if(this->recv_buffer.size() > 0)
-        if(this->check_buffer(command) == 0)
-          // We have the command!
-          return 0;
+  } catch(std::exception& e) {
+    rt_syslog(ATMD_CRIT, "Network [execute]: caught an unexpected exception (%s).", e.what());
+    closed = true;
+
+  } catch(...) {
+    rt_syslog(ATMD_CRIT, "Network [execute]: unknown exception.");
+    closed = true;
+  }
+  client->unlock_send();
+
+  if(closed) {
+    rt_mutex_acquire(&_mutex, TM_INFINITE);
+    client->_closed = true;
+    client->_pending.clear();
+
+    // Count the clients still connected
+    size_t connected = 0;
+    std::map<int, NetClient*>::iterator it;
+    for(it = this->clients.begin(); it != this->clients.end(); ++it)
+      if(!it->second->_closed)
+        connected++;
+    rt_mutex_release(&_mutex);
+
+    // EXT ends only the session of the client, the board is reset when the last one leaves
+    if(command == "EXT" && connected == 0)
+      reset_board();
+  }
+}
 
-      if(terminate_interrupt)
-        throw(ATMD_ERR_TERM);
 
-    } while(retval != -1);
+/* @fn Network::reset_board()
+ * Stop the running measure, clear the measures and reset the configuration,
+ * as at the end of a session. Called with the exclusive command lock held.
+ */
+void Network::reset_board() {
+  rt_syslog(ATMD_INFO, "Network [reset_board]: last client left. Resetting the board.");
+
+  if(_board->status() == ATMD_STATUS_RUNNING)
+    _board->stop_measure();
+
+  // The measure list is shared with the data task
+  if(_board->acquire_lock()) {
+    rt_syslog(ATMD_ERR, "Network [reset_board]: error acquiring lock of measure struct.");
+  } else {
+    _board->clear_measures();
+    if(_board->release_lock())
+      rt_syslog(ATMD_ERR, "Network [reset_board]: error releasing lock of measure struct.");
+  }
+
+  _board->clear_config();
+}
 
-    // There's no data on the network, so we return to the main cycle...
-    return -1;
+
+/* @fn static Network::command_class(const std::string& command)
+ * Tell how a command synchronizes with the others:
+ *  - downloads and statistics work on refcounted snapshots of the measures,
+ *    and MSR STOP only sends a control command, so they take no lock and are
+ *    never delayed by other clients;
+ *  - commands changing configuration or the measure list are exclusive;
+ *  - everything else (GET, status, live views) is shared. Saves are shared
+ *    too, although they work on snapshots: they read the save configuration
+ *    (format, prefix, FTP host and credentials), that SET commands change.
+ *
+ * @param command The command.
+ * @return ATMD_CMD_FREE, ATMD_CMD_SHARED or ATMD_CMD_EXCLUSIVE.
+ */
+int Network::command_class(const std::string& command) {
+  if(command.compare(0, 3, "SET") == 0 || command.compare(0, 3, "EXT") == 0)
+    return ATMD_CMD_EXCLUSIVE;
+
+  if(command == "MSR START" || command == "MSR CLR" || command.compare(0, 7, "MSR DEL") == 0)
+    return ATMD_CMD_EXCLUSIVE;
+
+  if(command == "MSR STOP" || command.compare(0, 9, "MSR FETCH") == 0 || command.compare(0, 9, "MSR STAT ") == 0)
+    return ATMD_CMD_FREE;
+
+  return ATMD_CMD_SHARED;
+}
+
+
+/* @fn Network::try_lock_command(NetClient* client, int cls)
+ * Try to take the command lock (called with the mutex held). Once an exclusive
+ * command is parked, new shared commands are parked too until it has run, so
+ * clients polling with shared commands cannot starve configuration changes.
+ *
+ * @param client The client issuing the command.
+ * @param cls The command class.
+ * @return True if the lock was taken.
+ */
+bool Network::try_lock_command(NetClient* client, int cls) {
+  if(cls == ATMD_CMD_EXCLUSIVE) {
+    if(_writer || _readers > 0) {
+      if(!client->_waiting_writer) {
+        client->_waiting_writer = true;
+        _writers_waiting++;
+      }
+      return false;
+    }
+    if(client->_waiting_writer) {
+      client->_waiting_writer = false;
+      _writers_waiting--;
+    }
+    _writer = true;
+  } else if(cls == ATMD_CMD_SHARED) {
+    if(_writer || _writers_waiting > 0)
+      return false;
+    _readers++;
+  }
+  return true;
+}
+
+
+/* @fn Network::unlock_command(int cls)
+ * Release the command lock (called with the mutex held) and queue again the
+ * clients parked waiting for it. With ATMD_CMD_FREE only the parked clients
+ * are queued again, if the lock is free.
+ *
+ * @param cls The command class.
+ */
+void Network::unlock_command(int cls) {
+  if(cls == ATMD_CMD_EXCLUSIVE)
+    _writer = false;
+  else if(cls == ATMD_CMD_SHARED)
+    _readers--;
+
+  if(!_writer && _readers == 0 && _parked.size() > 0) {
+    _queue.insert(_queue.end(), _parked.begin(), _parked.end());
+    _parked.clear();
+    rt_cond_broadcast(&_work);
+  }
+}
+
+
+/* @fn NetClient::receive(std::vector<std::string>& commands)
+ * Receive all the data available on the connection and extract the complete
+ * commands.
+ *
+ * @param commands Output vector of the commands received.
+ * @return Return 0 on success, -1 if the connection was closed or failed.
+ */
+int NetClient::receive(std::vector<std::string>& commands) {
+  try {
+    // Read until there is no more data on the network
+    while(this->fill_buffer() == 0)
+      ;
 
   } catch(int e) {
     // Handle exceptions... the only thing that we can do here is to log what happened.
     switch(e) {
       case ATMD_ERR_RECV:
         // A recv call failed... errno should be still valid...
-        rt_syslog(ATMD_ERR, "Network [get_command]: recv failed (Error: %s).", strerror(errno));
+        rt_syslog(ATMD_ERR, "Network [receive]: recv failed (Error: %s).", strerror(errno));
         break;
       case ATMD_ERR_CLOSED:
-        rt_syslog(ATMD_ERR, "Network [get_command]: client closed the connection.");
-        break;
-      case ATMD_ERR_TERM:
-        rt_syslog(ATMD_ERR, "Network [get_command]: command recieving interrupted by HUP signal.");
+        rt_syslog(ATMD_INFO, "Network [receive]: client %s closed the connection.", _peer.c_str());
         break;
       default:
         // Unexpected exception... this should never happen!
-        rt_syslog(ATMD_CRIT, "Network [get_command]: unexpected exception %d.", e);
+        rt_syslog(ATMD_CRIT, "Network [receive]: unexpected exception %d.", e);
     }
-    // We pass the exception to the parent
-    throw(e);
-
-  } catch(...) {
-      rt_syslog(ATMD_ERR, "Network [get_command]: unhandled exception");
-      throw(ATMD_ERR_UNKNOWN_EX);
+    return -1;
   }
+
+  std::string command;
+  while(this->recv_buffer.size() > 0 && this->check_buffer(command) == 0)
+    commands.push_back(command);
+
+  return 0;
 }
 
 
-/* @fn Network::send_command(std::string command)
+/* @fn NetClient::send_command(std::string command)
  * This function send a command string to the network.
  *
  * @param command The command string.
  * @return Return 0 on success, -1 on error.
  */
-int Network::send_command(std::string command) {
+int NetClient::send_command(std::string command) {
   int retval;
 
   // We keep a copy of the original command for the logs
@@ -278,7 +797,7 @@ int Network::send_command(std::string command) {
     // The command was partially sent, we try to send what is left
     } else if(retval != -1 && retval < remaining) {
       rt_syslog(ATMD_WARN, "Network [send_command]: partially sent command \"%s\". Sent out %d bytes out of %d.", orig_command.c_str(), sent, (unsigned int) command.length());
-      sent = retval;
+      sent += retval;
       remaining = remaining - retval;
       continue;
 
@@ -288,7 +807,10 @@ int Network::send_command(std::string command) {
         if(errno == ECONNRESET || errno == EPIPE) {
           rt_syslog(ATMD_ERR, "Network [send_command]: remote connection closed.");
           throw(ATMD_ERR_CLOSED);
-        } else if (errno == EAGAIN || errno == EINTR) {
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          rt_syslog(ATMD_ERR, "Network [send_command]: client %s stalled for more than %d s. Closing connection.", _peer.c_str(), ATMD_NET_SNDTIMEO);
+          throw(ATMD_ERR_CLOSED);
+        } else if (errno == EINTR) {
           continue;
         }
         rt_syslog(ATMD_ERR, "Network [send_command]: 'send' failed with error \"%s\".", strerror(errno));
@@ -305,13 +827,13 @@ int Network::send_command(std::string command) {
 }
 
 
-/* @fn Network::check_buffer(std::string& command)
+/* @fn NetClient::check_buffer(std::string& command)
  * Private utility function for checking the receive buffer for a valid command.
  *
  * @param command A reference to the output variable.
  * @return Return 0 on success, -1 if there's no command.
  */
-int Network::check_buffer(std::string& command) {
+int NetClient::check_buffer(std::string& command) {
   std::vector<std::string>::iterator iter;
   size_t begin, end;
 
@@ -347,12 +869,12 @@ int Network::check_buffer(std::string& command) {
 }
 
 
-/* @fn Network::fill_buffer()
+/* @fn NetClient::fill_buffer()
  * Private utility function for filling the recv buffer
  *
  * @return Return 0 on success, -1 if there's no data. On error throw an exception.
  */
-int Network::fill_buffer() {
+int NetClient::fill_buffer() {
   char buffer[256];
   int retval;
 
@@ -377,7 +899,7 @@ int Network::fill_buffer() {
 }
 
 
-/* @fn Network::format_command(std::string format, ...)
+/* @fn NetClient::format_command(std::string format, ...)
  * This function takes a format string and a variable number of other inputs and
  * returns a formatted string object.
  *
@@ -385,7 +907,7 @@ int Network::fill_buffer() {
  * @param ... A variable list of arguments corresponding to specifiers in format string.
  * @return Return a string. Should never fail.
  */
-std::string Network::format_command(std::string format, ...) {
+std::string NetClient::format_command(std::string format, ...) {
   char *buffer;
   std::string output;
   va_list ap;
@@ -410,14 +932,332 @@ std::string Network::format_command(std::string format, ...) {
 }
 
 
-/* @fn Network::exec_command(std::string command, ATMDboard& board)
+/* @fn NetClient::send_binary(const void* data, size_t len)
+ * Send a block of binary data to the client, without any termination.
+ *
+ * @param data Pointer to the data.
+ * @param len Length of the data in bytes.
+ * @return Return 0 on success or throw an exception on error.
+ */
+int NetClient::send_binary(const void* data, size_t len) {
+  const char* ptr = (const char*)data;
+  size_t sent = 0;
+
+  while(sent < len) {
+    ssize_t retval = send(this->client_socket, ptr+sent, len-sent, MSG_NOSIGNAL);
+
+    if(retval == -1) {
+      if(errno == ECONNRESET || errno == EPIPE) {
+        rt_syslog(ATMD_ERR, "Network [send_binary]: remote connection closed.");
+        throw(ATMD_ERR_CLOSED);
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        rt_syslog(ATMD_ERR, "Network [send_binary]: client %s stalled for more than %d s. Closing connection.", _peer.c_str(), ATMD_NET_SNDTIMEO);
+        throw(ATMD_ERR_CLOSED);
+      } else if (errno != EINTR) {
+        rt_syslog(ATMD_ERR, "Network [send_binary]: 'send' failed with error \"%s\".", strerror(errno));
+        throw(ATMD_ERR_SEND);
+      }
+    } else {
+      sent += retval;
+    }
+
+    if(terminate_interrupt)
+      throw(ATMD_ERR_TERM);
+  }
+
+  return 0;
+}
+
+
+/* @fn NetClient::send_vector(struct iovec* iov, size_t n)
+ * Send a list of memory blocks with scatter/gather I/O, without copying them
+ * into a contiguous buffer. The iovec array is modified while sending.
+ *
+ * @param iov The memory blocks.
+ * @param n The number of blocks.
+ * @return Return 0 on success or throw an exception on error.
+ */
+int NetClient::send_vector(struct iovec* iov, size_t n) {
+  while(n > 0) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (n > IOV_MAX) ? IOV_MAX : n;
+
+    ssize_t retval = sendmsg(this->client_socket, &msg, MSG_NOSIGNAL);
+
+    if(retval == -1) {
+      if(errno == ECONNRESET || errno == EPIPE) {
+        rt_syslog(ATMD_ERR, "Network [send_vector]: remote connection closed.");
+        throw(ATMD_ERR_CLOSED);
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        rt_syslog(ATMD_ERR, "Network [send_vector]: client %s stalled for more than %d s. Closing connection.", _peer.c_str(), ATMD_NET_SNDTIMEO);
+        throw(ATMD_ERR_CLOSED);
+      } else if (errno != EINTR) {
+        rt_syslog(ATMD_ERR, "Network [send_vector]: 'sendmsg' failed with error \"%s\".", strerror(errno));
+        throw(ATMD_ERR_SEND);
+      }
+    } else {
+      // Skip the blocks sent and advance in the partially sent one
+      size_t done = retval;
+      while(n > 0 && done >= iov->iov_len) {
+        done -= iov->iov_len;
+        iov++;
+        n--;
+      }
+      if(n > 0) {
+        iov->iov_base = (char*)iov->iov_base + done;
+        iov->iov_len -= done;
+      }
+    }
+
+    if(terminate_interrupt)
+      throw(ATMD_ERR_TERM);
+  }
+
+  return 0;
+}
+
+
+/* @fn NetClient::send_measure(const Measure& meas, size_t first, size_t count)
+ * Send a range of starts of a measure in binary form (MSR FETCH). A text header
+ * "MSR FETCH <first> <starts> <events> <windows> <times> <nch> <tbin> <retrig> <bytes>"
+ * is followed by <bytes> bytes of frames: each frame is a FetchFrame followed
+ * by the column data. Columns are sent straight from the measure arenas (or
+ * from its spill mapping) and have the layout of the BINRAW file columns.
+ * START_INDEX and TIME_INDEX hold indexes into the whole measure: subtract
+ * their first value to index the CHANNEL/STOPTIME/RETRIG and WIN_* columns sent.
+ *
+ * @param meas The measure.
+ * @param first The first start.
+ * @param count The number of starts.
+ */
+void NetClient::send_measure(const Measure& meas, size_t first, size_t count) {
+  const uint64_t ev_first = meas.start_indexes()[first];
+  const uint64_t ev_last = meas.start_indexes()[first+count];
+  const uint64_t win_first = meas.time_indexes()[first];
+  const uint64_t win_last = meas.time_indexes()[first+count];
+
+  FetchFrame frames[ATMD_BIN_COLUMNS];
+  struct iovec iov[2*ATMD_BIN_COLUMNS];
+  size_t n = 0;
+  uint64_t bytes = 0;
+
+  // Column table: ID, element size, first element and number of elements
+  struct {
+    uint32_t column;
+    uint32_t width;
+    const void* ptr;
+    uint64_t elements;
+  } cols[ATMD_BIN_COLUMNS] = {
+    { ATMD_BIN_MEAS_BEGIN, sizeof(uint64_t), meas.begins(), meas.times() },
+    { ATMD_BIN_MEAS_TIME, sizeof(uint64_t), meas.durations(), meas.times() },
+    { ATMD_BIN_START_INDEX, sizeof(uint64_t), meas.start_indexes() + first, count + 1 },
+    { ATMD_BIN_START_ID, sizeof(uint32_t), meas.start_ids(), count },
+    { ATMD_BIN_TIME_INDEX, sizeof(uint64_t), meas.time_indexes() + first, count + 1 },
+    { ATMD_BIN_WIN_BEGIN, sizeof(uint64_t), meas.window_begins(), win_last - win_first },
+    { ATMD_BIN_WIN_TIME, sizeof(uint64_t), meas.window_times(), win_last - win_first },
+    { ATMD_BIN_CHANNEL, sizeof(int8_t), meas.channels(), ev_last - ev_first },
+    { ATMD_BIN_STOPTIME, sizeof(int32_t), meas.stoptimes(), ev_last - ev_first },
+    { ATMD_BIN_RETRIG, sizeof(uint32_t), meas.retrigs(), ev_last - ev_first }
+  };
+  const uint64_t offset[ATMD_BIN_COLUMNS] = { 0, 0, 0, first, 0, win_first, win_first, ev_first, ev_first, ev_first };
+
+  for(size_t i = 0; i < ATMD_BIN_COLUMNS; i++) {
+    frames[i].column = cols[i].column;
+    frames[i].width = cols[i].width;
+    frames[i].bytes = cols[i].elements * cols[i].width;
+    iov[n].iov_base = &(frames[i]);
+    iov[n].iov_len = sizeof(FetchFrame);
+    n++;
+    if(frames[i].bytes) {
+      iov[n].iov_base = (void*)((const char*)cols[i].ptr + offset[i] * cols[i].width);
+      iov[n].iov_len = frames[i].bytes;
+      n++;
+    }
+    bytes += sizeof(FetchFrame) + frames[i].bytes;
+  }
+
+  this->send_command(this->format_command("MSR FETCH %lu %lu %llu %llu %lu %lu %.6f %.6f %llu",
+                                          (unsigned long)first, (unsigned long)count,
+                                          (unsigned long long)(ev_last - ev_first), (unsigned long long)(win_last - win_first),
+                                          (unsigned long)meas.times(), (unsigned long)meas.nch(),
+                                          meas.get_tbin(), ATMD_RETRIG_PS, (unsigned long long)bytes));
+  this->send_vector(iov, n);
+}
+
+
+/* @fn NetClient::subscribe(StartStream& stream, uint64_t mask, uint32_t sample)
+ * Subscribe to the live starts and start the stream task.
+ *
+ * @param stream The start stream of the board.
+ * @param mask Channel mask (bit c-1 selects channel c).
+ * @param sample Send one start out of 'sample'.
+ * @return Return 0 on success, -1 on error.
+ */
+int NetClient::subscribe(StartStream& stream, uint64_t mask, uint32_t sample) {
+  if(_sub)
+    unsubscribe();
+
+  Subscription* sub = new Subscription(mask, sample, ATMD_STREAM_QUEUE);
+  if(stream.subscribe(sub)) {
+    delete sub;
+    return -1;
+  }
+  _sub = sub;
+  _stream = &stream;
+  _stream_stop = false;
+
+  int retval = rt_task_spawn(&_stream_task, NULL, 0, 0, T_FPU|T_JOINABLE, NetClient::stream_task, (void*)this);
+  if(retval) {
+    rt_syslog(ATMD_ERR, "NetClient [subscribe]: rt_task_spawn() failed to start the stream task (Code: %d).", retval);
+    _stream->unsubscribe(_sub);
+    delete _sub;
+    _sub = NULL;
+    return -1;
+  }
+
+  rt_syslog(ATMD_INFO, "NetClient [subscribe]: client %s subscribed to the live starts (mask 0x%llx, 1 in %u).", _peer.c_str(), (unsigned long long)mask, sub->sample());
+  return 0;
+}
+
+
+/* @fn NetClient::unsubscribe()
+ * Stop the stream task and drop the subscription. No frame is sent after the
+ * call returns.
+ */
+void NetClient::unsubscribe() {
+  if(_sub == NULL)
+    return;
+
+  _stream->unsubscribe(_sub);
+  _stream_stop = true;
+  rt_task_join(&_stream_task);
+  delete _sub;
+  _sub = NULL;
+  _stream = NULL;
+}
+
+
+/* @fn static void NetClient::stream_task(void *arg)
+ * Stream task: send the frames of the subscription as they are queued. Each
+ * frame is preceded by the text header "MSR SUB <bytes>". If a send fails the
+ * subscription is detached from the stream, the client is marked as closed and
+ * the event loop releases it.
+ *
+ * @param arg Cookie for the task (pointer to the client object).
+ */
+void NetClient::stream_task(void *arg) {
+
+  // Init rt_printf and rt_syslog
+  rt_print_auto_init(1);
+
+  // Cast back 'this' pointer
+  NetClient *pthis = (NetClient*)arg;
+
+  // Prevent this task to send SIGDEBUG when switching to secondary mode
+  rt_task_set_mode(T_WARNSW, 0, NULL);
+
+  const RTIME timeout = (RTIME)ATMD_NET_TIMEOUT * 1000000;
+  std::string frame;
+
+  while(!pthis->_stream_stop && !terminate_interrupt) {
+    int retval = pthis->_sub->pop(frame, timeout);
+    if(retval == -ETIMEDOUT)
+      continue;
+    if(retval) {
+      rt_syslog(ATMD_ERR, "NetClient [stream_task]: failed to get a frame (Code: %d).", retval);
+      break;
+    }
+
+    // Wait for the reply being sent, without blocking unsubscribe()
+    retval = -ETIMEDOUT;
+    while(retval == -ETIMEDOUT && !pthis->_stream_stop)
+      retval = rt_mutex_acquire(&(pthis->_send_mutex), timeout);
+    if(retval)
+      continue;
+
+    std::string head = pthis->format_command("MSR SUB %lu\r\n", (unsigned long)frame.size());
+    struct iovec iov[2];
+    iov[0].iov_base = (void*)head.data();
+    iov[0].iov_len = head.size();
+    iov[1].iov_base = (void*)frame.data();
+    iov[1].iov_len = frame.size();
+
+    bool failed = false;
+    try {
+      pthis->send_vector(iov, 2);
+    } catch(int) {
+      failed = true;
+    }
+    rt_mutex_release(&(pthis->_send_mutex));
+
+    if(failed) {
+      // Stop producing frames and let the event loop release the client
+      pthis->_stream->unsubscribe(pthis->_sub);
+      pthis->_net->drop_client(pthis);
+      break;
+    }
+  }
+}
+
+
+/* @fn NetClient::send_histogram(const Histogram& hist)
+ * Send a histogram. A text header "MSR HIST <nch> <nbins> <width> <offset> <bytes>"
+ * is followed by the bin counts as raw 32 bit unsigned integers in host byte
+ * order, channel after channel.
+ *
+ * @param hist The histogram.
+ */
+void NetClient::send_histogram(const Histogram& hist) {
+  this->send_command(this->format_command("MSR HIST %lu %u %u %u %lu", (unsigned long)hist.nch(), hist.nbins(), hist.width(), hist.offset(), (unsigned long)hist.bytes()));
+  if(hist.bytes())
+    this->send_binary(hist.data(), hist.bytes());
+}
+
+
+/* @fn NetClient::send_stat_starts(const std::vector<uint32_t>& stopcount, size_t width)
+ * Send the statistics of each start of a measure.
+ *
+ * @param stopcount The statistic rows (window time and stops per channel).
+ * @param width The number of values in each row.
+ */
+void NetClient::send_stat_starts(const std::vector<uint32_t>& stopcount, size_t width) {
+  size_t starts = stopcount.size() / width;
+  this->send_command(this->format_command("MSR STAT NUM %lu", (unsigned long)starts));
+  for(size_t i = 0; i < starts; i++) {
+    std::stringstream command(std::stringstream::out);
+    command << "MSR STAT " << i + 1;
+    for(size_t index = 0; index < width; index++)
+      command << " " << stopcount[i*width+index];
+    this->send_command(command.str());
+  }
+}
+
+
+/* @fn NetClient::send_stat_total(size_t starts, const std::vector<uint64_t>& stopsum)
+ * Send the cumulative statistics of a measure.
+ *
+ * @param starts The number of starts in the measure.
+ * @param stopsum The total window time and the total stops per channel.
+ */
+void NetClient::send_stat_total(size_t starts, const std::vector<uint64_t>& stopsum) {
+  std::stringstream command(std::stringstream::out);
+  command << "MSR STAT " << starts << " " << ((starts) ? stopsum[0] / starts : 0);
+  for(size_t index = 1; index < stopsum.size(); index++)
+    command << " " << stopsum[index];
+  this->send_command(command.str());
+}
+
+
+/* @fn NetClient::exec_command(std::string command, VirtualBoard& board)
  * This function get a command string and a reference to the board object on which the command should act.
  *
  * @param command The command string.
  * @param board A reference to the board object.
  * @return Return 0 on success or throw an exception on error.
  */
-int Network::exec_command(std::string command, VirtualBoard& board) {
+int NetClient::exec_command(std::string command, VirtualBoard& board) {
   std::string main_command, parameters;
   if(command.size() < 5) {
     main_command = command.substr(0, 3);
@@ -598,81 +1438,147 @@ int Network::exec_command(std::string command, VirtualBoard& board) {
       cmd_re.FullMatch(parameters, &txt);
 #ifdef DEBUG
       if(enable_debug)
-          rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting FTP username to \"%s\".", txt.c_str());
+          rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting FTP username to \"%s\".", txt.c_str());
+#endif
+
+      board.set_user(txt);
+      this->send_command("ACK");
+      return 0;
+    }
+
+    // Set password for FTP transfers
+    cmd_re = "PSW ([a-zA-Z0-9]+)";
+    if(cmd_re.FullMatch(parameters)) {
+      cmd_re.FullMatch(parameters, &txt);
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting FTP password.");
+#endif
+
+      board.set_password(txt);
+      this->send_command("ACK");
+      return 0;
+    }
+
+    // Set filename prefix for measure autorestart (with relative path...)
+    cmd_re = "PREFIX ([a-zA-Z0-9\\.\\_\\-\\/]+)";
+    if(cmd_re.FullMatch(parameters)) {
+      cmd_re.FullMatch(parameters, &txt);
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting autostart file prefix \"%s\".", txt.c_str());
+#endif
+
+      board.set_prefix(txt);
+      board.reset_counter();
+      this->send_command("ACK");
+      return 0;
+    }
+
+    // Set save format
+    cmd_re = "FORMAT (\\d+)";
+    if(cmd_re.FullMatch(parameters)) {
+      cmd_re.FullMatch(parameters, &val1);
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting autorestart save format to %d.", val1);
+#endif
+
+      board.set_format(val1);
+      this->send_command("ACK");
+      return 0;
+    }
+
+    // Set autosave
+    cmd_re = "AUTOSAVE (\\d+)";
+    if(cmd_re.FullMatch(parameters)) {
+      cmd_re.FullMatch(parameters, &val1);
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting autosave to %d starts.", val1);
 #endif
 
-      board.set_user(txt);
+      board.set_autosave(val1);
       this->send_command("ACK");
       return 0;
     }
 
-    // Set password for FTP transfers
-    cmd_re = "PSW ([a-zA-Z0-9]+)";
+    // Set rolling files (size in bytes and time in seconds, 0 to disable)
+    cmd_re = "ROLL (\\d+) (\\d+)";
     if(cmd_re.FullMatch(parameters)) {
-      cmd_re.FullMatch(parameters, &txt);
+      unsigned long long roll_bytes = 0;
+      cmd_re.FullMatch(parameters, &roll_bytes, &val1);
 #ifdef DEBUG
       if(enable_debug)
-        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting FTP password.");
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting rolling files to %llu bytes or %d seconds.", roll_bytes, val1);
 #endif
 
-      board.set_password(txt);
+      board.set_rolling(roll_bytes, val1);
       this->send_command("ACK");
       return 0;
     }
 
-    // Set filename prefix for measure autorestart (with relative path...)
-    cmd_re = "PREFIX ([a-zA-Z0-9\\.\\_\\-\\/]+)";
+    // Set monitor
+    cmd_re = "MONITOR (\\d+) (\\d+) ([a-zA-Z0-9\\.\\_\\-\\/]+)";
     if(cmd_re.FullMatch(parameters)) {
-      cmd_re.FullMatch(parameters, &txt);
+      cmd_re.FullMatch(parameters, &val1, &val2, &txt);
 #ifdef DEBUG
       if(enable_debug)
-        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting autostart file prefix \"%s\".", txt.c_str());
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting monitor parameters to saving every %d starts the last %d starts, to %s.", val1, val2, txt.c_str());
 #endif
 
-      board.set_prefix(txt);
-      board.reset_counter();
+      board.set_monitor(val1, val2, txt);
       this->send_command("ACK");
       return 0;
     }
 
-    // Set save format
-    cmd_re = "FORMAT (\\d+)";
+    // Set live histogram
+    cmd_re = "HIST (\\d+) (\\d+) (\\d+)";
     if(cmd_re.FullMatch(parameters)) {
-      cmd_re.FullMatch(parameters, &val1);
+      cmd_re.FullMatch(parameters, &val1, &val2, &val3);
 #ifdef DEBUG
       if(enable_debug)
-        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting autorestart save format to %d.", val1);
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting histogram to %u bins of %u ticks from tick %u.", val2, val1, val3);
 #endif
 
-      board.set_format(val1);
+      if(val1 == 0 || val2 > ATMD_HIST_MAXBINS) {
+        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_BAD_PARAM, network_strerror[ATMD_NETERR_BAD_PARAM]));
+        return 0;
+      }
+
+      board.set_histogram(val1, val2, val3);
       this->send_command("ACK");
       return 0;
     }
 
-    // Set autosave
-    cmd_re = "AUTOSAVE (\\d+)";
+    // Set coincidences
+    cmd_re = "COINC (\\d+) (\\d+) ([0-9,;]+)";
     if(cmd_re.FullMatch(parameters)) {
-      cmd_re.FullMatch(parameters, &val1);
+      cmd_re.FullMatch(parameters, &val1, &val2, &txt);
 #ifdef DEBUG
       if(enable_debug)
-        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting autosave to %d starts.", val1);
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting coincidences %s with tolerance %u and bin width %u.", txt.c_str(), val1, val2);
 #endif
 
-      board.set_autosave(val1);
+      std::vector< std::vector<uint8_t> > groups;
+      if(val2 == 0 || Coincidence::parse_groups(txt, 8*board.agents(), groups)) {
+        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_BAD_PARAM, network_strerror[ATMD_NETERR_BAD_PARAM]));
+        return 0;
+      }
+
+      board.set_coincidence(val1, val2, groups);
       this->send_command("ACK");
       return 0;
     }
 
-    // Set monitor
-    cmd_re = "MONITOR (\\d+) (\\d+) ([a-zA-Z0-9\\.\\_\\-\\/]+)";
-    if(cmd_re.FullMatch(parameters)) {
-      cmd_re.FullMatch(parameters, &val1, &val2, &txt);
+    // Reset coincidences
+    if(parameters == "NOCOINC") {
 #ifdef DEBUG
       if(enable_debug)
-        rt_syslog(ATMD_DEBUG, "Network [exec_command]: setting monitor parameters to saving %d starts, every %d starts, to %s.", val1, val2, txt.c_str());
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested to disable coincidences.");
 #endif
 
-      board.set_monitor(val1, val2, txt);
+      board.set_coincidence(0, 1, std::vector< std::vector<uint8_t> >());
       this->send_command("ACK");
       return 0;
     }
@@ -883,6 +1789,32 @@ int Network::exec_command(std::string command, VirtualBoard& board) {
       return 0;
     }
 
+    // Get rolling files limits
+    if(parameters == "ROLL") {
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested rolling files limits.");
+#endif
+
+      uint64_t roll_bytes = 0;
+      uint32_t roll_time = 0;
+      board.get_rolling(roll_bytes, roll_time);
+      this->send_command(this->format_command("VAL ROLL %llu %u", (unsigned long long)roll_bytes, roll_time));
+      return 0;
+    }
+
+    // Get packet capture counters
+    if(parameters == "CAPTURE") {
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested packet capture counters.");
+#endif
+
+      const PacketRecorder& rec = board.recorder();
+      this->send_command(this->format_command("VAL CAPTURE %d %llu %llu %llu", rec.enabled() ? 1 : 0, (unsigned long long)rec.packets(), (unsigned long long)rec.bytes(), (unsigned long long)rec.dropped()));
+      return 0;
+    }
+
     // Get monitor  save format
     if(parameters == "MONITOR") {
 #ifdef DEBUG
@@ -897,6 +1829,98 @@ int Network::exec_command(std::string command, VirtualBoard& board) {
       return 0;
     }
 
+    // Get coincidence configuration
+    if(parameters == "COINC") {
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested configured coincidences.");
+#endif
+
+      std::vector< std::vector<uint8_t> > groups;
+      board.get_coincidence(val1, val2, groups);
+      txt = Coincidence::format_groups(groups);
+      this->send_command(this->format_command("VAL COINC %u %u %s", val1, val2, (txt == "") ? "NONE" : txt.c_str()));
+      return 0;
+    }
+
+    // Get live histogram configuration
+    if(parameters == "HIST") {
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested configured histogram parameters.");
+#endif
+
+      board.get_histogram(val1, val2, val3);
+      this->send_command(this->format_command("VAL HIST %u %u %u", val1, val2, val3));
+      return 0;
+    }
+
+    // Get count rates over the last 1 s, 10 s and 60 s
+    if(parameters == "RATES") {
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested count rates.");
+#endif
+
+      // Rates are read lock free, without touching the measure lock
+      const size_t windows[3] = { 1000000000 / ATMD_RATE_BUCKET, 10000000000ULL / ATMD_RATE_BUCKET, 60000000000ULL / ATMD_RATE_BUCKET };
+      double start_rate[3], live[3];
+      std::vector<double> ch_rates[3];
+      for(size_t i = 0; i < 3; i++)
+        board.rates(windows[i], start_rate[i], live[i], ch_rates[i]);
+
+      std::stringstream reply(std::stringstream::out);
+      reply.setf(std::ios::fixed);
+      reply.precision(1);
+      reply << "VAL RATES " << board.rate_channels();
+      for(size_t i = 0; i < 3; i++)
+        reply << " " << start_rate[i];
+      reply.precision(4);
+      for(size_t i = 0; i < 3; i++)
+        reply << " " << live[i];
+      reply.precision(1);
+      for(size_t ch = 0; ch < board.rate_channels(); ch++)
+        for(size_t i = 0; i < 3; i++)
+          reply << " " << ch_rates[i][ch];
+      this->send_command(reply.str());
+      return 0;
+    }
+
+    // Get autosave writer queue status
+    if(parameters == "SAVEQUEUE") {
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested autosave queue status.");
+#endif
+
+      WriteStats st;
+      if(board.save_stats(st)) {
+        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_LOCK, network_strerror[ATMD_NETERR_LOCK]));
+        return 0;
+      }
+
+      this->send_command(this->format_command("VAL SAVEQUEUE %lu %lu %lu %llu %llu %llu %.3f %.3f",
+                                              (unsigned long)st.depth, (unsigned long)st.capacity, (unsigned long)st.max_depth,
+                                              (unsigned long long)st.written, (unsigned long long)st.failed, (unsigned long long)st.stalls,
+                                              st.last_latency / 1e6, st.avg_latency / 1e6));
+      return 0;
+    }
+
+    // Get memory used by stored measures
+    if(parameters == "MEMORY") {
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested memory usage of stored measures.");
+#endif
+
+      // Both are computed on a snapshot, without the measure lock
+      unsigned long resident = board.resident_bytes();
+      unsigned long spilled = board.spilled_bytes();
+
+      this->send_command(this->format_command("VAL MEMORY %lu %lu %lu", resident, spilled, (unsigned long)board.config().memlimit()));
+      return 0;
+    }
+
 
   // Measurement MSR commands
   } else if(main_command == "MSR") {
@@ -1010,37 +2034,19 @@ int Network::exec_command(std::string command, VirtualBoard& board) {
     if(parameters == "LST" || parameters == "LIST") {
 #ifdef DEBUG
       if(enable_debug)
-        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested the list of unsaved measures. List contained %lu measures.", board.measures());
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested the list of unsaved measures.");
 #endif
 
-      // Acquire measure lock
-      if(board.acquire_lock()) {
-        rt_syslog(ATMD_ERR, "Network [exec_command]: error acquiring lock of measure struct.");
-        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_LOCK, network_strerror[ATMD_NETERR_LOCK]));
-        return 0;
-      }
-
-      if(board.measures() > 0) {
-        this->send_command(this->format_command("MSR LST NUM %u", board.measures()));
-        for(size_t i = 0; i < board.measures(); i++) {
-          uint32_t starts;
-          if(board.stat_measure(i, starts)) {
-            this->send_command(this->format_command("MSR LST %u ERR", i));
-          } else {
-            this->send_command(this->format_command("MSR LST %u %u", i, starts));
-          }
-        }
+      // List a snapshot of the measures, so the data task is never blocked while we send
+      MeasureSnapshot snap = board.snapshot();
+      if(snap.size() > 0) {
+        this->send_command(this->format_command("MSR LST NUM %lu", (unsigned long)snap.size()));
+        for(size_t i = 0; i < snap.size(); i++)
+          this->send_command(this->format_command("MSR LST %lu %u", (unsigned long)i, snap[i].count_starts()));
       } else {
         this->send_command("MSR LST NUM 0");
       }
 
-      // Release lock
-      if(board.release_lock()) {
-        rt_syslog(ATMD_ERR, "Network [exec_command]: error releasing lock of measure struct.");
-        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_LOCK, network_strerror[ATMD_NETERR_LOCK]));
-        return 0;
-      }
-
       return 0;
     }
 
@@ -1053,31 +2059,196 @@ int Network::exec_command(std::string command, VirtualBoard& board) {
         rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested to save measure %u to file \"%s\"", val1, txt.c_str());
 #endif
 
-      // Acquire measure lock
-      if(board.acquire_lock()) {
-        rt_syslog(ATMD_ERR, "Network [exec_command]: error acquiring lock of measure struct.");
-        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_LOCK, network_strerror[ATMD_NETERR_LOCK]));
-        return 0;
+      // The measure is saved from a snapshot, without the measure lock
+      if(board.save_measure(val1, txt)) {
+        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_SAV, network_strerror[ATMD_NETERR_SAV]));
+      } else {
+        this->send_command("ACK");
       }
 
-      if(board.save_measure(val1, txt)) {
+      return 0;
+    }
+
+    // Save all measures command
+    cmd_re = "SAVEALL ([a-zA-Z0-9\\.\\_\\-\\/]+)";
+    if(cmd_re.FullMatch(parameters)) {
+      cmd_re.FullMatch(parameters, &txt);
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested to save all measures with prefix \"%s\"", txt.c_str());
+#endif
+
+      // Measures are saved in parallel from a snapshot, progress is sent as they complete
+      SaveAllProgress progress(this);
+      size_t failed = 0;
+      int retval = board.save_all(txt, &progress, failed);
+
+      // The client failed while receiving the progress
+      if(progress.error())
+        throw(progress.error());
+
+      if(retval || failed > 0) {
         this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_SAV, network_strerror[ATMD_NETERR_SAV]));
       } else {
         this->send_command("ACK");
       }
 
-      // Release lock
-      if(board.release_lock()) {
-        rt_syslog(ATMD_ERR, "Network [exec_command]: error releasing lock of measure struct.");
-        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_LOCK, network_strerror[ATMD_NETERR_LOCK]));
+      return 0;
+    }
+
+    // Live histogram of the current measure
+    if(parameters == "HIST") {
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested live histogram.");
+#endif
+
+      // The live histogram is double-buffered, so we do not need the measure lock
+      Histogram hist;
+      if(board.live_histogram(hist) || !hist.enabled()) {
+        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_HIST, network_strerror[ATMD_NETERR_HIST]));
+        return 0;
+      }
+
+      this->send_histogram(hist);
+      return 0;
+    }
+
+    // Live coincidence counts
+    if(parameters == "COINC") {
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested live coincidences.");
+#endif
+
+      Coincidence coinc;
+      if(board.live_coincidence(coinc) || !coinc.enabled()) {
+        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_COINC, network_strerror[ATMD_NETERR_COINC]));
+        return 0;
+      }
+
+      this->send_command(this->format_command("MSR COINC NUM %lu %llu %u %u %u", (unsigned long)coinc.groups(), (unsigned long long)coinc.starts(), coinc.tolerance(), coinc.width(), coinc.nbins()));
+      for(size_t i = 0; i < coinc.groups(); i++) {
+        std::vector< std::vector<uint8_t> > grp(1, coinc.group(i));
+        this->send_command(this->format_command("MSR COINC %lu %s %llu", (unsigned long)i, Coincidence::format_groups(grp).c_str(), (unsigned long long)coinc.count(i)));
+      }
+      return 0;
+    }
+
+    // Live coincidence dt histogram
+    cmd_re = "COINC HIST (\\d+)";
+    if(cmd_re.FullMatch(parameters)) {
+      cmd_re.FullMatch(parameters, &val1);
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested dt histogram of coincidence group %u.", val1);
+#endif
+
+      Coincidence coinc;
+      if(board.live_coincidence(coinc) || val1 >= coinc.groups()) {
+        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_COINC, network_strerror[ATMD_NETERR_COINC]));
+        return 0;
+      }
+
+      size_t bytes = coinc.nbins() * sizeof(uint32_t);
+      this->send_command(this->format_command("MSR COINC HIST %u %u %u %u %lu", val1, coinc.nbins(), coinc.width(), coinc.tolerance(), (unsigned long)bytes));
+      this->send_binary(coinc.hist(val1), bytes);
+      return 0;
+    }
+
+    // Histogram of a stored measure
+    cmd_re = "HIST (\\d+)";
+    if(cmd_re.FullMatch(parameters)) {
+      cmd_re.FullMatch(parameters, &val1);
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested histogram of measure %u.", val1);
+#endif
+
+      Histogram hist;
+      int retval = board.measure_histogram(val1, hist);
+
+      if(retval || !hist.enabled()) {
+        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_HIST, network_strerror[ATMD_NETERR_HIST]));
+        return 0;
+      }
+
+      this->send_histogram(hist);
+      return 0;
+    }
+
+    // Subscribe to the live starts
+    std::string sub_mask, sub_sample;
+    cmd_re = "SUBSCRIBE(?: (0[xX][0-9a-fA-F]+|\\d+))?(?: (\\d+))?";
+    if(cmd_re.FullMatch(parameters)) {
+      cmd_re.FullMatch(parameters, &sub_mask, &sub_sample);
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested to subscribe to the live starts.");
+#endif
+
+      // Default: all channels, all starts
+      uint64_t mask = (sub_mask != "") ? strtoull(sub_mask.c_str(), NULL, 0) : ~((uint64_t)0);
+      uint32_t sample = (sub_sample != "") ? strtoul(sub_sample.c_str(), NULL, 10) : 1;
+      if(sample == 0)
+        sample = 1;
+
+      // The reply is sent before the first frame, as we hold the send mutex
+      if(this->subscribe(board.stream(), mask, sample)) {
+        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_SUBSCRIBE, network_strerror[ATMD_NETERR_SUBSCRIBE]));
+      } else {
+        this->send_command(this->format_command("MSR SUBSCRIBE 0x%llx %u %u %lu %.6f %.6f", (unsigned long long)mask, sample, ATMD_STREAM_QUEUE, (unsigned long)(8*board.agents()), board.get_tbin(), ATMD_RETRIG_PS));
+      }
+
+      return 0;
+    }
+
+    // Stop the live starts
+    if(parameters == "UNSUBSCRIBE") {
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested to unsubscribe from the live starts.");
+#endif
+
+      this->unsubscribe();
+      this->send_command("ACK");
+      return 0;
+    }
+
+    // Binary download of a measure
+    std::string fetch_first, fetch_count;
+    cmd_re = "FETCH (\\d+)(?: (\\d+))?(?: (\\d+))?";
+    if(cmd_re.FullMatch(parameters)) {
+      cmd_re.FullMatch(parameters, &val1, &fetch_first, &fetch_count);
+#ifdef DEBUG
+      if(enable_debug)
+        rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested to fetch measure %u.", val1);
+#endif
+
+      // The snapshot keeps the measure alive while it is sent, without the measure lock
+      MeasureSnapshot snap = board.snapshot();
+      if(val1 >= snap.size()) {
+        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_FETCH, network_strerror[ATMD_NETERR_FETCH]));
         return 0;
       }
 
+      const Measure& meas = snap[val1];
+      size_t starts = meas.count_starts();
+      size_t first = (fetch_first != "") ? strtoul(fetch_first.c_str(), NULL, 10) : 0;
+      if(first > starts) {
+        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_FETCH, network_strerror[ATMD_NETERR_FETCH]));
+        return 0;
+      }
+      size_t count = starts - first;
+      if(fetch_count != "")
+        count = std::min(count, (size_t)strtoul(fetch_count.c_str(), NULL, 10));
+
+      this->send_measure(meas, first, count);
       return 0;
     }
 
     // Send to client measure statistics
-    std::vector< std::vector<uint32_t> > stopcount;
+    std::vector<uint32_t> stopcount;
     std::string modifier = "", win_start = "", win_ampl = "";
     cmd_re = "STAT (\\-?)(\\d+) ([0-9\\.\\,]+[umsMh]{1}) ([0-9\\.\\,]+[umsMh]{1})";
     if(cmd_re.FullMatch(parameters)) {
@@ -1087,53 +2258,30 @@ int Network::exec_command(std::string command, VirtualBoard& board) {
         rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested stats of measure %u with window (s = %s, a = %s).", val1, win_start.c_str(), win_ampl.c_str());
 #endif
 
-      // Acquire measure lock
-      if(board.acquire_lock()) {
-        rt_syslog(ATMD_ERR, "Network [exec_command]: error acquiring lock of measure struct.");
-        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_LOCK, network_strerror[ATMD_NETERR_LOCK]));
-        return 0;
-      }
+      // Get stats of stops (from a snapshot, without the measure lock)
+      int retval = board.stat_stops(val1, stopcount, win_start, win_ampl);
 
-      // Get stats of stops
-      if(board.stat_stops(val1, stopcount, win_start, win_ampl)) {
+      if(retval) {
         this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_STAT, network_strerror[ATMD_NETERR_STAT]));
 
       } else {
+        size_t width = 1+8*board.agents();
+        size_t starts = stopcount.size() / width;
+
         if(modifier == "-") {
           // Asked for cumulative stats, sum up all starts!
-          std::vector<uint32_t> stopsum(8*board.agents(),0);
-          uint64_t mean_window = 0;
-          for(std::vector< std::vector<uint32_t> >::iterator iter = stopcount.begin(); iter!=stopcount.end(); ++iter) {
-            for(size_t index = 0; index < 8*board.agents(); index++)
-              stopsum[index] += iter->at(index+1);
-            mean_window += iter->at(0);
-          }
-          std::stringstream command(std::stringstream::out);
-          command << "MSR STAT " << stopcount.size() << " " << mean_window / stopcount.size();
-          for(size_t index = 0; index < 8*board.agents(); index++)
-            command << " " << stopsum.at(index);
-          this->send_command(command.str());
+          std::vector<uint64_t> stopsum(width,0);
+          for(size_t i = 0; i < starts; i++)
+            for(size_t index = 0; index < width; index++)
+              stopsum[index] += stopcount[i*width+index];
+          this->send_stat_total(starts, stopsum);
 
         } else {
           // Asked for separate stats for each start
-          this->send_command(this->format_command("MSR STAT NUM %u", stopcount.size()));
-          for(std::vector< std::vector<uint32_t> >::iterator iter = stopcount.begin(); iter!=stopcount.end(); ++iter) {
-            std::stringstream command(std::stringstream::out);
-            command << "MSR STAT " << iter - stopcount.begin() + 1 << " " << iter->at(0);
-            for(size_t index = 0; index < 8*board.agents(); index++)
-              command << " " << iter->at(index+1);
-            this->send_command(command.str());
-          }
+          this->send_stat_starts(stopcount, width);
         }
       }
 
-      // Release lock
-      if(board.release_lock()) {
-        rt_syslog(ATMD_ERR, "Network [exec_command]: error releasing lock of measure struct.");
-        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_LOCK, network_strerror[ATMD_NETERR_LOCK]));
-        return 0;
-      }
-
       return 0;
     }
 
@@ -1145,50 +2293,23 @@ int Network::exec_command(std::string command, VirtualBoard& board) {
         rt_syslog(ATMD_DEBUG, "Network [exec_command]: client requested stats of measure %u.", val1);
 #endif
 
-      // Acquire measure lock
-      if(board.acquire_lock()) {
-        rt_syslog(ATMD_ERR, "Network [exec_command]: error acquiring lock of measure struct.");
-        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_LOCK, network_strerror[ATMD_NETERR_LOCK]));
-        return 0;
-      }
+      // Get stats of stops (counters are maintained at ingest, so this is only a copy from a snapshot)
+      int retval;
+      uint32_t starts = 0;
+      std::vector<uint64_t> stopsum;
+      if(modifier == "-")
+        retval = board.stat_total(val1, starts, stopsum);
+      else
+        retval = board.stat_stops(val1, stopcount);
 
-      // Get stats of stops
-      if(board.stat_stops(val1, stopcount)) {
+      if(retval) {
         this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_STAT, network_strerror[ATMD_NETERR_STAT]));
 
       } else {
-        if(modifier == "-") {
-          std::vector<uint32_t> stopsum(8*board.agents(),0);
-          uint64_t mean_window = 0;
-          for(std::vector< std::vector<uint32_t> >::iterator iter = stopcount.begin(); iter!=stopcount.end(); ++iter) {
-            for(size_t index = 0; index < 8*board.agents(); index++)
-              stopsum[index] += iter->at(index+1);
-            mean_window += iter->at(0);
-          }
-          std::stringstream command(std::stringstream::out);
-          command << "MSR STAT " << stopcount.size() << " " << mean_window / stopcount.size();
-          for(size_t index = 0; index < 8*board.agents(); index++)
-            command << " " << stopsum.at(index);
-          this->send_command(command.str());
-
-        } else {
-          this->send_command(this->format_command("MSR STAT NUM %u", stopcount.size()));
-
-          for(std::vector< std::vector<uint32_t> >::iterator iter = stopcount.begin(); iter!=stopcount.end(); ++iter) {
-            std::stringstream command(std::stringstream::out);
-            command << "MSR STAT " << iter - stopcount.begin() + 1 << " " << iter->at(0);
-            for(size_t index = 0; index < 8*board.agents(); index++)
-              command << " " << iter->at(index+1);
-            this->send_command(command.str());
-          }
-        }
-      }
-
-      // Release lock
-      if(board.release_lock()) {
-        rt_syslog(ATMD_ERR, "Network [exec_command]: error releasing lock of measure struct.");
-        this->send_command(this->format_command("ERR %d:%s", ATMD_NETERR_LOCK, network_strerror[ATMD_NETERR_LOCK]));
-        return 0;
+        if(modifier == "-")
+          this->send_stat_total(starts, stopsum);
+        else
+          this->send_stat_starts(stopcount, 1+8*board.agents());
       }
 
       return 0;
@@ -1258,28 +2379,8 @@ int Network::exec_command(std::string command, VirtualBoard& board) {
 
 
   } else if(main_command == "EXT") {
-    // Terminate client session
-    // As first thing, we need to check the board status and eventually stop a running measure.
-    switch(board.status()) {
-      case ATMD_STATUS_RUNNING:
-        board.stop_measure();
-        break;
-
-      case ATMD_STATUS_IDLE:
-      case ATMD_STATUS_ERR:
-      case ATMD_STATUS_BOOT:
-        break;
-
-      default:
-        break;
-    }
-
-    // Then we clear all measures...
-    board.clear_measures();
-
-    // ... and we reset board configuration
-    board.clear_config();
-
+    // Terminate client session. Other clients may still be using the board,
+    // so the board is reset by Network only when the last client leaves.
     // We close the connection throwing an exception
     throw(ATMD_ERR_CLOSED);
 
@@ -25,9 +25,21 @@
 // Network constants
 #define ATMD_DEF_PORT       2606
 #define ATMD_DEF_LISTEN     "0.0.0.0"
+#define ATMD_NET_BACKLOG    16        // Pending connections
+#define ATMD_NET_MAXEVENTS  32        // Events handled per epoll_wait()
+#define ATMD_NET_TIMEOUT    250       // Check period of the termination interrupt (ms)
+#define ATMD_NET_MAXPENDING 256       // Commands queued by a client before it is dropped
+#define ATMD_NET_SNDTIMEO   10        // Send stall (s) after which a client is dropped
+
+// Command classes
+#define ATMD_CMD_FREE       0         // Commands on snapshots, without the command lock
+#define ATMD_CMD_SHARED     1         // Read-only commands, run concurrently
+#define ATMD_CMD_EXCLUSIVE  2         // Commands changing configuration or state
 
 // Global
 #include <vector>
+#include <deque>
+#include <map>
 #include <string>
 #include <stdarg.h>
 #include <stdint.h>
@@ -35,48 +47,80 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <pcrecpp.h>
 
+// Xenomai
+#include <native/task.h>
+#include <native/mutex.h>
+#include <native/cond.h>
 
 // Local
 #include "common.h"
 #include "atmd_virtualboard.h"
+#include "atmd_binfile.h"
 
 
-/* @class Network
- * Class to manage client connections
+/* @struct FetchFrame
+ * Header of a column sent by MSR FETCH, followed by 'bytes' bytes of data.
  */
-class Network {
+struct FetchFrame {
+  uint32_t column;                    // Column ID (ATMD_BIN_*)
+  uint32_t width;                     // Size of the elements in bytes
+  uint64_t bytes;                     // Size of the data
+};
+
+
+// Declare class Network for NetClient
+class Network;
+
+
+/* @class NetClient
+ * A client connection: receive buffer, command parser and execution. A client
+ * subscribed to the live starts has a stream task pushing the frames; sends are
+ * serialized by a mutex so that frames never split a command reply.
+ */
+class NetClient {
   public:
-  Network();
-  ~Network() { if(listen_socket >= 0) close(listen_socket); };
+  NetClient(Network* net, int socket, const std::string& peer);
+  ~NetClient();
 
-  // Network initialization
-  int init();
-  int accept_client();
-  void close_client() { if(this->client_socket >= 0) close(this->client_socket); this->client_socket = -1; };
+  int socket()const { return client_socket; };
+  const std::string& peer()const { return _peer; };
+
+  // Receive the available data and extract the complete commands
+  int receive(std::vector<std::string>& commands);
 
   // Command managing
-  int get_command(string& command);
   int exec_command(string command, VirtualBoard& board);
   int send_command(string command);
+  int send_binary(const void* data, size_t len);
+  int send_vector(struct iovec* iov, size_t n);
   std::string format_command(std::string format, ...);
 
-  // Interfaces for connection parameters
-  void set_address(std::string address) { this->address = address; };
-  string get_address() { return this->address; };
-  void set_port(uint16_t port) { this->port = port; };
-  uint16_t get_port() { return this->port; };
+  // Serialize the sends of the command replies and of the stream frames
+  void lock_send() { if(_send_init) rt_mutex_acquire(&_send_mutex, TM_INFINITE); };
+  void unlock_send() { if(_send_init) rt_mutex_release(&_send_mutex); };
+
+  // Live start subscription
+  int subscribe(StartStream& stream, uint64_t mask, uint32_t sample);
+  void unsubscribe();
+  bool subscribed()const { return (_sub != NULL); };
 
   private:
-  // Connection parameters
-  std::string address;
-  uint16_t port;
+  NetClient(const NetClient&);
+  NetClient& operator=(const NetClient&);
 
-  // Connection sockets
-  int listen_socket;
+  // Server owning the connection
+  Network* _net;
+
+  // Connection socket
   int client_socket;
+  std::string _peer;
 
   // Valid command beginnings
   std::vector<std::string> valid_commands;
@@ -89,6 +133,111 @@ class Network {
 
   // Utility function that check the buffer to find a valid command
   int check_buffer(std::string& command);
+
+  // Utility functions to send measure statistics
+  void send_stat_starts(const std::vector<uint32_t>& stopcount, size_t width);
+  void send_stat_total(size_t starts, const std::vector<uint64_t>& stopsum);
+
+  // Utility function to send a histogram
+  void send_histogram(const Histogram& hist);
+
+  // Utility function to send a range of starts of a measure in binary form
+  void send_measure(const Measure& meas, size_t first, size_t count);
+
+  // Stream task: send the frames of the subscription
+  static void stream_task(void *arg);
+
+  // Send mutex
+  RT_MUTEX _send_mutex;
+  bool _send_init;
+
+  // Live start subscription
+  Subscription* _sub;
+  StartStream* _stream;
+  RT_TASK _stream_task;
+  volatile bool _stream_stop;
+
+  // Scheduling state (protected by the Network mutex)
+  std::deque<std::string> _pending;   // Commands waiting to be executed
+  bool _busy;                         // A worker owns the client
+  bool _closed;                       // Connection closed, to be released
+  bool _waiting_writer;               // Parked with an exclusive command
+
+  friend class Network;
+};
+
+
+/* @class Network
+ * Server of the client connections. The listening socket and the clients are
+ * watched by an epoll event loop, which parses the commands of each client.
+ * Commands are executed by a pool of worker tasks, one command at a time per
+ * client so that answers keep their order; a long command (like a save)
+ * therefore delays only its own client. Commands working on snapshots take no
+ * lock, read-only commands run concurrently and commands changing
+ * configuration or state run alone. A client whose command must wait for the
+ * lock is parked without holding a worker.
+ */
+class Network {
+  public:
+  Network();
+  ~Network() { close_clients(); if(listen_socket >= 0) close(listen_socket); };
+
+  // Network initialization
+  int init();
+
+  // Serve the clients until the termination interrupt
+  int run(VirtualBoard& board);
+
+  // Stop the workers and close all the connections
+  void close_clients();
+
+  // Mark a client as closed (from its stream task)
+  void drop_client(NetClient* client);
+
+  // Interfaces for connection parameters
+  void set_address(std::string address) { this->address = address; };
+  string get_address() { return this->address; };
+  void set_port(uint16_t port) { this->port = port; };
+  uint16_t get_port() { return this->port; };
+
+  private:
+  // Connection parameters
+  std::string address;
+  uint16_t port;
+
+  // Sockets
+  int listen_socket;
+  int epoll_fd;
+  int wake_fd;                        // eventfd signalled when a worker closes a client
+
+  // Clients by socket
+  std::map<int, NetClient*> clients;
+
+  // Event loop helpers
+  void accept_clients();
+  void client_event(NetClient* client);
+  void reap_clients();
+
+  // Command execution
+  static void worker_task(void *arg);
+  void execute(NetClient* client, const std::string& command);
+  static int command_class(const std::string& command);
+  bool try_lock_command(NetClient* client, int cls);
+  void unlock_command(int cls);
+  void wake_loop();
+  void reset_board();
+
+  VirtualBoard* _board;
+  RT_MUTEX _mutex;
+  RT_COND _work;                      // Clients waiting for a worker
+  std::deque<NetClient*> _queue;
+  std::deque<NetClient*> _parked;     // Clients waiting for the command lock
+  size_t _readers;                    // Shared commands running
+  bool _writer;                       // Exclusive command running
+  size_t _writers_waiting;            // Exclusive commands parked (they go before new shared ones)
+  bool _terminate;
+  bool _init;
+  std::vector<RT_TASK> _tasks;
 };
 
 #endif
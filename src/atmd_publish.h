@@ -0,0 +1,120 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Published buffer header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_PUBLISH_H
+#define ATMD_PUBLISH_H
+
+// Global
+#include <errno.h>
+
+// Xenomai
+#include <native/mutex.h>
+#include <native/timer.h>
+
+
+/* @class Published
+ * Second buffer of a double-buffered object. The owner accumulates into its own
+ * copy and from time to time publishes it here; readers copy the published
+ * object out. Publishing only tries to take the mutex, so a slow reader can
+ * delay a publication but never blocks the writer.
+ */
+template <typename T> class Published {
+public:
+  Published() : _init(false) {};
+  ~Published() { if(_init) rt_mutex_delete(&_mutex); };
+
+  // Create the mutex
+  int init(const char* name) {
+    int retval = rt_mutex_create(&_mutex, name);
+    if(retval == 0)
+      _init = true;
+    return retval;
+  };
+
+  // Copy 'obj' into the published buffer. Return false if a reader held the buffer.
+  bool publish(const T& obj) {
+    if(rt_mutex_acquire(&_mutex, TM_NONBLOCK))
+      return false;
+    _data = obj;
+    rt_mutex_release(&_mutex);
+    return true;
+  };
+
+  // Copy the published buffer into 'obj'. Return 0 on success or the mutex error.
+  int read(T& obj) {
+    int retval = rt_mutex_acquire(&_mutex, TM_INFINITE);
+    if(retval)
+      return retval;
+    obj = _data;
+    rt_mutex_release(&_mutex);
+    return 0;
+  };
+
+private:
+  RT_MUTEX _mutex;
+  T _data;
+  bool _init;
+};
+
+
+/* @class LiveView
+ * A double-buffered object updated by the data task. The data task owns the
+ * live copy and publishes it at most once per period, so that readers get a
+ * recent snapshot without ever blocking ingest.
+ */
+template <typename T> class LiveView {
+public:
+  LiveView() : _last(0), _pending(false) {};
+  ~LiveView() {};
+
+  // Init the published buffer
+  int init(const char* name) { return _pub.init(name); };
+
+  // Object owned by the data task
+  T& live() { return _live; };
+  const T& live()const { return _live; };
+
+  // Mark the live object as modified and publish it if the period has elapsed
+  void update(RTIME now, RTIME period) {
+    _pending = true;
+    if(now - _last >= period)
+      flush(now);
+  };
+
+  // Publish the live object if it has been modified
+  void flush(RTIME now) {
+    if(_pending && _pub.publish(_live)) {
+      _pending = false;
+      _last = now;
+    }
+  };
+
+  // Copy the last published object
+  int read(T& obj) { return _pub.read(obj); };
+
+private:
+  T _live;
+  Published<T> _pub;
+  RTIME _last;
+  bool _pending;
+};
+
+#endif
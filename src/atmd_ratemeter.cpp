@@ -0,0 +1,168 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Count rate meter class
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Global debug flag
+#ifdef DEBUG
+extern bool enable_debug;
+#endif
+
+#include <exception>
+#include <rtdk.h>
+
+#include "atmd_ratemeter.h"
+#include "atmd_measure.h"
+
+
+/* @fn RateMeter::init(size_t nch)
+ * Allocate the bucket ring. The ring is never reallocated afterwards, so that
+ * readers can access it without locking.
+ *
+ * @param nch The number of channels.
+ * @return Return 0 on success, -1 on error.
+ */
+int RateMeter::init(size_t nch) {
+  try {
+    _nch = nch;
+    _stride = COUNTS + nch;
+    _begin = 0;
+    _ring.assign(ATMD_RATE_NBUCKETS * _stride, 0);
+    return 0;
+
+  } catch(std::exception& e) {
+    rt_syslog(ATMD_ERR, "RateMeter [init]: memory allocation failed with error %s", e.what());
+    return -1;
+  }
+}
+
+
+/* @fn RateMeter::add_start(const Measure& meas, size_t start, RTIME now)
+ * Add a start to the bucket of the current time. The stop counts are taken
+ * from the statistics row of the start. The bucket is recycled if it belongs
+ * to an older turn of the ring.
+ *
+ * @param meas The measure.
+ * @param start The start number.
+ * @param now The current time in ns.
+ */
+void RateMeter::add_start(const Measure& meas, size_t start, RTIME now) {
+  if(_stride == 0)
+    return;
+
+  uint64_t epoch = now / ATMD_RATE_BUCKET;
+  volatile uint64_t* b = bucket(epoch);
+
+  // Enter write section
+  b[SEQ]++;
+  __sync_synchronize();
+
+  if(b[EPOCH] != epoch) {
+    for(size_t i = STARTS; i < _stride; i++)
+      b[i] = 0;
+    b[EPOCH] = epoch;
+  }
+
+  b[STARTS]++;
+  if(meas.start_times(start))
+    b[LIVE] += meas.get_window_time(start, 0);
+
+  size_t nch = (meas.nch() < _nch) ? meas.nch() : _nch;
+  if(nch) {
+    const uint32_t* row = meas.stat_row(start);
+    for(size_t i = 0; i < nch; i++)
+      b[COUNTS + i] += row[i+1];
+  }
+
+  // Leave write section
+  __sync_synchronize();
+  b[SEQ]++;
+
+  if(_begin == 0)
+    __sync_bool_compare_and_swap(&_begin, 0, epoch + 1);
+}
+
+
+/* @fn RateMeter::rates(RTIME now, size_t buckets, double& start_rate, double& live, std::vector<double>& ch_rates)
+ * Compute the rates over the last complete buckets. The bucket in progress is
+ * not used, so rates lag at most one bucket but do not fluctuate while it
+ * fills. If the meter started less than 'buckets' buckets ago, only the
+ * elapsed ones are used.
+ *
+ * @param now The current time in ns.
+ * @param buckets Number of buckets to average (at most ATMD_RATE_NBUCKETS - 1).
+ * @param start_rate Output start rate in Hz.
+ * @param live Output live-time fraction.
+ * @param ch_rates Output stop rate of each channel in Hz.
+ */
+void RateMeter::rates(RTIME now, size_t buckets, double& start_rate, double& live, std::vector<double>& ch_rates) {
+  start_rate = 0.0;
+  live = 0.0;
+  ch_rates.assign(_nch, 0.0);
+
+  uint64_t begin = __sync_fetch_and_add(&_begin, 0);
+  if(_stride == 0 || begin == 0)
+    return;
+  begin--;
+
+  uint64_t cur = now / ATMD_RATE_BUCKET;
+  if(buckets > ATMD_RATE_NBUCKETS - 1)
+    buckets = ATMD_RATE_NBUCKETS - 1;
+  if(cur - begin < buckets)
+    buckets = cur - begin;
+  if(buckets == 0)
+    return;
+
+  uint64_t starts = 0, live_ns = 0;
+  std::vector<uint64_t> counts(_nch, 0);
+  std::vector<uint64_t> copy(_stride, 0);
+
+  for(uint64_t e = cur - buckets; e < cur; e++) {
+    volatile uint64_t* b = bucket(e);
+    bool valid = false;
+
+    // Copy the bucket consistently
+    for(int retry = 0; retry < ATMD_RATE_RETRIES; retry++) {
+      uint64_t seq = b[SEQ];
+      if(seq & 1)
+        continue;
+      __sync_synchronize();
+      for(size_t i = EPOCH; i < _stride; i++)
+        copy[i] = b[i];
+      __sync_synchronize();
+      if(b[SEQ] == seq) {
+        valid = (copy[EPOCH] == e);
+        break;
+      }
+    }
+    if(!valid)
+      continue;
+
+    starts += copy[STARTS];
+    live_ns += copy[LIVE];
+    for(size_t i = 0; i < _nch; i++)
+      counts[i] += copy[COUNTS + i];
+  }
+
+  double span = (double)buckets * ATMD_RATE_BUCKET / 1e9;
+  start_rate = starts / span;
+  live = live_ns / (span * 1e9);
+  for(size_t i = 0; i < _nch; i++)
+    ch_rates[i] = counts[i] / span;
+}
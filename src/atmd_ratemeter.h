@@ -0,0 +1,80 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Count rate meter header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_RATEMETER_H
+#define ATMD_RATEMETER_H
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <vector>
+
+// Xenomai
+#include <native/timer.h>
+
+// Local
+#include "common.h"
+
+// Declare class Measure
+class Measure;
+
+
+/* @class RateMeter
+ * Sliding-window count rates. Wall time is split in buckets of ATMD_RATE_BUCKET
+ * ns kept in a ring covering the last ATMD_RATE_NBUCKETS buckets. Each bucket
+ * holds the number of starts, the effective window time and the stops of each
+ * channel.
+ * The data task is the only writer. Every bucket is protected by a sequence
+ * counter, so readers never lock and never block the writer: they retry a
+ * bucket if it changed while being copied.
+ */
+class RateMeter {
+public:
+  RateMeter() : _nch(0), _stride(0), _begin(0) {};
+  ~RateMeter() {};
+
+  // Allocate the ring for a number of channels
+  int init(size_t nch);
+
+  // Account a start of a measure completed at time 'now' (data task only)
+  void add_start(const Measure& meas, size_t start, RTIME now);
+
+  // Rates over the last 'buckets' complete buckets before 'now'.
+  // Start and channel rates are in Hz, live is the fraction of wall time covered by the windows.
+  void rates(RTIME now, size_t buckets, double& start_rate, double& live, std::vector<double>& ch_rates);
+
+  // Number of channels
+  size_t nch()const { return _nch; };
+
+private:
+  // Bucket layout
+  enum { SEQ = 0, EPOCH, STARTS, LIVE, COUNTS };
+
+  // Pointer to the bucket of an epoch
+  volatile uint64_t* bucket(uint64_t epoch) { return &(_ring[(epoch % ATMD_RATE_NBUCKETS) * _stride]); };
+
+  size_t _nch;                      // Number of channels
+  size_t _stride;                   // Size of a bucket (COUNTS + _nch)
+  uint64_t _begin;                  // First epoch accounted (plus one, zero means none)
+  std::vector<uint64_t> _ring;      // Buckets
+};
+
+#endif
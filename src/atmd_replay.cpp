@@ -0,0 +1,292 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Capture replay tool
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Feed a capture file recorded by the server (see atmd_capture.h) through the
+ * same start assembly and save code of the data task, without agents and
+ * without RTnet. Packets are replayed at full speed or at the pace they were
+ * received, and the throughput is printed at the end.
+ */
+
+// Debug flag
+#ifdef DEBUG
+bool enable_debug = false;
+#endif
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string>
+#include <vector>
+
+// Xenomai
+#include <rtdk.h>
+#include <native/task.h>
+#include <native/timer.h>
+
+// Local
+#include "common.h"
+#include "atmd_netagent.h"
+#include "atmd_measure.h"
+#include "atmd_assembler.h"
+#include "atmd_capture.h"
+#include "atmd_export.h"
+#include "atmd_workerpool.h"
+#include "atmd_filewriter.h"
+
+
+/* @fn static void usage()
+ * Print command line help.
+ */
+static void usage() {
+  printf("atmd_replay [-r] [-f format] [-o prefix] [-a starts] [-w workers] <capture_file>\n");
+  printf(" -r: replay at the pace the packets were received (default: full speed).\n");
+  printf(" -f format: save format (%d-%d text, %d-%d binary; default %d).\n", ATMD_FORMAT_RAW, ATMD_FORMAT_US, ATMD_FORMAT_BINPS, ATMD_FORMAT_BINRAW, ATMD_FORMAT_BINPS);
+  printf(" -o prefix: save each measure to <prefix>_NNNN (default: assemble only).\n");
+  printf(" -a starts: save a chunk every 'starts' starts, as with autosave.\n");
+  printf(" -w workers: number of export workers (default %d).\n", ATMD_DEF_EXPORT_WORKERS);
+}
+
+
+/* @fn static int save(const Measure& meas, uint32_t format, size_t agents, const std::string& filename, WorkerPool* pool)
+ * Save a measure with the export code of the server.
+ *
+ * @return Return 0 on success, -1 on error.
+ */
+static int save(const Measure& meas, uint32_t format, size_t agents, const std::string& filename, WorkerPool* pool) {
+  FileWriter out;
+  if(out.open(filename, false, export_size(meas, format, agents))) {
+    fprintf(stderr, "Error creating \"%s\" (Error: %s).\n", filename.c_str(), strerror(errno));
+    return -1;
+  }
+
+  int retval = 0;
+  if(format == ATMD_FORMAT_BINPS || format == ATMD_FORMAT_BINRAW)
+    retval = measure2bin(meas, format, agents, out, pool);
+  else
+    retval = measure2text(meas, format, out, pool);
+
+  if(out.close())
+    retval = -1;
+  if(retval)
+    fprintf(stderr, "Error writing \"%s\".\n", filename.c_str());
+  return retval;
+}
+
+
+/* @fn int main(int argc, char * const argv[])
+ * Main entry point
+ */
+int main(int argc, char * const argv[])
+{
+  bool paced = false;
+  uint32_t format = ATMD_FORMAT_BINPS;
+  std::string prefix;
+  uint32_t autosave = 0;
+  size_t workers = ATMD_DEF_EXPORT_WORKERS;
+
+  int c;
+  while( (c = getopt(argc, argv, "rf:o:a:w:")) != -1 ) {
+    switch(c) {
+      case 'r':
+        paced = true;
+        break;
+
+      case 'f':
+        format = strtoul(optarg, NULL, 10);
+        if(format < ATMD_FORMAT_RAW || format > ATMD_FORMAT_BINRAW) {
+          fprintf(stderr, "Unsupported save format \"%s\".\n", optarg);
+          return -1;
+        }
+        break;
+
+      case 'o':
+        prefix = optarg;
+        break;
+
+      case 'a':
+        autosave = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'w':
+        workers = strtoul(optarg, NULL, 10);
+        break;
+
+      default:
+        usage();
+        return -1;
+    }
+  }
+  if(optind != argc - 1) {
+    usage();
+    return -1;
+  }
+
+  // Lock memory and shadow to Xenomai domain
+  mlockall(MCL_CURRENT|MCL_FUTURE);
+  RT_TASK main_task;
+  int retval = rt_task_shadow(&main_task, "atmd_replay", 0, T_FPU);
+  if(retval) {
+    fprintf(stderr, "Failed to shadow main task (Code: %d).\n", retval);
+    return -1;
+  }
+  rt_print_auto_init(1);
+
+  WorkerPool pool;
+  if(pool.init("replay_pool", workers)) {
+    fprintf(stderr, "Failed to start the export workers.\n");
+    return -1;
+  }
+
+  CaptureReader reader;
+  if(reader.open(argv[optind])) {
+    fprintf(stderr, "Cannot open capture file \"%s\" (Error: %s).\n", argv[optind], strerror(errno));
+    return -1;
+  }
+  size_t agents = reader.agents();
+
+  StartAssembler assembler;
+  assembler.setup(agents);
+  std::vector<bool> agent_end(agents, false);
+  Measure* meas = NULL;
+
+  CaptureRecord rec;
+  DataMsg packet;
+  char buffer[ATMD_PACKET_SIZE];
+  double tbin = 0.0;
+
+  // Pace reference
+  bool first = true;
+  uint64_t rec_begin = 0;
+  RTIME begin = rt_timer_read();
+
+  // Counters
+  uint64_t packets = 0, bytes = 0, starts = 0, events = 0, files = 0, errors = 0;
+
+  while((retval = reader.next(rec, buffer, sizeof(buffer))) == 1) {
+    if(rec.agent == ATMD_CAPTURE_TBIN) {
+      memcpy(&tbin, buffer, sizeof(double));
+      continue;
+    }
+    if(rec.agent >= agents) {
+      errors++;
+      continue;
+    }
+
+    // Wait for the receive time of the packet
+    if(paced) {
+      if(first) {
+        rec_begin = rec.time;
+        begin = rt_timer_read();
+        first = false;
+      } else {
+        RTIME target = begin + (rec.time - rec_begin);
+        RTIME now = rt_timer_read();
+        if(target > now)
+          rt_task_sleep(target - now);
+      }
+    }
+
+    // Decode as the data task does
+    packet.clear();
+    memcpy(packet.get_buffer(), buffer, rec.size);
+    packet.decode();
+    packets++;
+    bytes += rec.size;
+
+    if(meas == NULL)
+      meas = new Measure(8*agents);
+
+    bool measure_end = false;
+    if(packet.type() == ATMD_DT_TERM) {
+      agent_end[rec.agent] = true;
+      if(autosave == 0)
+        meas->add_time(packet.window_start(), packet.window_time());
+      measure_end = true;
+      for(size_t i = 0; i < agents; i++)
+        measure_end = measure_end && agent_end[i];
+    }
+
+    // Save the measure when complete, or a chunk when the autosave count is reached
+    if(measure_end || (autosave && meas->count_starts() >= autosave)) {
+      if(autosave)
+        meas->add_chunk_times(agents);
+      if(meas->count_starts() > 0 && prefix.size() > 0) {
+        char number[16];
+        snprintf(number, sizeof(number), "_%04lu", (unsigned long)files);
+        std::string ext = (format == ATMD_FORMAT_BINPS || format == ATMD_FORMAT_BINRAW) ? ".bin" : ".dat";
+        if(save(*meas, format, agents, prefix + number + ext, &pool))
+          errors++;
+        files++;
+      }
+
+      Measure* chunk = meas;
+      meas = NULL;
+      if(!measure_end) {
+        meas = new Measure(8*agents);
+        meas->reserve(chunk->count_starts(), chunk->count_stops());
+      } else {
+        agent_end.assign(agents, false);
+      }
+      chunk->unref();
+      if(measure_end)
+        continue;
+    }
+
+    retval = assembler.add_packet(rec.agent, packet, tbin);
+    if(retval < 0) {
+      errors++;
+    } else if(retval == 1) {
+      if(meas->add_start(assembler.start()) == 0) {
+        starts++;
+        events += meas->count_stops(meas->count_starts()-1);
+      }
+      assembler.clear();
+    }
+  }
+  RTIME elapsed = rt_timer_read() - begin;
+
+  if(retval < 0) {
+    fprintf(stderr, "Capture file is truncated or corrupted after %llu packets.\n", (unsigned long long)packets);
+    errors++;
+  }
+  if(meas) {
+    if(meas->count_starts() > 0)
+      fprintf(stderr, "Capture ended in the middle of a measure (%lu starts not saved).\n", (unsigned long)meas->count_starts());
+    meas->unref();
+  }
+
+  double secs = elapsed / 1e9;
+  printf("Packets: %llu (%.1f MB)\n", (unsigned long long)packets, bytes / 1048576.0);
+  printf("Starts: %llu, events: %llu\n", (unsigned long long)starts, (unsigned long long)events);
+  printf("Files saved: %llu, errors: %llu\n", (unsigned long long)files, (unsigned long long)errors);
+  printf("Elapsed: %.3f s", secs);
+  if(secs > 0)
+    printf(" (%.0f packets/s, %.1f MB/s, %.0f events/s)", packets / secs, bytes / 1048576.0 / secs, events / secs);
+  printf("\n");
+
+  return (errors > 0) ? 1 : 0;
+}
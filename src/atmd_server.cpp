@@ -382,56 +382,9 @@ int main(int argc, char * const argv[])
   }
   netif_init_done = true;
 
-  // Define the time for which the main cycle sleep between subsequent calls to get_command
-  sleeptime.tv_sec = 0;
-  sleeptime.tv_nsec = 25000000; // 25ms sleep
-
-  // Cycle accepting client connections
-  while(netif.accept_client() == 0) {
-    // We have a connection from a client, so we start the command processing cycle
-
-    try {
-
-      string command;
-      do {
-        // When we Receive the terminate_interrupt we close the connection and exit
-        if(terminate_interrupt) {
-          throw(ATMD_ERR_TERM);
-        }
-
-        if(netif.get_command(command) == 0) {
-          // Received a command
-
-#ifdef DEBUG
-          if(enable_debug)
-            // If debug is eanbled, we log all commands received
-            rt_syslog(ATMD_DEBUG, "Received command \"%s\"", command.c_str());
-#endif
-
-          // Command execution
-          netif.exec_command(command, board);
-        }
-
-        // Sleep
-        nanosleep(&sleeptime, NULL);
-
-      } while(true);
-
-    } catch(int e) {
-      // We catched an exception indicating an error on client connection so we close it.
-      netif.close_client();
-      if(e == ATMD_ERR_TERM)
-        break;
-
-    } catch(std::exception& e) {
-      rt_syslog(ATMD_CRIT, "atmd_server.cpp: caught an unexpected exception (%s).", e.what());
-      break;
-
-    } catch(...) {
-      rt_syslog(ATMD_CRIT, "Network [get_command]: unknown exception.");
-      break;
-    }
-  }
+  // Serve the clients until the terminate interrupt
+  if(netif.run(board))
+    rt_syslog(ATMD_CRIT, "Network event loop failed. Exiting.");
 
   // Final cleanup
   server_cleanup:
@@ -439,9 +392,9 @@ int main(int argc, char * const argv[])
   // Set termination flag
   terminate_interrupt = true;
 
-  // Explicitely close network
+  // Explicitely close network (waits for the commands being executed)
   if(netif_init_done)
-    netif.close_client();
+    netif.close_clients();
 
   // Explicitely call VirtualBoard destructor
   if(board_init_done)
@@ -0,0 +1,98 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Measure snapshot header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_SNAPSHOT_H
+#define ATMD_SNAPSHOT_H
+
+// Global
+#include <vector>
+
+// Local
+#include "atmd_measure.h"
+
+
+/* @class MeasureSet
+ * Immutable list of completed measures. A set holds a reference on each of its
+ * measures and is itself reference counted: a new set is published every time
+ * the list changes, while readers keep using the set they took until they drop
+ * it.
+ */
+class MeasureSet {
+public:
+  // Create a set with one reference, taking a reference on each measure
+  static MeasureSet* create(const std::vector<Measure*>& list) { return new MeasureSet(list); };
+
+  // Reference counting
+  void ref() { __sync_add_and_fetch(&_refs, 1); };
+  void unref() { if(__sync_sub_and_fetch(&_refs, 1) == 0) delete this; };
+
+  // Measures
+  size_t size()const { return _list.size(); };
+  const Measure& operator[](size_t i)const { return *(_list[i]); };
+
+private:
+  MeasureSet(const std::vector<Measure*>& list) : _list(list.begin(), list.end()), _refs(1) {
+    for(size_t i = 0; i < _list.size(); i++)
+      _list[i]->ref();
+  };
+  ~MeasureSet() {
+    for(size_t i = 0; i < _list.size(); i++)
+      _list[i]->unref();
+  };
+
+  // Sets are shared, not copied
+  MeasureSet(const MeasureSet&);
+  MeasureSet& operator=(const MeasureSet&);
+
+  std::vector<const Measure*> _list;
+  volatile int _refs;
+};
+
+
+/* @class MeasureSnapshot
+ * Reader handle on a MeasureSet. Copying the handle shares the set; the
+ * reference is dropped when the last handle is destroyed.
+ */
+class MeasureSnapshot {
+public:
+  MeasureSnapshot() : _set(NULL) {};
+  explicit MeasureSnapshot(MeasureSet* set) : _set(set) {};    // Adopts one reference
+  MeasureSnapshot(const MeasureSnapshot& obj) : _set(obj._set) { if(_set) _set->ref(); };
+  ~MeasureSnapshot() { if(_set) _set->unref(); };
+
+  MeasureSnapshot& operator=(const MeasureSnapshot& obj) {
+    if(obj._set)
+      obj._set->ref();
+    if(_set)
+      _set->unref();
+    _set = obj._set;
+    return *this;
+  };
+
+  // Measures
+  size_t size()const { return (_set) ? _set->size() : 0; };
+  const Measure& operator[](size_t i)const { return (*_set)[i]; };
+
+private:
+  MeasureSet* _set;
+};
+
+#endif
@@ -0,0 +1,253 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Live start stream
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <rtdk.h>
+
+#include "atmd_stream.h"
+
+
+/* @fn Subscription::Subscription(uint64_t mask, uint32_t sample, size_t capacity)
+ * Create a subscription. Check good() for the creation of the Xenomai objects.
+ *
+ * @param mask Channel mask (bit c-1 selects channel c).
+ * @param sample Send one start out of 'sample' (0 or 1 sends all).
+ * @param capacity Maximum number of frames queued.
+ */
+Subscription::Subscription(uint64_t mask, uint32_t sample, size_t capacity) : _mask(mask), _sample((sample) ? sample : 1), _capacity((capacity) ? capacity : 1), _seen(0), _dropped(0), _init(false) {
+  int retval = rt_mutex_create(&_mutex, NULL);
+  if(retval) {
+    rt_syslog(ATMD_ERR, "Subscription [Subscription]: failed to create mutex (Code: %d).", retval);
+    return;
+  }
+  retval = rt_cond_create(&_not_empty, NULL);
+  if(retval) {
+    rt_syslog(ATMD_ERR, "Subscription [Subscription]: failed to create condition variable (Code: %d).", retval);
+    rt_mutex_delete(&_mutex);
+    return;
+  }
+  _init = true;
+}
+
+
+/* @fn Subscription::~Subscription()
+ * Destroy the Xenomai objects. The subscription must have been removed from
+ * the stream.
+ */
+Subscription::~Subscription() {
+  if(_init) {
+    rt_cond_delete(&_not_empty);
+    rt_mutex_delete(&_mutex);
+  }
+}
+
+
+/* @fn Subscription::push(const Measure& meas, size_t start)
+ * Encode the events of a start on the channels of the mask and queue the
+ * frame, dropping the oldest one if the queue is full. Called by the data task.
+ *
+ * @param meas The measure.
+ * @param start The start number.
+ */
+void Subscription::push(const Measure& meas, size_t start) {
+  if((_seen++) % _sample)
+    return;
+
+  if(rt_mutex_acquire(&_mutex, TM_INFINITE))
+    return;
+
+  // Drop the oldest frame, keeping its storage
+  if(_frames.size() >= _capacity) {
+    _free.push_back(std::string());
+    _free.back().swap(_frames.front());
+    _frames.pop_front();
+    _dropped++;
+  }
+
+  _frames.push_back(std::string());
+  std::string& frame = _frames.back();
+  if(_free.size() > 0) {
+    frame.swap(_free.back());
+    _free.pop_back();
+  }
+
+  // Select the events
+  const int8_t* ch = meas.channels();
+  size_t first = meas.first_stop(start);
+  size_t last = first + meas.count_stops(start);
+  uint32_t events = 0;
+  for(size_t i = first; i < last; i++) {
+    size_t c = (ch[i] > 0) ? ch[i] : -ch[i];
+    if(c >= 1 && c <= 64 && (_mask & ((uint64_t)1 << (c-1))))
+      events++;
+  }
+
+  StreamFrame head;
+  head.bytes = sizeof(StreamFrame) + events * (sizeof(int8_t) + sizeof(int32_t) + sizeof(uint32_t));
+  head.start_id = meas.start_id(start);
+  head.start = start;
+  head.events = events;
+  head.dropped = _dropped;
+  frame.resize(head.bytes);
+
+  // Header and packed columns
+  char* ptr = &(frame[0]);
+  memcpy(ptr, &head, sizeof(head));
+  int8_t* out_ch = (int8_t*)(ptr + sizeof(head));
+  char* out_stop = ptr + sizeof(head) + events * sizeof(int8_t);
+  char* out_retrig = out_stop + events * sizeof(int32_t);
+  const int32_t* stop = meas.stoptimes();
+  const uint32_t* retrig = meas.retrigs();
+  for(size_t i = first, j = 0; i < last; i++) {
+    size_t c = (ch[i] > 0) ? ch[i] : -ch[i];
+    if(c < 1 || c > 64 || !(_mask & ((uint64_t)1 << (c-1))))
+      continue;
+    out_ch[j] = ch[i];
+    memcpy(out_stop + j * sizeof(int32_t), &(stop[i]), sizeof(int32_t));
+    memcpy(out_retrig + j * sizeof(uint32_t), &(retrig[i]), sizeof(uint32_t));
+    j++;
+  }
+
+  rt_cond_signal(&_not_empty);
+  rt_mutex_release(&_mutex);
+}
+
+
+/* @fn Subscription::pop(std::string& frame, RTIME timeout)
+ * Get the oldest frame. The previous content of 'frame' is kept as storage
+ * for the next frames.
+ *
+ * @param frame Output frame.
+ * @param timeout Maximum wait in ns.
+ * @return Return 0 on success, -ETIMEDOUT if the queue stayed empty, the Xenomai error code on error.
+ */
+int Subscription::pop(std::string& frame, RTIME timeout) {
+  int retval = rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(retval)
+    return retval;
+
+  if(_frames.empty()) {
+    retval = rt_cond_wait(&_not_empty, &_mutex, timeout);
+    if(_frames.empty()) {
+      rt_mutex_release(&_mutex);
+      return (retval && retval != -EINTR) ? retval : -ETIMEDOUT;
+    }
+  }
+
+  frame.swap(_frames.front());
+  if(_free.size() < _capacity) {
+    _free.push_back(std::string());
+    _free.back().swap(_frames.front());
+  }
+  _frames.pop_front();
+
+  rt_mutex_release(&_mutex);
+  return 0;
+}
+
+
+/* @fn StartStream::~StartStream()
+ * Destroy the registry mutex.
+ */
+StartStream::~StartStream() {
+  if(_init)
+    rt_mutex_delete(&_mutex);
+}
+
+
+/* @fn StartStream::init(const char* name)
+ * Create the registry mutex.
+ *
+ * @param name Name of the mutex.
+ * @return Return 0 on success, -1 on error.
+ */
+int StartStream::init(const char* name) {
+  int retval = rt_mutex_create(&_mutex, name);
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "StartStream [init]: failed to create mutex (Code: %d).", retval);
+    return -1;
+  }
+  _init = true;
+  return 0;
+}
+
+
+/* @fn StartStream::subscribe(Subscription* sub)
+ * Add a subscriber.
+ *
+ * @param sub The subscription.
+ * @return Return 0 on success, -1 on error.
+ */
+int StartStream::subscribe(Subscription* sub) {
+  if(!_init || !sub->good())
+    return -1;
+
+  int retval = rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(retval) {
+    rt_syslog(ATMD_ERR, "StartStream [subscribe]: failed to acquire mutex (Code: %d).", retval);
+    return -1;
+  }
+  _subs.push_back(sub);
+  _count = _subs.size();
+  rt_mutex_release(&_mutex);
+  return 0;
+}
+
+
+/* @fn StartStream::unsubscribe(Subscription* sub)
+ * Remove a subscriber. When the call returns the data task does not use the
+ * subscription any more.
+ *
+ * @param sub The subscription.
+ * @return Return 0 on success, -1 on error.
+ */
+int StartStream::unsubscribe(Subscription* sub) {
+  int retval = rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(retval) {
+    rt_syslog(ATMD_ERR, "StartStream [unsubscribe]: failed to acquire mutex (Code: %d).", retval);
+    return -1;
+  }
+  for(size_t i = 0; i < _subs.size(); i++) {
+    if(_subs[i] == sub) {
+      _subs.erase(_subs.begin() + i);
+      break;
+    }
+  }
+  _count = _subs.size();
+  rt_mutex_release(&_mutex);
+  return 0;
+}
+
+
+/* @fn StartStream::publish_start(const Measure& meas, size_t start)
+ * Queue a start to every subscriber.
+ *
+ * @param meas The measure.
+ * @param start The start number.
+ */
+void StartStream::publish_start(const Measure& meas, size_t start) {
+  if(rt_mutex_acquire(&_mutex, TM_INFINITE))
+    return;
+  for(size_t i = 0; i < _subs.size(); i++)
+    _subs[i]->push(meas, start);
+  rt_mutex_release(&_mutex);
+}
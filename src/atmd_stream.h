@@ -0,0 +1,130 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Live start stream header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_STREAM_H
+#define ATMD_STREAM_H
+
+// Global
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+// Xenomai
+#include <native/mutex.h>
+#include <native/cond.h>
+#include <native/timer.h>
+
+// Local
+#include "common.h"
+#include "atmd_measure.h"
+
+
+/* @struct StreamFrame
+ * Header of a start frame. It is followed by the events of the start as three
+ * packed arrays: channel (int8), stop time (int32, units of tbin) and retrig
+ * counter (uint32), 9 bytes per event.
+ */
+struct StreamFrame {
+  uint32_t bytes;                     // Size of the frame, header included
+  uint32_t start_id;                  // Start ID
+  uint64_t start;                     // Start number in the measure
+  uint32_t events;                    // Events in the frame
+  uint32_t dropped;                   // Frames dropped when this one was queued (cumulative)
+};
+
+
+/* @class Subscription
+ * A subscriber to the live starts. The data task encodes the starts passing
+ * the channel mask and the sampling into a bounded queue; when the queue is
+ * full the oldest frame is dropped, so a slow consumer never stalls ingest.
+ */
+class Subscription {
+public:
+  Subscription(uint64_t mask, uint32_t sample, size_t capacity);
+  ~Subscription();
+
+  // Tell if the mutex and the condition variable were created
+  bool good()const { return _init; };
+
+  // Get the next frame, waiting at most 'timeout' ns. Return -ETIMEDOUT if none.
+  int pop(std::string& frame, RTIME timeout);
+
+  // Filter parameters
+  uint64_t mask()const { return _mask; };
+  uint32_t sample()const { return _sample; };
+  size_t capacity()const { return _capacity; };
+
+  // Make class StartStream a friend
+  friend class StartStream;
+
+private:
+  Subscription(const Subscription&);
+  Subscription& operator=(const Subscription&);
+
+  // Encode a start and queue it (data task)
+  void push(const Measure& meas, size_t start);
+
+  RT_MUTEX _mutex;
+  RT_COND _not_empty;
+  std::deque<std::string> _frames;
+  std::vector<std::string> _free;     // Storage of the frames already sent, reused
+  uint64_t _mask;                     // Bit c-1 selects channel c
+  uint32_t _sample;                   // Send one start out of _sample
+  size_t _capacity;
+  uint64_t _seen;                     // Starts seen by the subscriber
+  uint32_t _dropped;
+  bool _init;
+};
+
+
+/* @class StartStream
+ * Registry of the subscribers to the live starts. The data task publishes
+ * every completed start; without subscribers this costs a single test.
+ */
+class StartStream {
+public:
+  StartStream() : _count(0), _init(false) {};
+  ~StartStream();
+
+  // Create the registry mutex
+  int init(const char* name);
+
+  // Add or remove a subscriber (the caller keeps ownership)
+  int subscribe(Subscription* sub);
+  int unsubscribe(Subscription* sub);
+
+  // Queue a start of a measure to the subscribers (data task)
+  void publish(const Measure& meas, size_t start) {
+    if(_count)
+      publish_start(meas, start);
+  };
+
+private:
+  void publish_start(const Measure& meas, size_t start);
+
+  RT_MUTEX _mutex;
+  std::vector<Subscription*> _subs;
+  volatile size_t _count;
+  bool _init;
+};
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - FTP upload pipeline
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Global debug flag
+#ifdef DEBUG
+extern bool enable_debug;
+#endif
+
+#include <string.h>
+#include <errno.h>
+#include <rtdk.h>
+
+#include "atmd_upload.h"
+
+
+/* @fn UploadPipe::~UploadPipe()
+ * Stop the producer and destroy the Xenomai objects.
+ */
+UploadPipe::~UploadPipe() {
+  if(_init) {
+    stop();
+    rt_cond_delete(&_not_empty);
+    rt_cond_delete(&_not_full);
+    rt_mutex_delete(&_mutex);
+  }
+}
+
+
+/* @fn UploadPipe::init(const std::string& name)
+ * Create the mutex and the condition variables and allocate the buffers.
+ *
+ * @param name Prefix of the names of the Xenomai objects.
+ * @return Return 0 on success, -1 on error.
+ */
+int UploadPipe::init(const std::string& name) {
+  _name = name;
+
+  int retval = rt_mutex_create(&_mutex, (name + "_mutex").c_str());
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "UploadPipe [init]: failed to create mutex (Code: %d).", retval);
+    return -1;
+  }
+  retval = rt_cond_create(&_not_empty, (name + "_notempty").c_str());
+  if(retval == 0)
+    retval = rt_cond_create(&_not_full, (name + "_notfull").c_str());
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "UploadPipe [init]: failed to create condition variables (Code: %d).", retval);
+    return -1;
+  }
+
+  for(size_t i = 0; i < ATMD_UPLOAD_BUFFERS; i++)
+    _buf[i].resize(ATMD_UPLOAD_BUFSIZE);
+
+  _init = true;
+  return 0;
+}
+
+
+/* @fn UploadPipe::start(MatStream* stream)
+ * Rewind the stream and spawn the producer task.
+ *
+ * @param stream The stream to upload.
+ * @return Return 0 on success, -1 on error.
+ */
+int UploadPipe::start(MatStream* stream) {
+  if(!_init || _running)
+    return -1;
+
+  stream->reset();
+  _stream = stream;
+  _head = 0;
+  _tail = 0;
+  _count = 0;
+  _rdoff = 0;
+  _eof = false;
+  _abort = false;
+
+  int retval = rt_task_spawn(&_task, (_name + "_task").c_str(), 0, 0, T_FPU|T_JOINABLE, UploadPipe::producer_task, (void*)this);
+  if(retval) {
+    rt_syslog(ATMD_ERR, "UploadPipe [start]: rt_task_spawn() failed to start the producer task (Code: %d).", retval);
+    return -1;
+  }
+  _running = true;
+  return 0;
+}
+
+
+/* @fn UploadPipe::stop()
+ * Ask the producer to stop and wait for it to terminate.
+ *
+ * @return Return 0 on success, -1 on error.
+ */
+int UploadPipe::stop() {
+  if(!_running)
+    return 0;
+
+  if(rt_mutex_acquire(&_mutex, TM_INFINITE) == 0) {
+    _abort = true;
+    rt_cond_broadcast(&_not_full);
+    rt_mutex_release(&_mutex);
+  }
+
+  int retval = rt_task_join(&_task);
+  _running = false;
+  if(retval) {
+    rt_syslog(ATMD_ERR, "UploadPipe [stop]: failed to join the producer task (Code: %d).", retval);
+    return -1;
+  }
+  return 0;
+}
+
+
+/* @fn static void UploadPipe::producer_task(void *arg)
+ * Fill the free buffers from the stream until its end, or until the consumer
+ * stops the upload. Buffers are filled outside of the lock.
+ *
+ * @param arg Cookie for the task (pointer to the pipe).
+ */
+void UploadPipe::producer_task(void *arg) {
+
+  // Init rt_printf and rt_syslog
+  rt_print_auto_init(1);
+
+  // Cast back 'this' pointer
+  UploadPipe *pthis = (UploadPipe*)arg;
+
+  // Prevent this task to send SIGDEBUG when switching to secondary mode
+  rt_task_set_mode(T_WARNSW, 0, NULL);
+
+  while(true) {
+    // Wait for a free buffer
+    if(rt_mutex_acquire(&(pthis->_mutex), TM_INFINITE))
+      break;
+    while(pthis->_count == ATMD_UPLOAD_BUFFERS && !pthis->_abort)
+      rt_cond_wait(&(pthis->_not_full), &(pthis->_mutex), TM_INFINITE);
+    bool abort = pthis->_abort;
+    size_t slot = pthis->_tail;
+    rt_mutex_release(&(pthis->_mutex));
+    if(abort)
+      break;
+
+    // Serialise the next block
+    size_t len = pthis->_stream->get_bytes(&(pthis->_buf[slot][0]), ATMD_UPLOAD_BUFSIZE);
+
+    // Publish it
+    if(rt_mutex_acquire(&(pthis->_mutex), TM_INFINITE))
+      break;
+    if(len > 0) {
+      pthis->_len[slot] = len;
+      pthis->_tail = (slot + 1) % ATMD_UPLOAD_BUFFERS;
+      pthis->_count++;
+    } else {
+      pthis->_eof = true;
+    }
+    rt_cond_signal(&(pthis->_not_empty));
+    rt_mutex_release(&(pthis->_mutex));
+
+    if(len == 0)
+      break;
+  }
+}
+
+
+/* @fn UploadPipe::read(uint8_t* buffer, size_t nb)
+ * Copy the next bytes of the stream, waiting for the producer if no buffer is
+ * ready.
+ *
+ * @param buffer The output buffer.
+ * @param nb The size of the output buffer.
+ * @return The number of bytes copied (zero at the end of the stream).
+ */
+size_t UploadPipe::read(uint8_t* buffer, size_t nb) {
+  size_t done = 0;
+
+  if(rt_mutex_acquire(&_mutex, TM_INFINITE))
+    return 0;
+
+  while(done < nb) {
+    while(_count == 0 && !_eof)
+      rt_cond_wait(&_not_empty, &_mutex, TM_INFINITE);
+    if(_count == 0)
+      break;
+
+    size_t n = _len[_head] - _rdoff;
+    if(n > nb - done)
+      n = nb - done;
+    memcpy(buffer + done, &(_buf[_head][_rdoff]), n);
+    done += n;
+    _rdoff += n;
+
+    // Release the buffer to the producer
+    if(_rdoff == _len[_head]) {
+      _head = (_head + 1) % ATMD_UPLOAD_BUFFERS;
+      _count--;
+      _rdoff = 0;
+      rt_cond_signal(&_not_full);
+    }
+  }
+
+  rt_mutex_release(&_mutex);
+  return done;
+}
+
+
+/* @fn UploadPipe::curl_read(void *ptr, size_t size, size_t count, void *data)
+ * Read callback for CURL network transfers.
+ *
+ * @param ptr Pointer to the curl output buffer
+ * @param size Size of the elements to be copied
+ * @param count Number of elements to be copied
+ * @param data Pointer to the UploadPipe object
+ * @return Return the number of bytes copied to ptr buffer
+ */
+size_t UploadPipe::curl_read(void *ptr, size_t size, size_t count, void *data) {
+  return ((UploadPipe*)data)->read((uint8_t*)ptr, size * count);
+}
@@ -0,0 +1,91 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - FTP upload pipeline header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_UPLOAD_H
+#define ATMD_UPLOAD_H
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Xenomai
+#include <native/task.h>
+#include <native/mutex.h>
+#include <native/cond.h>
+
+// Local
+#include "common.h"
+#include "MatFile.h"
+
+
+/* @class UploadPipe
+ * Ring of buffers between the serialisation of a MAT stream and its FTP
+ * transfer. A producer task fills the buffers from the stream while libcurl
+ * drains them through the read callback, so serialising one block overlaps the
+ * transfer of the previous ones. The producer waits when all the buffers are
+ * full, the consumer when they are all empty.
+ */
+class UploadPipe {
+public:
+  UploadPipe() : _stream(NULL), _head(0), _tail(0), _count(0), _rdoff(0), _eof(false), _abort(false), _running(false), _init(false) {};
+  ~UploadPipe();
+
+  // Create mutex and condition variables (their names are prefixed by 'name')
+  int init(const std::string& name);
+
+  // Start serialising a stream from its beginning
+  int start(MatStream* stream);
+
+  // Stop the producer (also if the transfer was interrupted)
+  int stop();
+
+  // CURL read callback (data is a pointer to the pipe)
+  static size_t curl_read(void *ptr, size_t size, size_t count, void *data);
+
+private:
+  // Producer task
+  static void producer_task(void *arg);
+
+  // Copy up to nb bytes, waiting for the producer if needed (consumer)
+  size_t read(uint8_t* buffer, size_t nb);
+
+  RT_MUTEX _mutex;
+  RT_COND _not_empty;
+  RT_COND _not_full;
+  RT_TASK _task;
+  std::string _name;
+
+  MatStream* _stream;                               // Stream being uploaded
+  std::vector<uint8_t> _buf[ATMD_UPLOAD_BUFFERS];   // Ring of buffers
+  size_t _len[ATMD_UPLOAD_BUFFERS];                 // Bytes in each buffer
+  size_t _head;                                     // Next buffer to read
+  size_t _tail;                                     // Next buffer to fill
+  size_t _count;                                    // Filled buffers
+  size_t _rdoff;                                    // Read offset in the head buffer
+  bool _eof;                                        // The producer reached the end of the stream
+  bool _abort;                                      // The consumer asked the producer to stop
+  bool _running;
+  bool _init;
+};
+
+#endif
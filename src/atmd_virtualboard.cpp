@@ -48,6 +48,11 @@ int VirtualBoard::init() {
   memset(this->curl_error, 0x0, CURL_ERROR_SIZE);
   curl_easy_setopt(this->easy_handle, CURLOPT_ERRORBUFFER, this->curl_error);
 
+  // The handle is reused for every upload, so libcurl keeps the FTP control
+  // connection open between autosave chunks. Keepalive probes stop idle
+  // firewalls from dropping it during long acquisitions.
+  curl_easy_setopt(this->easy_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+
   // Init measures vector mutex
   retval = rt_mutex_create(&_meas_mutex, ATMD_RT_MEAS_MUTEX);
   if(retval) {
@@ -71,6 +76,89 @@ int VirtualBoard::init() {
     return -1;
   }
 
+  // Init measure snapshot mutex and publish the empty list
+  retval = rt_mutex_create(&_snap_mutex, ATMD_RT_SNAP_MUTEX);
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to create measure snapshot mutex (Code: %d).", retval);
+    return -1;
+  }
+  publish_measures();
+
+  // Init live histogram
+  retval = _hist_view.init(ATMD_RT_HIST_MUTEX);
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to create live histogram mutex (Code: %d).", retval);
+    return -1;
+  }
+
+  // Init live coincidences
+  retval = _coinc_view.init(ATMD_RT_COINC_MUTEX);
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to create live coincidence mutex (Code: %d).", retval);
+    return -1;
+  }
+
+  // Init control mutex
+  retval = rt_mutex_create(&_ctrl_mutex, ATMD_RT_CTRL_MUTEX);
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to create control mutex (Code: %d).", retval);
+    return -1;
+  }
+
+  // Init save mutex
+  retval = rt_mutex_create(&_save_mutex, ATMD_RT_SAVE_MUTEX);
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to create save mutex (Code: %d).", retval);
+    return -1;
+  }
+
+  // Init autosave queue
+  if(_writeq.init(ATMD_RT_SAVE_QUEUE, _config.savequeue())) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to initialize the autosave queue.");
+    return -1;
+  }
+
+  // Init live start stream
+  if(_stream.init(ATMD_RT_STREAM_MUTEX)) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to initialize the live start stream.");
+    return -1;
+  }
+
+  // Init monitor queue (a single refresh in flight)
+  if(_monq.init(ATMD_RT_MON_QUEUE, 1)) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to initialize the monitor queue.");
+    return -1;
+  }
+
+  // Init export workers
+  if(_pool.init(ATMD_NRT_EXPORT_POOL, _config.exportworkers())) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to start the export workers.");
+    return -1;
+  }
+
+  // Init batch save workers
+  if(_save_pool.init(ATMD_NRT_SAVE_POOL, _config.saveworkers())) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to start the save workers.");
+    return -1;
+  }
+  retval = rt_mutex_create(&_progress_mutex, ATMD_RT_PROGRESS_MUTEX);
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to create save progress mutex (Code: %d).", retval);
+    return -1;
+  }
+
+  // Init FTP upload pipeline
+  if(_upload.init(ATMD_NRT_UPLOAD_PIPE)) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to initialize the upload pipeline.");
+    return -1;
+  }
+
+  // Init rate meter
+  if(_rate.init(8 * _config.agents())) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to initialize the rate meter.");
+    return -1;
+  }
+
   // Init the data queue
   if(_data_queue.init(ATMD_RT_DATA_QUEUE, 10000000)) {
     rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to initialize RT data queue.");
@@ -105,6 +193,15 @@ int VirtualBoard::init() {
     rt_syslog(ATMD_DEBUG, "VirtualBoard [init]: successfully create RTnet data socket.");
 #endif
 
+  // Start packet capture
+  if(_config.capture().size() > 0) {
+    if(_recorder.start(_config.capture(), _config.agents())) {
+      rt_syslog(ATMD_CRIT, "VirtualBoard [init]: failed to start packet capture to \"%s\".", _config.capture().c_str());
+      return -1;
+    }
+    rt_syslog(ATMD_INFO, "VirtualBoard [init]: recording data packets to \"%s\".", _config.capture().c_str());
+  }
+
   // The first thing to do is to start the control RT thread
   retval = rt_task_spawn(&_ctrl_task, ATMD_RT_CTRL_TASK, 0, 75, T_FPU|T_JOINABLE, VirtualBoard::control_task, (void*)this);
   if(retval) {
@@ -180,6 +277,20 @@ int VirtualBoard::init() {
     return -1;
   }
 
+  // Start the non-RT autosave writer thread
+  retval = rt_task_spawn(&_writer_task, ATMD_NRT_WRITER_TASK, 0, 0, T_FPU|T_JOINABLE, VirtualBoard::writer_task, (void*)this);
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: rt_task_spawn() failed to start the writer task (Code: %d).", retval);
+    return -1;
+  }
+
+  // Start the non-RT monitor writer thread
+  retval = rt_task_spawn(&_monitor_task, ATMD_NRT_MONITOR_TASK, 0, 0, T_FPU|T_JOINABLE, VirtualBoard::monitor_task, (void*)this);
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "VirtualBoard [init]: rt_task_spawn() failed to start the monitor task (Code: %d).", retval);
+    return -1;
+  }
+
 #ifdef EN_TANGO
   // Connecto to TANGO device
   this->tangodev = NULL;
@@ -207,6 +318,15 @@ int VirtualBoard::close() {
   retval += rt_task_join(&_ctrl_task);
   retval += rt_task_join(&_rt_data_task);
   retval += rt_task_join(&_data_task);
+  retval += rt_task_join(&_writer_task);
+  retval += rt_task_join(&_monitor_task);
+
+  // Stop packet capture (the data task is not running any more)
+  retval += _recorder.stop();
+
+  // Stop save and export workers (no save can be running now)
+  _save_pool.stop();
+  _pool.stop();
 
   // Close RT sockets
   retval += _ctrl_sock.close();
@@ -221,11 +341,19 @@ int VirtualBoard::close() {
 
 /* @fn int VirtualBoard::send_command(GenMsg& packet)
  * This function sends a control message and wait for a reply. The reply is stored
- * in the same message object passed to send data.
+ * in the same message object passed to send data. The control interface has a
+ * single message buffer, so commands from several clients are serialized.
  */
 int VirtualBoard::send_command(int& opcode, GenMsg& packet) {
+  int retval = rt_mutex_acquire(&_ctrl_mutex, TM_INFINITE);
+  if(retval) {
+    rt_syslog(ATMD_ERR, "VirtualBoard [send_command]: failed to acquire control mutex (Code: %d).", retval);
+    return -1;
+  }
   size_t sz = packet.maxsize();
-  if(_ctrl_if.send(opcode, packet.get_buffer(), packet.size(), packet.get_buffer(), &sz)) {
+  retval = _ctrl_if.send(opcode, packet.get_buffer(), packet.size(), packet.get_buffer(), &sz);
+  rt_mutex_release(&_ctrl_mutex);
+  if(retval) {
     rt_syslog(ATMD_ERR, "VirtualBoard [send_command]: failed to send control command.");
     return -1;
   }
@@ -751,6 +879,10 @@ void VirtualBoard::rt_data_task(void *arg) {
       // Decode packet to update size
       packet.decode();
 
+      // Record the raw packet
+      if(pthis->_recorder.enabled())
+        pthis->_recorder.record(rt_timer_read(), agent_id, pthis->get_tbin(), packet.get_buffer(), packet.size());
+
       // Allocate QUEUE buffer
       char msg[ATMD_PACKET_SIZE+sizeof(size_t)];
 
@@ -792,17 +924,11 @@ void VirtualBoard::data_task(void *arg) {
   // Service variables
   DataMsg packet;
 
-  // Vector of bool to check if we received the data from all the agents
-  std::vector<bool> agent_done;
-
   // Vector of bool to check if the measure has ended
   std::vector<bool> agent_end;
 
-  // Vector of current start pointers
-  std::vector<StartData*> curr_start;
-
-  // Vector of current start ID
-  std::vector<uint32_t> curr_start_id;
+  // Assembler of the packets into starts
+  StartAssembler assembler;
 
   // We stop and wait for the agent setup to complete
   retval = rt_task_suspend(NULL);
@@ -826,18 +952,17 @@ void VirtualBoard::data_task(void *arg) {
   }
 
   // Init vectors
-  for(size_t i = 0; i < pthis->agents(); i++) {
-    agent_done.push_back(false);
+  for(size_t i = 0; i < pthis->agents(); i++)
     agent_end.push_back(false);
-    curr_start.push_back(NULL);
-    curr_start_id.push_back(0);
-  }
+  assembler.setup(pthis->agents());
 
   // Current measure
   Measure* curr_measure = NULL;
+  RTIME chunk_begin = 0;      // Time the current chunk was started (rolling files)
+  bool stalled = false;       // All the autosave slots were in use at the last roll
 
-  // Monitor object
-  Monitor mon;
+  // Monitor object (shared with the monitor task)
+  Monitor& mon = pthis->_monitor;
 
   // Buffer
   char msg[sizeof(size_t)+ATMD_PACKET_SIZE];
@@ -888,13 +1013,20 @@ void VirtualBoard::data_task(void *arg) {
 
     // If measure is NULL, create one
     if(curr_measure == NULL) {
-      curr_measure = new Measure;
-      // Reset current start id
-      for(size_t i = 0; i < pthis->agents(); i++)
-        curr_start_id[i] = 0;
-
-      // We are starting a new measure. Setup monitor
-      mon.setup(pthis->_monitor_n, pthis->_monitor_n);
+      curr_measure = new Measure(8*pthis->agents());
+      chunk_begin = rt_timer_read();
+
+      // We are starting a new measure. Setup monitor (once the last refresh
+      // of the previous measure has released its slots)
+      if(pthis->_monq.wait_idle())
+        rt_syslog(ATMD_ERR, "VirtualBoard [data_task]: failed to wait for the monitor writer.");
+      mon.setup(pthis->_monitor_n, pthis->_monitor_m);
+
+      // Setup live histogram and coincidences
+      pthis->_hist_view.live().setup(8*pthis->agents(), pthis->_hist_nbins, pthis->_hist_width, pthis->_hist_offset);
+      pthis->_hist_view.update(rt_timer_read(), 0);
+      pthis->_coinc_view.live().setup(pthis->_coinc_tol, pthis->_coinc_width, pthis->_coinc_groups);
+      pthis->_coinc_view.update(rt_timer_read(), 0);
     }
 
     // If packet type is ATMD_DT_TERM, the measure has ended (at least for the current agent)
@@ -905,7 +1037,7 @@ void VirtualBoard::data_task(void *arg) {
         if(enable_debug)
           rt_syslog(ATMD_DEBUG, "VirtualBoard [data_task]: received a termination packet. Total measure time was: %.3f s.", packet.window_time()/1e9);
 #endif
-        if(!pthis->get_autosave())
+        if(!pthis->chunked())
           curr_measure->add_time(packet.window_start(), packet.window_time());
       } else {
         rt_syslog(ATMD_ERR, "VirtualBoard [data_task]: received a termination packet, but current measure pointer in NULL.");
@@ -929,7 +1061,7 @@ void VirtualBoard::data_task(void *arg) {
       measure_end = measure_end && agent_end[i];
 
 
-    if(pthis->get_autosave() == 0) {
+    if(!pthis->chunked()) {
       // No autosave
 
       if(measure_end) {
@@ -964,10 +1096,16 @@ void VirtualBoard::data_task(void *arg) {
             return;
           }
 
-          // Add measure
+          // Attach histogram and add measure
+          curr_measure->set_histogram(pthis->_hist_view.live());
+          pthis->_hist_view.flush(rt_timer_read());
+          pthis->_coinc_view.flush(rt_timer_read());
           pthis->add_measure(curr_measure);
           curr_measure = NULL;
 
+          // Keep stored measures within the memory budget (spilled by the writer task)
+          pthis->check_memlimit();
+
           // Release lock of measure object
           retval = pthis->release_lock();
           if(retval) {
@@ -1010,107 +1148,91 @@ void VirtualBoard::data_task(void *arg) {
       }
 
     } else {
-      // Autosave mode
+      // Autosave mode (fixed number of starts or rolling files)
 
       if(curr_measure && curr_measure->count_starts() > 0) {
 
-        if(curr_measure->count_starts() == pthis->get_autosave() || measure_end) {
-
-          // == Autosave measure ==
-          // Lock measures object
-          retval = pthis->acquire_lock();
-          if(retval) {
-            switch(retval) {
-              case -EINVAL:
-              case -EIDRM:
-                rt_syslog(ATMD_CRIT, "VirtualBoard [data_task]: failed to acquire measure mutex because it was an invalid object.");
-                break;
-
-              case -EINTR:
-                rt_syslog(ATMD_CRIT, "VirtualBoard [data_task]: failed to acquire measure mutex because the task was unlocked.");
-                break;
+        // Check if the chunk is complete
+        bool roll = measure_end;
+        uint64_t roll_bytes = 0;
+        uint32_t roll_time = 0;
+        pthis->get_rolling(roll_bytes, roll_time);
+        if(pthis->get_autosave() && curr_measure->count_starts() >= pthis->get_autosave())
+          roll = true;
+        if(roll_bytes && export_size(*curr_measure, pthis->get_format(), pthis->agents()) >= roll_bytes)
+          roll = true;
+        if(roll_time && rt_timer_read() - chunk_begin >= (RTIME)roll_time * 1000000000)
+          roll = true;
 
-              case -EPERM:
-                rt_syslog(ATMD_CRIT, "VirtualBoard [data_task]: failed to acquire measure mutex because it was asked in an invalid context.");
-                break;
+        if(roll) {
 
-              default:
-                rt_syslog(ATMD_CRIT, "VirtualBoard [data_task]: failed to acquire measure mutex for an unexpected reason (Code: %d).", retval);
-                break;
-            }
-
-            // Terminate server
-            terminate_interrupt = true;
-            return;
-          }
+          // == Autosave measure ==
+          // The measure is not stored: it is handed to the writer task, so
+          // that acquisition goes on while the chunk is being saved. If all the
+          // autosave slots are in use the chunk is not cut and keeps growing
+          // until the writer frees a slot, so ingest does not wait for storage
+          // unless the chunk reaches the memory budget. The last chunk of a
+          // measure is always queued, and the writer sets the board idle once
+          // it is saved.
 
           // Set measure times
-          for(size_t i = 0; i < pthis->agents(); i++) {
-            uint64_t measure_begin = 0;
-            uint64_t measure_time = 0;
-            if(curr_measure->get_start(0)->times() > i)
-              measure_begin = curr_measure->get_start(0)->get_window_begin(i);
-            if(curr_measure->get_start(curr_measure->count_starts()-1)->times() > i)
-              measure_time = curr_measure->get_start(curr_measure->count_starts()-1)->get_window_begin(i) +
-                             curr_measure->get_start(curr_measure->count_starts()-1)->get_window_time(i) - measure_begin;
-            curr_measure->add_time(measure_begin, measure_time);
-          }
+          curr_measure->add_chunk_times(pthis->agents());
 
-          // Add measure
-          pthis->add_measure(curr_measure);
-          if(!measure_end) {
-            curr_measure = new Measure;
-          } else {
-            curr_measure = NULL;
-          }
+          // We format the filename (and the one of the next rolling file, that the writer preallocates)
+          std::string filename = pthis->chunk_filename(pthis->get_counter());
+          std::string next = (roll_bytes || roll_time) ? pthis->chunk_filename(pthis->get_counter() + 1) : "";
 
-          // We format the filename
-          std::stringstream file_number(std::stringstream::out);
-          file_number.width(4);
-          file_number.fill('0');
-          file_number << pthis->get_counter();
-          std::string filename = pthis->get_prefix() + "_" + file_number.str() + pthis->get_format_ext();
-          pthis->increment_counter();
-
-          // Save measure
-          if(pthis->save_measure(pthis->measures()-1, filename)) {
-            rt_syslog(ATMD_ERR, "VirtualBoard [data_task]: measure_save() in autosave mode failed.");
-            // We have to stop the measurement
-            if(pthis->stop_measure())
-               rt_syslog(ATMD_ERR, "VirtualBoard [data_task]: failed to stop measure after save error.");
-          }
-
-          // Delete last measure
-          if(pthis->delete_measure(pthis->measures()-1)) {
-            // We have to stop the measurement
-            if(pthis->stop_measure())
-               rt_syslog(ATMD_ERR, "VirtualBoard [data_task]: failed to stop measure after delete error.");
+          // Queue chunk
+          Measure* chunk = curr_measure;
+          if(measure_end) {
+            retval = pthis->_writeq.push(chunk, filename, true);
+          } else {
+            retval = pthis->_writeq.try_push(chunk, filename, next);
+
+            // The pending chunk is bounded by the memory budget
+            size_t chunk_limit = (pthis->_config.memlimit() > 0) ? pthis->_config.memlimit() : ATMD_DEF_CHUNKLIMIT;
+            if(retval == -EWOULDBLOCK && chunk->resident_bytes() >= chunk_limit) {
+              rt_syslog(ATMD_WARN, "VirtualBoard [data_task]: pending chunk reached %lu bytes. Waiting for storage.", (unsigned long)chunk->resident_bytes());
+              retval = pthis->_writeq.wait_slot();
+              if(retval == 0)
+                retval = pthis->_writeq.try_push(chunk, filename, next);
+            }
           }
 
-          // Release lock of measure object
-          retval = pthis->release_lock();
-          if(retval) {
-            switch(retval) {
-              case -EINVAL:
-              case -EIDRM:
-                rt_syslog(ATMD_CRIT, "VirtualBoard [data_task]: failed to release measure mutex because it was an invalid object.");
-                break;
-
-              case -EPERM:
-                rt_syslog(ATMD_CRIT, "VirtualBoard [data_task]: failed to release measure mutex because it was asked in an invalid context.");
-                break;
+          if(retval == -EWOULDBLOCK) {
+            chunk->clear_times();
+            if(!stalled)
+              rt_syslog(ATMD_WARN, "VirtualBoard [data_task]: all autosave slots are in use, the chunk grows until storage catches up.");
+            stalled = true;
 
-              default:
-                rt_syslog(ATMD_CRIT, "VirtualBoard [data_task]: failed to release measure mutex for an unexpected reason (Code: %d).", retval);
-                break;
-            }
+          } else if(retval) {
+            rt_syslog(ATMD_CRIT, "VirtualBoard [data_task]: failed to queue measure for autosave (Code: %d).", retval);
+            chunk->unref();
 
             // Terminate server
             terminate_interrupt = true;
             return;
+
+          } else {
+            stalled = false;
+            pthis->increment_counter();
+
+            // Detach chunk. The next chunk is preallocated with the size of this
+            // one, so that a steady acquisition does not grow its arenas again.
+            if(!measure_end) {
+              curr_measure = new Measure(8*pthis->agents());
+              curr_measure->reserve(chunk->count_starts(), chunk->count_stops());
+              chunk_begin = rt_timer_read();
+            } else {
+              curr_measure = NULL;
+            }
           }
 
           if(measure_end) {
+            // Publish final histogram and coincidences
+            pthis->_hist_view.flush(rt_timer_read());
+            pthis->_coinc_view.flush(rt_timer_read());
+
             // Reset end flags
             for(size_t i = 0; i < pthis->agents(); i++)
               agent_end[i] = false;
@@ -1119,64 +1241,17 @@ void VirtualBoard::data_task(void *arg) {
             if(mon.enabled())
               mon.clear();
 
-            // Set status
-            pthis->status(ATMD_STATUS_IDLE);
-
+            // The writer task sets the status once the last chunk is saved
             continue;
           }
         }
       }
     }
 
-    // If current start is NULL, create one
-    if(curr_start[agent_id] == NULL) {
-      if(packet.type() == ATMD_DT_FIRST || packet.type() == ATMD_DT_ONLY) {
-        curr_start[agent_id] = new StartData;
-        curr_start[agent_id]->add_time(packet.window_start(), packet.window_time());
-        curr_start[agent_id]->set_tbin(pthis->get_tbin());
-        curr_start_id[agent_id] = packet.id();
-
-      } else if(packet.type() == ATMD_DT_TERM) {
-        continue;
-
-      } else {
-        // Error! We missed the first packet or something very bad happened
-        rt_syslog(ATMD_ERR, "VirtualBoard [data_task]: missed the first packet of a data sequence. Discarding current start.");
-        continue;
-      }
-
-    } else {
-      // Start id should not change until all the packets are received.
-      // The order of packets from a single agent is guaranteed, but it is not between different agents.
-      // We need to handle out of sequence packets (maybe we can implement a FIFO of out of sequence packets that will be processed after the current start is over)
-      if(curr_start_id[agent_id] != packet.id()) {
-        rt_syslog(ATMD_ERR, "VirtualBoard [data_task]: packet out of sequence! PANIC!");
-        rt_syslog(ATMD_INFO, "VirtualBoard [data_task]: agent '%s' sent a packet with start ID (%d) while we are still receiving start (%d).", ether_ntoa(pthis->get_agent(agent_id).agent_addr()), packet.id(), curr_start_id[agent_id]);
-        // TODO: handle out of sequence packets
-        continue;
-      }
-    }
-
-    // Extract events from packet
-    for(size_t i = 0; i < packet.numev(); i++) {
-      int8_t ch;
-      int32_t stop;
-      uint32_t retrig;
-      packet.getevent(i, ch, stop, retrig);
-      curr_start[agent_id]->add_event(retrig, stop, (ch > 0) ? ch + 8*agent_id : ch - 8*agent_id);
-    }
-
-    // If the packet was the last of its series set the done flag for this agent
-    if(packet.type() == ATMD_DT_LAST || packet.type() == ATMD_DT_ONLY)
-      agent_done[agent_id] = true;
-
-    // Check if all the agent are done
-    bool start_end = true;
-    for(size_t i = 0; i < agent_done.size(); i++)
-      start_end &= agent_done[i];
+    // Add the packet to the current start
+    if(assembler.add_packet(agent_id, packet, pthis->get_tbin()) == 1) {
+      std::vector<StartData*>& curr_start = assembler.start();
 
-    // If all agent are done, add start to measure
-    if(start_end) {
       // If monitor is enabled
       if(mon.enabled()) {
         // Add start
@@ -1191,19 +1266,164 @@ void VirtualBoard::data_task(void *arg) {
         curr_start[i]->id(bnumber);
 #endif
 
-      // Add current start to curr_measure
-      curr_measure->add_start(curr_start);
+      // Add current start to curr_measure and fill rate meter, live histogram, coincidences and subscribers
+      if(curr_measure->add_start(curr_start) == 0) {
+        RTIME now = rt_timer_read();
+        pthis->_rate.add_start(*curr_measure, curr_measure->count_starts()-1, now);
+        if(pthis->_hist_view.live().enabled()) {
+          pthis->_hist_view.live().add_start(*curr_measure, curr_measure->count_starts()-1);
+          pthis->_hist_view.update(now, ATMD_HIST_PUBLISH);
+        }
+        if(pthis->_coinc_view.live().enabled()) {
+          pthis->_coinc_view.live().add_start(*curr_measure, curr_measure->count_starts()-1);
+          pthis->_coinc_view.update(now, ATMD_HIST_PUBLISH);
+        }
+        pthis->_stream.publish(*curr_measure, curr_measure->count_starts()-1);
+      }
 
       // Clean up curr start
-      for(size_t i = 0; i < curr_start.size(); i++) {
-        delete curr_start[i];
-        curr_start[i] = NULL;
-      }
+      assembler.clear();
+    }
+  }
+}
+
+
+/* @fn VirtualBoard::chunk_filename(size_t num)
+ * Format the autosave filename of a chunk.
+ *
+ * @param num The chunk counter.
+ * @return The filename.
+ */
+std::string VirtualBoard::chunk_filename(size_t num)const {
+  std::stringstream file_number(std::stringstream::out);
+  file_number.width(4);
+  file_number.fill('0');
+  file_number << num;
+  return get_prefix() + "_" + file_number.str() + get_format_ext();
+}
+
+
+/* @fn static void VirtualBoard::writer_task(void *arg)
+ * Autosave writer. Saves the chunks queued by the data task, so that disk and
+ * FTP latency never stall acquisition. The last chunk of a measure is flushed
+ * here too: the data task never waits for it, and the board goes idle only
+ * once it is saved, so clients polling the status never read partial files. Between jobs it also spills the
+ * stored measures when they exceed the memory budget. On a save error the measure is stopped,
+ * as the data task used to do. The queue is drained before termination.
+ * With rolling files each chunk is written aside and renamed when complete, so
+ * a file that appears under its final name is always whole.
+ * Once a rolling chunk is saved, the file of the next one is preallocated, so
+ * its extents are already reserved when that chunk is cut.
+ *
+ * @param arg Cookie for the task (pointer to the board object).
+ */
+void VirtualBoard::writer_task(void *arg) {
+
+  int retval = 0;
+
+  // Init rt_printf and rt_syslog
+  rt_print_auto_init(1);
+  rt_syslog(ATMD_INFO, "VirtualBoard [writer_task]: successfully started autosave writer thread.");
+
+  // Cast back 'this' pointer
+  VirtualBoard *pthis = (VirtualBoard*)arg;
+
+  // Prevent this task to send SIGDEBUG when switching to secondary mode
+  rt_task_set_mode(T_WARNSW, 0, NULL);
+
+  while(true) {
+    // Spill stored measures if the data task found them over budget
+    if(pthis->_spill_due && pthis->enforce_memlimit())
+      rt_syslog(ATMD_ERR, "VirtualBoard [writer_task]: failed to spill measures to disk.");
+
+    WriteJob job;
+    retval = pthis->_writeq.pop(job, 100000000);
+    if(retval == -ETIMEDOUT) {
+      if(terminate_interrupt)
+        break;
+      continue;
+    }
+    if(retval) {
+      rt_syslog(ATMD_CRIT, "VirtualBoard [writer_task]: failed to get a job from the autosave queue (Code: %d).", retval);
+      terminate_interrupt = true;
+      break;
+    }
 
-      // Reset flags
-      for(size_t i = 0; i < agent_done.size(); i++)
-        agent_done[i] = false;
+    // Save measure (rolling files are renamed in place only when complete)
+    uint64_t roll_bytes = 0;
+    uint32_t roll_time = 0;
+    pthis->get_rolling(roll_bytes, roll_time);
+    bool success = (pthis->save_locked(*job.meas, job.filename, (roll_bytes > 0 || roll_time > 0)) == 0);
+    if(!success) {
+      rt_syslog(ATMD_ERR, "VirtualBoard [writer_task]: save of \"%s\" in autosave mode failed.", job.filename.c_str());
+      // We have to stop the measurement (unless it is already over)
+      if(!job.last && pthis->stop_measure())
+         rt_syslog(ATMD_ERR, "VirtualBoard [writer_task]: failed to stop measure after save error.");
     }
+
+    // Reserve the next rolling file ahead of the roll, sized like this chunk
+    // (or like the roll size). Failures only cost the reservation.
+    if(success && job.next != "") {
+      uint64_t size = (roll_bytes > 0) ? roll_bytes : export_size(*job.meas, pthis->get_format(), pthis->agents());
+      pthis->preallocate(job.next, size);
+    }
+
+    // Release the chunk
+    job.meas->unref();
+    pthis->_writeq.done(job, success);
+
+    // The measure is over only when its last chunk is on storage
+    if(job.last)
+      pthis->status(ATMD_STATUS_IDLE);
+  }
+}
+
+
+/* @fn static void VirtualBoard::monitor_task(void *arg)
+ * Monitor writer. Packs the starts frozen by the data task and replaces the
+ * monitor file with them. The file is written aside and renamed, so readers of
+ * the monitor file never see a partial write. Errors are logged but do not
+ * stop the measure.
+ *
+ * @param arg Cookie for the task (pointer to the board object).
+ */
+void VirtualBoard::monitor_task(void *arg) {
+
+  int retval = 0;
+
+  // Init rt_printf and rt_syslog
+  rt_print_auto_init(1);
+  rt_syslog(ATMD_INFO, "VirtualBoard [monitor_task]: successfully started monitor writer thread.");
+
+  // Cast back 'this' pointer
+  VirtualBoard *pthis = (VirtualBoard*)arg;
+
+  // Prevent this task to send SIGDEBUG when switching to secondary mode
+  rt_task_set_mode(T_WARNSW, 0, NULL);
+
+  while(true) {
+    WriteJob job;
+    retval = pthis->_monq.pop(job, 100000000);
+    if(retval == -ETIMEDOUT) {
+      if(terminate_interrupt)
+        break;
+      continue;
+    }
+    if(retval) {
+      rt_syslog(ATMD_CRIT, "VirtualBoard [monitor_task]: failed to get a job from the monitor queue (Code: %d).", retval);
+      terminate_interrupt = true;
+      break;
+    }
+
+    // Pack the frozen starts (the data task does not touch them until done())
+    Measure* meas = pthis->pack_monitor();
+    bool success = (meas && pthis->save_locked(*meas, job.filename, true) == 0);
+    if(!success)
+      rt_syslog(ATMD_ERR, "VirtualBoard [monitor_task]: failed to refresh monitor file \"%s\".", job.filename.c_str());
+
+    if(meas)
+      meas->unref();
+    pthis->_monq.done(job, success);
   }
 }
 
@@ -1252,6 +1472,10 @@ void VirtualBoard::clear_config() {
   // Autosave after numofstarts
   _autosave = 0;
 
+  // Rolling files disabled
+  _roll_bytes = 0;
+  _roll_time = 0;
+
   // Autosave counter
   _auto_counter = 0;
 
@@ -1265,6 +1489,16 @@ void VirtualBoard::clear_config() {
   _monitor_n = 0;
   _monitor_m = 0;
   _monitor_name = "";
+
+  // Histogram parameters
+  _hist_width = 1;
+  _hist_nbins = 0;
+  _hist_offset = 0;
+
+  // Coincidence parameters
+  _coinc_tol = 0;
+  _coinc_width = 1;
+  _coinc_groups.clear();
 }
 
 
@@ -1277,57 +1511,214 @@ void VirtualBoard::clear_config() {
  */
 int VirtualBoard::save_measure(size_t measure_num, const std::string& filename) {
 
+  // Let the writer complete the pending autosave chunks first
+  if(_writeq.wait_idle())
+    rt_syslog(ATMD_ERR, "VirtualBoard [save_measure]: failed to wait for the autosave writer.");
+
+  // Work on a snapshot, so the measure list is not locked while saving
+  MeasureSnapshot snap = this->snapshot();
+
   // Check if the measure number is valid.
-  if(measure_num < 0 || measure_num >= this->measures()) {
+  if(measure_num >= snap.size()) {
     rt_syslog(ATMD_ERR, "VirtualBoard [save_measure]: trying to save a non existent measure.");
     return -1;
   }
 
-  return measure2file(_measures[measure_num]->starts, _measures[measure_num]->measure_begin, _measures[measure_num]->measure_time, filename);
+  return save_locked(snap[measure_num], filename);
+}
+
+
+/* @fn int VirtualBoard::save_all(const std::string& prefix, SaveProgress* progress, size_t& failed)
+ * Save all the stored measures, one job per measure on the save worker pool.
+ * Each save also spreads its own work (columns, compression, text ranges) on
+ * the export pool. Like save_measure() it works on a snapshot, so acquisition
+ * goes on while saving. Pending autosave chunks are written first.
+ *
+ * @param prefix The filename prefix.
+ * @param progress Receiver of the progress (can be NULL).
+ * @param failed Output number of measures that failed to save.
+ * @return Return 0 on success (even if some measure failed), -1 on error.
+ */
+int VirtualBoard::save_all(const std::string& prefix, SaveProgress* progress, size_t& failed) {
+
+  // Let the writer complete the pending autosave chunks first
+  if(_writeq.wait_idle())
+    rt_syslog(ATMD_ERR, "VirtualBoard [save_all]: failed to wait for the autosave writer.");
+
+  MeasureSnapshot snap = this->snapshot();
+  failed = 0;
+
+  std::vector<SaveJob> jobs(snap.size());
+  std::vector<PoolJob*> ptrs(snap.size());
+  for(size_t i = 0; i < snap.size(); i++) {
+    std::stringstream file_number(std::stringstream::out);
+    file_number.width(4);
+    file_number.fill('0');
+    file_number << i;
+    jobs[i].setup(this, &(snap[i]), i, prefix + "_" + file_number.str() + get_format_ext(), progress);
+    ptrs[i] = &(jobs[i]);
+  }
+
+  if(progress)
+    progress->begin(jobs.size());
+  if(jobs.size() == 0)
+    return 0;
+
+  _save_pool.run(&(ptrs[0]), ptrs.size());
+
+  for(size_t i = 0; i < jobs.size(); i++)
+    if(!jobs[i].success())
+      failed++;
+
+  return 0;
+}
+
+
+/* @fn int VirtualBoard::save_batched(const Measure& meas, size_t num, const std::string& filename, SaveProgress* progress)
+ * Save one measure of a batch. Local files are written concurrently with the
+ * other jobs; FTP formats take the save mutex, as they share the CURL handle.
+ *
+ * @param meas The measure.
+ * @param num The number of the measure.
+ * @param filename The filename.
+ * @param progress Receiver of the progress (can be NULL).
+ * @return Return 0 on success, -1 on error.
+ */
+int VirtualBoard::save_batched(const Measure& meas, size_t num, const std::string& filename, SaveProgress* progress) {
+  int retval = 0;
+  if(_format == ATMD_FORMAT_MATPS2_FTP || _format == ATMD_FORMAT_MATPS2_ALL || _format == ATMD_FORMAT_MATPS3_FTP || _format == ATMD_FORMAT_MATPS3_ALL)
+    retval = save_locked(meas, filename);
+  else
+    retval = measure2file(meas, filename);
+
+  if(progress && rt_mutex_acquire(&_progress_mutex, TM_INFINITE) == 0) {
+    try {
+      progress->saved(num, filename, (retval == 0));
+    } catch(...) {
+      rt_syslog(ATMD_ERR, "VirtualBoard [save_batched]: progress receiver threw an exception.");
+    }
+    rt_mutex_release(&_progress_mutex);
+  }
+
+  return retval;
+}
+
+
+/* @fn SaveJob::run()
+ * Save the measure of the job.
+ *
+ * @return Return 0 on success, -1 on error.
+ */
+int SaveJob::run() {
+  _success = (_board->save_batched(*_meas, _num, _filename, _progress) == 0);
+  return (_success) ? 0 : -1;
 }
 
 
 /* @fn int VirtualBoard::save_monitor(Monitor& mon)
+ * If the monitor is due, freeze its starts and hand them to the monitor task,
+ * which packs them into a measure and replaces the monitor file atomically.
+ * If the previous refresh is still being written this one is skipped, so the
+ * data task never waits for storage nor copies the starts.
  *
- * @param ...
+ * @param mon The monitor.
  * @return Return 0 on success, -1 on error.
  */
 int VirtualBoard::save_monitor(Monitor& mon) {
 
-  if(mon._count >= _monitor_n) {
-    // Compile measure times
-    std::vector<uint64_t> measure_begin;
-    std::vector<uint64_t> measure_time;
+  if(!mon.due() || mon.start_count() == 0)
+    return 0;
+  mon._count = 0;
 
-    for(size_t i = 0; i < agents(); i++) {
-      if(mon._data.front()->times() > i) {
-        measure_begin.push_back(mon._data.front()->get_window_begin(i));
-        measure_time.push_back(mon._data.back()->get_window_begin(i)+mon._data.back()->get_window_time(i));
-      }
-    }
+  // Previous refresh still in progress (its starts stay frozen)
+  if(_monq.full())
+    return 0;
+  mon.release();
 
-    // Save
-    mon._count = 0;
-    return measure2file(mon._data, measure_begin, measure_time, _monitor_name);
+  // The job carries no measure: the monitor task packs the frozen starts
+  mon.freeze();
+  if(_monq.try_push(NULL, _monitor_name))
+    mon.release();
 
-  } else {
-    mon._count++;
-    return 0;
+  return 0;
+}
+
+
+/* @fn Measure* VirtualBoard::pack_monitor()
+ * Pack the starts frozen in the monitor into a measure (monitor task).
+ *
+ * @return The measure (owned by the caller), NULL on error.
+ */
+Measure* VirtualBoard::pack_monitor() {
+  const std::vector<const StartData*>& starts = _monitor.frozen();
+  if(starts.size() == 0)
+    return NULL;
+
+  Measure* measure = NULL;
+  try {
+    measure = new Measure;
+    size_t stops = 0;
+    for(size_t i = 0; i < starts.size(); i++)
+      stops += starts[i]->count_stops();
+    measure->reserve(starts.size(), stops);
+  } catch(std::exception& e) {
+    rt_syslog(ATMD_ERR, "VirtualBoard [pack_monitor]: memory allocation failed with error %s", e.what());
+    if(measure)
+      measure->unref();
+    return NULL;
   }
+
+  for(size_t i = 0; i < starts.size(); i++) {
+    if(measure->add_start(*(starts[i]))) {
+      measure->unref();
+      return NULL;
+    }
+  }
+
+  // Compile measure times
+  const StartData* first = starts.front();
+  const StartData* last = starts.back();
+  for(size_t i = 0; i < agents(); i++) {
+    if(first->times() > i && last->times() > i)
+      measure->add_time(first->get_window_begin(i), last->get_window_begin(i)+last->get_window_time(i));
+  }
+
+  return measure;
 }
 
 
-/* @fn int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std::vector<uint64_t>& begin, const std::vector<uint64_t>& time, std::string filename)
- * Save a vector of starts to a file in the specified format.
+/* @fn int VirtualBoard::save_locked(const Measure& meas, const std::string& filename, bool atomic)
+ * Save a measure holding the save mutex. Saves can be requested by the network
+ * thread, the data task (monitor) and the writer task, which all share the
+ * CURL handle. Batch saves of local files do not need it (see save_batched()).
  *
- * @param ...
+ * @param meas The measure.
+ * @param filename The filename.
+ * @param atomic If true the local file is replaced atomically.
  * @return Return 0 on success, -1 on error.
  */
-int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std::vector<uint64_t>& begin, const std::vector<uint64_t>& time, std::string filename) {
+int VirtualBoard::save_locked(const Measure& meas, const std::string& filename, bool atomic) {
+  int retval = rt_mutex_acquire(&_save_mutex, TM_INFINITE);
+  if(retval) {
+    rt_syslog(ATMD_ERR, "VirtualBoard [save_locked]: failed to acquire save mutex (Code: %d).", retval);
+    return -1;
+  }
 
-  // File handles
-  std::fstream savefile;
-  MatFile mat_savefile;
+  retval = measure2file(meas, filename, atomic);
+
+  rt_mutex_release(&_save_mutex);
+  return retval;
+}
+
+
+/* @fn int VirtualBoard::save_path(std::string& filename, std::string& fullpath)
+ * Sanitize a save filename and create the directories of the local file.
+ *
+ * @param filename The filename, relative path syntax is removed in place.
+ * @param fullpath Return the path of the local file under /home/data.
+ * @return Return 0 on success, -1 on error.
+ */
+int VirtualBoard::save_path(std::string& filename, std::string& fullpath) {
 
   // For safety we remove all relative path syntax
   pcrecpp::RE("\\.\\.\\/").GlobalReplace("", &filename);
@@ -1335,7 +1726,7 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
   filename.erase(0,1);
 
   // For safety the supplied path is taken relative to /home/data
-  std::string fullpath = "/home/data/";
+  fullpath = "/home/data/";
 
   // Now we check that all path elements exists
   pcrecpp::StringPiece input(filename);
@@ -1348,24 +1739,76 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
     if(stat(fullpath.c_str(), &st) == -1) {
       if(errno == ENOENT) {
         // Path does not exist
-        if(mkdir(fullpath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH)) {
-          rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: error creating save path \"%s\" (Error: %s).", fullpath.c_str(), strerror(errno));
+        if(mkdir(fullpath.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) && errno != EEXIST) {
+          rt_syslog(ATMD_ERR, "VirtualBoard [save_path]: error creating save path \"%s\" (Error: %s).", fullpath.c_str(), strerror(errno));
           return -1;
         }
 
         // Change owner to 'user'
         if(chown(fullpath.c_str(), _config.uid(), _config.gid())) {
-          rt_syslog(ATMD_WARN, "VirtualBoard [measure2file]: error changing owner for director \"%s\" (Error %s).", fullpath.c_str(), strerror(errno));
+          rt_syslog(ATMD_WARN, "VirtualBoard [save_path]: error changing owner for director \"%s\" (Error %s).", fullpath.c_str(), strerror(errno));
         }
 
       } else {
         // Error
-        rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: error checking save path \"%s\" (Error: %s).", fullpath.c_str(), strerror(errno));
+        rt_syslog(ATMD_ERR, "VirtualBoard [save_path]: error checking save path \"%s\" (Error: %s).", fullpath.c_str(), strerror(errno));
         return -1;
       }
     }
   }
   fullpath.append(input.as_string());
+  return 0;
+}
+
+
+/* @fn int VirtualBoard::preallocate(const std::string& filename, uint64_t size)
+ * Reserve the disk space of the file a rolling chunk will be written to (the
+ * '.tmp' file of an atomic save), so that the extents of the next chunk are
+ * allocated while acquisition is still filling it.
+ *
+ * @param filename The filename of the chunk.
+ * @param size The space to reserve.
+ * @return Return 0 on success, -1 on error.
+ */
+int VirtualBoard::preallocate(const std::string& filename, uint64_t size) {
+  // Nothing to reserve for FTP only formats
+  if(_format == ATMD_FORMAT_MATPS2_FTP || _format == ATMD_FORMAT_MATPS3_FTP || size == 0)
+    return 0;
+
+  std::string name = filename;
+  std::string fullpath;
+  if(save_path(name, fullpath))
+    return -1;
+
+  if(FileWriter::preallocate(fullpath + ".tmp", size)) {
+    rt_syslog(ATMD_WARN, "VirtualBoard [preallocate]: cannot reserve %llu bytes for \"%s\" (Error: %s).", (unsigned long long)size, (fullpath + ".tmp").c_str(), strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+
+/* @fn int VirtualBoard::measure2file(const Measure& meas, std::string filename, bool atomic)
+ * Save a measure to a file in the specified format.
+ *
+ * @param meas The measure.
+ * @param filename The filename.
+ * @param atomic If true the local file is replaced atomically (written aside and renamed).
+ * @return Return 0 on success, -1 on error.
+ */
+int VirtualBoard::measure2file(const Measure& meas, std::string filename, bool atomic) {
+
+  // File handles
+  MatFile mat_savefile;
+  FileWriter out;         // Binary and text formats
+
+  // Sanitize the filename and create the path to the local file
+  std::string fullpath;
+  if(save_path(filename, fullpath))
+    return -1;
+
+  // With 'atomic' the file is written aside and renamed over the destination when complete
+  std::string filepath = (atomic) ? fullpath + ".tmp" : fullpath;
 
   // URL for FTP transfers
   std::string fullurl = "";
@@ -1398,8 +1841,12 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
     switch(_format) {
       case ATMD_FORMAT_BINPS:
       case ATMD_FORMAT_BINRAW:
-        rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: binary format is not supported any more.");
-        return -1;
+        if(out.open(filepath, _config.directio(), export_size(meas, _format, agents()))) {
+          rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: error opening binary file \"%s\" (Error: %s).", filepath.c_str(), strerror(errno));
+          return -1;
+        }
+        lock_fd = out.fd();
+        break;
 
       case ATMD_FORMAT_DEBUG:
         rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: debug text format is not supported any more.");
@@ -1411,9 +1858,9 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
       case ATMD_FORMAT_MATRAW:
       case ATMD_FORMAT_MATPS2_ALL:
       case ATMD_FORMAT_MATPS3_ALL:
-        mat_savefile.open(fullpath);
+        mat_savefile.open(filepath, _config.directio(), export_size(meas, _format, agents()));
         if(!mat_savefile.IsOpen()) {
-          rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: cannot open Matlab file %s.", fullpath.c_str());
+          rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: cannot open Matlab file %s.", filepath.c_str());
           return -1;
         }
         lock_fd = mat_savefile.fd();
@@ -1423,17 +1870,15 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
       case ATMD_FORMAT_PS:
       case ATMD_FORMAT_US:
         // Open in text format
-        savefile.open(fullpath.c_str(), std::fstream::out | std::fstream::trunc);
-        savefile.precision(15);
-        if(!savefile.is_open()) {
-          rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: error opening text file \"%s\".", fullpath.c_str());
+        if(out.open(filepath, _config.directio(), export_size(meas, _format, agents()))) {
+          rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: error opening text file \"%s\" (Error: %s).", filepath.c_str(), strerror(errno));
           return -1;
         }
-        lock_fd = fileno(savefile);
+        lock_fd = out.fd();
         break;
     }
 
-    rt_syslog(ATMD_INFO, "VirtualBoard [measure2file]: saving to file \"%s\". File descriptor: (%d)", fullpath.c_str(), lock_fd);
+    rt_syslog(ATMD_INFO, "VirtualBoard [measure2file]: saving to file \"%s\". File descriptor: (%d)", filepath.c_str(), lock_fd);
   }
 
   // Acquire lock on file
@@ -1444,64 +1889,20 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
       rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: successfully locked file (%d)", lock_fd);
   }
 
-  StartData* current_start;
-
-  double stoptime;
-  int8_t channel;
-  uint32_t ref_count;
-
-  // Matlab definitions
-  MatVector<double> data("data", mxDOUBLE_CLASS);
-  MatVector<uint32_t> data_st("start", mxUINT32_CLASS);
-  MatVector<int8_t> data_ch("channel", mxINT8_CLASS);
-  MatVector<double> data_stop("stoptime", mxDOUBLE_CLASS);
-  MatVector<uint32_t> measure_begin("measure_begin", mxUINT32_CLASS);
-  MatVector<uint32_t> measure_time("measure_time", mxUINT32_CLASS);
-  MatVector<uint32_t> stat_times("stat_times", mxUINT32_CLASS);
-
-  uint32_t num_events = 0, ev_ind = 0;
-
-  std::stringstream txtbuffer(std::stringstream::in);
-
   switch(_format) {
+    case ATMD_FORMAT_BINPS: // Binary format with stoptimes in ps
+    case ATMD_FORMAT_BINRAW: // Binary format with raw stoptimes and retriggers
+      if(measure2bin(meas, _format, agents(), out, &_pool))
+        return -1;
+      break;
+
     case ATMD_FORMAT_RAW:
     case ATMD_FORMAT_US:
     case ATMD_FORMAT_PS:
     default:
-
-      // We make sure that the string stream is empty
-      txtbuffer.str("");
-
-      // We write an header
-      if(_format == ATMD_FORMAT_RAW)
-        txtbuffer << "start\tchannel\tslope\trefcount\tstoptime" << std::endl;
-      else
-        txtbuffer << "start\tchannel\tslope\tstoptime" << std::endl;
-
-      // We cycle over all starts
-      for(size_t i = 0; i < starts.size(); i++) {
-        if(!(current_start = starts[i])) {
-          rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: trying to save a non existent start.");
-          return -1;
-        }
-
-        // We cycle over all stops of current start
-        for(size_t j = 0; j < current_start->count_stops(); j++) {
-          current_start->get_channel(j, channel);
-
-          if(_format == ATMD_FORMAT_RAW) {
-            current_start->get_rawstoptime(j, ref_count, stoptime);
-            txtbuffer << i+1 << "\t" << (int32_t)channel << "\t" << ref_count << "\t" << stoptime << std::endl;
-
-          } else {
-            current_start->get_stoptime(j, stoptime);
-            txtbuffer << i+1 << "\t" << (int32_t)channel << "\t" << ((_format == ATMD_FORMAT_US) ? (stoptime / 1e6) : stoptime) << std::endl;
-          }
-        }
-      }
-
-      // We write the string stream to the output file
-      savefile << txtbuffer.str();
+      // Text is formatted in blocks by the worker pool and streamed to the file
+      if(measure2text(meas, _format, out, &_pool))
+        return -1;
       break;
 
 
@@ -1511,119 +1912,69 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
     case ATMD_FORMAT_MATPS2_ALL: // Same as previous but saved both locally and via FTP
     case ATMD_FORMAT_MATPS3:
     case ATMD_FORMAT_MATPS3_FTP:
-    case ATMD_FORMAT_MATPS3_ALL:
+    case ATMD_FORMAT_MATPS3_ALL: {
+      // The layout is computed up front and the data streamed from the measure columns
+      MeasureMat matlayout(meas, _format, agents());
+      if(!matlayout.valid())
+        return -1;
 
-      /* First of all we should count all the events */
-      num_events = 0;
-      for(size_t i = 0; i < starts.size(); i++) {
-        if(!(current_start = starts[i])) {
-          rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: trying to stat a non existent start.");
+      // Compressed output
+      if(_config.matcompress() > 0)
+        matlayout.stream().set_compression(_config.matcompress(), &_pool);
+
+      if(_format != ATMD_FORMAT_MATPS2_FTP && _format != ATMD_FORMAT_MATPS3_FTP) {
+        // Write to file
+        if(matlayout.stream().write(mat_savefile)) {
+          rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: error writing Matlab file \"%s\".", filepath.c_str());
           return -1;
         }
-        num_events += current_start->count_stops();
       }
 
-      // Measure times
-      measure_begin.resize(begin.size(),2);
-      measure_time.resize(time.size(),2);
-      for(size_t i = 0; i < begin.size(); i++) {
-        measure_begin(i,0) = begin[i] / 1000000000;
-        measure_begin(i,1) = (begin[i] % 1000000000) / 1000;
-        measure_time(i,0) = time[i] / 1000000000;
-        measure_time(i,1) = (time[i] % 1000000000) / 1000;
-      }
-
-      // Vector resizes
-      if(_format == ATMD_FORMAT_MATPS1) {
-        data.resize(num_events,3);
-      } else {
-        data_st.resize(num_events,1);
-        data_ch.resize(num_events,1);
-        data_stop.resize(num_events,1);
-      }
 
-      if(_format == ATMD_FORMAT_MATPS3 || _format == ATMD_FORMAT_MATPS3_FTP || _format == ATMD_FORMAT_MATPS3_ALL)
-        stat_times.resize(starts.size(), 2 * agents());
-
-      // Save data
-      ev_ind = 0;
-      for(size_t i = 0; i < starts.size(); i++) {
-        if(!(current_start = starts[i])) {
-          rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: trying to save a non existent start.");
-          return -1;
-        }
+      if(_format == ATMD_FORMAT_MATPS2_FTP || _format == ATMD_FORMAT_MATPS2_ALL || _format == ATMD_FORMAT_MATPS3_FTP || _format == ATMD_FORMAT_MATPS3_ALL) {
 
-#ifdef EN_TANGO
-          uint32_t startid = current_start->id();
-          if(startid == 0)
-            startid = i+1;
-#else
-          uint32_t startid = i+1;
-#endif
+        MatStream& matstream = matlayout.stream();
+        matstream.reset();
 
-        // Save data
-        for(size_t j = 0; j < current_start->count_stops(); j++) {
-          current_start->get_channel(j, channel);
-          current_start->get_stoptime(j, stoptime);
+        // Compressed element sizes are known only once written, so a compressed
+        // upload is sent from a file: the local copy or a temporary spool file
+        FILE* upload = NULL;
+        curl_off_t upload_size = matstream.total_size();
+        if(matstream.compression() > 0) {
+          if(_format == ATMD_FORMAT_MATPS2_ALL || _format == ATMD_FORMAT_MATPS3_ALL) {
+            mat_savefile.flush();
+            upload = fopen(filepath.c_str(), "rb");
 
-          if(_format == ATMD_FORMAT_MATPS1) {
-            data(ev_ind, 0) = double(startid);
-            data(ev_ind, 1) = double(channel);
-            data(ev_ind, 2) = stoptime;
           } else {
-            data_st(ev_ind,0) = startid;
-            data_ch(ev_ind,0) = channel;
-            data_stop(ev_ind,0) = stoptime;
+            std::string path = _config.spooldir() + "/atmd_upload_XXXXXX";
+            std::vector<char> tmpl(path.begin(), path.end());
+            tmpl.push_back('\0');
+            int fd = mkstemp(&(tmpl[0]));
+            if(fd == -1) {
+              rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: cannot create upload file \"%s\" (Error: %s).", path.c_str(), strerror(errno));
+              return -1;
+            }
+            ::close(fd);
+
+            MatFile tmpfile;
+            tmpfile.open(&(tmpl[0]));
+            int ret = matstream.write(tmpfile);
+            tmpfile.close();
+            if(ret == 0)
+              upload = fopen(&(tmpl[0]), "rb");
+            unlink(&(tmpl[0]));
           }
-          ev_ind++;
-        }
 
-        // Save start times
-        if(_format == ATMD_FORMAT_MATPS3 || _format == ATMD_FORMAT_MATPS3_FTP || _format == ATMD_FORMAT_MATPS3_ALL) {
-          size_t k = current_start->times();
-          if(k > agents()) {
-            k = agents();
-            rt_syslog(ATMD_WARN, "VirtualBoard [measure2file]: found a start that had more timings than the number of agents.");
-          }
-          for(size_t j = 0; j < k; j++) {
-            stat_times(i,2*j) = (uint32_t)( current_start->get_window_begin(j) / 1000 );
-            stat_times(i,2*j+1) = (uint32_t)( current_start->get_window_time(j) / 1000 );
+          struct stat ust;
+          if(upload == NULL || fstat(fileno(upload), &ust)) {
+            rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: cannot prepare compressed file for upload.");
+            if(upload)
+              fclose(upload);
+            return -1;
           }
-        }
-      }
-
-
-      if(_format != ATMD_FORMAT_MATPS2_FTP && _format != ATMD_FORMAT_MATPS3_FTP) {
-        // Write vectors to file
-        measure_begin.write(mat_savefile);
-        measure_time.write(mat_savefile);
-
-        if(_format == ATMD_FORMAT_MATPS1) {
-          data.write(mat_savefile);
-
-        } else {
-          data_st.write(mat_savefile);
-          data_ch.write(mat_savefile);
-          data_stop.write(mat_savefile);
+          upload_size = ust.st_size;
         }
 
-        if(_format == ATMD_FORMAT_MATPS3 || _format == ATMD_FORMAT_MATPS3_ALL)
-          stat_times.write(mat_savefile);
-      }
-
-
-      if(_format == ATMD_FORMAT_MATPS2_FTP || _format == ATMD_FORMAT_MATPS2_ALL || _format == ATMD_FORMAT_MATPS3_FTP || _format == ATMD_FORMAT_MATPS3_ALL) {
-
-        MatObj matobj;
-
-        matobj.add_obj((MatMatrix*) &measure_begin);
-        matobj.add_obj((MatMatrix*) &measure_time);
-        matobj.add_obj((MatMatrix*) &data_st);
-        matobj.add_obj((MatMatrix*) &data_ch);
-        matobj.add_obj((MatMatrix*) &data_stop);
-        if(_format == ATMD_FORMAT_MATPS3 || _format == ATMD_FORMAT_MATPS3_FTP)
-          matobj.add_obj((MatMatrix*) &stat_times);
-
         // Configure FTP in binary mode
         struct curl_slist *headerlist = NULL;
         headerlist = curl_slist_append(headerlist, "TYPE I");
@@ -1631,11 +1982,16 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
         curl_easy_setopt(this->easy_handle, CURLOPT_FTP_CREATE_MISSING_DIRS, CURLFTP_CREATE_DIR_RETRY);
 
         // Setup of CURL options
-        curl_easy_setopt(this->easy_handle, CURLOPT_READFUNCTION, this->curl_read);
+        if(upload) {
+          curl_easy_setopt(this->easy_handle, CURLOPT_READFUNCTION, this->curl_read_file);
+          curl_easy_setopt(this->easy_handle, CURLOPT_READDATA, (void*) upload);
+        } else {
+          curl_easy_setopt(this->easy_handle, CURLOPT_READFUNCTION, UploadPipe::curl_read);
+          curl_easy_setopt(this->easy_handle, CURLOPT_READDATA, (void*) &_upload);
+        }
         curl_easy_setopt(this->easy_handle, CURLOPT_UPLOAD, 1L);
         curl_easy_setopt(this->easy_handle, CURLOPT_URL, fullurl.c_str());
-        curl_easy_setopt(this->easy_handle, CURLOPT_READDATA, (void*) &matobj);
-        curl_easy_setopt(this->easy_handle, CURLOPT_INFILESIZE_LARGE, (curl_off_t)matobj.total_size());
+        curl_easy_setopt(this->easy_handle, CURLOPT_INFILESIZE_LARGE, upload_size);
 
         rt_syslog(ATMD_INFO, "VirtualBoard [measure2file]: remotely saving measurement to \"%s/%s\".", this->_hostname.c_str(), filename.c_str());
 
@@ -1644,11 +2000,38 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
           rt_syslog(ATMD_DEBUG, "VirtualBoard [measure2file]: full url: %s.", fullurl.c_str());
 #endif
 
-        // Start network transfer
+        // Start network transfer. Failed transfers are restarted from the
+        // beginning of the file, waiting twice as long before each retry.
         struct timeval t_begin, t_end;
         gettimeofday(&t_begin, NULL);
 
-        if(curl_easy_perform(this->easy_handle)) {
+        int curl_ret = 0;
+        RTIME backoff = ATMD_UPLOAD_BACKOFF;
+        for(size_t attempt = 0; ; attempt++) {
+          if(upload) {
+            rewind(upload);
+          } else if(_upload.start(&matstream)) {
+            curl_ret = -1;
+            break;
+          }
+
+          curl_ret = curl_easy_perform(this->easy_handle);
+          if(!upload)
+            _upload.stop();
+
+          if(curl_ret == 0 || attempt >= ATMD_UPLOAD_RETRIES)
+            break;
+
+          rt_syslog(ATMD_WARN, "VirtualBoard [measure2file]: transfer failed with error \"%s\". Retrying in %.1fs.", this->curl_error, backoff / 1e9);
+          rt_task_sleep(backoff);
+          backoff *= 2;
+        }
+
+        curl_slist_free_all(headerlist);
+        curl_easy_setopt(this->easy_handle, CURLOPT_QUOTE, NULL);
+        if(upload)
+          fclose(upload);
+        if(curl_ret) {
           rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: failed to transfer file with libcurl with error \"%s\".", this->curl_error);
           return -1;
         }
@@ -1657,6 +2040,7 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
         gettimeofday(&t_end, NULL);
         rt_syslog(ATMD_INFO, "VirtualBoard [measure2file]: remote save performed in %fs.", (double)(t_end.tv_sec - t_begin.tv_sec) + (double)(t_end.tv_usec - t_begin.tv_usec) / 1e6);
       }
+    }
       break;
 
     case ATMD_FORMAT_MATRAW: /* Raw Matlab format with separate variables for start, channel, retriger count and stoptime */
@@ -1667,6 +2051,13 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
 
   // Release lock on file
   if(lock_fd >= 0) {
+    // Wait for the data still in flight before unlocking
+    int err = (mat_savefile.IsOpen()) ? mat_savefile.flush() : out.sync();
+    if(err) {
+      rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: error writing file \"%s\" (Error: %s).", filepath.c_str(), strerror(errno));
+      return -1;
+    }
+
     if(lockf(lock_fd, F_ULOCK, 0))
       rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: error releasing lock on file. Error: '%s'.", strerror(errno));
     else
@@ -1677,7 +2068,12 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
     case ATMD_FORMAT_RAW:
     case ATMD_FORMAT_PS:
     case ATMD_FORMAT_US:
-      savefile.close();
+    case ATMD_FORMAT_BINPS:
+    case ATMD_FORMAT_BINRAW:
+      if(out.close()) {
+        rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: error closing file \"%s\" (Error: %s).", filepath.c_str(), strerror(errno));
+        return -1;
+      }
       break;
 
     case ATMD_FORMAT_MATPS1:
@@ -1692,31 +2088,36 @@ int VirtualBoard::measure2file(const std::vector<StartData*>& starts, const std:
 
   // Change owner to file
   if(_format != ATMD_FORMAT_MATPS2_FTP && _format != ATMD_FORMAT_MATPS3_FTP) {
-    if(chown(fullpath.c_str(), _config.uid(), _config.gid()))
-      rt_syslog(ATMD_ERR, "Measure [measure2file]: cannot change owner of file \"%s\" (Error: %s).", fullpath.c_str(), strerror(errno));
-    if(chmod(fullpath.c_str(), S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH))
-      rt_syslog(ATMD_ERR, "Measure [measure2file]: cannot change mode of file \"%s\" (Error: %s).", fullpath.c_str(), strerror(errno));
+    if(chown(filepath.c_str(), _config.uid(), _config.gid()))
+      rt_syslog(ATMD_ERR, "Measure [measure2file]: cannot change owner of file \"%s\" (Error: %s).", filepath.c_str(), strerror(errno));
+    if(chmod(filepath.c_str(), S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH))
+      rt_syslog(ATMD_ERR, "Measure [measure2file]: cannot change mode of file \"%s\" (Error: %s).", filepath.c_str(), strerror(errno));
+
+    if(atomic && rename(filepath.c_str(), fullpath.c_str())) {
+      rt_syslog(ATMD_ERR, "VirtualBoard [measure2file]: cannot rename \"%s\" to \"%s\" (Error: %s).", filepath.c_str(), fullpath.c_str(), strerror(errno));
+      return -1;
+    }
   }
 
   return 0;
 }
 
 
-/* @fn VirtualBoard::curl_read(void *ptr, size_t size, size_t count, void *data)
- * Read callback for CURL network transfers
+/* @fn VirtualBoard::curl_read_file(void *ptr, size_t size, size_t count, void *data)
+ * Read callback for CURL network transfers of a file already written
  *
  * @param ptr Pointer to the curl output buffer
  * @param size Size of the data block
  * @param count Number of data block to copy
- * @param data Pointer to the input data structure
- * @return Return the number of bytes copied to ptr buffer
+ * @param data Pointer to the input FILE
+ * @return Return the number of bytes copied to ptr buffer, CURL_READFUNC_ABORT on error
  */
-size_t VirtualBoard::curl_read(void *ptr, size_t size, size_t count, void *data) {
-  // Restore pointer to buffer object
-  struct MatObj* matobj = (MatObj*)data;
+size_t VirtualBoard::curl_read_file(void *ptr, size_t size, size_t count, void *data) {
+  FILE* fp = (FILE*)data;
 
-  size_t bn = matobj->get_bytes((uint8_t*)ptr, size*count);
-  // Return number of byte copied to buffer
+  size_t bn = fread(ptr, 1, size*count, fp);
+  if(bn == 0 && ferror(fp))
+    return CURL_READFUNC_ABORT;
   return bn;
 }
 
@@ -1870,65 +2271,264 @@ int VirtualBoard::stop_measure() {
 }
 
 
-/* @fn VirtualBoard::stat_stops(uint32_t measure_number, std::vector< std::vector<uint32_t> >& stop_counts)
- * Return a vector of vectors of integers with the counts of stops on each channel.
+/* @fn VirtualBoard::snapshot()
+ * Take a reference on the published set of measures. The measure lock is not
+ * needed: the snapshot mutex only protects the pointer swap, so readers never
+ * wait for a writer doing I/O and vice versa.
+ *
+ * @return The snapshot (empty if the mutex cannot be acquired).
+ */
+MeasureSnapshot VirtualBoard::snapshot() {
+  if(rt_mutex_acquire(&this->_snap_mutex, TM_INFINITE)) {
+    rt_syslog(ATMD_ERR, "VirtualBoard [snapshot]: failed to acquire snapshot mutex.");
+    return MeasureSnapshot();
+  }
+
+  MeasureSet* set = this->_published;
+  if(set)
+    set->ref();
+
+  rt_mutex_release(&this->_snap_mutex);
+  return MeasureSnapshot(set);
+}
+
+
+/* @fn VirtualBoard::publish_measures()
+ * Publish a new set built from the current measure list and drop the
+ * reference on the previous one. Must be called with the measure lock held.
+ */
+void VirtualBoard::publish_measures() {
+  MeasureSet* set = NULL;
+  try {
+    set = MeasureSet::create(this->_measures);
+  } catch(std::exception& e) {
+    rt_syslog(ATMD_ERR, "VirtualBoard [publish_measures]: memory allocation failed with error %s", e.what());
+    return;
+  }
+
+  if(rt_mutex_acquire(&this->_snap_mutex, TM_INFINITE)) {
+    rt_syslog(ATMD_ERR, "VirtualBoard [publish_measures]: failed to acquire snapshot mutex.");
+    set->unref();
+    return;
+  }
+
+  MeasureSet* old = this->_published;
+  this->_published = set;
+
+  rt_mutex_release(&this->_snap_mutex);
+
+  // Measures no longer listed are deleted here, unless a reader still holds them
+  if(old)
+    old->unref();
+}
+
+
+/* @fn VirtualBoard::resident_bytes()
+ * Return the memory held in RAM by the stored measures.
+ *
+ * @return The number of bytes.
+ */
+size_t VirtualBoard::resident_bytes() {
+  MeasureSnapshot snap = this->snapshot();
+  size_t bytes = 0;
+  for(size_t i = 0; i < snap.size(); i++)
+    bytes += snap[i].resident_bytes();
+  return bytes;
+}
+
+
+/* @fn VirtualBoard::spilled_bytes()
+ * Return the size of the spill files of the stored measures.
+ *
+ * @return The number of bytes.
+ */
+size_t VirtualBoard::spilled_bytes() {
+  MeasureSnapshot snap = this->snapshot();
+  size_t bytes = 0;
+  for(size_t i = 0; i < snap.size(); i++)
+    bytes += snap[i].spilled_bytes();
+  return bytes;
+}
+
+
+/* @fn VirtualBoard::check_memlimit()
+ * If the memory used by the stored measures exceeds the configured budget,
+ * ask the writer task to spill some of them. Only the in-memory sizes are
+ * read, so the data task never waits for the spool directory.
+ * Must be called with the measure lock held.
+ */
+void VirtualBoard::check_memlimit() {
+  if(this->_config.memlimit() == 0)
+    return;
+
+  size_t resident = 0;
+  for(size_t i = 0; i < this->_measures.size(); i++)
+    resident += this->_measures[i]->resident_bytes();
+
+  if(resident > this->_config.memlimit())
+    this->_spill_due = true;
+}
+
+
+/* @fn VirtualBoard::enforce_memlimit()
+ * If the memory used by the stored measures exceeds the configured budget,
+ * spill the oldest measures to the spool directory until it does not any more.
+ * The victims are chosen under the measure lock, but they are written and
+ * mapped without it: stored measures are never modified, so each one is
+ * copied and then replaced in the list by its mapped copy, unless it was
+ * deleted meanwhile. The RAM of the original is released as soon as no
+ * snapshot refers to it. Called by the writer task.
  *
- * @param measure_number The number of the measure that we want to save.
- * @param stop_counts Reference to the vector of vectors to output the data.
  * @return Return 0 on success, -1 on error.
  */
-int VirtualBoard::stat_stops(uint32_t measure_number, std::vector< std::vector<uint32_t> >& stop_counts)const {
+int VirtualBoard::enforce_memlimit() {
+  if(this->_config.memlimit() == 0)
+    return 0;
 
-  // Check if the measure number is valid.
-  if(measure_number < 0 || measure_number >= this->measures()) {
-    rt_syslog(ATMD_ERR, "VirtualBoard [stat_stops]: trying to get statistics about a non existent measure.");
+  // Choose the victims
+  if(this->acquire_lock()) {
+    rt_syslog(ATMD_ERR, "VirtualBoard [enforce_memlimit]: failed to acquire measure mutex.");
     return -1;
   }
+  this->_spill_due = false;
 
-  std::vector<uint32_t> stops_ch(1+8*agents(),0);
-  StartData* current_start;
+  size_t resident = 0;
+  for(size_t i = 0; i < this->_measures.size(); i++)
+    resident += this->_measures[i]->resident_bytes();
 
-  // We cycle over all starts
-  for(size_t i = 0; i < this->_measures[measure_number]->count_starts(); i++) {
-    if(!(current_start = this->_measures[measure_number]->get_start(i))) {
-      rt_syslog(ATMD_ERR, "VirtualBoard [stat_stops]: trying to stat a non existent start.");
-      return -1;
+  std::vector<Measure*> victims;
+  for(size_t i = 0; i < this->_measures.size() && resident > this->_config.memlimit(); i++) {
+    if(this->_measures[i]->spilled())
+      continue;
+    this->_measures[i]->ref();
+    victims.push_back(this->_measures[i]);
+    resident -= this->_measures[i]->resident_bytes();
+  }
+  this->release_lock();
+
+  int retval = 0;
+  for(size_t v = 0; v < victims.size(); v++) {
+    Measure* meas = victims[v];
+    size_t bytes = meas->resident_bytes();
+
+    // Write and map without the lock
+    Measure* copy = NULL;
+    if(retval == 0) {
+      copy = meas->spill(this->_config.spooldir());
+      if(copy == NULL) {
+        rt_syslog(ATMD_ERR, "VirtualBoard [enforce_memlimit]: failed to spill a measure to \"%s\".", this->_config.spooldir().c_str());
+        retval = -1;
+      }
     }
 
-    // We save the measure time
-    if(current_start->times())
-      stops_ch[0] = (uint32_t)(current_start->get_window_time(0) / 1000);
+    // Swap in the mapped copy
+    if(copy) {
+      if(this->acquire_lock() == 0) {
+        size_t i = 0;
+        while(i < this->_measures.size() && this->_measures[i] != meas)
+          i++;
+        if(i < this->_measures.size()) {
+          this->_measures[i] = copy;
+          this->publish_measures();
+          meas->unref();
+          copy = NULL;
+          rt_syslog(ATMD_INFO, "VirtualBoard [enforce_memlimit]: spilled measure %lu (%lu bytes) to disk.", (unsigned long)i, (unsigned long)bytes);
+        }
+        this->release_lock();
+      }
 
-    // We cycle over all stops of current start
-    for(size_t j = 0; j < current_start->count_stops(); j++) {
-      int8_t ch;
-      current_start->get_channel(j, ch);
-      stops_ch[(ch > 0) ? ch : -ch]++;
+      // The measure was deleted while it was spilled
+      if(copy)
+        copy->unref();
     }
 
-    // We add the vector with counts to the output
-    stop_counts.push_back(stops_ch);
+    meas->unref();
+  }
+  if(retval)
+    return retval;
+
+  if(resident > this->_config.memlimit())
+    rt_syslog(ATMD_WARN, "VirtualBoard [enforce_memlimit]: memory used by measures (%lu bytes) still exceeds the limit.", (unsigned long)resident);
+
+  return 0;
+}
+
+
+/* @fn VirtualBoard::stat_stops(uint32_t measure_number, std::vector<uint32_t>& stop_counts)
+ * Return the counts of stops on each channel for every start. The counters are
+ * kept by the measure while it is acquired, so the event data is not scanned.
+ *
+ * @param measure_number The number of the measure that we want to stat.
+ * @param stop_counts Reference to the vector to output the data (one row of 1+8*agents() values per start).
+ * @return Return 0 on success, -1 on error.
+ */
+int VirtualBoard::stat_stops(uint32_t measure_number, std::vector<uint32_t>& stop_counts) {
+
+  // Check if the measure number is valid.
+  MeasureSnapshot snap = this->snapshot();
+  if(measure_number >= snap.size()) {
+    rt_syslog(ATMD_ERR, "VirtualBoard [stat_stops]: trying to get statistics about a non existent measure.");
+    return -1;
+  }
+
+  const Measure* meas = &(snap[measure_number]);
+  if(meas->nch() != 8*agents()) {
+    rt_syslog(ATMD_ERR, "VirtualBoard [stat_stops]: measure has %lu channels instead of %lu.", (unsigned long)meas->nch(), (unsigned long)(8*agents()));
+    return -1;
+  }
+
+  // Copy the statistic rows
+  if(meas->count_starts())
+    stop_counts.assign(meas->stat_rows(), meas->stat_rows() + meas->count_starts() * meas->stat_width());
+  else
+    stop_counts.clear();
+
+  return 0;
+}
+
+
+/* @fn VirtualBoard::stat_total(uint32_t measure_number, uint32_t& starts, std::vector<uint64_t>& totals)
+ * Return the counts of stops on each channel summed over all the starts.
+ *
+ * @param measure_number The number of the measure that we want to stat.
+ * @param starts Output of the number of starts.
+ * @param totals Reference to the vector to output the data (total window time in us and stops per channel).
+ * @return Return 0 on success, -1 on error.
+ */
+int VirtualBoard::stat_total(uint32_t measure_number, uint32_t& starts, std::vector<uint64_t>& totals) {
 
-    // We reset the counts
-    for(size_t j = 0; j < 1+8*agents(); j++)
-      stops_ch[j] = 0;
+  // Check if the measure number is valid.
+  MeasureSnapshot snap = this->snapshot();
+  if(measure_number >= snap.size()) {
+    rt_syslog(ATMD_ERR, "VirtualBoard [stat_total]: trying to get statistics about a non existent measure.");
+    return -1;
   }
 
+  const Measure* meas = &(snap[measure_number]);
+  if(meas->nch() != 8*agents()) {
+    rt_syslog(ATMD_ERR, "VirtualBoard [stat_total]: measure has %lu channels instead of %lu.", (unsigned long)meas->nch(), (unsigned long)(8*agents()));
+    return -1;
+  }
+
+  starts = meas->count_starts();
+  totals = meas->stat_totals();
   return 0;
 }
 
 
-/* @fn VirtualBoard::stat_stops(uint32_t measure_number, std::vector< std::vector<uint32_t> >& stop_counts, std::string win_start, std::string win_ampl)
- * Return a vector of vectors of integers with the counts of stops on each channel.
+/* @fn VirtualBoard::stat_stops(uint32_t measure_number, std::vector<uint32_t>& stop_counts, std::string win_start, std::string win_ampl)
+ * Return the counts of stops on each channel for every start, counting only
+ * the stops inside the given time window.
  *
- * @param measure_number The number of the measure that we want to save.
- * @param stop_counts Reference to the vector of vectors to output the data.
+ * @param measure_number The number of the measure that we want to stat.
+ * @param stop_counts Reference to the vector to output the data (one row of 1+8*agents() values per start).
  * @return Return 0 on success, -1 on error.
  */
-int VirtualBoard::stat_stops(uint32_t measure_number, std::vector< std::vector<uint32_t> >& stop_counts, std::string win_start, std::string win_ampl)const {
+int VirtualBoard::stat_stops(uint32_t measure_number, std::vector<uint32_t>& stop_counts, std::string win_start, std::string win_ampl) {
 
     // Check if the measure number is valid.
-    if(measure_number < 0 || measure_number >= this->measures()) {
+    MeasureSnapshot snap = this->snapshot();
+    if(measure_number >= snap.size()) {
         rt_syslog(ATMD_ERR, "VirtualBoard [stat_stops]: trying to get statistics about a non existent measure.");
         return -1;
     }
@@ -1943,37 +2543,30 @@ int VirtualBoard::stat_stops(uint32_t measure_number, std::vector< std::vector<u
         return -1;
     }
 
-    std::vector<uint32_t> stops_ch(1+8*agents(),0);
-    StartData* current_start;
+    const Measure* meas = &(snap[measure_number]);
+    if(meas->nch() != 8*agents()) {
+      rt_syslog(ATMD_ERR, "VirtualBoard [stat_stops]: measure has %lu channels instead of %lu.", (unsigned long)meas->nch(), (unsigned long)(8*agents()));
+      return -1;
+    }
+
+    size_t width = meas->stat_width();
+    stop_counts.assign(meas->count_starts() * width, 0);
+    if(meas->count_starts() == 0)
+      return 0;
+
+    // A stop is counted if it falls strictly inside the window
+    double begin = window_start.get_ps();
+    double end = window_start.get_ps() + window_amplitude.get_ps();
 
     // We cycle over all starts
-    for(size_t i = 0; i < this->_measures[measure_number]->count_starts(); i++) {
-      if(!(current_start = this->_measures[measure_number]->get_start(i))) {
-        rt_syslog(ATMD_ERR, "VirtualBoard [stat_stops]: trying to stat a non existent start.");
-        return -1;
-      }
+    for(size_t i = 0; i < meas->count_starts(); i++) {
+      uint32_t* row = &(stop_counts[i * width]);
 
       // We save the measure time
-      if(current_start->times())
-        stops_ch[0] = (uint32_t)(current_start->get_window_time(0) / 1000);
-
-      // We cycle over all stops of current start
-      for(size_t j = 0; j < current_start->count_stops(); j++) {
-        int8_t ch;
-        double stoptime;
-        current_start->get_channel(j, ch);
-        current_start->get_stoptime(j, stoptime);
-
-        if(stoptime > window_start.get_ps() && stoptime < window_start.get_ps()+window_amplitude.get_ps())
-          stops_ch[(ch > 0) ? ch : -ch]++;
-      }
-
-      // We add the vector with counts to the output
-      stop_counts.push_back(stops_ch);
+      row[0] = meas->stat_row(i)[0];
 
-      // We reset the counts
-      for(size_t j = 0; j < 1+8*agents(); j++)
-        stops_ch[j] = 0;
+      // Count stops with the time index
+      meas->count_window(i, begin, end, row);
     }
 
     return 0;
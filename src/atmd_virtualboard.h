@@ -55,6 +55,18 @@ namespace Tango {
 #include "atmd_rtqueue.h"
 #include "atmd_rtcomm.h"
 #include "atmd_monitor.h"
+#include "atmd_histogram.h"
+#include "atmd_coincidence.h"
+#include "atmd_ratemeter.h"
+#include "atmd_writequeue.h"
+#include "atmd_snapshot.h"
+#include "atmd_publish.h"
+#include "atmd_stream.h"
+#include "atmd_export.h"
+#include "atmd_workerpool.h"
+#include "atmd_upload.h"
+#include "atmd_capture.h"
+#include "atmd_assembler.h"
 #include "MatFile.h"
 #include "std_fileno.h"
 
@@ -82,14 +94,65 @@ private:
 };
 
 
+/* @class SaveProgress
+ * Receives the progress of a batch save (MSR SAVEALL). saved() is called by
+ * the save workers as each measure completes, one call at a time. Neither
+ * method may throw: errors must be kept by the receiver.
+ */
+class SaveProgress {
+public:
+  virtual ~SaveProgress() {};
+
+  // Number of measures about to be saved
+  virtual void begin(size_t count) = 0;
+
+  // A measure has been saved (or failed)
+  virtual void saved(size_t measure, const std::string& filename, bool success) = 0;
+};
+
+
+// Declare class VirtualBoard for SaveJob
+class VirtualBoard;
+
+
+/* @class SaveJob
+ * Save of one measure of a batch, run by the save worker pool.
+ */
+class SaveJob : public PoolJob {
+public:
+  SaveJob() : _board(NULL), _meas(NULL), _num(0), _progress(NULL), _success(false) {};
+
+  void setup(VirtualBoard* board, const Measure* meas, size_t num, const std::string& filename, SaveProgress* progress) {
+    _board = board;
+    _meas = meas;
+    _num = num;
+    _filename = filename;
+    _progress = progress;
+    _success = false;
+  };
+
+  int run();
+
+  bool success()const { return _success; };
+
+private:
+  VirtualBoard* _board;
+  const Measure* _meas;
+  size_t _num;
+  std::string _filename;
+  SaveProgress* _progress;
+  bool _success;
+};
+
+
 /* @class VirtualBoard
  * This class manages the interface with the agents on the real-time network
  */
 class VirtualBoard {
 public:
   // Constructor and destructor
-  VirtualBoard(AtmdConfig &obj) : _config(obj) { clear_config(); };
-  ~VirtualBoard() {};
+  VirtualBoard(AtmdConfig &obj) : _config(obj), _published(NULL), _spill_due(false) { clear_config(); };
+  ~VirtualBoard() { if(_published) _published->unref(); };
 
   // Start all the relevant RT tasks and sends broadcasts to find agents
   int init();
@@ -128,6 +191,12 @@ public:
   // Non-RT data thread code
   static void data_task(void *arg);
 
+  // Non-RT autosave writer thread code
+  static void writer_task(void *arg);
+
+  // Non-RT monitor writer thread code
+  static void monitor_task(void *arg);
+
   // Wait for data tasks
   bool wait_for_datatask();
 
@@ -207,6 +276,9 @@ public:
         case ATMD_FORMAT_MATPS3_FTP:
         case ATMD_FORMAT_MATPS3_ALL:
           return ".mat";
+        case ATMD_FORMAT_BINPS:
+        case ATMD_FORMAT_BINRAW:
+          return ".bin";
     }
   }
 
@@ -214,7 +286,14 @@ public:
   void set_autosave(uint32_t val) { _autosave = val; };
   uint32_t get_autosave()const { return _autosave; };
 
-  // Setup monitor
+  // Setup rolling files (roll over on file size in bytes or on time in seconds, 0 to disable)
+  void set_rolling(uint64_t bytes, uint32_t seconds) { _roll_bytes = bytes; _roll_time = seconds; };
+  void get_rolling(uint64_t& bytes, uint32_t& seconds)const { bytes = _roll_bytes; seconds = _roll_time; };
+
+  // Tell if the measure is saved in chunks while it is running (autosave or rolling files)
+  bool chunked()const { return (_autosave > 0 || _roll_bytes > 0 || _roll_time > 0); };
+
+  // Setup monitor (refresh every n starts with the last m starts)
   void set_monitor(uint32_t n, uint32_t m, const std::string& name) {
     _monitor_n = n;
     _monitor_m = m;
@@ -230,13 +309,40 @@ public:
       return true;
   };
 
+  // Setup live histogram (bin width and offset in units of Tbin, zero bins to disable)
+  void set_histogram(uint32_t width, uint32_t nbins, uint32_t offset) {
+    _hist_width = width;
+    _hist_nbins = nbins;
+    _hist_offset = offset;
+  };
+  void get_histogram(uint32_t& width, uint32_t& nbins, uint32_t& offset)const {
+    width = _hist_width;
+    nbins = _hist_nbins;
+    offset = _hist_offset;
+  };
+
+  // Setup coincidences (tolerance and dt bin width in units of Tbin, no groups to disable)
+  void set_coincidence(uint32_t tol, uint32_t width, const std::vector< std::vector<uint8_t> >& groups) {
+    _coinc_tol = tol;
+    _coinc_width = width;
+    _coinc_groups = groups;
+  };
+  void get_coincidence(uint32_t& tol, uint32_t& width, std::vector< std::vector<uint8_t> >& groups)const {
+    tol = _coinc_tol;
+    width = _coinc_width;
+    groups = _coinc_groups;
+  };
+
 
   // == Measure handling ==
 
-  // Count measures
+  // Count measures (writers only, with the measure lock held)
   size_t measures()const { return _measures.size(); };
 
-  // Measures vector mutex
+  // Take a snapshot of the stored measures (readers, never blocks on writers)
+  MeasureSnapshot snapshot();
+
+  // Measures vector mutex (serializes writers of the measure list)
   int acquire_lock() {
     return rt_mutex_acquire(&_meas_mutex, TM_INFINITE);
   };
@@ -244,52 +350,108 @@ public:
     return rt_mutex_release(&_meas_mutex);
   };
 
-  // Add a measure
+  // Add a measure (the list takes over the reference of the caller)
   void add_measure(Measure *obj) {
     _measures.push_back(obj);
+    publish_measures();
   };
 
-  // Delete a measure
+  // Delete a measure (freed when the last snapshot holding it is dropped)
   int delete_measure(size_t id) {
     if(id >= _measures.size())
       return -1;
-    delete _measures[id];
+    _measures[id]->unref();
     _measures.erase(_measures.begin()+id);
+    publish_measures();
     return 0;
   };
 
   // Clear all measures
   void clear_measures() {
     for(size_t i = 0; i < _measures.size(); i++)
-      delete _measures[i];
+      _measures[i]->unref();
     _measures.clear();
+    publish_measures();
   };
 
-  // Stat a measure
-  int stat_stops(uint32_t measure_number, std::vector< std::vector<uint32_t> >& stop_counts)const;
-  int stat_stops(uint32_t measure_number, std::vector< std::vector<uint32_t> >& stop_counts, std::string win_start, std::string win_ampl)const;
+  // Memory used by stored measures (in RAM and in spill files)
+  size_t resident_bytes();
+  size_t spilled_bytes();
 
-  int stat_measure(size_t id, uint32_t& count)const {
-    if(id >= _measures.size())
+  // Tell the writer task to spill measures if the memory budget is exceeded (measure lock held)
+  void check_memlimit();
+
+  // Spill the oldest measures to disk until the memory budget is respected (writer task)
+  int enforce_memlimit();
+
+  // Stat a measure (one row of 1+8*agents() values per start: window time in us and stops per channel)
+  int stat_stops(uint32_t measure_number, std::vector<uint32_t>& stop_counts);
+  int stat_stops(uint32_t measure_number, std::vector<uint32_t>& stop_counts, std::string win_start, std::string win_ampl);
+
+  // Stat a measure cumulatively (same layout as a single row, summed over all starts)
+  int stat_total(uint32_t measure_number, uint32_t& starts, std::vector<uint64_t>& totals);
+
+  // Histogram of a stored measure
+  int measure_histogram(size_t id, Histogram& hist) {
+    MeasureSnapshot snap = snapshot();
+    if(id >= snap.size())
       return -1;
-    count = _measures[id]->count_starts();
+    hist = snap[id].histogram();
     return 0;
   };
 
+  // Live histogram of the running (or last) measure
+  int live_histogram(Histogram& hist) { return _hist_view.read(hist); };
+
+  // Live coincidences of the running (or last) measure
+  int live_coincidence(Coincidence& coinc) { return _coinc_view.read(coinc); };
+
+  // Subscribers to the starts of the running measure
+  StartStream& stream() { return _stream; };
+
+  // Count rates over the last 'buckets' rate meter buckets (lock free)
+  void rates(size_t buckets, double& start_rate, double& live, std::vector<double>& ch_rates) { _rate.rates(rt_timer_read(), buckets, start_rate, live, ch_rates); };
+  size_t rate_channels()const { return _rate.nch(); };
+
+  // Autosave writer queue counters
+  int save_stats(WriteStats& st) { return _writeq.stats(st); };
+
+  // Packet capture (lock free counters)
+  const PacketRecorder& recorder()const { return _recorder; };
+
   // Save measure
   int save_measure(size_t measure_num, const std::string& filename);
 
+  // Save all the stored measures in parallel (files are named prefix_NNNN.ext)
+  int save_all(const std::string& prefix, SaveProgress* progress, size_t& failed);
+
   // Save monitor
   int save_monitor(Monitor& mon);
 
+  // Pack the frozen monitor starts into a measure (monitor task)
+  Measure* pack_monitor();
+
 private:
   // General save routine
-  int measure2file(const std::vector<StartData*>& starts, const std::vector<uint64_t>& begin, const std::vector<uint64_t>& time, std::string filename);
+  int measure2file(const Measure& meas, std::string filename, bool atomic = false);
+
+  // Sanitize a save filename and create the path of the local file
+  int save_path(std::string& filename, std::string& fullpath);
+
+  // Reserve disk space for the file of the next rolling chunk
+  int preallocate(const std::string& filename, uint64_t size);
+
+  // Call measure2file() holding the save mutex
+  int save_locked(const Measure& meas, const std::string& filename, bool atomic = false);
+
+  // Save one measure of a batch and report it
+  friend class SaveJob;
+  int save_batched(const Measure& meas, size_t num, const std::string& filename, SaveProgress* progress);
 
 public:
 
-  // CURL callback
-  static size_t curl_read(void *ptr, size_t size, size_t count, void *data);
+  // CURL callbacks
+  static size_t curl_read_file(void *ptr, size_t size, size_t count, void *data);
 
   // Start measure
   int start_measure();
@@ -306,6 +468,9 @@ public:
   size_t get_counter()const { return _auto_counter; };
   void increment_counter() { _auto_counter++; };
 
+  // Autosave filename of chunk 'num'
+  std::string chunk_filename(size_t num)const;
+
   // Send command to control_task
   int send_command(int& opcode, GenMsg& msg);
 
@@ -326,12 +491,46 @@ private:
   // Control interface
   RTcomm _ctrl_if;
 
+  // Mutex serializing the commands sent on the control interface
+  RT_MUTEX _ctrl_mutex;
+
   // Handle of the RT data task
   RT_TASK _rt_data_task;
 
   // Handle of the non-RT data task
   RT_TASK _data_task;
 
+  // Handle of the non-RT autosave writer task
+  RT_TASK _writer_task;
+
+  // Autosave queue between data task and writer task
+  WriteQueue _writeq;
+
+  // Handle of the non-RT monitor writer task
+  RT_TASK _monitor_task;
+
+  // Monitor queue between data task and monitor task
+  WriteQueue _monq;
+
+  // Monitor of the running measure (data task, frozen starts read by the monitor task)
+  Monitor _monitor;
+
+  // Workers helping saves (compression and text formatting)
+  WorkerPool _pool;
+
+  // Pipeline overlapping MAT serialisation and FTP transfer
+  UploadPipe _upload;
+
+  // Mutex serializing file saves and the CURL handle
+  RT_MUTEX _save_mutex;
+
+  // Workers of batch saves, and mutex serializing their progress reports
+  WorkerPool _save_pool;
+  RT_MUTEX _progress_mutex;
+
+  // Recorder of the data packets
+  PacketRecorder _recorder;
+
   // Data queue
   RTqueue _data_queue;
 
@@ -382,6 +581,10 @@ private:
   // Autosave after numofstarts
   uint32_t _autosave;
 
+  // Rolling files size (bytes) and time (seconds) limits
+  uint64_t _roll_bytes;
+  uint32_t _roll_time;
+
   // Autosave counter
   size_t _auto_counter;
 
@@ -393,6 +596,28 @@ private:
   uint32_t _monitor_m;
   std::string _monitor_name;
 
+  // Histogram parameters
+  uint32_t _hist_width;
+  uint32_t _hist_nbins;
+  uint32_t _hist_offset;
+
+  // Live histogram
+  LiveView<Histogram> _hist_view;
+
+  // Coincidence parameters
+  uint32_t _coinc_tol;
+  uint32_t _coinc_width;
+  std::vector< std::vector<uint8_t> > _coinc_groups;
+
+  // Live coincidences
+  LiveView<Coincidence> _coinc_view;
+
+  // Subscribers to the live starts
+  StartStream _stream;
+
+  // Count rate meter
+  RateMeter _rate;
+
 
   // == Measures handling ==
 
@@ -402,6 +627,16 @@ private:
   // Measures vector mutex
   RT_MUTEX _meas_mutex;
 
+  // Published set of measures and mutex protecting the pointer swap
+  MeasureSet* _published;
+  RT_MUTEX _snap_mutex;
+
+  // Publish the current measure list to readers
+  void publish_measures();
+
+  // Stored measures exceed the memory budget (set by the data task, cleared by the writer task)
+  volatile bool _spill_due;
+
   // Board status
   int _status;
 
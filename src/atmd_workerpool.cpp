@@ -0,0 +1,240 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Export worker pool
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Global debug flag
+#ifdef DEBUG
+extern bool enable_debug;
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <rtdk.h>
+
+#include "atmd_workerpool.h"
+
+
+/* @fn WorkerPool::~WorkerPool()
+ * Stop the workers and destroy the Xenomai objects.
+ */
+WorkerPool::~WorkerPool() {
+  stop();
+  if(_init) {
+    rt_cond_delete(&_work);
+    rt_cond_delete(&_finished);
+    rt_mutex_delete(&_mutex);
+  }
+}
+
+
+/* @fn WorkerPool::init(const std::string& name, size_t workers)
+ * Create the synchronization objects and spawn the worker tasks. With zero
+ * workers the jobs are run by the caller alone.
+ *
+ * @param name Prefix of the names of the Xenomai objects.
+ * @param workers Number of worker tasks.
+ * @return Return 0 on success, -1 on error.
+ */
+int WorkerPool::init(const std::string& name, size_t workers) {
+  int retval = rt_mutex_create(&_mutex, (name + "_mutex").c_str());
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "WorkerPool [init]: failed to create mutex (Code: %d).", retval);
+    return -1;
+  }
+  retval = rt_cond_create(&_work, (name + "_work").c_str());
+  if(retval == 0)
+    retval = rt_cond_create(&_finished, (name + "_finished").c_str());
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "WorkerPool [init]: failed to create condition variables (Code: %d).", retval);
+    return -1;
+  }
+  _init = true;
+
+  // The vector must not be resized once the tasks are running
+  _tasks.resize(workers);
+  for(size_t i = 0; i < workers; i++) {
+    char task_name[64];
+    snprintf(task_name, sizeof(task_name), "%s_%lu", name.c_str(), (unsigned long)i);
+    retval = rt_task_spawn(&(_tasks[i]), task_name, 0, 0, T_FPU|T_JOINABLE, WorkerPool::worker_task, (void*)this);
+    if(retval) {
+      rt_syslog(ATMD_CRIT, "WorkerPool [init]: failed to spawn worker %lu (Code: %d).", (unsigned long)i, retval);
+      _tasks.resize(i);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+/* @fn WorkerPool::stop()
+ * Ask the workers to terminate and join them.
+ */
+void WorkerPool::stop() {
+  if(!_init || _tasks.size() == 0)
+    return;
+
+  if(rt_mutex_acquire(&_mutex, TM_INFINITE) == 0) {
+    _terminate = true;
+    rt_cond_broadcast(&_work);
+    rt_mutex_release(&_mutex);
+  }
+
+  for(size_t i = 0; i < _tasks.size(); i++)
+    rt_task_join(&(_tasks[i]));
+  _tasks.clear();
+}
+
+
+/* @fn WorkerPool::run(PoolJob** jobs, size_t n)
+ * Run a batch of jobs with the workers and the calling task, and wait for
+ * all of them to be done.
+ *
+ * @param jobs The jobs.
+ * @param n The number of jobs.
+ * @return Return 0 on success, -1 if any job failed.
+ */
+int WorkerPool::run(PoolJob** jobs, size_t n) {
+  if(!_init || _tasks.size() == 0) {
+    int retval = 0;
+    for(size_t i = 0; i < n; i++)
+      if(run_job(jobs[i]))
+        retval = -1;
+    return retval;
+  }
+
+  int retval = rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(retval) {
+    rt_syslog(ATMD_ERR, "WorkerPool [run]: failed to acquire mutex (Code: %d).", retval);
+    return -1;
+  }
+
+  // Wait for a batch already running
+  while(_jobs != NULL)
+    rt_cond_wait(&_finished, &_mutex, TM_INFINITE);
+
+  _jobs = jobs;
+  _count = n;
+  _next = 0;
+  _done = 0;
+  _failed = false;
+  rt_cond_broadcast(&_work);
+
+  // Take part in the batch
+  work();
+
+  while(_done < _count)
+    rt_cond_wait(&_finished, &_mutex, TM_INFINITE);
+
+  retval = (_failed) ? -1 : 0;
+  _jobs = NULL;
+  rt_cond_broadcast(&_finished);
+
+  rt_mutex_release(&_mutex);
+  return retval;
+}
+
+
+/* @fn WorkerPool::compress(MatBlock *blocks, size_t n)
+ * Compress a batch of MAT blocks (MatCompressor interface). Several saves can
+ * run at the same time, so the adapters belong to the call.
+ *
+ * @param blocks The blocks.
+ * @param n The number of blocks.
+ * @return Return 0 on success, -1 if any block failed.
+ */
+int WorkerPool::compress(MatBlock *blocks, size_t n) {
+  if(n == 0)
+    return 0;
+  std::vector<BlockJob> block_jobs(n);
+  std::vector<PoolJob*> block_ptrs(n);
+  for(size_t i = 0; i < n; i++) {
+    block_jobs[i].blk = &(blocks[i]);
+    block_ptrs[i] = &(block_jobs[i]);
+  }
+  return run(&(block_ptrs[0]), n);
+}
+
+
+/* @fn static int WorkerPool::run_job(PoolJob* job)
+ * Run a job. An exception thrown by the job counts as a failure, so that it
+ * never unwinds through the pool and leaves a batch half accounted.
+ *
+ * @param job The job.
+ * @return Return 0 on success, -1 on error.
+ */
+int WorkerPool::run_job(PoolJob* job) {
+  try {
+    return job->run();
+  } catch(...) {
+    rt_syslog(ATMD_ERR, "WorkerPool [run_job]: job threw an exception.");
+    return -1;
+  }
+}
+
+
+/* @fn WorkerPool::work()
+ * Take jobs of the current batch until none is left. Called with the mutex
+ * held, which is released while running a job.
+ */
+void WorkerPool::work() {
+  while(_jobs != NULL && _next < _count) {
+    PoolJob* job = _jobs[_next++];
+
+    rt_mutex_release(&_mutex);
+    int retval = run_job(job);
+    rt_mutex_acquire(&_mutex, TM_INFINITE);
+
+    if(retval)
+      _failed = true;
+    if(++_done == _count)
+      rt_cond_broadcast(&_finished);
+  }
+}
+
+
+/* @fn static void WorkerPool::worker_task(void *arg)
+ * Worker task: wait for batches and run their jobs.
+ *
+ * @param arg Cookie for the task (pointer to the pool object).
+ */
+void WorkerPool::worker_task(void *arg) {
+
+  // Init rt_printf and rt_syslog
+  rt_print_auto_init(1);
+
+  // Cast back 'this' pointer
+  WorkerPool *pthis = (WorkerPool*)arg;
+
+  // Prevent this task to send SIGDEBUG when switching to secondary mode
+  rt_task_set_mode(T_WARNSW, 0, NULL);
+
+  if(rt_mutex_acquire(&(pthis->_mutex), TM_INFINITE))
+    return;
+
+  while(!pthis->_terminate) {
+    if(pthis->_jobs != NULL && pthis->_next < pthis->_count)
+      pthis->work();
+    else
+      rt_cond_wait(&(pthis->_work), &(pthis->_mutex), TM_INFINITE);
+  }
+
+  rt_mutex_release(&(pthis->_mutex));
+}
@@ -0,0 +1,112 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Export worker pool header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_WORKERPOOL_H
+#define ATMD_WORKERPOOL_H
+
+// Global
+#include <stdlib.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Xenomai
+#include <native/task.h>
+#include <native/mutex.h>
+#include <native/cond.h>
+
+// Local
+#include "common.h"
+#include "MatFile.h"
+
+
+/* @class PoolJob
+ * A unit of work run by the WorkerPool.
+ */
+class PoolJob {
+public:
+  virtual ~PoolJob() {};
+
+  // Do the work (return 0 on success, -1 on error). Should not throw
+  virtual int run() = 0;
+};
+
+
+/* @class WorkerPool
+ * Pool of non-RT tasks sharing the CPU-bound part of saves (compression of
+ * MAT blocks, text formatting). The caller of run() works on the batch too,
+ * so a pool with N workers runs N+1 jobs at a time. Only one batch runs at a
+ * time: concurrent callers wait for their turn. With zero workers everything
+ * runs in the calling task.
+ */
+class WorkerPool : public MatCompressor {
+public:
+  WorkerPool() : _jobs(NULL), _count(0), _next(0), _done(0), _failed(false), _terminate(false), _init(false) {};
+  ~WorkerPool();
+
+  // Create the synchronization objects and spawn the workers (their names are prefixed by 'name')
+  int init(const std::string& name, size_t workers);
+
+  // Terminate and join the workers
+  void stop();
+
+  // Number of jobs run in parallel (workers and caller)
+  size_t workers()const { return _tasks.size() + 1; };
+
+  // Run a batch of jobs and wait for all of them (return 0 on success, -1 if any job failed)
+  int run(PoolJob** jobs, size_t n);
+
+  // MatCompressor interface
+  int compress(MatBlock *blocks, size_t n);
+
+private:
+  // Adapter of a MAT block to a job
+  class BlockJob : public PoolJob {
+  public:
+    BlockJob() : blk(NULL) {};
+    int run() { return blk->run(); };
+    MatBlock* blk;
+  };
+
+  // Worker task
+  static void worker_task(void *arg);
+
+  // Run one job, turning exceptions into failures
+  static int run_job(PoolJob* job);
+
+  // Run jobs of the current batch until none is left
+  void work();
+
+  RT_MUTEX _mutex;
+  RT_COND _work;                // Signaled when a batch is available (or on termination)
+  RT_COND _finished;            // Signaled when the last job of a batch is done
+  std::vector<RT_TASK> _tasks;
+
+  PoolJob** _jobs;              // Current batch
+  size_t _count;                // Jobs in the batch
+  size_t _next;                 // Next job to take
+  size_t _done;                 // Jobs completed
+  bool _failed;                 // Some job failed
+  bool _terminate;
+  bool _init;
+};
+
+#endif
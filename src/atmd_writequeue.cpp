@@ -0,0 +1,286 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Autosave write queue class
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Global debug flag
+#ifdef DEBUG
+extern bool enable_debug;
+#endif
+
+#include <errno.h>
+#include <rtdk.h>
+
+#include "atmd_writequeue.h"
+
+
+/* @fn WriteQueue::~WriteQueue()
+ * Destroy the Xenomai objects.
+ */
+WriteQueue::~WriteQueue() {
+  if(_init) {
+    rt_cond_delete(&_not_empty);
+    rt_cond_delete(&_not_full);
+    rt_cond_delete(&_idle);
+    rt_mutex_delete(&_mutex);
+  }
+}
+
+
+/* @fn WriteQueue::init(const std::string& name, size_t capacity)
+ * Create the mutex and the condition variables of the queue.
+ *
+ * @param name Prefix of the names of the Xenomai objects.
+ * @param capacity Maximum number of jobs in flight (zero selects the default).
+ * @return Return 0 on success, -1 on error.
+ */
+int WriteQueue::init(const std::string& name, size_t capacity) {
+  _capacity = (capacity > 0) ? capacity : ATMD_DEF_SAVEQUEUE;
+
+  int retval = rt_mutex_create(&_mutex, (name + "_mutex").c_str());
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "WriteQueue [init]: failed to create mutex (Code: %d).", retval);
+    return -1;
+  }
+  retval = rt_cond_create(&_not_empty, (name + "_notempty").c_str());
+  if(retval == 0)
+    retval = rt_cond_create(&_not_full, (name + "_notfull").c_str());
+  if(retval == 0)
+    retval = rt_cond_create(&_idle, (name + "_idle").c_str());
+  if(retval) {
+    rt_syslog(ATMD_CRIT, "WriteQueue [init]: failed to create condition variables (Code: %d).", retval);
+    return -1;
+  }
+
+  _init = true;
+  return 0;
+}
+
+
+/* @fn WriteQueue::push(Measure* meas, const std::string& filename, bool last)
+ * Enqueue a measure to be saved even if all the slots are in use. It is meant
+ * for the last chunk of a measure, that the producer cannot keep, so the queue
+ * exceeds its capacity at most by one job per measure. Never waits for the
+ * writer. The queue takes over the reference of the caller.
+ *
+ * @param meas The measure.
+ * @param filename The destination file.
+ * @param last True for the last chunk of a measure.
+ * @return Return 0 on success, the Xenomai error code on error.
+ */
+int WriteQueue::push(Measure* meas, const std::string& filename, bool last) {
+  int retval = rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(retval)
+    return retval;
+
+  if(_jobs.size() + _busy >= _capacity)
+    _stalls++;
+
+  _jobs.push_back(WriteJob(meas, filename, rt_timer_read(), last));
+  if(_jobs.size() + _busy > _max_depth)
+    _max_depth = _jobs.size() + _busy;
+  rt_cond_signal(&_not_empty);
+
+  rt_mutex_release(&_mutex);
+  return 0;
+}
+
+
+/* @fn WriteQueue::try_push(Measure* meas, const std::string& filename, const std::string& next)
+ * Enqueue a measure only if a slot is free. On success the queue takes
+ * over the reference of the caller.
+ *
+ * @param meas The measure.
+ * @param filename The destination file.
+ * @param next The file of the following chunk, if the consumer should preallocate it.
+ * @return Return 0 on success, -EWOULDBLOCK if all the slots are in use, the Xenomai error code on error.
+ */
+int WriteQueue::try_push(Measure* meas, const std::string& filename, const std::string& next) {
+  int retval = rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(retval)
+    return retval;
+
+  if(_jobs.size() + _busy >= _capacity) {
+    _stalls++;
+    rt_mutex_release(&_mutex);
+    return -EWOULDBLOCK;
+  }
+
+  _jobs.push_back(WriteJob(meas, filename, rt_timer_read(), false, next));
+  if(_jobs.size() + _busy > _max_depth)
+    _max_depth = _jobs.size() + _busy;
+  rt_cond_signal(&_not_empty);
+
+  rt_mutex_release(&_mutex);
+  return 0;
+}
+
+
+/* @fn WriteQueue::full()
+ * Tell if all the slots are in use.
+ *
+ * @return True if a try_push() would fail.
+ */
+bool WriteQueue::full() {
+  if(rt_mutex_acquire(&_mutex, TM_INFINITE))
+    return true;
+  bool retval = (_jobs.size() + _busy >= _capacity);
+  rt_mutex_release(&_mutex);
+  return retval;
+}
+
+
+/* @fn WriteQueue::wait_slot()
+ * Wait until the writer frees a slot.
+ *
+ * @return Return 0 on success, the Xenomai error code on error.
+ */
+int WriteQueue::wait_slot() {
+  int retval = rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(retval)
+    return retval;
+
+  while(_jobs.size() + _busy >= _capacity) {
+    retval = rt_cond_wait(&_not_full, &_mutex, TM_INFINITE);
+    if(retval && retval != -EINTR)
+      break;
+    retval = 0;
+  }
+
+  rt_mutex_release(&_mutex);
+  return retval;
+}
+
+
+/* @fn WriteQueue::pop(WriteJob& job, RTIME timeout)
+ * Get the oldest job. The job stays in flight until done() is called.
+ *
+ * @param job Output job.
+ * @param timeout Maximum wait in ns.
+ * @return Return 0 on success, -ETIMEDOUT if the queue stayed empty, the Xenomai error code on error.
+ */
+int WriteQueue::pop(WriteJob& job, RTIME timeout) {
+  int retval = rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(retval)
+    return retval;
+
+  if(_jobs.empty()) {
+    retval = rt_cond_wait(&_not_empty, &_mutex, timeout);
+    if(_jobs.empty()) {
+      rt_mutex_release(&_mutex);
+      return (retval && retval != -EINTR) ? retval : -ETIMEDOUT;
+    }
+  }
+
+  job = _jobs.front();
+  _jobs.pop_front();
+  _busy++;
+
+  rt_mutex_release(&_mutex);
+  return 0;
+}
+
+
+/* @fn WriteQueue::done(const WriteJob& job, bool success)
+ * Release the slot of a completed job and update the counters.
+ *
+ * @param job The job returned by pop().
+ * @param success True if the job was saved successfully.
+ * @return Return 0 on success, the Xenomai error code on error.
+ */
+int WriteQueue::done(const WriteJob& job, bool success) {
+  int retval = rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(retval)
+    return retval;
+
+  _busy--;
+  if(success)
+    _written++;
+  else
+    _failed++;
+  _last_latency = rt_timer_read() - job.queued;
+  _total_latency += _last_latency;
+
+  rt_cond_signal(&_not_full);
+  if(_jobs.empty() && _busy == 0)
+    rt_cond_broadcast(&_idle);
+
+  rt_mutex_release(&_mutex);
+  return 0;
+}
+
+
+/* @fn WriteQueue::wait_idle()
+ * Wait until the writer has completed every queued job.
+ *
+ * @return Return 0 on success, the Xenomai error code on error.
+ */
+int WriteQueue::wait_idle() {
+  int retval = rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(retval)
+    return retval;
+
+  while(!_jobs.empty() || _busy > 0) {
+    retval = rt_cond_wait(&_idle, &_mutex, TM_INFINITE);
+    if(retval && retval != -EINTR)
+      break;
+    retval = 0;
+  }
+
+  rt_mutex_release(&_mutex);
+  return retval;
+}
+
+
+/* @fn WriteQueue::stats(WriteStats& st)
+ * Copy the queue counters.
+ *
+ * @param st Output counters.
+ * @return Return 0 on success, the Xenomai error code on error.
+ */
+int WriteQueue::stats(WriteStats& st) {
+  int retval = rt_mutex_acquire(&_mutex, TM_INFINITE);
+  if(retval)
+    return retval;
+
+  st.depth = _jobs.size() + _busy;
+  st.capacity = _capacity;
+  st.max_depth = _max_depth;
+  st.written = _written;
+  st.failed = _failed;
+  st.stalls = _stalls;
+  st.last_latency = _last_latency;
+  st.avg_latency = (_written + _failed) ? _total_latency / (_written + _failed) : 0;
+
+  rt_mutex_release(&_mutex);
+  return 0;
+}
+
+
+/* @fn WriteQueue::clear_stats()
+ * Reset all the counters.
+ */
+void WriteQueue::clear_stats() {
+  _max_depth = 0;
+  _written = 0;
+  _failed = 0;
+  _stalls = 0;
+  _last_latency = 0;
+  _total_latency = 0;
+}
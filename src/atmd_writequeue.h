@@ -0,0 +1,137 @@
+/*
+ * ATMD Server version 3.0
+ *
+ * ATMD Server - Autosave write queue header
+ *
+ * Copyright (C) Michele Devetta 2012 <michele.devetta@unimi.it>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ATMD_WRITEQUEUE_H
+#define ATMD_WRITEQUEUE_H
+
+// Global
+#include <stdint.h>
+#include <string>
+#include <deque>
+
+// Xenomai
+#include <native/mutex.h>
+#include <native/cond.h>
+#include <native/timer.h>
+
+// Local
+#include "common.h"
+
+// Declare class Measure
+class Measure;
+
+
+/* @struct WriteJob
+ * A completed measure waiting to be saved.
+ */
+struct WriteJob {
+  WriteJob() : meas(NULL), queued(0), last(false) {};
+  WriteJob(Measure* m, const std::string& f, RTIME t, bool l, const std::string& n = "") : meas(m), filename(f), queued(t), last(l), next(n) {};
+
+  Measure* meas;          // Measure to save (the queue holds a reference until done)
+  std::string filename;   // Destination file
+  RTIME queued;           // Time of enqueue in ns
+  bool last;              // Last chunk of a measure
+  std::string next;       // File of the following chunk, to preallocate ("" for none)
+};
+
+
+/* @struct WriteStats
+ * Counters of a write queue.
+ */
+struct WriteStats {
+  size_t depth;           // Jobs queued or being written
+  size_t capacity;        // Maximum number of jobs in flight
+  size_t max_depth;       // Highest depth reached
+  uint64_t written;       // Jobs saved successfully
+  uint64_t failed;        // Jobs that failed to save
+  uint64_t stalls;        // Times the producer found all the slots in use
+  RTIME last_latency;     // Enqueue to completion time of the last job (ns)
+  RTIME avg_latency;      // Average enqueue to completion time (ns)
+};
+
+
+/* @class WriteQueue
+ * Bounded queue between the data task and the autosave writer task. At most
+ * capacity() jobs are in flight (queued or being written). When all the slots
+ * are taken, i.e. when storage is persistently slower than acquisition, the
+ * producer keeps the chunk and tries again later; it waits for a slot only
+ * when the chunk it keeps grows too large.
+ */
+class WriteQueue {
+public:
+  WriteQueue() : _capacity(ATMD_DEF_SAVEQUEUE), _busy(0), _init(false) { clear_stats(); };
+  ~WriteQueue();
+
+  // Create mutex and condition variables (their names are prefixed by 'name')
+  int init(const std::string& name, size_t capacity);
+
+  // Maximum number of jobs in flight
+  size_t capacity()const { return _capacity; };
+
+  // Enqueue a measure even if all the slots are in use (producer, last chunk of a measure)
+  int push(Measure* meas, const std::string& filename, bool last);
+
+  // Enqueue a measure only if a slot is free. Return -EWOULDBLOCK if not (producer)
+  int try_push(Measure* meas, const std::string& filename, const std::string& next = "");
+
+  // Tell if all the slots are in use
+  bool full();
+
+  // Wait until a slot is free (producer)
+  int wait_slot();
+
+  // Get the next job, waiting at most 'timeout' ns (consumer). Return -ETIMEDOUT if none.
+  int pop(WriteJob& job, RTIME timeout);
+
+  // Mark a job popped with pop() as completed (consumer)
+  int done(const WriteJob& job, bool success);
+
+  // Wait until every job has been completed
+  int wait_idle();
+
+  // Get a copy of the counters
+  int stats(WriteStats& st);
+
+private:
+  // Reset counters
+  void clear_stats();
+
+  RT_MUTEX _mutex;
+  RT_COND _not_empty;
+  RT_COND _not_full;
+  RT_COND _idle;
+
+  std::deque<WriteJob> _jobs;   // Queued jobs
+  size_t _capacity;             // Maximum jobs in flight
+  size_t _busy;                 // Jobs being written
+  bool _init;
+
+  // Counters
+  size_t _max_depth;
+  uint64_t _written;
+  uint64_t _failed;
+  uint64_t _stalls;
+  RTIME _last_latency;
+  RTIME _total_latency;
+};
+
+#endif
@@ -33,6 +33,9 @@
 // ATMD autoretrigger timer
 #define ATMD_AUTORETRIG  199
 
+// ATMD autoretrigger period in ps
+#define ATMD_RETRIG_PS  ((ATMD_AUTORETRIG + 1) * ATMD_TREF * 1e12)
+
 // ATMD board default start offset
 #define ATMD_DEF_STARTOFFSET  2000
 
@@ -52,6 +55,64 @@
 // Default confiugration file
 #define ATMD_CONF_FILE "/etc/atmd_server.conf"
 
+// Default spool directory for measures spilled to disk
+#define ATMD_SPOOL_DIR "/var/tmp"
+
+// Default number of autosave chunks in flight to the writer task
+#define ATMD_DEF_SAVEQUEUE 4
+
+// Memory in bytes that an autosave chunk can reach while all the slots are in use,
+// before the data task waits for the writer (memlimit replaces it when set)
+#define ATMD_DEF_CHUNKLIMIT ((size_t)1024*1024*1024)
+
+// FTP upload pipeline: number and size of the buffers between serialisation and transfer
+#define ATMD_UPLOAD_BUFFERS  4
+#define ATMD_UPLOAD_BUFSIZE  (1024*1024)
+
+// FTP upload retries, and delay before the first retry in ns (doubled at each retry)
+#define ATMD_UPLOAD_RETRIES  3
+#define ATMD_UPLOAD_BACKOFF  1000000000ULL
+
+// Packet capture: size of the ring between the RT data task and the writer (power of two),
+// and period of the writer task in ns
+#define ATMD_CAPTURE_RING    (16*1024*1024)
+#define ATMD_CAPTURE_PERIOD  10000000
+
+// Asynchronous file writer: number, size and alignment of the buffers in flight,
+// and number of worker tasks when io_uring is not available
+#define ATMD_AIO_BUFFERS     4
+#define ATMD_AIO_BUFSIZE     (4*1024*1024)
+#define ATMD_AIO_ALIGN       4096
+#define ATMD_AIO_THREADS     2
+
+// Default MAT compression level (0 disables compression)
+#define ATMD_DEF_MATCOMPRESS 0
+
+// Default number of worker tasks helping saves (compression and text formatting)
+#define ATMD_DEF_EXPORT_WORKERS 2
+
+// Default number of worker tasks saving measures in parallel (MSR SAVEALL)
+#define ATMD_DEF_SAVE_WORKERS 2
+
+// Number of worker tasks executing client commands
+#define ATMD_NET_WORKERS 4
+
+// Frames queued for each subscriber to the live starts (the oldest are dropped)
+#define ATMD_STREAM_QUEUE 1024
+
+// Live histogram publication period (ns) and maximum number of bins per channel
+#define ATMD_HIST_PUBLISH  100000000
+#define ATMD_HIST_MAXBINS  1048576
+
+// Maximum number of coincidence groups and of channels in a group
+#define ATMD_COINC_MAXGROUPS  32
+#define ATMD_COINC_MAXCH      8
+
+// Rate meter bucket width (ns), number of buckets in the ring and read retries per bucket
+#define ATMD_RATE_BUCKET    100000000
+#define ATMD_RATE_NBUCKETS  601
+#define ATMD_RATE_RETRIES   100
+
 // Syslog constants
 #include <syslog.h>
 #define ATMD_DEBUG (LOG_DAEMON | LOG_DEBUG)
@@ -79,9 +140,25 @@
 #define ATMD_RT_CTRL_TASK   "ctrl_task"
 #define ATMD_RT_DATA_TASK   "rt_data_task"
 #define ATMD_NRT_DATA_TASK  "data_task"
+#define ATMD_NRT_WRITER_TASK "writer_task"
+#define ATMD_NRT_MONITOR_TASK "monitor_task"
+#define ATMD_NRT_EXPORT_POOL "export_pool"
+#define ATMD_NRT_SAVE_POOL  "save_pool"
+#define ATMD_NRT_UPLOAD_PIPE "upload"
+#define ATMD_NRT_CAPTURE_TASK "capture_task"
+#define ATMD_NRT_NET_POOL   "net_pool"
 #define ATMD_RT_CTRL_QUEUE  "ctrl_queue"
 #define ATMD_RT_DATA_QUEUE  "data_queue"
 #define ATMD_RT_MEAS_MUTEX  "meas_mutex"
+#define ATMD_RT_HIST_MUTEX  "hist_mutex"
+#define ATMD_RT_COINC_MUTEX "coinc_mutex"
+#define ATMD_RT_SAVE_MUTEX  "save_mutex"
+#define ATMD_RT_CTRL_MUTEX  "ctrl_mutex"
+#define ATMD_RT_PROGRESS_MUTEX "progress_mutex"
+#define ATMD_RT_SNAP_MUTEX  "snap_mutex"
+#define ATMD_RT_STREAM_MUTEX "stream_mutex"
+#define ATMD_RT_SAVE_QUEUE  "save_queue"
+#define ATMD_RT_MON_QUEUE   "mon_queue"
 
 // Board status
 #define ATMD_STATUS_IDLE        0
@@ -93,8 +170,8 @@
 #define ATMD_FORMAT_RAW         1   // Save in a text file in raw format (stop counts and retriggers)
 #define ATMD_FORMAT_PS          2   // Save in a text file with stop times in ps
 #define ATMD_FORMAT_US          3   // Save in a text file with stop times in us
-#define ATMD_FORMAT_BINPS       4   // NOT IMPLEMENTED
-#define ATMD_FORMAT_BINRAW      5   // NOT IMPLEMENTED
+#define ATMD_FORMAT_BINPS       4   // Indexed binary file with stop times in ps (see atmd_binfile.h)
+#define ATMD_FORMAT_BINRAW      5   // Indexed binary file with raw stop counts and retriggers (see atmd_binfile.h)
 #define ATMD_FORMAT_DEBUG       6   // Debug format in text mode
 #define ATMD_FORMAT_MATPS1      7   // Matlab v5 file with all data in a single matrix
 #define ATMD_FORMAT_MATPS2      8   // Matlab v5 file with separate variables for start, channel and stop (more compact!)